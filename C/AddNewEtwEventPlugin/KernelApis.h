@@ -24,6 +24,9 @@ typedef struct _OBJECT_ATTRIBUTES {
 } OBJECT_ATTRIBUTES;
 typedef OBJECT_ATTRIBUTES* POBJECT_ATTRIBUTES;
 
+typedef ULONG_PTR KSPIN_LOCK, * PKSPIN_LOCK;
+typedef UCHAR KIRQL;
+
 #define FILE_SUPERSEDE                  0x00000000
 #define FILE_OPEN                       0x00000001
 #define FILE_CREATE                     0x00000002
@@ -233,6 +236,8 @@ typedef struct _OBJECT_NAME_INFORMATION {
 
 extern "C" __declspec(dllimport) PVOID NTAPI ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
 extern "C" __declspec(dllimport) void NTAPI ExFreePoolWithTag(PVOID P, ULONG Tag);
+extern "C" __declspec(dllimport) KIRQL NTAPI KeAcquireSpinLockRaiseToDpc(PKSPIN_LOCK SpinLock);
+extern "C" __declspec(dllimport) void NTAPI KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
 
 extern "C" __declspec(dllimport) NTSTATUS NTAPI RtlAppendUnicodeStringToString(PUNICODE_STRING Destination, PCUNICODE_STRING Source);
 extern "C" __declspec(dllimport) NTSTATUS NTAPI RtlAppendUnicodeToString(PUNICODE_STRING Destination, PCWSTR Source);
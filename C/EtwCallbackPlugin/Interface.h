@@ -14,6 +14,18 @@ public:
 	uint64_t* pStackArgs;
 	uint64_t* pRegArgs;
 
+	// captured once by the driver, so plugins don't each ask the kernel
+	uint64_t threadId;
+	uint32_t processorIndex;    // KeGetCurrentProcessorNumberEx
+	uint64_t timestamp;         // KeQueryPerformanceCounter when the probe ran
+	uint64_t duration;          // return probe only, ticks since the call's entry probe. 0 on entry or if unknown
+	uint64_t frequency;         // KeQueryPerformanceCounter ticks per second
+
+	// entry: a zeroed block the plugin may fill, return: the same block as the matching entry left it. Released after
+	// the return callback. Null unless the plugin asked for one with pSetCallContextSize, or if the entry wasn't seen.
+	void* pCallContext;
+	uint32_t callContextSize;
+
 	uint64_t read_argument(const uint32_t idx)
 	{
 		if (idx > paramCount)
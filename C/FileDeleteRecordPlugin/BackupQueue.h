@@ -0,0 +1,287 @@
+#pragma once
+#include "KernelApis.h"
+#include "config.h"
+
+// A file waiting to be backed up. hFile is a kernel handle to the deleting thread's file object, holding it open keeps
+// the pending delete from completing until the copy is done (the file goes away when the last handle closes).
+struct BackupJob {
+    BackupJob* next;
+    HANDLE hFile;
+    uint64_t id;
+    uint64_t bytes;       // size when queued, reserved against backup_max_inflight_bytes
+    uint64_t queuedAt;    // KeQueryPerformanceCounter
+    uint64_t processId;   // of the deleting thread
+    LARGE_INTEGER deletedAt;
+    OBJECT_NAME_INFORMATION* pPath;   // from the driver's handle cache, null if it missed
+};
+
+struct BackupStats {
+    uint64_t queued;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t dropped;          // throttled for longer than backup_throttle_wait_ms or out of memory
+    uint64_t bytesCopied;
+    uint64_t totalLatency;     // queued to done, in performance counter ticks
+    uint64_t maxLatency;
+    uint64_t frequency;
+};
+
+/*
+Moves file backups off the syscall path. The deleting thread only takes a reference to the file and queues it,
+backup_worker_count system threads do the copying with a backup_chunk_size buffer each. The bytes queued or being
+copied are bounded, past that the deleting thread is throttled rather than letting the queue grow without limit.
+
+Every enqueue holds a rundown reference. stop() refuses new ones, wakes the throttled ones and waits for all of them to
+leave before the workers drain the queue, so no job is queued after the last worker is gone.
+*/
+class BackupQueue {
+public:
+    // Runs on a worker thread at PASSIVE_LEVEL, buffer is the worker's own backup_chunk_size copy buffer
+    typedef bool(*tHandler)(BackupJob& job, PVOID buffer, ULONG bufferSize, uint64_t& bytesCopied);
+
+    bool start(tHandler handler) {
+        m_handler = handler;
+        m_head = m_tail = nullptr;
+        m_lock = 0;
+        m_inFlightBytes = 0;
+        m_nextId = 0;
+        m_stopping = false;
+        ExInitializeRundownProtection(&m_rundown);
+        memset(&m_stats, 0, sizeof(m_stats));
+        memset(m_threads, 0, sizeof(m_threads));
+
+        LARGE_INTEGER frequency;
+        KeQueryPerformanceCounter(&frequency);
+        m_stats.frequency = frequency.QuadPart;
+
+        KeInitializeSemaphore(&m_work, 0, MAXLONG);
+        KeInitializeEvent(&m_capacity, NotificationEvent, TRUE);
+
+        for (ULONG i = 0; i < backup_worker_count; i++) {
+            OBJECT_ATTRIBUTES attrs = { 0 };
+            InitializeObjectAttributes(&attrs, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+            if (PsCreateSystemThread(&m_threads[i], THREAD_ALL_ACCESS, &attrs, NULL, NULL, workerMain, this) != STATUS_SUCCESS) {
+                m_threads[i] = NULL;
+                stop();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // PASSIVE_LEVEL. Fails every enqueue from now on and waits for those in progress, a throttled one gives up at once.
+    // Then finishes every queued backup and waits for the workers to exit.
+    void stop() {
+        // under the lock, a reserve() that saw m_stopping clear has cleared m_capacity before this sets it
+        KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+        m_stopping = true;
+        KeSetEvent(&m_capacity, 0, FALSE);
+        KeReleaseSpinLock(&m_lock, irql);
+        ExWaitForRundownProtectionRelease(&m_rundown);
+
+        KeReleaseSemaphore(&m_work, 0, backup_worker_count, FALSE);
+
+        for (ULONG i = 0; i < backup_worker_count; i++) {
+            if (m_threads[i]) {
+                ZwWaitForSingleObject(m_threads[i], FALSE, NULL);
+                ZwClose(m_threads[i]);
+                m_threads[i] = NULL;
+            }
+        }
+    }
+
+    // PASSIVE_LEVEL. Takes its own reference to the file behind hFile (a handle of the current process) and queues
+    // it. pPath (pool, may be null) is owned by the queue from here on, queued or not. Returns the backup's id, 0 if
+    // the file wasn't queued.
+    uint64_t enqueue(HANDLE hFile, uint64_t processId, OBJECT_NAME_INFORMATION* pPath) {
+        if (!ExAcquireRundownProtection(&m_rundown)) {
+            freePath(pPath);
+            return 0;
+        }
+
+        const uint64_t id = queue(hFile, processId, pPath);
+        ExReleaseRundownProtection(&m_rundown);
+        return id;
+    }
+
+    BackupStats stats() {
+        KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+        BackupStats stats = m_stats;
+        KeReleaseSpinLock(&m_lock, irql);
+        return stats;
+    }
+
+    uint64_t frequency() const {
+        return m_stats.frequency;
+    }
+private:
+    // enqueue() under the rundown reference
+    uint64_t queue(HANDLE hFile, uint64_t processId, OBJECT_NAME_INFORMATION* pPath) {
+        PVOID fileObject = nullptr;
+        if (ObReferenceObjectByHandle(hFile, 0, *IoFileObjectType, KernelMode, &fileObject, NULL) != STATUS_SUCCESS) {
+            freePath(pPath);
+            return 0;
+        }
+
+        HANDLE hKernelFile = NULL;
+        NTSTATUS status = ObOpenObjectByPointer(fileObject, OBJ_KERNEL_HANDLE, NULL, FILE_READ_DATA | SYNCHRONIZE, *IoFileObjectType, KernelMode, &hKernelFile);
+        ObfDereferenceObject(fileObject);
+        if (status != STATUS_SUCCESS) {
+            freePath(pPath);
+            return 0;
+        }
+
+        FILE_STANDARD_INFORMATION info = { 0 };
+        IO_STATUS_BLOCK iosb = { 0 };
+        if (ZwQueryInformationFile(hKernelFile, &iosb, &info, sizeof(info), FileStandardInformation) != STATUS_SUCCESS || info.Directory) {
+            ZwClose(hKernelFile);
+            freePath(pPath);
+            return 0;
+        }
+
+        auto job = (BackupJob*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(BackupJob), POOL_TAG);
+        if (!job || !reserve((uint64_t)info.EndOfFile.QuadPart)) {
+            if (job) {
+                ExFreePoolWithTag(job, POOL_TAG);
+            }
+            ZwClose(hKernelFile);
+            freePath(pPath);
+
+            KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+            m_stats.dropped++;
+            KeReleaseSpinLock(&m_lock, irql);
+            return 0;
+        }
+
+        job->next = nullptr;
+        job->hFile = hKernelFile;
+        job->bytes = (uint64_t)info.EndOfFile.QuadPart;
+        job->queuedAt = KeQueryPerformanceCounter(NULL).QuadPart;
+        job->processId = processId;
+        KeQuerySystemTimePrecise(&job->deletedAt);
+        job->pPath = pPath;
+
+        KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+        job->id = ++m_nextId;
+        if (m_tail) {
+            m_tail->next = job;
+        } else {
+            m_head = job;
+        }
+        m_tail = job;
+        m_stats.queued++;
+        const uint64_t id = job->id;
+        KeReleaseSpinLock(&m_lock, irql);
+
+        KeReleaseSemaphore(&m_work, 0, 1, FALSE);
+        return id;
+    }
+
+    // Waits until bytes fit under backup_max_inflight_bytes. A file bigger than the bound on its own is let through
+    // once nothing else is in flight. False after backup_throttle_wait_ms, or once stop() began.
+    bool reserve(uint64_t bytes) {
+        LARGE_INTEGER timeout;
+        timeout.QuadPart = -10000ll * backup_throttle_wait_ms;
+
+        while (true) {
+            KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+            if (m_stopping) {
+                KeReleaseSpinLock(&m_lock, irql);
+                return false;
+            }
+
+            if (!m_inFlightBytes || m_inFlightBytes + bytes <= backup_max_inflight_bytes) {
+                m_inFlightBytes += bytes;
+                KeReleaseSpinLock(&m_lock, irql);
+                return true;
+            }
+            KeClearEvent(&m_capacity);
+            KeReleaseSpinLock(&m_lock, irql);
+
+            if (KeWaitForSingleObject(&m_capacity, Executive, KernelMode, FALSE, &timeout) != STATUS_SUCCESS)
+                return false;
+        }
+    }
+
+    BackupJob* dequeue() {
+        KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+        BackupJob* job = m_head;
+        if (job) {
+            m_head = job->next;
+            if (!m_head) {
+                m_tail = nullptr;
+            }
+        }
+        KeReleaseSpinLock(&m_lock, irql);
+        return job;
+    }
+
+    void complete(BackupJob* job, bool success, uint64_t bytesCopied) {
+        const uint64_t latency = KeQueryPerformanceCounter(NULL).QuadPart - job->queuedAt;
+
+        KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_lock);
+        m_inFlightBytes -= job->bytes;
+        if (success) {
+            m_stats.completed++;
+        } else {
+            m_stats.failed++;
+        }
+        m_stats.bytesCopied += bytesCopied;
+        m_stats.totalLatency += latency;
+        if (latency > m_stats.maxLatency) {
+            m_stats.maxLatency = latency;
+        }
+        KeSetEvent(&m_capacity, 0, FALSE);
+        KeReleaseSpinLock(&m_lock, irql);
+
+        ZwClose(job->hFile);
+        freePath(job->pPath);
+        ExFreePoolWithTag(job, POOL_TAG);
+    }
+
+    static void freePath(OBJECT_NAME_INFORMATION* pPath) {
+        if (pPath) {
+            ExFreePoolWithTag(pPath, POOL_TAG);
+        }
+    }
+
+    static void NTAPI workerMain(PVOID context) {
+        auto self = (BackupQueue*)context;
+        PVOID buffer = ExAllocatePoolWithTag(NonPagedPoolNx, backup_chunk_size, POOL_TAG);
+
+        while (true) {
+            KeWaitForSingleObject(&self->m_work, Executive, KernelMode, FALSE, NULL);
+
+            // stop() wakes every worker once, whoever gets those wakeups drains what's left
+            BackupJob* job = self->dequeue();
+            if (!job) {
+                if (self->m_stopping)
+                    break;
+                continue;
+            }
+
+            uint64_t bytesCopied = 0;
+            const bool success = buffer && self->m_handler(*job, buffer, backup_chunk_size, bytesCopied);
+            self->complete(job, success, bytesCopied);
+        }
+
+        if (buffer) {
+            ExFreePoolWithTag(buffer, POOL_TAG);
+        }
+        PsTerminateSystemThread(STATUS_SUCCESS);
+    }
+
+    tHandler m_handler;
+    BackupJob* m_head;
+    BackupJob* m_tail;
+    KSPIN_LOCK m_lock;
+    uint64_t m_inFlightBytes;
+    uint64_t m_nextId;
+    volatile bool m_stopping;
+    EX_RUNDOWN_REF m_rundown;    // held by every enqueue in progress
+    BackupStats m_stats;
+
+    KSEMAPHORE m_work;      // one count per queued job
+    KEVENT m_capacity;      // signaled whenever in flight bytes drop
+    HANDLE m_threads[backup_worker_count];
+};
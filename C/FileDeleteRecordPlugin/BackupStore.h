@@ -0,0 +1,309 @@
+#pragma once
+#include "KernelApis.h"
+#include "config.h"
+#include "../STrace/Sha256.h"
+
+struct BackupStoreStats {
+    volatile LONG64 stored;         // new content
+    volatile LONG64 duplicates;     // content that was already stored
+    volatile LONG64 bytesWritten;
+};
+
+/*
+Content addressed storage for backups. A file's content is stored once under the hex SHA-256 of it, index.txt maps
+every backup to its hash along with the original path, time of the delete and process. Temp files and build outputs
+that churn through the same content then cost one copy instead of one per delete.
+
+Every copy is written to a temporary name and renamed to its hash once complete, or deleted again if that name is
+taken, so a hash named file is only ever created whole and a failed copy doesn't leave a wrong one behind. A file that
+fits the copy buffer is hashed before anything is written, a duplicate of it isn't written at all. A larger one is
+hashed while it's copied.
+*/
+class BackupStore {
+public:
+    static const size_t HashNameLength = Sha256::DigestSize * 2;
+
+    // PASSIVE_LEVEL. Creates directory if needed and opens the index for appending
+    bool open(PCWSTR directory) {
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_hIndex = NULL;
+
+        m_directoryLength = wcslen(directory);
+        if (m_directoryLength + 1 + HashNameLength + 1 > MAX_PATH)
+            return false;
+        memcpy(m_directory, directory, (m_directoryLength + 1) * sizeof(wchar_t));
+
+        wchar_t path[MAX_PATH];
+        UNICODE_STRING uPath = makePath(path, L"");
+        HANDLE hDirectory = NULL;
+        if (!createFile(&uPath, &hDirectory, FILE_LIST_DIRECTORY | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN_IF, FILE_DIRECTORY_FILE))
+            return false;
+        ZwClose(hDirectory);
+
+        uPath = makePath(path, L"index.txt");
+        return createFile(&uPath, &m_hIndex, FILE_APPEND_DATA | SYNCHRONIZE, FILE_SHARE_READ, FILE_OPEN_IF, FILE_NON_DIRECTORY_FILE);
+    }
+
+    void close() {
+        if (m_hIndex) {
+            ZwClose(m_hIndex);
+            m_hIndex = NULL;
+        }
+    }
+
+    // PASSIVE_LEVEL. Copies hFileSource from the start through buffer, which should be large (backup_chunk_size) to keep
+    // the number of filesystem round trips down. tempId must be unique among concurrent calls.
+    bool store(HANDLE hFileSource, uint64_t tempId, PVOID buffer, ULONG bufferSize, uint64_t& bytesCopied, uint8_t (&digest)[Sha256::DigestSize], bool& duplicate) {
+        bytesCopied = 0;
+        duplicate = false;
+
+        Sha256 hash;
+        LARGE_INTEGER pos = { 0 };
+        ULONG filled = 0;
+        while (filled < bufferSize) {
+            ULONG read = 0;
+            if (!readAt(hFileSource, (uint8_t*)buffer + filled, bufferSize - filled, pos, read))
+                return false;
+
+            if (!read)
+                break;
+
+            filled += read;
+            pos.QuadPart += read;
+        }
+
+        wchar_t path[MAX_PATH];
+        wchar_t name[HashNameLength + 1];
+        const bool hashed = filled < bufferSize;
+        if (hashed) {
+            hash.update(buffer, filled);
+            hash.finish(digest);
+
+            if (exists(hashName(name, digest))) {
+                duplicate = true;
+                bytesCopied = filled;
+                InterlockedIncrement64(&m_stats.duplicates);
+                return true;
+            }
+        }
+
+        // written under a temporary name and renamed to the hash once complete, a crash or a concurrent store of the
+        // same content never sees a hash named file that's only partly written
+        UNICODE_STRING uTemp = makePath(path, tempName(name, tempId));
+        HANDLE hTemp = NULL;
+        if (!createFile(&uTemp, &hTemp, FILE_WRITE_DATA | DELETE | SYNCHRONIZE, 0, FILE_OVERWRITE_IF, FILE_NON_DIRECTORY_FILE))
+            return false;
+
+        bool success = true;
+        LARGE_INTEGER writePos = { 0 };
+        ULONG chunk = filled;
+        while (chunk) {
+            if (!hashed) {
+                hash.update(buffer, chunk);
+            }
+
+            if (!writeAt(hTemp, buffer, chunk, writePos)) {
+                success = false;
+                break;
+            }
+            writePos.QuadPart += chunk;
+
+            // all of it was in the buffer already
+            if (hashed)
+                break;
+
+            if (!readAt(hFileSource, buffer, bufferSize, writePos, chunk)) {
+                success = false;
+                break;
+            }
+        }
+
+        if (success) {
+            if (!hashed) {
+                hash.finish(digest);
+            }
+            success = rename(hTemp, hashName(name, digest), duplicate);
+        }
+        ZwClose(hTemp);
+
+        if (!success || duplicate) {
+            deleteFile(&uTemp);
+        }
+
+        if (!success)
+            return false;
+
+        bytesCopied = (uint64_t)writePos.QuadPart;
+        if (duplicate) {
+            InterlockedIncrement64(&m_stats.duplicates);
+        } else {
+            InterlockedIncrement64(&m_stats.stored);
+            InterlockedAdd64(&m_stats.bytesWritten, writePos.QuadPart);
+        }
+        return true;
+    }
+
+    // Appends "<time UTC> pid <pid> <hash> <bytes> <original path>" to the index
+    void index(const uint8_t (&digest)[Sha256::DigestSize], uint64_t bytes, uint64_t processId, LARGE_INTEGER deletedAt, PCUNICODE_STRING originalPath) {
+        if (!m_hIndex)
+            return;
+
+        char hex[HashNameLength + 1];
+        for (size_t i = 0; i < Sha256::DigestSize; i++) {
+            hex[i * 2] = "0123456789abcdef"[digest[i] >> 4];
+            hex[i * 2 + 1] = "0123456789abcdef"[digest[i] & 0xF];
+        }
+        hex[HashNameLength] = 0;
+
+        TIME_FIELDS time = { 0 };
+        RtlTimeToTimeFields(&deletedAt, &time);
+
+        char line[1024];
+        int len = _snprintf(line, sizeof(line), "%04d-%02d-%02d %02d:%02d:%02d.%03d pid %llu %s %llu %wZ\r\n",
+            time.Year, time.Month, time.Day, time.Hour, time.Minute, time.Second, time.Milliseconds, processId, hex, bytes, originalPath);
+
+        // a long path is cut off, the line still has to end
+        if (len < 0 || len >= (int)sizeof(line)) {
+            len = sizeof(line);
+            line[len - 2] = '\r';
+            line[len - 1] = '\n';
+        }
+
+        LARGE_INTEGER end;
+        end.HighPart = -1;
+        end.LowPart = FILE_WRITE_TO_END_OF_FILE;
+        writeAt(m_hIndex, line, (ULONG)len, end);
+    }
+
+    const BackupStoreStats& stats() const {
+        return m_stats;
+    }
+
+    static PCWSTR hashName(wchar_t (&name)[HashNameLength + 1], const uint8_t (&digest)[Sha256::DigestSize]) {
+        for (size_t i = 0; i < Sha256::DigestSize; i++) {
+            name[i * 2] = L"0123456789abcdef"[digest[i] >> 4];
+            name[i * 2 + 1] = L"0123456789abcdef"[digest[i] & 0xF];
+        }
+        name[HashNameLength] = 0;
+        return name;
+    }
+private:
+    static PCWSTR tempName(wchar_t (&name)[HashNameLength + 1], uint64_t id) {
+        const wchar_t prefix[] = L"tmp-";
+        size_t len = 0;
+        for (; prefix[len]; len++) {
+            name[len] = prefix[len];
+        }
+
+        for (int shift = 60; shift >= 0; shift -= 4) {
+            name[len++] = L"0123456789abcdef"[(id >> shift) & 0xF];
+        }
+        name[len] = 0;
+        return name;
+    }
+
+    // directory\name, or the directory itself for an empty name
+    UNICODE_STRING makePath(wchar_t (&path)[MAX_PATH], PCWSTR name) const {
+        memcpy(path, m_directory, m_directoryLength * sizeof(wchar_t));
+        size_t len = m_directoryLength;
+        if (*name) {
+            path[len++] = L'\\';
+            for (; *name && len < MAX_PATH - 1; name++) {
+                path[len++] = *name;
+            }
+        }
+        path[len] = 0;
+
+        UNICODE_STRING str;
+        str.Buffer = path;
+        str.Length = (USHORT)(len * sizeof(wchar_t));
+        str.MaximumLength = (USHORT)(str.Length + sizeof(wchar_t));
+        return str;
+    }
+
+    static OBJECT_ATTRIBUTES objectAttributes(PUNICODE_STRING path) {
+        OBJECT_ATTRIBUTES attrs = { 0 };
+        InitializeObjectAttributes(&attrs, path, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+        return attrs;
+    }
+
+    bool exists(PCWSTR name) const {
+        wchar_t path[MAX_PATH];
+        UNICODE_STRING uPath = makePath(path, name);
+        HANDLE hFile = NULL;
+        if (!createFile(&uPath, &hFile, FILE_READ_ATTRIBUTES | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN, FILE_NON_DIRECTORY_FILE))
+            return false;
+
+        ZwClose(hFile);
+        return true;
+    }
+
+    static void deleteFile(PUNICODE_STRING path) {
+        OBJECT_ATTRIBUTES attrs = objectAttributes(path);
+        ZwDeleteFile(&attrs);
+    }
+
+    static bool createFile(PUNICODE_STRING path, PHANDLE hFileOut, ACCESS_MASK access, ULONG shareAccess, ULONG disposition, ULONG options) {
+        *hFileOut = NULL;
+        OBJECT_ATTRIBUTES attrs = objectAttributes(path);
+        IO_STATUS_BLOCK iosb = { 0 };
+        NTSTATUS status = ZwCreateFile(hFileOut, access, &attrs, &iosb, NULL, FILE_ATTRIBUTE_NORMAL, shareAccess, disposition,
+            options | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+        if (status != STATUS_SUCCESS) {
+            *hFileOut = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    // read is 0 at the end of the file
+    static bool readAt(HANDLE hFile, PVOID buffer, ULONG size, LARGE_INTEGER pos, ULONG& read) {
+        read = 0;
+        IO_STATUS_BLOCK iosb = { 0 };
+        NTSTATUS status = ZwReadFile(hFile, NULL, NULL, NULL, &iosb, buffer, size, &pos, NULL);
+
+        // the source may have been opened for asynchronous io, its file object is signaled on completion then
+        if (status == STATUS_PENDING) {
+            ZwWaitForSingleObject(hFile, FALSE, NULL);
+            status = iosb.Status;
+        }
+
+        if (status == STATUS_END_OF_FILE)
+            return true;
+
+        if (status != STATUS_SUCCESS)
+            return false;
+
+        read = (ULONG)iosb.Information;
+        return true;
+    }
+
+    static bool writeAt(HANDLE hFile, PVOID buffer, ULONG size, LARGE_INTEGER pos) {
+        IO_STATUS_BLOCK iosb = { 0 };
+        NTSTATUS status = ZwWriteFile(hFile, NULL, NULL, NULL, &iosb, buffer, size, &pos, NULL);
+        return status == STATUS_SUCCESS && iosb.Information == size;
+    }
+
+    // Renames the open file into the store, duplicate is set if the name is taken already
+    bool rename(HANDLE hFile, PCWSTR name, bool& duplicate) {
+        wchar_t path[MAX_PATH];
+        UNICODE_STRING uPath = makePath(path, name);
+
+        char infoBuffer[sizeof(FILE_RENAME_INFORMATION) + MAX_PATH * sizeof(wchar_t)] = { 0 };
+        auto info = (FILE_RENAME_INFORMATION*)infoBuffer;
+        info->ReplaceIfExists = FALSE;
+        info->RootDirectory = NULL;
+        info->FileNameLength = uPath.Length;
+        memcpy(info->FileName, uPath.Buffer, uPath.Length);
+
+        IO_STATUS_BLOCK iosb = { 0 };
+        NTSTATUS status = ZwSetInformationFile(hFile, &iosb, info, sizeof(infoBuffer), FileRenameInformation);
+        duplicate = status == STATUS_OBJECT_NAME_COLLISION;
+        return status == STATUS_SUCCESS || duplicate;
+    }
+
+    wchar_t m_directory[MAX_PATH];
+    size_t m_directoryLength;
+    HANDLE m_hIndex;
+    BackupStoreStats m_stats;
+};
@@ -14,6 +14,18 @@ public:
 	uint64_t* pStackArgs;
 	uint64_t* pRegArgs;
 
+	// captured once by the driver, so plugins don't each ask the kernel
+	uint64_t threadId;
+	uint32_t processorIndex;    // KeGetCurrentProcessorNumberEx
+	uint64_t timestamp;         // KeQueryPerformanceCounter when the probe ran
+	uint64_t duration;          // return probe only, ticks since the call's entry probe. 0 on entry or if unknown
+	uint64_t frequency;         // KeQueryPerformanceCounter ticks per second
+
+	// entry: a zeroed block the plugin may fill, return: the same block as the matching entry left it. Released after
+	// the return callback. Null unless the plugin asked for one with pSetCallContextSize, or if the entry wasn't seen.
+	void* pCallContext;
+	uint32_t callContextSize;
+
 	uint64_t read_argument(const uint32_t idx)
 	{
 		if (idx > paramCount)
@@ -68,6 +80,8 @@ typedef NTSTATUS(*tSetEtwCallbackApi)(GUID providerGuid);
 typedef NTSTATUS(*tUnSetEtwCallbackApi)();
 typedef PVOID(NTAPI* tMmGetSystemRoutineAddress)(PUNICODE_STRING SystemRoutineName);
 typedef BOOLEAN(*tTraceAccessMemory)(PVOID SafeAddress, ULONG_PTR UnsafeAddress, SIZE_T NumberOfBytes, SIZE_T ChunkSize, BOOLEAN DoRead);
+typedef NTSTATUS(*tEnableHandlePathsApi)();
+typedef NTSTATUS(*tGetHandlePathApi)(HANDLE handle, wchar_t* path, uint32_t pathChars, uint32_t* pathLength);
 
 class PluginApis {
 public:
@@ -76,12 +90,15 @@ public:
 	tSetTlsData pSetTlsData;
 	tGetTlsData pGetTlsData;
 	tLogPrintApi pLogPrint;
+	tEtwTraceApi pEtwTrace;
 	tSetCallbackApi pSetCallback;
 	tUnSetCallbackApi pUnsetCallback;
 	tSetEtwCallbackApi pEtwSetCallback;
 	tUnSetEtwCallbackApi pEtwUnSetCallback;
 	tMmGetSystemRoutineAddress pGetSystemRoutineAddress;
 	tTraceAccessMemory pTraceAccessMemory;
+	tEnableHandlePathsApi pEnableHandlePaths;
+	tGetHandlePathApi pGetHandlePath;
 };
 
 #define MINCHAR     0x80        // winnt
@@ -102,6 +119,27 @@ T ResolveApi(const wchar_t* name, PluginApis& apis) {
 	return (T)apis.pGetSystemRoutineAddress(&ustr);
 }
 
+// Shared by every CallerInfo of a process, valid for the duration of the callback it's passed to
+struct ProcessIdentity {
+	uint64_t processId;
+	uint64_t parentProcessId;
+	int64_t createTime;         // 100ns since 1601, tells a reused pid apart
+	uint32_t sessionId;
+	uint32_t nameHash;          // hashName(imageName)
+	bool isWow64;
+	char imageName[16];         // as truncated by the OS
+	wchar_t imagePath[MAX_PATH];   // full NT path, empty if it wasn't available when the process was first seen
+
+	// FNV-1a, case sensitive. Hash a target name once and compare nameHash instead of the string.
+	static uint32_t hashName(const char* name) {
+		uint32_t hash = 2166136261u;
+		for (; *name; name++) {
+			hash = (hash ^ (uint8_t)*name) * 16777619u;
+		}
+		return hash;
+	}
+};
+
 class CallerInfo
 {
 public:
@@ -116,6 +154,9 @@ public:
 	StackFrame* frames;
 	uint8_t frameDepth;
 	bool isWow64;
+
+	// null if the driver couldn't build it, the fields above are always set
+	const ProcessIdentity* process;
 };
 
 typedef bool(*tStpIsTarget)(CallerInfo& callerinfo);
@@ -65,6 +65,9 @@ typedef OBJECT_ATTRIBUTES* POBJECT_ATTRIBUTES;
 #define OBJ_VALID_ATTRIBUTES                0x00001FF2L
 
 #define STATUS_END_OF_FILE               ((NTSTATUS)0xC0000011L)
+#define STATUS_OBJECT_NAME_COLLISION     ((NTSTATUS)0xC0000035L)
+
+#define FILE_WRITE_TO_END_OF_FILE       0xffffffff
 
 #define InitializeObjectAttributes( p, n, a, r, s ) { \
     (p)->Length = sizeof( OBJECT_ATTRIBUTES );          \
@@ -230,6 +233,69 @@ typedef struct _OBJECT_NAME_INFORMATION {
     UNICODE_STRING          Name;
 } OBJECT_NAME_INFORMATION, * POBJECT_NAME_INFORMATION;
 
+typedef struct _FILE_RENAME_INFORMATION {
+    BOOLEAN ReplaceIfExists;
+    HANDLE RootDirectory;
+    ULONG FileNameLength;
+    WCHAR FileName[1];
+} FILE_RENAME_INFORMATION, * PFILE_RENAME_INFORMATION;
+
+typedef struct _TIME_FIELDS {
+    SHORT Year;
+    SHORT Month;
+    SHORT Day;
+    SHORT Hour;
+    SHORT Minute;
+    SHORT Second;
+    SHORT Milliseconds;
+    SHORT Weekday;
+} TIME_FIELDS, * PTIME_FIELDS;
+
+typedef struct _FILE_STANDARD_INFORMATION {
+    LARGE_INTEGER AllocationSize;
+    LARGE_INTEGER EndOfFile;
+    ULONG NumberOfLinks;
+    BOOLEAN DeletePending;
+    BOOLEAN Directory;
+} FILE_STANDARD_INFORMATION, * PFILE_STANDARD_INFORMATION;
+
+// Dispatcher objects are only ever touched through Ke* routines, so they're opaque here but sized like the WDK's
+typedef struct _KEVENT {
+    ULONG64 Header[3];
+} KEVENT, * PKEVENT;
+
+typedef struct _KSEMAPHORE {
+    ULONG64 Header[3];
+    LONG Limit;
+} KSEMAPHORE, * PKSEMAPHORE;
+
+// one pointer sized count, only touched through the Ex*RundownProtection routines
+typedef struct _EX_RUNDOWN_REF {
+    ULONG_PTR Count;
+} EX_RUNDOWN_REF, * PEX_RUNDOWN_REF;
+
+typedef ULONG_PTR KSPIN_LOCK, * PKSPIN_LOCK;
+typedef UCHAR KIRQL;
+typedef CCHAR KPROCESSOR_MODE;
+typedef struct _OBJECT_TYPE* POBJECT_TYPE;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode,
+    MaximumMode
+} MODE;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive = 0,
+} KWAIT_REASON;
+
+typedef VOID(NTAPI* PKSTART_ROUTINE)(PVOID StartContext);
+
 extern "C" __declspec(dllimport) PVOID NTAPI ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
 extern "C" __declspec(dllimport) void NTAPI ExFreePoolWithTag(PVOID P, ULONG Tag);
 
@@ -303,6 +369,41 @@ extern "C" __declspec(dllimport) NTSTATUS NTAPI ZwCreateFile(
 extern "C" __declspec(dllimport) NTSTATUS NTAPI NtQueryInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass);
 
 extern "C" __declspec(dllimport) NTSTATUS NTAPI ZwQueryObject(HANDLE Handle, OBJECT_INFORMATION_CLASS ObjectInformationClass, PVOID ObjectInformation, ULONG ObjectInformationLength, PULONG ReturnLength);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI ZwQueryInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI ZwSetInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+
+extern "C" __declspec(dllimport) POBJECT_TYPE* IoFileObjectType;
+extern "C" __declspec(dllimport) NTSTATUS NTAPI ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode, PVOID* Object, PVOID HandleInformation);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI ObOpenObjectByPointer(PVOID Object, ULONG HandleAttributes, PVOID PassedAccessState, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode, PHANDLE Handle);
+extern "C" __declspec(dllimport) LONG_PTR __fastcall ObfDereferenceObject(PVOID Object);
+
+extern "C" __declspec(dllimport) NTSTATUS NTAPI PsCreateSystemThread(
+    PHANDLE            ThreadHandle,
+    ULONG              DesiredAccess,
+    POBJECT_ATTRIBUTES ObjectAttributes,
+    HANDLE             ProcessHandle,
+    PVOID              ClientId,
+    PKSTART_ROUTINE    StartRoutine,
+    PVOID              StartContext
+);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI PsTerminateSystemThread(NTSTATUS ExitStatus);
+
+extern "C" __declspec(dllimport) void NTAPI KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+extern "C" __declspec(dllimport) LONG NTAPI KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait);
+extern "C" __declspec(dllimport) void NTAPI KeClearEvent(PKEVENT Event);
+extern "C" __declspec(dllimport) void NTAPI KeInitializeSemaphore(PKSEMAPHORE Semaphore, LONG Count, LONG Limit);
+extern "C" __declspec(dllimport) LONG NTAPI KeReleaseSemaphore(PKSEMAPHORE Semaphore, LONG Increment, LONG Adjustment, BOOLEAN Wait);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+extern "C" __declspec(dllimport) void NTAPI ExInitializeRundownProtection(PEX_RUNDOWN_REF RunRef);
+extern "C" __declspec(dllimport) BOOLEAN NTAPI ExAcquireRundownProtection(PEX_RUNDOWN_REF RunRef);
+extern "C" __declspec(dllimport) void NTAPI ExReleaseRundownProtection(PEX_RUNDOWN_REF RunRef);
+extern "C" __declspec(dllimport) void NTAPI ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF RunRef);
+extern "C" __declspec(dllimport) KIRQL NTAPI KeAcquireSpinLockRaiseToDpc(PKSPIN_LOCK SpinLock);
+extern "C" __declspec(dllimport) void NTAPI KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+extern "C" __declspec(dllimport) LARGE_INTEGER NTAPI KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+extern "C" __declspec(dllimport) void NTAPI KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+extern "C" __declspec(dllimport) void NTAPI RtlTimeToTimeFields(PLARGE_INTEGER Time, PTIME_FIELDS TimeFields);
 
 #undef _snprintf
 extern "C" __declspec(dllimport) int __cdecl _snprintf(char*, size_t, const char*, ...);
\ No newline at end of file
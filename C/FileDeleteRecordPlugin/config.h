@@ -2,4 +2,13 @@
 #include <stdint.h>
 
 const unsigned long POOL_TAG = '0RTS';
-const wchar_t* backup_directory = L"\\??\\C:\\deleted";
\ No newline at end of file
+// Content addressed backup store, see BackupStore
+const wchar_t* backup_directory = L"\\??\\C:\\deleted";
+
+// Backups are copied by a pool of worker threads, the deleting thread only queues them
+const unsigned long backup_worker_count = 4;
+const unsigned long backup_chunk_size = 1024 * 1024;
+
+// Deleting threads wait (up to backup_throttle_wait_ms) while more than this much file data is queued or being copied
+const unsigned long long backup_max_inflight_bytes = 256ull * 1024 * 1024;
+const unsigned long backup_throttle_wait_ms = 5000;
\ No newline at end of file
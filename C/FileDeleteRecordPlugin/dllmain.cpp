@@ -6,6 +6,8 @@
 #include "utils.h"
 #include "config.h"
 #include "string.h"
+#include "BackupQueue.h"
+#include "BackupStore.h"
 
 #pragma warning(disable: 6011)
 PluginApis g_Apis;
@@ -19,10 +21,77 @@ enum PROBE_IDS : ULONG64 {
     IdSetInformationFile = 0,
 };
 
+BackupQueue g_Backups;
+BackupStore g_BackupStore;
+
+// The path of a handle of the current process from the driver's handle cache, in the same pool layout
+// getFilePathFromHandle returns. Null on a miss, the caller falls back to asking the object manager.
+OBJECT_NAME_INFORMATION* getCachedFilePath(HANDLE hFile) {
+    wchar_t path[512];
+    uint32_t pathLength = 0;
+    if (g_Apis.pGetHandlePath(hFile, path, sizeof(path) / sizeof(path[0]), &pathLength) != STATUS_SUCCESS)
+        return nullptr;
+
+    const ULONG bytes = pathLength * sizeof(wchar_t);
+    auto pName = (OBJECT_NAME_INFORMATION*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(OBJECT_NAME_INFORMATION) + bytes, POOL_TAG);
+    if (!pName)
+        return nullptr;
+
+    pName->Name.Buffer = (PWCH)(pName + 1);
+    pName->Name.Length = (USHORT)bytes;
+    pName->Name.MaximumLength = (USHORT)bytes;
+    memcpy(pName->Name.Buffer, path, bytes);
+    return pName;
+}
+
+bool backupWorker(BackupJob& job, PVOID buffer, ULONG bufferSize, uint64_t& bytesCopied) {
+    // the queue frees job.pPath, only a path looked up here is ours to free
+    auto pFilePath = job.pPath ? job.pPath : getFilePathFromHandle(job.hFile);
+    if (!pFilePath) {
+        LOG_WARN("Backup #%llu: file [unknown] not backed up\r\n", job.id);
+        return false;
+    }
+
+    uint8_t digest[Sha256::DigestSize];
+    bool duplicate = false;
+    const bool success = g_BackupStore.store(job.hFile, job.id, buffer, bufferSize, bytesCopied, digest, duplicate);
+    const uint64_t latencyUs = (KeQueryPerformanceCounter(NULL).QuadPart - job.queuedAt) * 1000000 / g_Backups.frequency();
+    if (success) {
+        g_BackupStore.index(digest, bytesCopied, job.processId, job.deletedAt, &pFilePath->Name);
+
+        wchar_t name[BackupStore::HashNameLength + 1];
+        LOG_INFO("Backup #%llu: file %wZ backed up as %ws%s, %llu bytes %lluus after the delete\r\n", job.id, &pFilePath->Name,
+            BackupStore::hashName(name, digest), duplicate ? " (already stored)" : "", bytesCopied, latencyUs);
+    } else {
+        LOG_WARN("Backup #%llu: file %wZ backup failed\r\n", job.id, &pFilePath->Name);
+    }
+
+    if (pFilePath != job.pPath) {
+        ExFreePoolWithTag(pFilePath, POOL_TAG);
+    }
+    return success;
+}
+
 extern "C" __declspec(dllexport) void StpInitialize(PluginApis& pApis) {
     g_Apis = pApis;
     LOG_INFO("Plugin Initializing...\r\n");
 
+    if (!g_BackupStore.open(backup_directory)) {
+        LOG_ERROR("Failed to open the backup store %ws\r\n", backup_directory);
+        return;
+    }
+
+    if (!g_Backups.start(backupWorker)) {
+        LOG_ERROR("Failed to start the backup workers\r\n");
+        g_BackupStore.close();
+        return;
+    }
+
+    // names deleted files from the driver's (process, handle) cache instead of a name query per delete
+    if (g_Apis.pEnableHandlePaths() != STATUS_SUCCESS) {
+        LOG_WARN("Handle path cache unavailable, file names are queried per delete\r\n");
+    }
+
     g_Apis.pSetCallback("SetInformationFile", PROBE_IDS::IdSetInformationFile);
     LOG_INFO("Plugin Initialized\r\n");
 }
@@ -33,6 +102,22 @@ extern "C" __declspec(dllexport) void StpDeInitialize() {
 
     g_Apis.pUnsetCallback("SetInformationFile");
 
+    // finishes the backups still queued
+    g_Backups.stop();
+    g_BackupStore.close();
+
+    const BackupStats stats = g_Backups.stats();
+    const uint64_t done = stats.completed + stats.failed;
+    LOG_INFO("Backups: %llu queued, %llu completed, %llu failed, %llu dropped, %llu bytes copied\r\n",
+        stats.queued, stats.completed, stats.failed, stats.dropped, stats.bytesCopied);
+    const BackupStoreStats& storeStats = g_BackupStore.stats();
+    LOG_INFO("Backup store: %lld new, %lld already stored, %lld bytes written\r\n",
+        storeStats.stored, storeStats.duplicates, storeStats.bytesWritten);
+    if (done && stats.frequency) {
+        LOG_INFO("Backup latency: %lluus average, %lluus max\r\n",
+            stats.totalLatency / done * 1000000 / stats.frequency, stats.maxLatency * 1000000 / stats.frequency);
+    }
+
     LOG_INFO("Plugin DeInitialized\r\n");
 }
 ASSERT_INTERFACE_IMPLEMENTED(StpDeInitialize, tStpDeInitialize, "StpDeInitialize does not match the interface type");
@@ -85,16 +170,17 @@ extern "C" __declspec(dllexport) void StpCallbackEntry(ULONG64 pService, ULONG32
             if (InformationClass == 13) { // FileDispositionInformation
                 auto pInformation = (char*)ctx.read_argument(2); // 1 == DeleteFile
                 if (*pInformation == 1) {
-                    auto pFilePath = getFilePathFromHandle(hFile);
-
-                    if(pFilePath) {
-                        LOG_INFO("File %wZ deleted\r\n", pFilePath->Name);
-                        backupFile((wchar_t*)backup_directory, pFilePath->Name, hFile);
-                        ExFreePoolWithTag(pFilePath, POOL_TAG);
-                        pFilePath = nullptr;
-                        LOG_INFO("File Backup Complete\r\n");
-                    }else {
-                        LOG_INFO("File [unknown] deleted\r\n");
+                    // the copy happens on a backup worker, this only takes a reference that keeps the file around
+                    auto pPath = getCachedFilePath(hFile);
+                    if (pPath) {
+                        LOG_INFO("File %wZ deleted\r\n", &pPath->Name);
+                    }
+
+                    const uint64_t backupId = g_Backups.enqueue(hFile, callerinfo.processId, pPath);
+                    if (backupId) {
+                        LOG_INFO("File deleted, backup #%llu queued\r\n", backupId);
+                    } else {
+                        LOG_WARN("File deleted, backup skipped\r\n");
                     }
 
                     PrintStackTrace(callerinfo);
@@ -115,7 +115,7 @@ bool createFile(PUNICODE_STRING filePath, PHANDLE hFileOut) {
         NULL,
         FILE_ATTRIBUTE_SYSTEM,
         FILE_SHARE_READ,
-        FILE_OPEN_IF,
+        FILE_OVERWRITE_IF,
         FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
         NULL,
         0);
@@ -139,88 +139,6 @@ bool openFile(PUNICODE_STRING filePath, PHANDLE hFileOut) {
     return Status == STATUS_SUCCESS;
 }
 
-// backupFileName must begin with a slash, or be a filepath with slashes
-bool backupFile(PWSTR backupDir, UNICODE_STRING backupFileName, HANDLE hFileSource) {
-    if (!backupFileName.Buffer || backupFileName.Length <= sizeof(wchar_t))
-        return false;
-
-    // scan backwards until first slash
-    PWCHAR fileName = backupFileName.Buffer + (backupFileName.Length - sizeof(wchar_t));
-    size_t fileNameLen = 0;
-    while (*fileName != L'\\') {
-        fileName--;
-        fileNameLen++;
-    }
-
-    UNICODE_STRING backupPath = { 0 };
-    backupPath.Length = (USHORT)(wcslen(backupDir) * sizeof(wchar_t));
-    backupPath.MaximumLength = (USHORT)(backupPath.Length + (fileNameLen * sizeof(wchar_t)));
-    backupPath.Buffer = (PWSTR)ExAllocatePoolWithTag(NonPagedPoolNx, backupPath.MaximumLength, POOL_TAG);
-    memcpy(backupPath.Buffer, backupDir, backupPath.Length);
-
-    NTSTATUS status = RtlAppendUnicodeToString(&backupPath, fileName);
-    if (status != STATUS_SUCCESS)
-        return false;
-
-    HANDLE hFileCopy = INVALID_HANDLE_VALUE;
-    auto close_handles = finally([&] {
-        if (hFileCopy != INVALID_HANDLE_VALUE) {
-            ZwClose(hFileCopy);
-        }
-    });
-
-    if (!createFile(&backupPath, &hFileCopy))
-        return false;
-
-    LARGE_INTEGER pos = { 0 };
-    IO_STATUS_BLOCK iosb = { 0 };
-
-    LARGE_INTEGER pos_write = { 0 };
-    IO_STATUS_BLOCK iosb_write = { 0 };
-
-    while (true) {
-        char pBuf[512] = { 0 };
-        status = ZwReadFile(
-            hFileSource,
-            NULL, NULL, NULL,
-            &iosb,
-            pBuf, (ULONG)sizeof(pBuf),
-            &pos,
-            NULL
-        );
-
-        if (status == STATUS_END_OF_FILE) {
-            if (iosb.Information == 0) {
-                break;
-            }
-        }
-
-        if (status != STATUS_SUCCESS) {
-            break;
-        }
-
-        status = ZwWriteFile(hFileCopy,
-            NULL, NULL, NULL,
-            &iosb_write,
-            pBuf, (ULONG)sizeof(pBuf),
-            &pos_write,
-            NULL
-        );
-
-        if (iosb_write.Status != STATUS_SUCCESS) {
-            break;
-        }
-
-        if (status != STATUS_SUCCESS) {
-            break;
-        }
-
-        pos.QuadPart += iosb.Information;
-        pos_write.QuadPart += iosb_write.Information;
-    }
-    return true;
-}
-
 VOID NTAPI FreeUnicodeString(PUNICODE_STRING UnicodeString, ULONG Tag)
 {
     if (UnicodeString->Buffer)
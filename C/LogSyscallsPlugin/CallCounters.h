@@ -0,0 +1,125 @@
+#pragma once
+#include "KernelApis.h"
+#include "config.h"
+#include "../PluginShared/concurrent_map.h"
+#include "new.h"
+
+// ConcurrentMaps live in the plugin's pool, placement new since there is no kernel operator new
+inline void destroyMap(ConcurrentMap*& pMap) {
+    if (!pMap)
+        return;
+
+    pMap->~ConcurrentMap();
+    ExFreePoolWithTag(pMap, POOL_TAG);
+    pMap = nullptr;
+}
+
+// Null if the map or its table couldn't be allocated
+inline ConcurrentMap* createMap(size_t capacity) {
+    void* p = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(ConcurrentMap), POOL_TAG);
+    if (!p)
+        return nullptr;
+
+    auto pMap = new (p) ConcurrentMap(capacity);
+    if (!pMap->valid()) {
+        destroyMap(pMap);
+    }
+    return pMap;
+}
+
+// Combines value into the running hash h, boost's hash_combine widened to 64 bits
+inline uint64_t mixHash(uint64_t h, uint64_t value) {
+    h ^= value + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+    return h;
+}
+
+/*
+The counting half of RegistrySummary and StackFolder. A call bumps its key in one of TableCount tables picked by
+processor index, so CPUs rarely share a cache line, and drain() moves what the tables counted into one merged map for
+the owner's flush. Every map is fixed size, a call whose key doesn't fit is counted in dropped() instead.
+*/
+template<uint32_t TableCount>
+class CallCounters {
+public:
+    // False if a map couldn't be allocated, stop() then frees what was
+    bool start(size_t slots, size_t mergedCapacity) {
+        m_nextFlush = 0;
+        m_flushing = 0;
+        m_dropped = 0;
+
+        bool ok = (m_merged = createMap(mergedCapacity)) != nullptr;
+        for (uint32_t i = 0; ok && i < TableCount; i++) {
+            ok = (m_tables[i] = createMap(slots)) != nullptr;
+        }
+        return ok;
+    }
+
+    void stop() {
+        for (uint32_t i = 0; i < TableCount; i++) {
+            destroyMap(m_tables[i]);
+        }
+        destroyMap(m_merged);
+    }
+
+    bool active() const {
+        return m_merged != nullptr;
+    }
+
+    uint64_t dropped() const {
+        return (uint64_t)m_dropped;
+    }
+
+    void drop(uint64_t calls = 1) {
+        _InterlockedAdd64(&m_dropped, (LONG64)calls);
+    }
+
+    void count(uint32_t processorIndex, uint64_t key) {
+        if (!m_tables[processorIndex % TableCount]->add(key, 1)) {
+            drop();
+        }
+    }
+
+    // True for the one caller that should flush now, every intervalMs. The first call arms the timer.
+    bool flushDue(uint64_t timestamp, uint64_t frequency, uint64_t intervalMs) {
+        const uint64_t next = (uint64_t)m_nextFlush;
+        if (timestamp < next || !frequency)
+            return false;
+
+        const uint64_t following = timestamp + frequency * intervalMs / 1000;
+        if ((uint64_t)_InterlockedCompareExchange64(&m_nextFlush, (LONG64)following, (LONG64)next) != next)
+            return false;
+        return next != 0;
+    }
+
+    // Moves every count since the previous drain into the merged map, calls fn(merged) and empties it again. False,
+    // without calling fn, if another drain is running.
+    template<typename Fn>
+    bool drain(Fn fn) {
+        if (_InterlockedExchange(&m_flushing, 1))
+            return false;
+
+        // remove() hands back exactly what was counted, a call racing it starts the slot over
+        for (uint32_t i = 0; i < TableCount; i++) {
+            ConcurrentMap* pTable = m_tables[i];
+            pTable->forEach([&](uint64_t key, uint64_t) {
+                uint64_t calls = 0;
+                if (pTable->remove(key, &calls) && calls && !m_merged->add(key, calls)) {
+                    drop(calls);
+                }
+            });
+        }
+
+        fn(*m_merged);
+
+        // only a drain uses the merged map
+        m_merged->clear();
+        _InterlockedExchange(&m_flushing, 0);
+        return true;
+    }
+private:
+    ConcurrentMap* m_merged;       // key -> calls, drain only
+    ConcurrentMap* m_tables[TableCount];    // key -> calls since the last drain
+    volatile LONG64 m_nextFlush;
+    volatile LONG m_flushing;
+    volatile LONG64 m_dropped;
+};
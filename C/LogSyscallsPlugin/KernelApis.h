@@ -24,6 +24,32 @@ typedef struct _OBJECT_ATTRIBUTES {
 } OBJECT_ATTRIBUTES;
 typedef OBJECT_ATTRIBUTES* POBJECT_ATTRIBUTES;
 
+typedef ULONG_PTR KSPIN_LOCK, * PKSPIN_LOCK;
+typedef UCHAR KIRQL;
+typedef CCHAR KPROCESSOR_MODE;
+
+// Dispatcher objects are only ever touched through Ke* routines, so they're opaque here but sized like the WDK's
+typedef struct _KEVENT {
+	ULONG64 Header[3];
+} KEVENT, * PKEVENT;
+
+typedef enum _MODE {
+	KernelMode,
+	UserMode,
+	MaximumMode
+} MODE;
+
+typedef enum _EVENT_TYPE {
+	NotificationEvent,
+	SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+	Executive = 0,
+} KWAIT_REASON;
+
+typedef VOID(NTAPI* PKSTART_ROUTINE)(PVOID StartContext);
+
 #define FILE_SUPERSEDE                  0x00000000
 #define FILE_OPEN                       0x00000001
 #define FILE_CREATE                     0x00000002
@@ -233,6 +259,23 @@ typedef struct _OBJECT_NAME_INFORMATION {
 
 extern "C" __declspec(dllimport) PVOID NTAPI ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
 extern "C" __declspec(dllimport) void NTAPI ExFreePoolWithTag(PVOID P, ULONG Tag);
+extern "C" __declspec(dllimport) KIRQL NTAPI KeAcquireSpinLockRaiseToDpc(PKSPIN_LOCK SpinLock);
+extern "C" __declspec(dllimport) void NTAPI KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+extern "C" __declspec(dllimport) void NTAPI KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+extern "C" __declspec(dllimport) LONG NTAPI KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+extern "C" __declspec(dllimport) LARGE_INTEGER NTAPI KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI PsCreateSystemThread(
+	PHANDLE            ThreadHandle,
+	ULONG              DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	HANDLE             ProcessHandle,
+	PVOID              ClientId,
+	PKSTART_ROUTINE    StartRoutine,
+	PVOID              StartContext
+);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI PsTerminateSystemThread(NTSTATUS ExitStatus);
+extern "C" __declspec(dllimport) NTSTATUS NTAPI ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
 
 extern "C" __declspec(dllimport) NTSTATUS NTAPI RtlAppendUnicodeStringToString(PUNICODE_STRING Destination, PCUNICODE_STRING Source);
 extern "C" __declspec(dllimport) NTSTATUS NTAPI RtlAppendUnicodeToString(PUNICODE_STRING Destination, PCWSTR Source);
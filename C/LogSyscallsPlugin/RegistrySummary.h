@@ -0,0 +1,297 @@
+#pragma once
+#include "KernelApis.h"
+#include "config.h"
+#include "CallCounters.h"
+
+// What an open's entry leaves for its return in MachineState::pCallContext
+struct RegistryOpenContext {
+    uint64_t pKeyHandle;      // PHANDLE, 0 if the call isn't an open
+    uint64_t pDisposition;    // PULONG of NtCreateKey(Transacted), 0 otherwise
+};
+
+/*
+Counts registry reads, writes and deletes per (process, key path, value name) instead of logging every call, so what a
+process touched in the registry comes out as a few KB of summary lines.
+
+A key handle's path is asked from the object manager once, when the open returns (or on first use of a handle opened
+before tracing started), and cached per (process, handle) until NtClose. Paths and value names are interned by a case
+insensitive hash, a row is interned by the hash of its three parts. The calls themselves only bump the row's counter in
+CallCounters, flush() drains them and hands each row to a printer, rows without calls since the previous flush aren't
+repeated.
+
+Every map is fixed size (registry_summary_slots for the counter tables, registry_summary_keys for the rest). Once one is
+full new handles, names or rows are dropped and counted in dropped(), the summary then says so rather than growing.
+*/
+class RegistrySummary {
+public:
+    enum Op : uint64_t {
+        Read = 0,
+        Write = 1,
+        Delete = 2,
+        OpCount = 3,
+    };
+
+    struct Name {
+        uint32_t length;      // chars, chars is NUL terminated too
+        wchar_t chars[1];
+    };
+
+    struct Row {
+        uint64_t processId;
+        uint64_t keyId;       // 0 if the key path couldn't be resolved
+        uint64_t valueId;     // 0 for calls on the key itself
+        char processName[16];
+    };
+
+    static const uint32_t MaxKeyChars = 1024;
+    static const uint32_t MaxValueChars = 256;
+
+    // Call from StpInitialize. False if the tables couldn't be allocated, the summary then stays off.
+    bool start(const PluginApis& apis) {
+        m_apis = &apis;
+
+        const bool ok = (m_handles = createMap(registry_summary_keys)) && (m_names = createMap(registry_summary_keys)) &&
+            (m_rows = createMap(registry_summary_keys)) && m_counts.start(registry_summary_slots, registry_summary_keys);
+        if (!ok) {
+            stop();
+        }
+        return ok;
+    }
+
+    // Call from StpDeInitialize once the callbacks are unset, after the last flush
+    void stop() {
+        m_counts.stop();
+
+        // the maps own the interned names and rows
+        if (m_names) {
+            m_names->forEach([](uint64_t, uint64_t value) { ExFreePoolWithTag((PVOID)value, POOL_TAG); });
+        }
+
+        if (m_rows) {
+            m_rows->forEach([](uint64_t, uint64_t value) { ExFreePoolWithTag((PVOID)value, POOL_TAG); });
+        }
+
+        destroyMap(m_handles);
+        destroyMap(m_names);
+        destroyMap(m_rows);
+    }
+
+    bool active() const {
+        return m_counts.active();
+    }
+
+    uint64_t dropped() const {
+        return m_counts.dropped();
+    }
+
+    // One call on the key handle, pValueName is the call's PUNICODE_STRING ValueName or 0 for calls on the key itself
+    void count(Op op, const MachineState& ctx, const CallerInfo& callerinfo, uint64_t handle, uint64_t pValueName) {
+        const uint64_t keyId = keyOf(callerinfo.processId, handle);
+        const uint64_t valueId = pValueName ? internValueName(pValueName) : 0;
+        const uint64_t rowId = internRow(callerinfo, keyId, valueId);
+        if (rowId) {
+            m_counts.count(ctx.processorIndex, rowId | op);
+        } else {
+            m_counts.drop();
+        }
+    }
+
+    // NtOpenKey(Ex), NtCreateKey and their transacted forms, all return the key in their first argument
+    void onOpenEntry(MachineState& ctx, uint64_t pDisposition) {
+        if (!ctx.pCallContext || ctx.callContextSize < sizeof(RegistryOpenContext))
+            return;
+
+        auto pContext = (RegistryOpenContext*)ctx.pCallContext;
+        pContext->pKeyHandle = ctx.read_argument(0);
+        pContext->pDisposition = pDisposition;
+    }
+
+    // Any return, only an open's entry left a context behind
+    void onReturn(MachineState& ctx, const CallerInfo& callerinfo) {
+        if (!ctx.pCallContext || ctx.callContextSize < sizeof(RegistryOpenContext))
+            return;
+
+        const RegistryOpenContext context = *(const RegistryOpenContext*)ctx.pCallContext;
+        if (!context.pKeyHandle || (NTSTATUS)ctx.read_return_value() < 0)
+            return;
+
+        HANDLE hKey = NULL;
+        if (!m_apis->pTraceAccessMemory(&hKey, context.pKeyHandle, sizeof(hKey), sizeof(hKey), TRUE) || !hKey)
+            return;
+
+        // handle values are reused, whatever was cached for this one belonged to a closed handle
+        const uint64_t keyId = resolveKey(hKey);
+        if (keyId && !m_handles->set(handleKey(callerinfo.processId, (uint64_t)hKey), keyId)) {
+            m_counts.drop();
+        }
+
+        ULONG disposition = 0;
+        if (context.pDisposition && m_apis->pTraceAccessMemory(&disposition, context.pDisposition, sizeof(disposition), sizeof(disposition), TRUE) &&
+            disposition == REG_CREATED_NEW_KEY) {
+            count(Write, ctx, callerinfo, (uint64_t)hKey, 0);
+        }
+    }
+
+    // NtClose entry, any handle. Forgets the key path cached for it.
+    void onClose(const CallerInfo& callerinfo, uint64_t handle) {
+        m_handles->remove(handleKey(callerinfo.processId, handle));
+    }
+
+    // True when the flush thread should flush, every registry_summary_flush_ms. The first call arms the timer.
+    bool flushDue(uint64_t timestamp, uint64_t frequency) {
+        return m_counts.flushDue(timestamp, frequency, registry_summary_flush_ms);
+    }
+
+    // Calls print(row, keyPath, valueName, counts[OpCount]) for every row counted since the previous flush, a name is
+    // null if it couldn't be resolved or interned. Returns the number of rows printed. A flush already running wins.
+    template<typename Fn>
+    uint64_t flush(Fn print) {
+        uint64_t printed = 0;
+        m_counts.drain([&](ConcurrentMap& merged) {
+            merged.forEach([&](uint64_t key, uint64_t) {
+                // the row was printed with an earlier op of it
+                const uint64_t rowId = key & ~(uint64_t)3;
+                uint64_t counts[OpCount] = { 0 };
+                bool any = false;
+                for (uint64_t op = 0; op < OpCount; op++) {
+                    any |= merged.remove(rowId | op, &counts[op]);
+                }
+
+                uint64_t row = 0;
+                if (!any || !m_rows->get(rowId, row))
+                    return;
+
+                const Row& r = *(const Row*)row;
+                print(r, nameOf(r.keyId), nameOf(r.valueId), counts);
+                printed++;
+            });
+        });
+        return printed;
+    }
+private:
+    static uint64_t handleKey(uint64_t processId, uint64_t handle) {
+        return (processId << 32) | (uint32_t)handle;
+    }
+
+    // registry names compare case insensitively, ASCII folding covers nearly all of them
+    static uint64_t nameHash(const wchar_t* chars, uint32_t length) {
+        uint64_t hash = 14695981039346656037ull;
+        for (uint32_t i = 0; i < length; i++) {
+            wchar_t c = chars[i];
+            if (c >= L'a' && c <= L'z') {
+                c -= L'a' - L'A';
+            }
+            hash = (hash ^ (uint64_t)c) * 1099511628211ull;
+        }
+        return hash && hash != ConcurrentMap::ReservedKey ? hash : 1;
+    }
+
+    const Name* nameOf(uint64_t id) const {
+        uint64_t name = 0;
+        return id && m_names->get(id, name) ? (const Name*)name : nullptr;
+    }
+
+    // 0 only if chars is empty
+    uint64_t intern(const wchar_t* chars, uint32_t length) {
+        if (!length)
+            return 0;
+
+        const uint64_t id = nameHash(chars, length);
+        uint64_t existing = 0;
+        if (m_names->get(id, existing))
+            return id;
+
+        auto pName = (Name*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Name) + length * sizeof(wchar_t), POOL_TAG);
+        if (!pName)
+            return id;
+
+        pName->length = length;
+        memcpy(pName->chars, chars, length * sizeof(wchar_t));
+        pName->chars[length] = 0;
+
+        // lost a race for the same name, or the map is full and the row prints without it
+        if (!m_names->insert(id, (uint64_t)pName)) {
+            ExFreePoolWithTag(pName, POOL_TAG);
+        }
+        return id;
+    }
+
+    uint64_t internValueName(uint64_t pValueName) {
+        UNICODE_STRING name = { 0 };
+        if (!m_apis->pTraceAccessMemory(&name, pValueName, sizeof(name), sizeof(name), TRUE) || !name.Buffer || !name.Length)
+            return 0;
+
+        wchar_t chars[MaxValueChars];
+        uint32_t length = name.Length / sizeof(wchar_t);
+        if (length > MaxValueChars) {
+            length = MaxValueChars;
+        }
+
+        if (!m_apis->pTraceAccessMemory(chars, (ULONG_PTR)name.Buffer, length * sizeof(wchar_t), sizeof(wchar_t), TRUE))
+            return 0;
+        return intern(chars, length);
+    }
+
+    // Asks the object manager, \REGISTRY\MACHINE\... for a key handle of the current process
+    uint64_t resolveKey(HANDLE hKey) {
+        const ULONG size = sizeof(UNICODE_STRING) + MaxKeyChars * sizeof(wchar_t);
+        auto pName = (UNICODE_STRING*)ExAllocatePoolWithTag(NonPagedPoolNx, size, POOL_TAG);
+        if (!pName)
+            return 0;
+
+        uint64_t id = 0;
+        ULONG returned = 0;
+        if (ZwQueryObject(hKey, ObjectNameInformation, pName, size, &returned) == STATUS_SUCCESS && pName->Buffer) {
+            id = intern(pName->Buffer, pName->Length / sizeof(wchar_t));
+        }
+        ExFreePoolWithTag(pName, POOL_TAG);
+        return id;
+    }
+
+    // A handle opened before tracing started is resolved on first use
+    uint64_t keyOf(uint64_t processId, uint64_t handle) {
+        const uint64_t key = handleKey(processId, handle);
+        uint64_t keyId = 0;
+        if (m_handles->get(key, keyId))
+            return keyId;
+
+        keyId = resolveKey((HANDLE)handle);
+        if (keyId && !m_handles->set(key, keyId)) {
+            m_counts.drop();
+        }
+        return keyId;
+    }
+
+    // 0 if the row map is full
+    uint64_t internRow(const CallerInfo& callerinfo, uint64_t keyId, uint64_t valueId) {
+        // the low two bits carry the op in the counter tables
+        const uint64_t rowId = mixHash(mixHash(mixHash(0, callerinfo.processId), keyId), valueId) & ~(uint64_t)3;
+        uint64_t existing = 0;
+        if (m_rows->get(rowId, existing))
+            return rowId;
+
+        auto pRow = (Row*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Row), POOL_TAG);
+        if (!pRow)
+            return 0;
+
+        pRow->processId = callerinfo.processId;
+        pRow->keyId = keyId;
+        pRow->valueId = valueId;
+        memset(pRow->processName, 0, sizeof(pRow->processName));
+        for (uint32_t i = 0; i + 1 < sizeof(pRow->processName) && callerinfo.processName[i]; i++) {
+            pRow->processName[i] = callerinfo.processName[i];
+        }
+
+        if (!m_rows->insert(rowId, (uint64_t)pRow, &existing)) {
+            ExFreePoolWithTag(pRow, POOL_TAG);
+            return existing ? rowId : 0;
+        }
+        return rowId;
+    }
+
+    const PluginApis* m_apis;
+    ConcurrentMap* m_handles;      // (pid << 32) | handle -> key path name id
+    ConcurrentMap* m_names;        // name id -> Name*
+    ConcurrentMap* m_rows;         // row id -> Row*
+    CallCounters<registry_summary_tables> m_counts;    // row id | op -> calls
+};
@@ -0,0 +1,206 @@
+#pragma once
+#include "KernelApis.h"
+#include "config.h"
+#include "CallCounters.h"
+
+/*
+Folded stacks for flame graphs. Instead of a log line per frame, a captured stack is reduced to (module, offset) frames
+and counted under a stack id, the hash of the process name and its frames. flush() then logs a handful of lines for
+any number of calls: a module's path once, a stack's frames once and a count per stack since the previous flush.
+PDBReSym's "fold" command streams such a log back into "process;frame;...;frame count" lines for flamegraph.pl,
+symbolicating the frames with the PDBs it caches.
+
+A call bumps its stack id in CallCounters, flush() drains them. Modules and stacks are interned into fixed size maps
+(stack_fold_stacks slots), once one is full new stacks are dropped and counted in dropped().
+*/
+class StackFolder {
+public:
+    struct Module {
+        uint32_t id;                  // 1 based, 0 marks frames outside any module
+        volatile LONG printed;
+        char path[sizeof(CallerInfo::StackFrame::modulePath)];
+    };
+
+    struct Frame {
+        uint32_t moduleId;
+        uint32_t reserved;
+        uint64_t offset;              // from the module's base, the address itself if moduleId is 0
+    };
+
+    struct Stack {
+        uint64_t id;
+        volatile LONG printed;
+        uint32_t depth;
+        char processName[16];
+        Frame frames[MAX_FRAME_DEPTH];    // root first
+    };
+
+    // Call from StpInitialize. False if the maps couldn't be allocated, stacks are then logged frame by frame.
+    bool start() {
+        m_moduleCount = 0;
+
+        const bool ok = (m_modules = createMap(stack_fold_stacks)) && (m_stacks = createMap(stack_fold_stacks)) &&
+            m_counts.start(stack_fold_slots, stack_fold_stacks);
+        if (!ok) {
+            stop();
+        }
+        return ok;
+    }
+
+    // Call from StpDeInitialize once the callbacks are unset, after the last flush
+    void stop() {
+        m_counts.stop();
+
+        // the maps own the interned modules and stacks
+        if (m_modules) {
+            m_modules->forEach([](uint64_t, uint64_t value) { ExFreePoolWithTag((PVOID)value, POOL_TAG); });
+        }
+
+        if (m_stacks) {
+            m_stacks->forEach([](uint64_t, uint64_t value) { ExFreePoolWithTag((PVOID)value, POOL_TAG); });
+        }
+
+        destroyMap(m_modules);
+        destroyMap(m_stacks);
+    }
+
+    bool active() const {
+        return m_counts.active();
+    }
+
+    uint64_t dropped() const {
+        return m_counts.dropped();
+    }
+
+    // One call with a captured stack, calls without frames aren't counted
+    void count(const MachineState& ctx, const CallerInfo& callerinfo) {
+        if (!callerinfo.frames || !callerinfo.frameDepth)
+            return;
+
+        Frame frames[MAX_FRAME_DEPTH];
+        uint32_t depth = 0;
+        uint64_t id = nameHash(callerinfo.processName, sizeof(Stack::processName));
+        for (uint32_t i = callerinfo.frameDepth; i > 0 && depth < MAX_FRAME_DEPTH; i--) {
+            const CallerInfo::StackFrame& frame = callerinfo.frames[i - 1];
+            if (!frame.frameaddress)
+                continue;
+
+            Frame& folded = frames[depth++];
+            folded.moduleId = frame.modulebase ? internModule(frame.modulePath) : 0;
+            folded.reserved = 0;
+            folded.offset = folded.moduleId ? frame.frameaddress - frame.modulebase : frame.frameaddress;
+            id = mixHash(mixHash(id, folded.moduleId), folded.offset);
+        }
+
+        if (!depth)
+            return;
+
+        id = id != ConcurrentMap::ReservedKey ? id : 1;
+        if (internStack(id, callerinfo, frames, depth)) {
+            m_counts.count(ctx.processorIndex, id);
+        } else {
+            m_counts.drop();
+        }
+    }
+
+    // True when the flush thread should flush, every stack_fold_flush_ms. The first call arms the timer.
+    bool flushDue(uint64_t timestamp, uint64_t frequency) {
+        return m_counts.flushDue(timestamp, frequency, stack_fold_flush_ms);
+    }
+
+    // Calls printModule(module) for modules not printed before, then printStack(stack) for stacks not printed before and
+    // printCount(stack, calls) for every stack counted since the previous flush. Returns the number of stacks counted. A
+    // flush already running wins.
+    template<typename FnModule, typename FnStack, typename FnCount>
+    uint64_t flush(FnModule printModule, FnStack printStack, FnCount printCount) {
+        uint64_t printed = 0;
+        m_counts.drain([&](ConcurrentMap& merged) {
+            // a stack's modules were interned before it was counted, so they're all known by now
+            m_modules->forEach([&](uint64_t, uint64_t value) {
+                auto pModule = (Module*)value;
+                if (!_InterlockedExchange(&pModule->printed, 1)) {
+                    printModule(*pModule);
+                }
+            });
+
+            merged.forEach([&](uint64_t key, uint64_t calls) {
+                uint64_t stack = 0;
+                if (!m_stacks->get(key, stack))
+                    return;
+
+                auto pStack = (Stack*)stack;
+                if (!_InterlockedExchange(&pStack->printed, 1)) {
+                    printStack(*pStack);
+                }
+                printCount(*pStack, calls);
+                printed++;
+            });
+        });
+        return printed;
+    }
+private:
+    static uint64_t nameHash(const char* chars, size_t maxLength) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < maxLength && chars[i]; i++) {
+            hash = (hash ^ (uint64_t)(uint8_t)chars[i]) * 1099511628211ull;
+        }
+        return hash && hash != ConcurrentMap::ReservedKey ? hash : 1;
+    }
+
+    // 0 if the module map is full
+    uint32_t internModule(const char* path) {
+        const uint64_t key = nameHash(path, sizeof(Module::path));
+        uint64_t existing = 0;
+        if (m_modules->get(key, existing))
+            return ((const Module*)existing)->id;
+
+        auto pModule = (Module*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Module), POOL_TAG);
+        if (!pModule)
+            return 0;
+
+        pModule->printed = 0;
+        memset(pModule->path, 0, sizeof(pModule->path));
+        for (uint32_t i = 0; i + 1 < sizeof(pModule->path) && path[i]; i++) {
+            pModule->path[i] = path[i];
+        }
+
+        // an id lost to a race is skipped, ids only need to be unique
+        pModule->id = (uint32_t)_InterlockedIncrement(&m_moduleCount);
+        if (!m_modules->insert(key, (uint64_t)pModule, &existing)) {
+            ExFreePoolWithTag(pModule, POOL_TAG);
+            return existing ? ((const Module*)existing)->id : 0;
+        }
+        return pModule->id;
+    }
+
+    // False if the stack map is full
+    bool internStack(uint64_t id, const CallerInfo& callerinfo, const Frame* frames, uint32_t depth) {
+        uint64_t existing = 0;
+        if (m_stacks->get(id, existing))
+            return true;
+
+        auto pStack = (Stack*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Stack), POOL_TAG);
+        if (!pStack)
+            return false;
+
+        pStack->id = id;
+        pStack->printed = 0;
+        pStack->depth = depth;
+        memset(pStack->processName, 0, sizeof(pStack->processName));
+        for (uint32_t i = 0; i + 1 < sizeof(pStack->processName) && callerinfo.processName[i]; i++) {
+            pStack->processName[i] = callerinfo.processName[i];
+        }
+        memcpy(pStack->frames, frames, depth * sizeof(Frame));
+
+        if (!m_stacks->insert(id, (uint64_t)pStack, &existing)) {
+            ExFreePoolWithTag(pStack, POOL_TAG);
+            return existing != 0;
+        }
+        return true;
+    }
+
+    ConcurrentMap* m_modules;      // path hash -> Module*
+    ConcurrentMap* m_stacks;       // stack id -> Stack*
+    CallCounters<stack_fold_tables> m_counts;      // stack id -> calls
+    volatile LONG m_moduleCount;
+};
@@ -2,4 +2,28 @@
 #include <stdint.h>
 
 const unsigned long POOL_TAG = '0RTS';
-const wchar_t* backup_directory = L"\\??\\C:\\deleted";
\ No newline at end of file
+const wchar_t* backup_directory = L"\\??\\C:\\deleted";
+
+// Registry calls are counted per (process, key, value) and logged as a summary every registry_summary_flush_ms instead
+// of one by one, see RegistrySummary
+const bool registry_summary = true;
+const unsigned long registry_summary_flush_ms = 10000;
+
+// Counter tables, CPUs share them by processor index, and the slots of each
+const unsigned long registry_summary_tables = 16;
+const unsigned long registry_summary_slots = 4096;
+
+// Slots of the handle, name and row maps. Bounds the distinct keys, values and rows of the whole trace.
+const unsigned long registry_summary_keys = 16384;
+
+// Stacks of logged calls are counted per stack id and logged folded every stack_fold_flush_ms instead of one line per
+// frame, see StackFolder. PDBReSym fold turns the log into flame graph input.
+const bool stack_fold = true;
+const unsigned long stack_fold_flush_ms = 10000;
+
+// Counter tables, CPUs share them by processor index, and the slots of each
+const unsigned long stack_fold_tables = 16;
+const unsigned long stack_fold_slots = 4096;
+
+// Slots of the module and stack maps. Bounds the distinct stacks of the whole trace.
+const unsigned long stack_fold_stacks = 16384;
@@ -9,6 +9,8 @@
 #include "probedefs.h"
 #include "string.h"
 #include "magic_enum.hpp"
+#include "RegistrySummary.h"
+#include "StackFolder.h"
 
 #pragma warning(disable: 6011)
 PluginApis g_Apis;
@@ -18,9 +20,159 @@ PluginApis g_Apis;
 #define LOG_WARN(fmt,...)   g_Apis.pLogPrint(LogLevelWarn,  __FUNCTION__, fmt,   __VA_ARGS__)
 #define LOG_ERROR(fmt,...)  g_Apis.pLogPrint(LogLevelError, __FUNCTION__, fmt,   __VA_ARGS__)
 
+RegistrySummary g_RegistrySummary;
+StackFolder g_StackFolder;
+
+// Logs the rows counted since the previous summary, one line per (process, key, value)
+void PrintRegistrySummary() {
+	const uint64_t rows = g_RegistrySummary.flush([](const RegistrySummary::Row& row, const RegistrySummary::Name* pKey, const RegistrySummary::Name* pValue, const uint64_t* counts) {
+		const wchar_t* value = pValue ? pValue->chars : row.valueId ? L"[UNKNOWN VALUE]" : nullptr;
+		LOG_INFO("[REG] %s %llu R:%llu W:%llu D:%llu %ws%s%ws\r\n", row.processName, row.processId, counts[RegistrySummary::Read],
+			counts[RegistrySummary::Write], counts[RegistrySummary::Delete], pKey ? pKey->chars : L"[UNKNOWN KEY]", value ? " : " : "", value ? value : L"");
+	});
+	LOG_INFO("[REG] %llu keys and values touched since the last summary, %llu calls dropped so far\r\n", rows, g_RegistrySummary.dropped());
+}
+
+// Frames per [FOLDSTACK] line, a log line holds at most 512 characters
+const uint32_t FoldFramesPerLine = 12;
+
+// Logs the stacks counted since the previous flush: new modules and stacks first, then a count per stack. PDBReSym fold
+// reads these back.
+void PrintFoldedStacks() {
+	const uint64_t stacks = g_StackFolder.flush([](const StackFolder::Module& module) {
+		LOG_INFO("[FOLDMOD] %x %s\r\n", module.id, module.path);
+	}, [](const StackFolder::Stack& stack) {
+		char sprintf_tmp_buf[64] = { 0 };
+		for (uint32_t first = 0; first < stack.depth; first += FoldFramesPerLine) {
+			String frames;
+			for (uint32_t i = first; i < stack.depth && i < first + FoldFramesPerLine; i++) {
+				string_printf(frames, sprintf_tmp_buf, "%s%x+%llx", i == first ? "" : ";", stack.frames[i].moduleId, stack.frames[i].offset);
+			}
+
+			// the first line names the process, the others continue its frames
+			if (!first) {
+				LOG_INFO("[FOLDSTACK] %016llx %s %s\r\n", stack.id, stack.processName[0] ? stack.processName : "?", frames.data());
+			} else {
+				LOG_INFO("[FOLDSTACK+] %016llx %s\r\n", stack.id, frames.data());
+			}
+		}
+	}, [](const StackFolder::Stack& stack, uint64_t calls) {
+		LOG_INFO("[FOLD] %016llx %llu\r\n", stack.id, calls);
+	});
+	LOG_INFO("[FOLDSTATS] %llu stacks counted since the last flush, %llu calls dropped so far\r\n", stacks, g_StackFolder.dropped());
+}
+
+// How often the flush thread checks whether a summary is due
+const int64_t FlushPollMs = 1000;
+
+// The summaries are logged from this thread, a syscall callback only counts. Null if it couldn't be started, they're
+// then logged once from StpDeInitialize.
+HANDLE g_FlushThread;
+KEVENT g_FlushStop;
+
+void NTAPI FlushThreadMain(PVOID) {
+	LARGE_INTEGER timeout;
+	timeout.QuadPart = -10000LL * FlushPollMs;    // relative, in 100ns
+
+	while (KeWaitForSingleObject(&g_FlushStop, Executive, KernelMode, FALSE, &timeout) == (NTSTATUS)STATUS_TIMEOUT) {
+		LARGE_INTEGER frequency;
+		const uint64_t now = (uint64_t)KeQueryPerformanceCounter(&frequency).QuadPart;
+		if (g_RegistrySummary.active() && g_RegistrySummary.flushDue(now, frequency.QuadPart)) {
+			PrintRegistrySummary();
+		}
+
+		if (g_StackFolder.active() && g_StackFolder.flushDue(now, frequency.QuadPart)) {
+			PrintFoldedStacks();
+		}
+	}
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+bool StartFlushThread() {
+	KeInitializeEvent(&g_FlushStop, NotificationEvent, FALSE);
+
+	OBJECT_ATTRIBUTES attrs = { 0 };
+	InitializeObjectAttributes(&attrs, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	if (PsCreateSystemThread(&g_FlushThread, THREAD_ALL_ACCESS, &attrs, NULL, NULL, FlushThreadMain, nullptr) != STATUS_SUCCESS) {
+		g_FlushThread = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Returns once the thread is gone, a flush it was running included
+void StopFlushThread() {
+	if (!g_FlushThread)
+		return;
+
+	KeSetEvent(&g_FlushStop, 0, FALSE);
+	ZwWaitForSingleObject(g_FlushThread, FALSE, NULL);
+	ZwClose(g_FlushThread);
+	g_FlushThread = NULL;
+}
+
+// Feeds a registry syscall to the summary. False for any other syscall, those are still logged one by one.
+bool SummarizeRegistryCall(ULONG32 probeId, MachineState& ctx, CallerInfo& callerinfo) {
+	switch ((PROBE_IDS)probeId) {
+	case PROBE_IDS::IdOpenKey:
+	case PROBE_IDS::IdOpenKeyEx:
+	case PROBE_IDS::IdOpenKeyTransacted:
+	case PROBE_IDS::IdOpenKeyTransactedEx:
+		g_RegistrySummary.onOpenEntry(ctx, 0);
+		return true;
+	case PROBE_IDS::IdCreateKey:
+		g_RegistrySummary.onOpenEntry(ctx, ctx.read_argument(6));
+		return true;
+	case PROBE_IDS::IdCreateKeyTransacted:
+		g_RegistrySummary.onOpenEntry(ctx, ctx.read_argument(7));
+		return true;
+	case PROBE_IDS::IdQueryValueKey:
+		g_RegistrySummary.count(RegistrySummary::Read, ctx, callerinfo, ctx.read_argument(0), ctx.read_argument(1));
+		return true;
+	case PROBE_IDS::IdQueryKey:
+	case PROBE_IDS::IdEnumerateKey:
+	case PROBE_IDS::IdEnumerateValueKey:
+	case PROBE_IDS::IdQueryMultipleValueKey:
+		g_RegistrySummary.count(RegistrySummary::Read, ctx, callerinfo, ctx.read_argument(0), 0);
+		return true;
+	case PROBE_IDS::IdSetValueKey:
+		g_RegistrySummary.count(RegistrySummary::Write, ctx, callerinfo, ctx.read_argument(0), ctx.read_argument(1));
+		return true;
+	case PROBE_IDS::IdRenameKey:
+		g_RegistrySummary.count(RegistrySummary::Write, ctx, callerinfo, ctx.read_argument(0), 0);
+		return true;
+	case PROBE_IDS::IdDeleteValueKey:
+		g_RegistrySummary.count(RegistrySummary::Delete, ctx, callerinfo, ctx.read_argument(0), ctx.read_argument(1));
+		return true;
+	case PROBE_IDS::IdDeleteKey:
+		g_RegistrySummary.count(RegistrySummary::Delete, ctx, callerinfo, ctx.read_argument(0), 0);
+		return true;
+	case PROBE_IDS::IdClose:
+		// any handle, the call is still logged
+		g_RegistrySummary.onClose(callerinfo, ctx.read_argument(0));
+		return false;
+	default:
+		return false;
+	}
+}
+
 extern "C" __declspec(dllexport) void StpInitialize(PluginApis & pApis) {
 	g_Apis = pApis;
 	LOG_INFO("Plugin Initializing...\r\n");
+
+	// an open's entry hands its PHANDLE to the return, where the new key's path is looked up once
+	if (registry_summary && (g_Apis.pSetCallContextSize(sizeof(RegistryOpenContext)) != STATUS_SUCCESS || !g_RegistrySummary.start(g_Apis))) {
+		LOG_WARN("Registry summary unavailable, registry calls are logged one by one\r\n");
+	}
+
+	if (stack_fold && !g_StackFolder.start()) {
+		LOG_WARN("Stack folding unavailable, stacks are logged frame by frame\r\n");
+	}
+
+	if ((g_RegistrySummary.active() || g_StackFolder.active()) && !StartFlushThread()) {
+		LOG_WARN("No summary flush thread, summaries are logged once when the plugin unloads\r\n");
+	}
+
 	g_Apis.pSetCallback("LockProductActivationKeys", PROBE_IDS::IdLockProductActivationKeys);
 	g_Apis.pSetCallback("WaitHighEventPair", PROBE_IDS::IdWaitHighEventPair);
 	g_Apis.pSetCallback("RegisterThreadTerminatePort", PROBE_IDS::IdRegisterThreadTerminatePort);
@@ -945,6 +1097,19 @@ extern "C" __declspec(dllexport) void StpDeInitialize() {
 	g_Apis.pUnsetCallback("SetInformationWorkerFactory");
 	g_Apis.pUnsetCallback("AdjustTokenClaimsAndDeviceGroups");
 	g_Apis.pUnsetCallback("SaveMergedKeys");
+
+	// the last flush is this one
+	StopFlushThread();
+
+	if (g_RegistrySummary.active()) {
+		PrintRegistrySummary();
+		g_RegistrySummary.stop();
+	}
+
+	if (g_StackFolder.active()) {
+		PrintFoldedStacks();
+		g_StackFolder.stop();
+	}
 	LOG_INFO("Plugin DeInitialized\r\n");
 }
 ASSERT_INTERFACE_IMPLEMENTED(StpDeInitialize, tStpDeInitialize, "StpDeInitialize does not match the interface type");
@@ -1009,6 +1174,11 @@ pStackArgs: Pointer to stack area containing the rest of the arguments, if any
 **/
 extern "C" __declspec(dllexport) void StpCallbackEntry(ULONG64 pService, ULONG32 probeId, MachineState & ctx, CallerInfo & callerinfo)
 {
+	if (g_RegistrySummary.active()) {
+		if (SummarizeRegistryCall(probeId, ctx, callerinfo))
+			return;
+	}
+
 	LOG_INFO("[ENTRY] %s %s\r\n", get_probe_name((PROBE_IDS)probeId), callerinfo.processName);
 	auto argTypes = get_probe_argtypes((PROBE_IDS)probeId);
 
@@ -1258,7 +1428,12 @@ extern "C" __declspec(dllexport) void StpCallbackEntry(ULONG64 pService, ULONG32
 	if (argsString.size()) {
 		LOG_INFO("Args(%s)\r\n", argsString.data());
 	}
-	PrintStackTrace(callerinfo);
+
+	if (g_StackFolder.active()) {
+		g_StackFolder.count(ctx, callerinfo);
+	} else {
+		PrintStackTrace(callerinfo);
+	}
 }
 ASSERT_INTERFACE_IMPLEMENTED(StpCallbackEntry, tStpCallbackEntryPlugin, "StpCallbackEntry does not match the interface type");
 
@@ -1271,6 +1446,10 @@ pArgSize: Length of argument array, usually hard coded to 1
 pStackArgs: Pointer to stack area containing the rest of the arguments, if any
 **/
 extern "C" __declspec(dllexport) void StpCallbackReturn(ULONG64 pService, ULONG32 probeId, MachineState & ctx, CallerInfo & callerinfo) {
+	if (g_RegistrySummary.active()) {
+		g_RegistrySummary.onReturn(ctx, callerinfo);
+	}
+
 	if (strcmp(callerinfo.processName, "test.exe") == 0) {
 		LOG_INFO("[RETURN] %s %s\r\n", get_probe_name((PROBE_IDS)probeId), callerinfo.processName);
 	}
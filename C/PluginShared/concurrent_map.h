@@ -0,0 +1,313 @@
+#pragma once
+#include <intrin.h>
+
+// Shared by every plugin. The includer is responsible for including its own KernelApis.h first, for the pool and spin
+// lock routines, so this must stay free of any plugin's headers.
+
+/*
+Fixed capacity, open addressing uint64_t -> uint64_t hash map for plugin global state: per process counters, handle ->
+something, address -> allocation. Any number of CPUs may use it at once at IRQL <= DISPATCH_LEVEL. The table is a
+single NonPagedPoolNx allocation made by the constructor and never grows.
+
+Reads and updates of a key that has a slot take no lock. Every value change is one compare exchange of the whole
+(key, value) slot, so it can't land on a slot that meanwhile went to another key. Removing a key turns its value into
+a tombstone and inserting it again revives the same slot.
+
+Claiming a slot for a key that has none is locked by design: it takes m_claimLock, a spin lock at DISPATCH_LEVEL, to
+claim the first tombstone or empty slot in its probe window. Tombstones being reusable makes capacity bound the live
+keys rather than every key ever inserted, pids, handles and addresses can all come and go for the whole trace. That
+reuse is what rules out a lock free claim. A CPU probing for a free slot can pass a live slot whose key another CPU
+removes, reuses for the same new key and publishes a value in, and would then claim a second slot further on. With
+claims serialized, and only claims changing a slot's key, a key never has two slots. A claim happens once per key, or
+again after its tombstone went to another key, every later insert, update or remove of it takes no lock.
+
+A key lives within MaxProbe slots of its hash. Lookups stop there even once no slot is empty any more, the table is
+full for a key whose window holds only live keys. Keep it at most half full.
+
+ReservedKey can't be used as a key and ReservedValue can't be stored, they mark empty slots and tombstones.
+*/
+class ConcurrentMap {
+public:
+    static const uint64_t ReservedKey = ~0ull;
+    static const uint64_t ReservedValue = ~0ull;
+    static const size_t MaxProbe = 64;
+
+    // capacity is rounded up to a power of two, check valid() after, the allocation can fail
+    explicit ConcurrentMap(size_t capacity) noexcept {
+        size_t slots = 16;
+        while (slots < capacity) {
+            slots *= 2;
+        }
+
+        m_used = 0;
+        m_claimLock = 0;
+        m_mask = slots - 1;
+        m_slots = (Slot*)ExAllocatePoolWithTag(NonPagedPoolNx, slots * sizeof(Slot), '0PAM');
+        clear();
+    }
+
+    ~ConcurrentMap() {
+        if (m_slots) {
+            ExFreePoolWithTag(m_slots, '0PAM');
+            m_slots = nullptr;
+        }
+    }
+
+    // non-copyable
+    ConcurrentMap(const ConcurrentMap&) = delete;
+    ConcurrentMap& operator=(const ConcurrentMap&) = delete;
+
+    // non-moveable, other CPUs hold pointers into it
+    ConcurrentMap(ConcurrentMap&&) = delete;
+    ConcurrentMap& operator=(ConcurrentMap&&) = delete;
+
+    bool valid() const {
+        return m_slots != nullptr;
+    }
+
+    size_t capacity() const {
+        return m_mask + 1;
+    }
+
+    // slots ever claimed by a key, tombstones included
+    size_t used() const {
+        return (size_t)m_used;
+    }
+
+    // Inserts or overwrites. False if the table is full or key/value is reserved.
+    bool set(uint64_t key, uint64_t value) {
+        if (value == ReservedValue)
+            return false;
+
+        while (Slot* slot = find(key, true)) {
+            if (exchangeValue(slot, key, (uint64_t)slot->value, value))
+                return true;
+        }
+        return false;
+    }
+
+    // Inserts only if the key is absent, otherwise existing (optional) receives the current value and nothing changes
+    bool insert(uint64_t key, uint64_t value, uint64_t* existing = nullptr) {
+        if (value == ReservedValue)
+            return false;
+
+        while (Slot* slot = find(key, true)) {
+            Contents current;
+            if (exchangeValue(slot, key, ReservedValue, value, &current))
+                return true;
+
+            // otherwise the slot went to another key or the value was just removed again, look again
+            if (current.key == key && current.value != ReservedValue) {
+                if (existing) {
+                    *existing = current.value;
+                }
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool get(uint64_t key, uint64_t& value) const {
+        return const_cast<ConcurrentMap*>(this)->read(key, value);
+    }
+
+    // Adds delta (two's complement, so subtracting works too), an absent key starts at 0. result (optional) receives the
+    // new value. False if the table is full or the sum would be ReservedValue.
+    bool add(uint64_t key, uint64_t delta, uint64_t* result = nullptr) {
+        while (Slot* slot = find(key, true)) {
+            const uint64_t prev = (uint64_t)slot->value;
+            const uint64_t next = (prev == ReservedValue ? 0 : prev) + delta;
+            if (next == ReservedValue)
+                return false;
+
+            if (exchangeValue(slot, key, prev, next)) {
+                if (result) {
+                    *result = next;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Replaces the value only if it is still expected. False if it wasn't or the key is absent.
+    bool compareExchange(uint64_t key, uint64_t expected, uint64_t desired) {
+        if (expected == ReservedValue || desired == ReservedValue)
+            return false;
+
+        while (Slot* slot = find(key, false)) {
+            Contents current;
+            if (exchangeValue(slot, key, expected, desired, &current))
+                return true;
+
+            if (current.key == key)
+                return false;
+        }
+        return false;
+    }
+
+    // Tombstones the key, value (optional) receives what it held. False if it was absent.
+    bool remove(uint64_t key, uint64_t* value = nullptr) {
+        while (Slot* slot = find(key, false)) {
+            const uint64_t prev = (uint64_t)slot->value;
+            if (prev == ReservedValue) {
+                if ((uint64_t)slot->key == key)
+                    return false;
+                continue;
+            }
+
+            if (exchangeValue(slot, key, prev, ReservedValue)) {
+                if (value) {
+                    *value = prev;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Calls fn(key, value) for every present key. Changes made meanwhile by other CPUs may or may not be seen.
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        if (!m_slots)
+            return;
+
+        for (size_t i = 0; i <= m_mask; i++) {
+            const uint64_t key = (uint64_t)m_slots[i].key;
+            const uint64_t value = (uint64_t)m_slots[i].value;
+            if (key != ReservedKey && value != ReservedValue && (uint64_t)m_slots[i].key == key) {
+                fn(key, value);
+            }
+        }
+    }
+
+    // Frees every slot, removed keys included. Not safe while another CPU uses the map.
+    void clear() {
+        if (!m_slots)
+            return;
+
+        for (size_t i = 0; i <= m_mask; i++) {
+            m_slots[i].key = (LONG64)ReservedKey;
+            m_slots[i].value = (LONG64)ReservedValue;
+        }
+        m_used = 0;
+    }
+private:
+    // 16 bytes, four to a cache line. Aligned for the 16 byte compare exchange, pool allocations always are.
+    struct alignas(16) Slot {
+        volatile LONG64 key;      // ReservedKey until claimed, changes only under m_claimLock
+        volatile LONG64 value;    // ReservedValue until the key's first value is published, and once removed
+    };
+
+    // murmur3 finalizer, handles and pool addresses have their low bits clear and would otherwise cluster
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    struct Contents {
+        uint64_t key;
+        uint64_t value;
+    };
+
+    // Replaces expected with desired in one go. False if the slot held anything else, current (optional) then receives
+    // what it held.
+    static bool exchangeSlot(Slot* slot, Contents expected, Contents desired, Contents* current = nullptr) {
+        LONG64 comparand[2] = { (LONG64)expected.key, (LONG64)expected.value };
+        if (_InterlockedCompareExchange128((volatile LONG64*)slot, (LONG64)desired.value, (LONG64)desired.key, comparand))
+            return true;
+
+        if (current) {
+            current->key = (uint64_t)comparand[0];
+            current->value = (uint64_t)comparand[1];
+        }
+        return false;
+    }
+
+    static bool exchangeValue(Slot* slot, uint64_t key, uint64_t expected, uint64_t desired, Contents* current = nullptr) {
+        return exchangeSlot(slot, { key, expected }, { key, desired }, current);
+    }
+
+    size_t window() const {
+        return m_mask + 1 < MaxProbe ? m_mask + 1 : MaxProbe;
+    }
+
+    // The key's slot within its window, null if it has none
+    Slot* lookup(uint64_t key) {
+        size_t i = (size_t)hash(key) & m_mask;
+        for (size_t probed = 0; probed < window(); probed++, i = (i + 1) & m_mask) {
+            const uint64_t slotKey = (uint64_t)m_slots[i].key;
+            if (slotKey == key)
+                return &m_slots[i];
+
+            // claims take the first free slot, nothing lies past an empty one
+            if (slotKey == ReservedKey)
+                return nullptr;
+        }
+        return nullptr;
+    }
+
+    // Claims the first tombstone or empty slot of the window for a key that has none. m_claimLock must be held.
+    Slot* claim(uint64_t key) {
+        size_t i = (size_t)hash(key) & m_mask;
+        for (size_t probed = 0; probed < window(); probed++, i = (i + 1) & m_mask) {
+            Slot* slot = &m_slots[i];
+            const uint64_t slotKey = (uint64_t)slot->key;
+            if (slotKey == ReservedKey) {
+                _InterlockedExchange64(&slot->key, (LONG64)key);
+                _InterlockedIncrement64(&m_used);
+                return slot;
+            }
+
+            // a lock free insert may revive the tombstone's own key first, the slot is then left to it
+            if ((uint64_t)slot->value == ReservedValue && exchangeSlot(slot, { slotKey, ReservedValue }, { key, ReservedValue }))
+                return slot;
+        }
+        return nullptr;
+    }
+
+    // The key's slot, claimed when create is set. Null when absent, or when its window is full and create is set.
+    Slot* find(uint64_t key, bool create) {
+        if (!m_slots || key == ReservedKey)
+            return nullptr;
+
+        Slot* slot = lookup(key);
+        if (slot || !create)
+            return slot;
+
+        // looked up again under the lock, another CPU may have claimed one for the same key meanwhile
+        const KIRQL irql = KeAcquireSpinLockRaiseToDpc(&m_claimLock);
+        slot = lookup(key);
+        if (!slot) {
+            slot = claim(key);
+        }
+        KeReleaseSpinLock(&m_claimLock, irql);
+        return slot;
+    }
+
+    // Reads the value, then checks the slot still belongs to the key. Only a slot that went to another key and back in
+    // between could fool it, that takes two claims within a few instructions.
+    bool read(uint64_t key, uint64_t& value) {
+        while (Slot* slot = find(key, false)) {
+            const uint64_t current = (uint64_t)slot->value;
+            if ((uint64_t)slot->key != key)
+                continue;
+
+            if (current == ReservedValue)
+                return false;
+
+            value = current;
+            return true;
+        }
+        return false;
+    }
+
+    Slot* m_slots;
+    size_t m_mask;
+    volatile LONG64 m_used;
+    KSPIN_LOCK m_claimLock;
+};
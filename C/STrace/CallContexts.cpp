@@ -0,0 +1,96 @@
+#include "CallContexts.h"
+#include "ThreadVars.h"
+
+CallContexts g_CallContexts;
+CallContexts g_DriverCalls;
+
+// plugins can't register names starting with $, see RegisterThreadVarApi
+void CallContexts::initialize(const char* varName) {
+	m_varName = varName;
+	m_size = 0;
+	m_offset = 0;
+}
+
+NTSTATUS CallContexts::setSize(uint32_t size) {
+	if (!size || size > MaxSize) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (m_size) {
+		return STATUS_ALREADY_REGISTERED;
+	}
+
+	const uint32_t frameSize = (size + 7) & ~7u;
+	uint32_t offset = 0;
+	NTSTATUS status = g_ThreadVars.registerVar(m_varName, sizeof(Stack) + MaxDepth * (sizeof(Frame) + frameSize), 8, &offset);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	m_offset = offset;
+	m_size = frameSize;
+	return STATUS_SUCCESS;
+}
+
+void CallContexts::reset() {
+	m_size = 0;
+	m_offset = 0;
+}
+
+CallContexts::Stack* CallContexts::stack() {
+	if (!m_size) {
+		return nullptr;
+	}
+
+	uint8_t* pVars = g_ThreadVars.current();
+	return pVars ? (Stack*)(pVars + m_offset) : nullptr;
+}
+
+uint32_t CallContexts::indexOf(Stack* pStack, uint32_t probeId) {
+	for (uint32_t i = pStack->depth; i > 0; i--) {
+		if (frameAt(pStack, i - 1)->probeId == probeId)
+			return i - 1;
+	}
+	return MaxDepth;
+}
+
+void* CallContexts::push(uint32_t probeId) {
+	Stack* pStack = stack();
+	if (!pStack) {
+		return nullptr;
+	}
+
+	// a syscall from user mode can't be nested in another call, whatever is left belongs to calls that never returned.
+	// A full stack is the same thing for a thread that never enters from user mode.
+	if (ExGetPreviousMode() == UserMode || pStack->depth >= MaxDepth) {
+		pStack->depth = 0;
+	}
+
+	Frame* pFrame = frameAt(pStack, pStack->depth++);
+	pFrame->probeId = probeId;
+	memset(pFrame + 1, 0, m_size);
+	return pFrame + 1;
+}
+
+void* CallContexts::find(uint32_t probeId) {
+	Stack* pStack = stack();
+	if (!pStack) {
+		return nullptr;
+	}
+
+	const uint32_t index = indexOf(pStack, probeId);
+	return index < MaxDepth ? frameAt(pStack, index) + 1 : nullptr;
+}
+
+void CallContexts::pop(uint32_t probeId) {
+	Stack* pStack = stack();
+	if (!pStack) {
+		return;
+	}
+
+	// blocks above this call's own belong to nested calls that never returned
+	const uint32_t index = indexOf(pStack, probeId);
+	if (index < MaxDepth) {
+		pStack->depth = index;
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+
+/*
+Per call context blocks handed from a plugin's entry callback to the matching return callback, so it doesn't have to
+stash values in TLS slots or read the arguments again from user memory on return.
+
+TLSData can't carry them, a nested kernel mode syscall's return frees it before the outer call returns. Each thread
+instead keeps a small stack of blocks in its ThreadVars block, pushed by a delivered entry and popped by the return
+with the same probe id. A call that never returns (NtContinue, a thread exiting) leaves its block behind, the next
+syscall from user mode starts the stack over and a return pops everything above its own block.
+
+g_DriverCalls is a second stack of the same kind for the driver's own entry to return state, registered from
+DriverEntry so it outlives plugins. Every call the entry probe sees gets a frame there.
+*/
+class CallContexts {
+public:
+	static const uint32_t MaxSize = 256;
+	static const uint32_t MaxDepth = 6;       // nested calls a block is kept for
+
+	// varName is the ThreadVars name the stack is kept under, starting with $
+	void initialize(const char* varName);
+
+	// PASSIVE_LEVEL, from the plugin's StpInitialize or DriverEntry. size is rounded up to 8 bytes.
+	NTSTATUS setSize(uint32_t size);
+
+	// Plugin unload
+	void reset();
+
+	uint32_t size() const {
+		return m_size;
+	}
+
+	// IRQL <= DISPATCH_LEVEL. A zeroed block for a call the plugin's entry callback is about to see, null if none.
+	void* push(uint32_t probeId);
+
+	// IRQL <= DISPATCH_LEVEL. The block the matching entry pushed, null if there is none. Valid until pop.
+	void* find(uint32_t probeId);
+
+	// Releases the block find returned and anything left above it
+	void pop(uint32_t probeId);
+private:
+	struct Frame {
+		uint32_t probeId;
+		uint32_t reserved;
+		// m_size bytes follow
+	};
+
+	struct Stack {
+		uint32_t depth;
+		uint32_t reserved;
+		// MaxDepth frames follow
+	};
+
+	Stack* stack();
+
+	Frame* frameAt(Stack* pStack, uint32_t index) {
+		return (Frame*)((uint8_t*)(pStack + 1) + index * (sizeof(Frame) + m_size));
+	}
+
+	// index of probeId's frame counted from the bottom, MaxDepth if there is none
+	uint32_t indexOf(Stack* pStack, uint32_t probeId);
+
+	const char* m_varName;
+	uint32_t m_size;
+	uint32_t m_offset;      // of the Stack in the thread's ThreadVars block
+};
+
+extern CallContexts g_CallContexts;
+extern CallContexts g_DriverCalls;
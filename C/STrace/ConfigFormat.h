@@ -0,0 +1,56 @@
+#pragma once
+
+// Shared between the driver and STraceCLI. Only fixed width types are used and the includer is responsible for
+// providing them, so this must stay free of any windows or kernel headers.
+
+/*
+IOCTL_GET_CONFIG returns the current StpConfig. IOCTL_SET_CONFIG takes a StpConfig, applies only the fields named in
+fields and returns the resulting configuration. Invalid values fail the whole request and change nothing.
+
+Changing the log path or buffer size restarts the logger (buffered lines are flushed to the old file first), a new
+record buffer size applies the next time a stream client attaches. Turning memory tracking on sets its probes and
+fails the request if they can't be set, turning n-grams on fails it if their tables can't be allocated. Everything else
+takes effect immediately.
+*/
+enum StpConfigField : uint32_t {
+	StpConfigLogLevel = 1 << 0,
+	StpConfigLogPath = 1 << 1,
+	StpConfigLogBufferPages = 1 << 2,
+	StpConfigFlushInterval = 1 << 3,
+	StpConfigDebuggerEcho = 1 << 4,
+	StpConfigStackDepth = 1 << 5,
+	StpConfigSampleRate = 1 << 6,
+	StpConfigRecordBufferSize = 1 << 7,
+	StpConfigMemoryTracking = 1 << 8,
+	StpConfigNgrams = 1 << 9,
+	StpConfigRawStacks = 1 << 10,
+};
+
+enum StpLogLevel : uint32_t {
+	StpLogLevelOff = 0,
+	StpLogLevelError = 1,
+	StpLogLevelWarn = 2,
+	StpLogLevelInfo = 3,
+	StpLogLevelDebug = 4,
+};
+
+#define STP_CONFIG_MAX_LOG_BUFFER_PAGES   4096
+#define STP_CONFIG_MAX_FLUSH_INTERVAL     10000                // ms
+#define STP_CONFIG_MIN_RECORD_BUFFER_SIZE (64 * 1024)
+#define STP_CONFIG_MAX_RECORD_BUFFER_SIZE (256 * 1024 * 1024)
+#define STP_CONFIG_LOG_PATH_LENGTH        200
+
+struct StpConfig {
+	uint32_t fields;             // StpConfigField bits, ignored on output
+	uint32_t logLevel;           // StpLogLevel
+	uint32_t logBufferPages;     // size of each of the logger's two buffers
+	uint32_t flushIntervalMs;    // how often buffered log lines are written to the file
+	uint32_t debuggerEcho;       // non zero echoes every log line to the kernel debugger
+	uint32_t stackDepth;         // frames captured for targeted calls, 0 disables capture
+	uint32_t sampleRate;         // 1 in N targeted calls reach the plugin and the record stream, 1 is every call
+	uint32_t recordBufferSize;   // record stream ring, power of two
+	uint16_t logPath[STP_CONFIG_LOG_PATH_LENGTH];  // NUL terminated NT path, eg \??\C:\strace.log
+	uint32_t memoryTracking;     // non zero reports memory becoming executable to the record stream, see VmTracker.h
+	uint32_t ngrams;             // non zero counts syscall bigrams and trigrams per process, see NgramProfiles.h
+	uint32_t rawStacks;          // non zero leaves captured stacks unresolved and records them, see ModuleEvents.h
+};
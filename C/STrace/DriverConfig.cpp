@@ -0,0 +1,194 @@
+#include "DriverConfig.h"
+#include "Constants.h"
+#include "Interface.h"
+#include "Logger.h"
+#include "RecordStream.h"
+#include "VmTracker.h"
+#include "NgramProfiles.h"
+
+DriverConfig g_Config;
+
+static const wchar_t DefaultLogPath[] = L"\\??\\C:\\strace.log";
+static const uint32_t DefaultLogBufferPages = 64;
+static const uint32_t DefaultFlushIntervalMs = 50;
+
+void DriverConfig::initialize() {
+	ExInitializeFastMutex(&m_lock);
+	m_logLevel = StpLogLevelInfo;
+	m_logBufferPages = DefaultLogBufferPages;
+	m_flushIntervalMs = DefaultFlushIntervalMs;
+	m_debuggerEcho = 0;
+	m_stackDepth = MAX_FRAME_DEPTH;
+	m_rawStacks = 0;
+	m_sampleRate = 1;
+	memcpy(m_logPath, DefaultLogPath, sizeof(DefaultLogPath));
+	memset(m_sampleTicks, 0, sizeof(m_sampleTicks));
+}
+
+void DriverConfig::get(StpConfig& config) {
+	memset(&config, 0, sizeof(config));
+
+	ExAcquireFastMutex(&m_lock);
+	config.logLevel = m_logLevel;
+	config.logBufferPages = m_logBufferPages;
+	config.flushIntervalMs = m_flushIntervalMs;
+	config.debuggerEcho = m_debuggerEcho;
+	config.stackDepth = m_stackDepth;
+	config.rawStacks = m_rawStacks;
+	config.sampleRate = m_sampleRate;
+	config.recordBufferSize = g_RecordStream.bufferSize();
+	config.memoryTracking = g_VmTracker.isActive() ? 1 : 0;
+	config.ngrams = g_NgramProfiles.isActive() ? 1 : 0;
+	for (uint32_t i = 0; i < STP_CONFIG_LOG_PATH_LENGTH && m_logPath[i]; i++) {
+		config.logPath[i] = (uint16_t)m_logPath[i];
+	}
+	ExReleaseFastMutex(&m_lock);
+}
+
+ULONG DriverConfig::logFlags() const {
+	static const ULONG levels[] = { LogPutLevelDisable, LogPutLevelError, LogPutLevelWarn, LogPutLevelInfo, LogPutLevelDebug };
+
+	ULONG flags = levels[m_logLevel <= StpLogLevelDebug ? m_logLevel : StpLogLevelInfo] | LogOptDisableFunctionName | LogOptDisableAppend;
+	if (m_debuggerEcho) {
+		flags |= LogOptEnableDbgPrint;
+	}
+	return flags;
+}
+
+NTSTATUS DriverConfig::apply(const StpConfig& config, bool& logRestart) {
+	logRestart = false;
+
+	const uint32_t fields = config.fields;
+	if ((fields & StpConfigLogLevel) && config.logLevel > StpLogLevelDebug) {
+		LOG_ERROR("[!] Invalid log level %u\r\n", config.logLevel);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ((fields & StpConfigLogBufferPages) && (!config.logBufferPages || config.logBufferPages > STP_CONFIG_MAX_LOG_BUFFER_PAGES)) {
+		LOG_ERROR("[!] Invalid log buffer size %u pages\r\n", config.logBufferPages);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ((fields & StpConfigFlushInterval) && (!config.flushIntervalMs || config.flushIntervalMs > STP_CONFIG_MAX_FLUSH_INTERVAL)) {
+		LOG_ERROR("[!] Invalid flush interval %ums\r\n", config.flushIntervalMs);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ((fields & StpConfigStackDepth) && config.stackDepth > MAX_FRAME_DEPTH) {
+		LOG_ERROR("[!] Invalid stack depth %u, at most %u frames\r\n", config.stackDepth, MAX_FRAME_DEPTH);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if ((fields & StpConfigSampleRate) && !config.sampleRate) {
+		LOG_ERROR("[!] Invalid sample rate 0\r\n");
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	const uint32_t recordSize = config.recordBufferSize;
+	if ((fields & StpConfigRecordBufferSize) && (recordSize < STP_CONFIG_MIN_RECORD_BUFFER_SIZE || recordSize > STP_CONFIG_MAX_RECORD_BUFFER_SIZE || (recordSize & (recordSize - 1)))) {
+		LOG_ERROR("[!] Invalid record buffer size %u, must be a power of two\r\n", recordSize);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	uint32_t pathLength = 0;
+	if (fields & StpConfigLogPath) {
+		while (pathLength < STP_CONFIG_LOG_PATH_LENGTH && config.logPath[pathLength]) {
+			pathLength++;
+		}
+
+		if (!pathLength || pathLength == STP_CONFIG_LOG_PATH_LENGTH) {
+			LOG_ERROR("[!] Invalid log path\r\n");
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	// allocates its tables and can fail, so it starts before anything below is changed
+	const bool startNgrams = (fields & StpConfigNgrams) && config.ngrams && !g_NgramProfiles.isActive();
+	if (startNgrams) {
+		NTSTATUS status = g_NgramProfiles.start();
+		if (!NT_SUCCESS(status)) {
+			LOG_ERROR("[!] Failed to start syscall n-grams 0x%08X\r\n", status);
+			return status;
+		}
+	}
+
+	// sets and removes probes, which can't happen under the mutex. Last of the checks, a failure changes nothing else.
+	if (fields & StpConfigMemoryTracking) {
+		if (config.memoryTracking) {
+			NTSTATUS status = g_VmTracker.start();
+			if (!NT_SUCCESS(status)) {
+				LOG_ERROR("[!] Failed to start memory tracking 0x%08X\r\n", status);
+				if (startNgrams) {
+					g_NgramProfiles.stop();
+				}
+				return status;
+			}
+		} else {
+			g_VmTracker.stop();
+		}
+	}
+
+	if ((fields & StpConfigNgrams) && !config.ngrams) {
+		g_NgramProfiles.stop();
+	}
+
+	ExAcquireFastMutex(&m_lock);
+	if (fields & StpConfigLogLevel) {
+		m_logLevel = config.logLevel;
+	}
+
+	if (fields & StpConfigDebuggerEcho) {
+		m_debuggerEcho = config.debuggerEcho ? 1 : 0;
+	}
+
+	if (fields & StpConfigFlushInterval) {
+		m_flushIntervalMs = config.flushIntervalMs;
+		LogSetFlushInterval(m_flushIntervalMs);
+	}
+
+	if ((fields & StpConfigLogBufferPages) && config.logBufferPages != m_logBufferPages) {
+		m_logBufferPages = config.logBufferPages;
+		LogSetBufferSize(m_logBufferPages);
+		logRestart = true;
+	}
+
+	if (fields & StpConfigLogPath) {
+		for (uint32_t i = 0; i <= pathLength; i++) {
+			m_logPath[i] = (wchar_t)config.logPath[i];
+		}
+		logRestart = true;
+	}
+
+	if (fields & StpConfigStackDepth) {
+		m_stackDepth = config.stackDepth;
+	}
+
+	if (fields & StpConfigRawStacks) {
+		m_rawStacks = config.rawStacks ? 1 : 0;
+	}
+
+	if (fields & StpConfigSampleRate) {
+		m_sampleRate = config.sampleRate;
+	}
+
+	if (fields & StpConfigRecordBufferSize) {
+		g_RecordStream.setBufferSize(recordSize);
+	}
+
+	// a restart picks the flags up anyway
+	if (!logRestart && (fields & (StpConfigLogLevel | StpConfigDebuggerEcho))) {
+		LogSetFlags(logFlags());
+	}
+	ExReleaseFastMutex(&m_lock);
+	return STATUS_SUCCESS;
+}
+
+bool DriverConfig::shouldSample() {
+	const uint32_t rate = m_sampleRate;
+	if (rate <= 1)
+		return true;
+
+	// a migrated thread can race the increment, that only skews which call gets picked
+	SampleTick& tick = m_sampleTicks[KeGetCurrentProcessorIndex() % MaxSampleCpus];
+	return tick.count++ % rate == 0;
+}
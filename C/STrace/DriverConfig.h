@@ -0,0 +1,59 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "ConfigFormat.h"
+
+/*
+Runtime tunables set through IOCTL_SET_CONFIG (STraceCLI config). The values are read lock free by the probes, a
+torn read between two settings only affects the call in flight. Applying a configuration is serialized by a mutex.
+*/
+class DriverConfig {
+public:
+	// Defaults, must be called from DriverEntry before any other member
+	void initialize();
+
+	void get(StpConfig& config);
+
+	// PASSIVE_LEVEL. Validates every requested field before changing anything. logRestart is set if the logger
+	// has to be re-initialized (LogInitialize with logFlags() and logPath()) for the change to take effect.
+	NTSTATUS apply(const StpConfig& config, bool& logRestart);
+
+	// LogInitialize flags for the configured level and echo
+	ULONG logFlags() const;
+
+	const wchar_t* logPath() const {
+		return m_logPath;
+	}
+
+	uint32_t stackDepth() const {
+		return m_stackDepth;
+	}
+
+	bool rawStacks() const {
+		return m_rawStacks != 0;
+	}
+
+	// IRQL <= DISPATCH_LEVEL. True for 1 in sampleRate calls
+	bool shouldSample();
+private:
+	static const uint32_t MaxSampleCpus = 256;
+
+	struct alignas(64) SampleTick {
+		uint32_t count;
+	};
+
+	FAST_MUTEX m_lock;
+	volatile uint32_t m_logLevel;
+	uint32_t m_logBufferPages;
+	uint32_t m_flushIntervalMs;
+	volatile uint32_t m_debuggerEcho;
+	volatile uint32_t m_stackDepth;
+	volatile uint32_t m_rawStacks;
+	volatile uint32_t m_sampleRate;
+	wchar_t m_logPath[STP_CONFIG_LOG_PATH_LENGTH];
+
+	// per CPU so sampling doesn't bounce a shared counter between cores, exactness doesn't matter
+	SampleTick m_sampleTicks[MaxSampleCpus];
+};
+
+extern DriverConfig g_Config;
@@ -0,0 +1,207 @@
+#include "DriverProbes.h"
+#include "Constants.h"
+#include "DynamicTrace.h"
+
+DriverProbes g_DriverProbes;
+
+extern "C" __declspec(dllexport) void StpCallbackEntry(ULONG64 pService, ULONG32 probeId, ULONG32 paramCount, ULONG64* pArgs, ULONG32 pArgSize, void* pStackArgs);
+extern "C" __declspec(dllexport) void StpCallbackReturn(ULONG64 pService, ULONG32 probeId, ULONG32 paramCount, ULONG64* pArgs, ULONG32 pArgSize, void* pStackArgs);
+
+static const uint32_t NoHandleArg = 0xFF;
+
+struct DriverSyscall {
+	const char* name;
+	uint8_t handleArg;      // register argument holding the PHANDLE
+};
+
+static const DriverSyscall Syscalls[DriverProbes::SyscallCount] = {
+	{ "CreateFile", 0 },
+	{ "OpenFile", 0 },
+	{ "Close", NoHandleArg },
+	{ "CreateNamedPipeFile", 0 },
+	{ "CreateMailslotFile", 0 },
+	{ "CreateKey", 0 },
+	{ "OpenKey", 0 },
+	{ "OpenKeyEx", 0 },
+	{ "CreateEvent", 0 },
+	{ "OpenEvent", 0 },
+	{ "CreateMutant", 0 },
+	{ "OpenMutant", 0 },
+	{ "CreateSemaphore", 0 },
+	{ "OpenSemaphore", 0 },
+	{ "CreateTimer", 0 },
+	{ "CreateIoCompletion", 0 },
+	{ "CreateSection", 0 },
+	{ "OpenSection", 0 },
+	{ "CreateJobObject", 0 },
+	{ "OpenJobObject", 0 },
+	{ "OpenProcess", 0 },
+	{ "OpenThread", 0 },
+	{ "OpenProcessToken", 2 },
+	{ "OpenProcessTokenEx", 3 },
+	{ "OpenThreadToken", 3 },
+	{ "CreateThreadEx", 0 },
+	{ "CreateUserProcess", 0 },     // the process handle, the thread handle in the second argument isn't followed
+	{ "DuplicateObject", 3 },       // only duplicates into the calling process, see onEntry
+	{ "AllocateVirtualMemory", NoHandleArg },
+	{ "ProtectVirtualMemory", NoHandleArg },
+	{ "WriteVirtualMemory", NoHandleArg },
+	{ "MapViewOfSection", NoHandleArg },
+	{ "FreeVirtualMemory", NoHandleArg },
+	{ "UnmapViewOfSection", NoHandleArg },
+	{ "ReadFile", NoHandleArg },
+	{ "WriteFile", NoHandleArg },
+};
+
+void DriverProbes::initialize() {
+	m_users = 0;
+	m_pluginOwnedCount = 0;
+	ExInitializeFastMutex(&m_lock);
+
+	for (uint32_t i = 0; i < SyscallCount; i++) {
+		m_useCount[i] = 0;
+		m_pluginOwned[i] = false;
+		m_pluginProbeId[i] = 0;
+	}
+}
+
+const char* DriverProbes::nameOf(Syscall syscall) {
+	return syscall < SyscallCount ? Syscalls[syscall].name : "";
+}
+
+DriverProbes::Syscall DriverProbes::syscallOf(const char* syscallName) {
+	for (uint32_t i = 0; i < SyscallCount; i++) {
+		if (strcmp(syscallName, Syscalls[i].name) == 0)
+			return (Syscall)i;
+	}
+	return None;
+}
+
+// m_lock must be held
+NTSTATUS DriverProbes::setProbe(Syscall syscall, bool set) {
+	if (!TraceSystemApi || !TraceSystemApi->KeSetSystemServiceCallback) {
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	const char* syscallName = Syscalls[syscall].name;
+	const ULONG64 probeId = set ? InternalProbeBase + syscall : 0;
+	NTSTATUS status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, true, set ? (ULONG64)&StpCallbackEntry : 0, probeId);
+	if (NT_SUCCESS(status)) {
+		status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, false, set ? (ULONG64)&StpCallbackReturn : 0, probeId);
+	}
+	return status;
+}
+
+NTSTATUS DriverProbes::acquire(Syscall syscall) {
+	if (syscall >= SyscallCount) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	NTSTATUS status = STATUS_SUCCESS;
+	ExAcquireFastMutex(&m_lock);
+	if (!m_useCount[syscall] && !m_pluginOwned[syscall]) {
+		status = setProbe(syscall, true);
+	}
+
+	if (NT_SUCCESS(status)) {
+		m_useCount[syscall]++;
+		m_users++;
+	}
+	ExReleaseFastMutex(&m_lock);
+	return status;
+}
+
+void DriverProbes::release(Syscall syscall) {
+	if (syscall >= SyscallCount) {
+		return;
+	}
+
+	ExAcquireFastMutex(&m_lock);
+	if (m_useCount[syscall]) {
+		m_useCount[syscall]--;
+		m_users--;
+		if (!m_useCount[syscall] && !m_pluginOwned[syscall]) {
+			setProbe(syscall, false);
+		}
+	}
+	ExReleaseFastMutex(&m_lock);
+}
+
+void DriverProbes::pluginSetCallback(const char* syscallName, uint32_t probeId) {
+	const Syscall syscall = syscallOf(syscallName);
+	if (syscall == None)
+		return;
+
+	ExAcquireFastMutex(&m_lock);
+	m_pluginProbeId[syscall] = probeId;
+	if (!m_pluginOwned[syscall]) {
+		m_pluginOwned[syscall] = true;
+		m_pluginOwnedCount++;
+	}
+	ExReleaseFastMutex(&m_lock);
+}
+
+bool DriverProbes::pluginUnSetCallback(const char* syscallName, NTSTATUS& status) {
+	const Syscall syscall = syscallOf(syscallName);
+	if (syscall == None)
+		return false;
+
+	ExAcquireFastMutex(&m_lock);
+	if (m_pluginOwned[syscall]) {
+		m_pluginOwned[syscall] = false;
+		m_pluginOwnedCount--;
+	}
+
+	const bool handled = m_useCount[syscall] != 0;
+	if (handled) {
+		status = setProbe(syscall, true);
+	}
+	ExReleaseFastMutex(&m_lock);
+	return handled;
+}
+
+void DriverProbes::pluginUnloaded() {
+	ExAcquireFastMutex(&m_lock);
+	for (uint32_t i = 0; i < SyscallCount; i++) {
+		if (!m_pluginOwned[i])
+			continue;
+
+		// whatever else the plugin left set is its own
+		m_pluginOwned[i] = false;
+		if (m_useCount[i]) {
+			setProbe((Syscall)i, true);
+		}
+	}
+	m_pluginOwnedCount = 0;
+	ExReleaseFastMutex(&m_lock);
+}
+
+void DriverProbes::onEntry(Syscall syscall, const uint64_t* pArgs, uint64_t& handleOut) {
+	// kernel mode callers create kernel handles, which aren't followed
+	if (syscall >= SyscallCount || Syscalls[syscall].handleArg == NoHandleArg || ExGetPreviousMode() != UserMode) {
+		return;
+	}
+
+	// a duplicate into another process is a handle of that process
+	if (syscall == DuplicateObject && pArgs[2] != (uint64_t)NtCurrentProcess()) {
+		return;
+	}
+
+	handleOut = pArgs[Syscalls[syscall].handleArg];
+}
+
+bool DriverProbes::createdHandle(Syscall syscall, NTSTATUS status, uint64_t& handleOut, HANDLE& handle) {
+	// a nested kernel mode call returns with its own previous mode and mustn't consume the outer call's slot
+	if (syscall >= SyscallCount || Syscalls[syscall].handleArg == NoHandleArg || ExGetPreviousMode() != UserMode) {
+		return false;
+	}
+
+	const uint64_t pHandle = handleOut;
+	handleOut = 0;
+	if (!pHandle || !NT_SUCCESS(status) || KeGetCurrentIrql() != PASSIVE_LEVEL) {
+		return false;
+	}
+
+	handle = NULL;
+	return TraceAccessMemory(&handle, (ULONG_PTR)pHandle, sizeof(handle), sizeof(handle), TRUE) && handle;
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+
+/*
+Syscalls the driver probes on its own behalf, for the handle cache, the trackers and I/O accounting. A syscall has a
+single probe id at a time, so everything the driver follows on a syscall shares one internal probe, set by the first
+user and removed with the last. A plugin may still set its own callback on one of them, the probe then serves both and
+the plugin's probe id is the one passed to it.
+
+The syscalls up to DuplicateObject are the handle syscalls. Every one of them but Close creates a handle and returns it
+through a PHANDLE in one of the register arguments, the entry probe remembers the pointer and the return probe reads the
+handle from it once for every user. The virtual memory syscalls after them are only followed by the VM tracker, ReadFile
+and WriteFile by I/O accounting.
+*/
+class DriverProbes {
+public:
+	enum Syscall : uint32_t {
+		CreateFile,
+		OpenFile,
+		Close,
+		CreateNamedPipeFile,
+		CreateMailslotFile,
+		CreateKey,
+		OpenKey,
+		OpenKeyEx,
+		CreateEvent,
+		OpenEvent,
+		CreateMutant,
+		OpenMutant,
+		CreateSemaphore,
+		OpenSemaphore,
+		CreateTimer,
+		CreateIoCompletion,
+		CreateSection,
+		OpenSection,
+		CreateJobObject,
+		OpenJobObject,
+		OpenProcess,
+		OpenThread,
+		OpenProcessToken,
+		OpenProcessTokenEx,
+		OpenThreadToken,
+		CreateThreadEx,
+		CreateUserProcess,
+		DuplicateObject,
+		AllocateVirtualMemory,
+		ProtectVirtualMemory,
+		WriteVirtualMemory,
+		MapViewOfSection,
+		FreeVirtualMemory,
+		UnmapViewOfSection,
+		ReadFile,
+		WriteFile,
+		SyscallCount,
+		None = SyscallCount,
+	};
+
+	// Close and the syscalls that create handles come first
+	static const uint32_t HandleSyscallCount = DuplicateObject + 1;
+
+	// Probe ids the driver registers on its own behalf, above anything a plugin uses
+	static const uint32_t InternalProbeBase = 0xFFFFFF00;
+
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// PASSIVE_LEVEL. Reference counted, the first acquire sets the probe and the last release removes it
+	NTSTATUS acquire(Syscall syscall);
+	void release(Syscall syscall);
+
+	// Which driver syscall a probe id belongs to, None for everything else or while the driver follows nothing
+	Syscall syscallFor(uint32_t probeId) const {
+		if (probeId >= InternalProbeBase)
+			return probeId - InternalProbeBase < SyscallCount ? (Syscall)(probeId - InternalProbeBase) : None;
+
+		if (!m_users || !m_pluginOwnedCount)
+			return None;
+
+		for (uint32_t i = 0; i < SyscallCount; i++) {
+			if (m_pluginOwned[i] && m_pluginProbeId[i] == probeId)
+				return (Syscall)i;
+		}
+		return None;
+	}
+
+	static bool isInternalProbe(uint32_t probeId) {
+		return probeId >= InternalProbeBase;
+	}
+
+	static const char* nameOf(Syscall syscall);
+
+	// SetCallbackApi, before the plugin's callback is set. Remembers the plugin's id if it's one of the driver's syscalls
+	void pluginSetCallback(const char* syscallName, uint32_t probeId);
+
+	// UnSetCallbackApi. True if the syscall is one of the driver's and the probe went back to the driver instead of being
+	// removed, status is the result of that.
+	bool pluginUnSetCallback(const char* syscallName, NTSTATUS& status);
+
+	// PASSIVE_LEVEL. Plugin unload, probes the plugin left set go back to the driver if it still follows them
+	void pluginUnloaded();
+
+	// Entry probe hook. Remembers the PHANDLE of a user mode call in handleOut, the per-call state that carries it to return.
+	static void onEntry(Syscall syscall, const uint64_t* pArgs, uint64_t& handleOut);
+
+	// Return probe hook. Consumes handleOut, true and the new handle if the call succeeded and created one.
+	static bool createdHandle(Syscall syscall, NTSTATUS status, uint64_t& handleOut, HANDLE& handle);
+private:
+	NTSTATUS setProbe(Syscall syscall, bool set);
+	static Syscall syscallOf(const char* syscallName);
+
+	volatile uint32_t m_users;      // outstanding acquires over every syscall
+	uint32_t m_useCount[SyscallCount];
+	FAST_MUTEX m_lock;
+
+	// probes a plugin set a callback on use the plugin's id instead of InternalProbeBase + syscall
+	bool m_pluginOwned[SyscallCount];
+	uint32_t m_pluginProbeId[SyscallCount];
+	volatile uint32_t m_pluginOwnedCount;
+};
+
+extern DriverProbes g_DriverProbes;
@@ -0,0 +1,53 @@
+#include <ntifs.h>
+
+#include "ExportIndex.h"
+#include "Constants.h"
+
+bool ExportIndex::build(uint64_t moduleBase, uint32_t imageSize) {
+	if (isBuilt() || !moduleBase)
+		return false;
+
+	StpExportDirectory exports;
+	if (!StpReadExportDirectory((const uint8_t*)moduleBase, imageSize, exports))
+		return false;
+
+	const uint32_t tableSize = StpExportTableSize(exports);
+	m_entries = (StpExportEntry*)ExAllocatePoolWithTag(NonPagedPoolNx, tableSize * sizeof(StpExportEntry), DRIVER_POOL_TAG);
+	if (!m_entries)
+		return false;
+
+	memset(m_entries, 0, tableSize * sizeof(StpExportEntry));
+	StpFillExportTable(exports, m_entries, tableSize);
+	m_moduleBase = moduleBase;
+	m_exports = exports;
+	m_tableSize = tableSize;
+	return true;
+}
+
+void ExportIndex::Destruct() {
+	if (m_entries) {
+		ExFreePoolWithTag(m_entries, DRIVER_POOL_TAG);
+	}
+	zero();
+}
+
+bool ExportIndex::lookup(const char* name, uint32_t hash, Export& result) const {
+	result.address = 0;
+	result.forwarder = nullptr;
+
+	if (!isBuilt())
+		return false;
+
+	const StpExportEntry* entry = StpProbeExportTable(m_exports, m_entries, m_tableSize, name, hash);
+	if (!entry)
+		return false;
+
+	// a forwarder whose string runs off the image is as good as missing
+	const StpExport exp = StpExportAt(m_exports, entry->nameIdx);
+	if (!exp.rva && !exp.forwarder)
+		return false;
+
+	result.address = exp.rva ? m_moduleBase + exp.rva : 0;
+	result.forwarder = exp.forwarder;
+	return true;
+}
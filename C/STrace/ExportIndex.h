@@ -0,0 +1,66 @@
+#pragma once
+
+#include "MyStdint.h"
+#include "PeExports.h"
+
+/*
+A hashed lookup table over the named exports of an already loaded module (ntoskrnl, hal). It's built one time
+and then shared by every plugin load, so that resolving an import is a hash + one string compare instead of
+a RtlAnsiStringToUnicodeString allocation followed by MmGetSystemRoutineAddress walking the whole export table.
+
+The parsing and probing live in PeExports.h, which builds on the host too and is tested against real PE files
+there, this only owns the table's single pool allocation.
+*/
+class ExportIndex {
+public:
+	struct Export {
+		uint64_t address;
+
+		// non-null if the export is a forwarder ("MODULE.Function"), in which case address is zero
+		const char* forwarder;
+	};
+
+	ExportIndex() {
+		zero();
+	}
+
+	// non-copy
+	ExportIndex(const ExportIndex&) = delete;
+	ExportIndex& operator=(const ExportIndex&) = delete;
+
+	// The module's export directory is bounds checked against [moduleBase, moduleBase + imageSize)
+	bool build(uint64_t moduleBase, uint32_t imageSize);
+	void Destruct();
+
+	bool isBuilt() const {
+		return m_entries != nullptr;
+	}
+
+	uint64_t base() const {
+		return m_moduleBase;
+	}
+
+	// Case sensitive, as the loader and MmGetSystemRoutineAddress are. Returns false if the name isn't exported.
+	bool lookup(const char* name, Export& result) const {
+		return lookup(name, hashName(name), result);
+	}
+
+	// Same as above, for callers that already know the name's hash (prelinked plugins store it)
+	bool lookup(const char* name, uint32_t hash, Export& result) const;
+
+	static uint32_t hashName(const char* name) {
+		return StpHashExportName(name);
+	}
+private:
+	void zero() {
+		m_moduleBase = 0;
+		m_exports = {};
+		m_entries = nullptr;
+		m_tableSize = 0;
+	}
+
+	uint64_t m_moduleBase;
+	StpExportDirectory m_exports;
+	StpExportEntry* m_entries;
+	uint32_t m_tableSize;
+};
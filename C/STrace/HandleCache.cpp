@@ -0,0 +1,313 @@
+#include "HandleCache.h"
+#include "Constants.h"
+
+HandleCache g_HandleCache;
+
+static const DriverProbes::Syscall CacheSyscalls[] = { DriverProbes::CreateFile, DriverProbes::OpenFile, DriverProbes::Close };
+
+void HandleCache::initialize() {
+	m_active = false;
+	m_users = 0;
+	m_buckets = nullptr;
+	m_entryCount = 0;
+	m_lock = 0;
+	ExInitializeFastMutex(&m_controlLock);
+}
+
+void HandleCache::Destruct() {
+	stop(AllUsers);
+
+	if (m_buckets) {
+		ExFreePoolWithTag(m_buckets, DRIVER_POOL_TAG);
+		m_buckets = nullptr;
+	}
+}
+
+NTSTATUS HandleCache::start(User user) {
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_active) {
+		m_users |= user;
+		ExReleaseFastMutex(&m_controlLock);
+		return STATUS_SUCCESS;
+	}
+
+	if (!m_buckets) {
+		m_buckets = (Entry**)ExAllocatePoolWithTag(NonPagedPoolNx, BucketCount * sizeof(Entry*), DRIVER_POOL_TAG);
+		if (!m_buckets) {
+			ExReleaseFastMutex(&m_controlLock);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		memset(m_buckets, 0, BucketCount * sizeof(Entry*));
+	}
+
+	// active first, the probes must be recognized from their first call on
+	m_active = true;
+	NTSTATUS status = STATUS_SUCCESS;
+	uint32_t acquired = 0;
+	for (; acquired < ARRAYSIZE(CacheSyscalls); acquired++) {
+		status = g_DriverProbes.acquire(CacheSyscalls[acquired]);
+		if (!NT_SUCCESS(status))
+			break;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		for (uint32_t i = 0; i < acquired; i++) {
+			g_DriverProbes.release(CacheSyscalls[i]);
+		}
+		m_active = false;
+		freeAll();
+	} else {
+		m_users = user;
+	}
+	ExReleaseFastMutex(&m_controlLock);
+	return status;
+}
+
+void HandleCache::stop(User user) {
+	ExAcquireFastMutex(&m_controlLock);
+	m_users &= ~(uint32_t)user;
+	if (m_users) {
+		ExReleaseFastMutex(&m_controlLock);
+		return;
+	}
+
+	if (m_active) {
+		m_active = false;
+		for (uint32_t i = 0; i < ARRAYSIZE(CacheSyscalls); i++) {
+			g_DriverProbes.release(CacheSyscalls[i]);
+		}
+	}
+
+	// a probe that was already past the active check can still insert, it sees m_active under the lock and backs off
+	freeAll();
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+void HandleCache::onProcessExit(HANDLE ProcessId) {
+	// an inactive table was emptied by stop
+	if (m_active) {
+		purgeProcess(ProcessId);
+	}
+}
+
+void HandleCache::onClose(HANDLE handle) {
+	// dropped before the close, the value may be reused by another thread as soon as it's closed
+	if (m_active) {
+		remove(makeKey(PsGetCurrentProcessId(), handle));
+	}
+}
+
+void HandleCache::onCreated(DriverProbes::Syscall syscall, HANDLE handle, bool resolveNow) {
+	if (!m_active || (syscall != DriverProbes::CreateFile && syscall != DriverProbes::OpenFile)) {
+		return;
+	}
+
+	// whatever an earlier handle of this value pointed to is gone, the new one is named on its first lookup
+	const uint64_t key = makeKey(PsGetCurrentProcessId(), handle);
+	if (!resolveNow) {
+		remove(key);
+		return;
+	}
+
+	Entry* pEntry = resolve(handle, key);
+	if (pEntry) {
+		insert(pEntry);
+	}
+}
+
+// PASSIVE_LEVEL
+HandleCache::Entry* HandleCache::resolve(HANDLE handle, uint64_t key) {
+	PFILE_OBJECT pFileObject = nullptr;
+	if (!NT_SUCCESS(ObReferenceObjectByHandle(handle, 0, *IoFileObjectType, UserMode, (PVOID*)&pFileObject, nullptr))) {
+		return nullptr;
+	}
+
+	// a name query on a synchronous pipe can block behind another thread's pending read, such handles stay nameless
+	const DEVICE_TYPE deviceType = pFileObject->DeviceObject ? pFileObject->DeviceObject->DeviceType : 0;
+	const bool named = deviceType != FILE_DEVICE_NAMED_PIPE && deviceType != FILE_DEVICE_MAILSLOT;
+
+	const ULONG infoSize = sizeof(OBJECT_NAME_INFORMATION) + MaxPathChars * sizeof(wchar_t);
+	auto pInfo = named ? (POBJECT_NAME_INFORMATION)ExAllocatePoolWithTag(PagedPool, infoSize, DRIVER_POOL_TAG) : nullptr;
+
+	ULONG returned = 0;
+	uint16_t length = 0;
+	if (pInfo && NT_SUCCESS(ObQueryNameString(pFileObject, pInfo, infoSize, &returned)) && pInfo->Name.Buffer) {
+		length = pInfo->Name.Length / sizeof(wchar_t);
+	}
+	ObDereferenceObject(pFileObject);
+
+	auto pEntry = (Entry*)ExAllocatePoolWithTag(NonPagedPoolNx, FIELD_OFFSET(Entry, path) + (length + 1) * sizeof(wchar_t), DRIVER_POOL_TAG);
+	if (pEntry) {
+		pEntry->next = nullptr;
+		pEntry->key = key;
+		pEntry->length = length;
+		if (length) {
+			memcpy(pEntry->path, pInfo->Name.Buffer, length * sizeof(wchar_t));
+		}
+		pEntry->path[length] = 0;
+	}
+
+	if (pInfo) {
+		ExFreePoolWithTag(pInfo, DRIVER_POOL_TAG);
+	}
+	return pEntry;
+}
+
+void HandleCache::insert(Entry* pEntry) {
+	Entry* pOld = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (!m_active || !m_buckets || (ULONG)m_entryCount >= MaxEntries) {
+		ExReleaseSpinLockExclusive(&m_lock, irql);
+		ExFreePoolWithTag(pEntry, DRIVER_POOL_TAG);
+		return;
+	}
+
+	// a handle value that's reused replaces what it pointed to before
+	const uint32_t bucket = bucketOf(pEntry->key);
+	for (Entry** ppLink = &m_buckets[bucket]; *ppLink; ppLink = &(*ppLink)->next) {
+		if ((*ppLink)->key == pEntry->key) {
+			pOld = *ppLink;
+			*ppLink = pOld->next;
+			m_entryCount--;
+			break;
+		}
+	}
+
+	pEntry->next = m_buckets[bucket];
+	m_buckets[bucket] = pEntry;
+	m_entryCount++;
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pOld) {
+		ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+	}
+}
+
+void HandleCache::remove(uint64_t key) {
+	Entry* pOld = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (Entry** ppLink = &m_buckets[bucketOf(key)]; *ppLink; ppLink = &(*ppLink)->next) {
+			if ((*ppLink)->key == key) {
+				pOld = *ppLink;
+				*ppLink = pOld->next;
+				m_entryCount--;
+				break;
+			}
+		}
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pOld) {
+		ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+	}
+}
+
+void HandleCache::purgeProcess(HANDLE pid) {
+	const uint64_t pidKey = (uint64_t)HandleToULong(pid);
+	Entry* pFree = nullptr;
+
+	// unlinked under the lock, freed after it
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount; i++) {
+			Entry** ppLink = &m_buckets[i];
+			while (*ppLink) {
+				Entry* pEntry = *ppLink;
+				if ((pEntry->key >> 32) == pidKey) {
+					*ppLink = pEntry->next;
+					pEntry->next = pFree;
+					pFree = pEntry;
+					m_entryCount--;
+				} else {
+					ppLink = &pEntry->next;
+				}
+			}
+		}
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	while (pFree) {
+		Entry* pNext = pFree->next;
+		ExFreePoolWithTag(pFree, DRIVER_POOL_TAG);
+		pFree = pNext;
+	}
+}
+
+void HandleCache::freeAll() {
+	Entry* pFree = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount; i++) {
+			while (m_buckets[i]) {
+				Entry* pEntry = m_buckets[i];
+				m_buckets[i] = pEntry->next;
+				pEntry->next = pFree;
+				pFree = pEntry;
+			}
+		}
+	}
+	m_entryCount = 0;
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	while (pFree) {
+		Entry* pNext = pFree->next;
+		ExFreePoolWithTag(pFree, DRIVER_POOL_TAG);
+		pFree = pNext;
+	}
+}
+
+NTSTATUS HandleCache::lookup(HANDLE handle, wchar_t* path, uint32_t pathChars, uint32_t* pathLength) {
+	if (!m_active) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	const uint64_t key = makeKey(PsGetCurrentProcessId(), handle);
+	NTSTATUS status = copyCached(key, path, pathChars, pathLength);
+	if (status != STATUS_NOT_FOUND || KeGetCurrentIrql() != PASSIVE_LEVEL) {
+		return status;
+	}
+
+	// never seen, resolve it now and remember it for the next call
+	Entry* pEntry = resolve(handle, key);
+	if (!pEntry) {
+		return STATUS_NOT_FOUND;
+	}
+
+	status = copyEntry(pEntry, path, pathChars, pathLength);
+	insert(pEntry);
+	return status;
+}
+
+NTSTATUS HandleCache::copyEntry(const Entry* pEntry, wchar_t* path, uint32_t pathChars, uint32_t* pathLength) {
+	*pathLength = pEntry->length;
+	if (!pEntry->length) {
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	if (pathChars <= pEntry->length) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(path, pEntry->path, (pEntry->length + 1) * sizeof(wchar_t));
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS HandleCache::copyCached(uint64_t key, wchar_t* path, uint32_t pathChars, uint32_t* pathLength) {
+	NTSTATUS status = STATUS_NOT_FOUND;
+
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	if (m_buckets) {
+		for (Entry* pEntry = m_buckets[bucketOf(key)]; pEntry; pEntry = pEntry->next) {
+			if (pEntry->key == key) {
+				status = copyEntry(pEntry, path, pathChars, pathLength);
+				break;
+			}
+		}
+	}
+	ExReleaseSpinLockShared(&m_lock, irql);
+	return status;
+}
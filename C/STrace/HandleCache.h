@@ -0,0 +1,95 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "DriverProbes.h"
+
+/*
+(process, handle) -> path of the file object behind it, so plugins can name files in every NtReadFile, NtWriteFile etc
+without an object manager name query per call. Entries are dropped by the Close entry probe and purged when their
+process exits. Only handles created by user mode callers are tracked.
+
+A name query per open on the whole system costs more than the cache saves, so the CreateFile and OpenFile return probes
+only name the handles of processes the plugin targets right away, its callbacks may look them up above PASSIVE_LEVEL.
+Every other new handle just drops a stale entry of the same value and is named on its first lookup.
+
+The cache is off until a user (the plugin) enables it and is turned off again once every user that enabled it has
+stopped. While it's on it holds the three syscalls' probes in DriverProbes.
+
+A handle the cache never saw (opened before it was enabled, duplicated, inherited) is resolved on the first lookup at
+PASSIVE_LEVEL and added then. Handles without a name (pipes, or the query failed) are cached too, so they aren't
+resolved again on every lookup. A handle closed some other way than NtClose (DuplicateHandle with
+DUPLICATE_CLOSE_SOURCE) keeps its stale entry until its value is reused by the next open.
+*/
+class HandleCache {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	enum User : uint32_t {
+		UserPlugin = 1 << 0,
+		AllUsers = ~0u,
+	};
+
+	// PASSIVE_LEVEL. The first user allocates the table and acquires the probes
+	NTSTATUS start(User user);
+
+	// PASSIVE_LEVEL. Once no user is left, releases the probes and frees every entry
+	void stop(User user);
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// Probe hooks, see DriverProbes. onClose runs in Close's entry probe, onCreated in the return probe of a syscall
+	// that created a handle of the current process. resolveNow names the handle right away, for the plugin's targets.
+	void onClose(HANDLE handle);
+	void onCreated(DriverProbes::Syscall syscall, HANDLE handle, bool resolveNow);
+
+	// PASSIVE_LEVEL, the driver's process notify. Drops the process's entries.
+	void onProcessExit(HANDLE ProcessId);
+
+	// IRQL <= DISPATCH_LEVEL, a miss is only resolved at PASSIVE_LEVEL. Copies the NUL terminated path of a handle of the
+	// current process. pathLength receives the length in characters without the NUL, or the size needed on
+	// STATUS_BUFFER_TOO_SMALL. STATUS_OBJECT_NAME_NOT_FOUND for a handle that has no name.
+	NTSTATUS lookup(HANDLE handle, wchar_t* path, uint32_t pathChars, uint32_t* pathLength);
+private:
+	struct Entry {
+		Entry* next;
+		uint64_t key;          // (pid << 32) | handle
+		uint16_t length;       // characters, path is NUL terminated, 0 if the handle has no name
+		wchar_t path[1];
+	};
+
+	static const uint32_t BucketCount = 4096;       // power of two
+	static const uint32_t MaxEntries = 64 * 1024;
+	static const uint32_t MaxPathChars = 1024;
+
+	static uint64_t makeKey(HANDLE pid, HANDLE handle) {
+		return ((uint64_t)HandleToULong(pid) << 32) | HandleToULong(handle);
+	}
+
+	static uint32_t bucketOf(uint64_t key) {
+		// fibonacci hashing, handle values are multiples of 4
+		return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 52);
+	}
+
+	static NTSTATUS copyEntry(const Entry* pEntry, wchar_t* path, uint32_t pathChars, uint32_t* pathLength);
+	NTSTATUS copyCached(uint64_t key, wchar_t* path, uint32_t pathChars, uint32_t* pathLength);
+	Entry* resolve(HANDLE handle, uint64_t key);
+	void insert(Entry* pEntry);
+	void remove(uint64_t key);
+	void purgeProcess(HANDLE pid);
+	void freeAll();
+
+	volatile bool m_active;
+	uint32_t m_users;      // User bits
+	Entry** m_buckets;
+	volatile LONG m_entryCount;
+	EX_SPIN_LOCK m_lock;
+	FAST_MUTEX m_controlLock;
+};
+
+extern HandleCache g_HandleCache;
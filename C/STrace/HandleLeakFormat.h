@@ -0,0 +1,45 @@
+#pragma once
+
+// Shared between the driver and STraceCLI. Only fixed width types are used and the includer is responsible for
+// providing them, so this must stay free of any windows or kernel headers.
+
+/*
+IOCTL_SET_HANDLE_TRACKING takes one StpHandleTrackRequest. While tracking is on, every handle a user mode process
+creates through one of the followed create/open syscalls is remembered together with the user mode stack that created
+it, until NtClose closes it or its process exits. Stopping forgets everything, clearing forgets what's open now and
+keeps tracking, so a later dump only shows handles created since.
+
+IOCTL_GET_HANDLE_LEAKS returns an StpHandleLeakHeader followed by up to the output buffer's worth of
+StpHandleLeakStack, one per (process, syscall, creating stack) that still has open handles.
+*/
+enum StpHandleTrackOp : uint32_t {
+	StpHandleTrackStart = 1,
+	StpHandleTrackStop = 2,
+	StpHandleTrackClear = 3,
+};
+
+#define STP_HANDLE_LEAK_MAX_FRAMES      16
+#define STP_HANDLE_LEAK_SYSCALL_LENGTH  24
+
+struct StpHandleTrackRequest {
+	uint32_t op;                 // StpHandleTrackOp
+	uint32_t reserved;
+};
+
+struct StpHandleLeakStack {
+	uint64_t processId;
+	uint64_t openHandles;        // created from this stack and not closed yet
+	uint32_t stackId;            // hash of the frames, the same stack keeps its id across dumps
+	uint32_t frameCount;
+	char syscall[STP_HANDLE_LEAK_SYSCALL_LENGTH];    // without Nt, NUL terminated
+	uint64_t frames[STP_HANDLE_LEAK_MAX_FRAMES];     // user mode return addresses, innermost first
+};
+
+struct StpHandleLeakHeader {
+	uint32_t active;             // non zero while tracking
+	uint32_t stackCount;         // stacks with open handles, may be more than were returned
+	uint32_t returnedCount;      // StpHandleLeakStack entries following this header
+	uint32_t reserved;
+	uint64_t openHandles;        // over every stack
+	uint64_t droppedHandles;     // created while the handle or stack table was full, never tracked
+};
@@ -0,0 +1,482 @@
+#include "HandleTracker.h"
+#include "Constants.h"
+#include "NtStructs.h"
+
+HandleTracker g_HandleTracker;
+
+void HandleTracker::initialize() {
+	m_active = false;
+	m_memory = nullptr;
+	m_dropped = 0;
+	for (uint32_t i = 0; i < ShardCount; i++) {
+		memset(&m_shards[i], 0, sizeof(Shard));
+	}
+	ExInitializeFastMutex(&m_controlLock);
+}
+
+void HandleTracker::Destruct() {
+	stop();
+}
+
+// the tables must be allocated
+void HandleTracker::resetShard(Shard& shard) {
+	memset(shard.handleBuckets, 0, HandleBucketCount * sizeof(uint32_t));
+	memset(shard.stackBuckets, 0, StackBucketCount * sizeof(uint32_t));
+	memset(shard.processBuckets, 0, ProcessBucketCount * sizeof(uint32_t));
+
+	// index 0 ends a chain, entries start at 1
+	for (uint32_t i = 1; i <= MaxHandles; i++) {
+		shard.handles[i].next = i < MaxHandles ? i + 1 : 0;
+	}
+	shard.freeHandle = 1;
+
+	for (uint32_t i = 1; i <= MaxStacks; i++) {
+		shard.stacks[i].next = i < MaxStacks ? i + 1 : 0;
+	}
+	shard.freeStack = 1;
+
+	for (uint32_t i = 1; i <= MaxProcesses; i++) {
+		shard.processes[i].next = i < MaxProcesses ? i + 1 : 0;
+	}
+	shard.freeProcess = 1;
+
+	shard.openHandles = 0;
+	shard.stackCount = 0;
+}
+
+NTSTATUS HandleTracker::start() {
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_active) {
+		ExReleaseFastMutex(&m_controlLock);
+		return STATUS_SUCCESS;
+	}
+
+	auto pMemory = (uint8_t*)ExAllocatePoolWithTag(NonPagedPoolNx, ShardCount * ShardBytes, DRIVER_POOL_TAG);
+	if (!pMemory) {
+		ExReleaseFastMutex(&m_controlLock);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	m_memory = pMemory;
+	m_dropped = 0;
+	for (uint32_t i = 0; i < ShardCount; i++) {
+		uint8_t* p = pMemory + i * ShardBytes;
+		auto pHandles = (HandleEntry*)p;
+		p += (MaxHandles + 1) * sizeof(HandleEntry);
+		auto pStacks = (StackEntry*)p;
+		p += (MaxStacks + 1) * sizeof(StackEntry);
+		auto pProcesses = (ProcessEntry*)p;
+		p += (MaxProcesses + 1) * sizeof(ProcessEntry);
+		auto pHandleBuckets = (uint32_t*)p;
+		p += HandleBucketCount * sizeof(uint32_t);
+		auto pStackBuckets = (uint32_t*)p;
+		p += StackBucketCount * sizeof(uint32_t);
+
+		Shard& shard = m_shards[i];
+		KIRQL irql = ExAcquireSpinLockExclusive(&shard.lock);
+		shard.handles = pHandles;
+		shard.handleBuckets = pHandleBuckets;
+		shard.stacks = pStacks;
+		shard.stackBuckets = pStackBuckets;
+		shard.processes = pProcesses;
+		shard.processBuckets = (uint32_t*)p;
+		resetShard(shard);
+		ExReleaseSpinLockExclusive(&shard.lock, irql);
+	}
+
+	// active first, the probes must be recognized from their first call on
+	m_active = true;
+	NTSTATUS status = STATUS_SUCCESS;
+	uint32_t acquired = 0;
+	for (; acquired < DriverProbes::HandleSyscallCount; acquired++) {
+		status = g_DriverProbes.acquire((DriverProbes::Syscall)acquired);
+		if (!NT_SUCCESS(status))
+			break;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		for (uint32_t i = 0; i < acquired; i++) {
+			g_DriverProbes.release((DriverProbes::Syscall)i);
+		}
+		m_active = false;
+	}
+	ExReleaseFastMutex(&m_controlLock);
+
+	if (!NT_SUCCESS(status)) {
+		stop();
+	}
+	return status;
+}
+
+void HandleTracker::stop() {
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_active) {
+		m_active = false;
+		for (uint32_t i = 0; i < DriverProbes::HandleSyscallCount; i++) {
+			g_DriverProbes.release((DriverProbes::Syscall)i);
+		}
+	}
+
+	// a probe that was already past the active check finds its shard's tables gone under the lock
+	for (uint32_t i = 0; i < ShardCount; i++) {
+		Shard& shard = m_shards[i];
+		KIRQL irql = ExAcquireSpinLockExclusive(&shard.lock);
+		shard.handles = nullptr;
+		shard.handleBuckets = nullptr;
+		shard.stacks = nullptr;
+		shard.stackBuckets = nullptr;
+		shard.processes = nullptr;
+		shard.processBuckets = nullptr;
+		shard.openHandles = 0;
+		shard.stackCount = 0;
+		ExReleaseSpinLockExclusive(&shard.lock, irql);
+	}
+
+	if (m_memory) {
+		ExFreePoolWithTag(m_memory, DRIVER_POOL_TAG);
+		m_memory = nullptr;
+	}
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+void HandleTracker::clear() {
+	for (uint32_t i = 0; i < ShardCount; i++) {
+		Shard& shard = m_shards[i];
+		KIRQL irql = ExAcquireSpinLockExclusive(&shard.lock);
+		if (shard.handles) {
+			resetShard(shard);
+		}
+		ExReleaseSpinLockExclusive(&shard.lock, irql);
+	}
+	m_dropped = 0;
+}
+
+void HandleTracker::onProcessExit(HANDLE ProcessId) {
+	// the tables only exist while active
+	if (m_active) {
+		purgeProcess(ProcessId);
+	}
+}
+
+uint32_t HandleTracker::internStack(Shard& shard, uint32_t processId, uint32_t syscall, uint32_t hash, const uint64_t* frames, uint32_t frameCount) {
+	uint32_t* pBucket = &shard.stackBuckets[hash & (StackBucketCount - 1)];
+	for (uint32_t i = *pBucket; i; i = shard.stacks[i].next) {
+		const StackEntry& stack = shard.stacks[i];
+		if (stack.hash == hash && stack.processId == processId && stack.syscall == syscall && stack.frameCount == frameCount &&
+			memcmp(stack.frames, frames, frameCount * sizeof(uint64_t)) == 0)
+			return i;
+	}
+
+	const uint32_t index = shard.freeStack;
+	if (!index) {
+		return 0;
+	}
+
+	StackEntry& stack = shard.stacks[index];
+	shard.freeStack = stack.next;
+	stack.hash = hash;
+	stack.processId = processId;
+	stack.syscall = syscall;
+	stack.frameCount = frameCount;
+	stack.openHandles = 0;
+	memcpy(stack.frames, frames, frameCount * sizeof(uint64_t));
+	stack.next = *pBucket;
+	*pBucket = index;
+	shard.stackCount++;
+	return index;
+}
+
+// Drops one open handle from the stack, the stack goes with its last one
+void HandleTracker::releaseStack(Shard& shard, uint32_t index) {
+	StackEntry& stack = shard.stacks[index];
+	if (--stack.openHandles) {
+		return;
+	}
+
+	for (uint32_t* pLink = &shard.stackBuckets[stack.hash & (StackBucketCount - 1)]; *pLink; pLink = &shard.stacks[*pLink].next) {
+		if (*pLink == index) {
+			*pLink = stack.next;
+			break;
+		}
+	}
+	stack.next = shard.freeStack;
+	shard.freeStack = index;
+	shard.stackCount--;
+}
+
+// The process's entry, a new one without handles if create is set. 0 if it has none, or none is free.
+uint32_t HandleTracker::findProcess(Shard& shard, uint32_t processId, bool create) {
+	uint32_t* pBucket = &shard.processBuckets[hashOf(processId) & (ProcessBucketCount - 1)];
+	for (uint32_t i = *pBucket; i; i = shard.processes[i].next) {
+		if (shard.processes[i].processId == processId)
+			return i;
+	}
+
+	const uint32_t index = shard.freeProcess;
+	if (!create || !index) {
+		return 0;
+	}
+
+	ProcessEntry& process = shard.processes[index];
+	shard.freeProcess = process.next;
+	process.processId = processId;
+	process.firstHandle = 0;
+	process.next = *pBucket;
+	*pBucket = index;
+	return index;
+}
+
+void HandleTracker::releaseProcess(Shard& shard, uint32_t index) {
+	ProcessEntry& process = shard.processes[index];
+	for (uint32_t* pLink = &shard.processBuckets[hashOf(process.processId) & (ProcessBucketCount - 1)]; *pLink; pLink = &shard.processes[*pLink].next) {
+		if (*pLink == index) {
+			*pLink = process.next;
+			break;
+		}
+	}
+	process.next = shard.freeProcess;
+	shard.freeProcess = index;
+}
+
+// The link in its bucket chain pointing at the key's entry, null if there is none
+uint32_t* HandleTracker::findHandle(Shard& shard, uint64_t key) {
+	for (uint32_t* pLink = &shard.handleBuckets[hashOf(key) & (HandleBucketCount - 1)]; *pLink; pLink = &shard.handles[*pLink].next) {
+		if (shard.handles[*pLink].key == key)
+			return pLink;
+	}
+	return nullptr;
+}
+
+// The link in its bucket chain pointing at the entry
+uint32_t* HandleTracker::linkOf(Shard& shard, uint32_t index) {
+	uint32_t* pLink = &shard.handleBuckets[hashOf(shard.handles[index].key) & (HandleBucketCount - 1)];
+	while (*pLink != index) {
+		pLink = &shard.handles[*pLink].next;
+	}
+	return pLink;
+}
+
+// Enters a key findHandle didn't find, the caller has counted it on the stack. False if the shard is full.
+bool HandleTracker::insertHandle(Shard& shard, uint64_t key, uint32_t processId, uint32_t stack) {
+	// checked first, a process entry must not be left without handles
+	const uint32_t index = shard.freeHandle;
+	if (!index) {
+		return false;
+	}
+
+	const uint32_t process = findProcess(shard, processId, true);
+	if (!process) {
+		return false;
+	}
+
+	HandleEntry& entry = shard.handles[index];
+	shard.freeHandle = entry.next;
+	uint32_t* pBucket = &shard.handleBuckets[hashOf(key) & (HandleBucketCount - 1)];
+	entry.key = key;
+	entry.stack = stack;
+	entry.next = *pBucket;
+	*pBucket = index;
+
+	ProcessEntry& owner = shard.processes[process];
+	entry.process = process;
+	entry.prevInProcess = 0;
+	entry.nextInProcess = owner.firstHandle;
+	if (owner.firstHandle) {
+		shard.handles[owner.firstHandle].prevInProcess = index;
+	}
+	owner.firstHandle = index;
+	shard.openHandles++;
+	return true;
+}
+
+// Frees the entry pLink points at, its process's entry goes with the process's last handle
+void HandleTracker::unlinkHandle(Shard& shard, uint32_t* pLink) {
+	const uint32_t index = *pLink;
+	HandleEntry& entry = shard.handles[index];
+	*pLink = entry.next;
+
+	ProcessEntry& process = shard.processes[entry.process];
+	if (entry.prevInProcess) {
+		shard.handles[entry.prevInProcess].nextInProcess = entry.nextInProcess;
+	} else {
+		process.firstHandle = entry.nextInProcess;
+	}
+
+	if (entry.nextInProcess) {
+		shard.handles[entry.nextInProcess].prevInProcess = entry.prevInProcess;
+	}
+
+	if (!process.firstHandle) {
+		releaseProcess(shard, entry.process);
+	}
+	releaseStack(shard, entry.stack);
+
+	entry.next = shard.freeHandle;
+	shard.freeHandle = index;
+	shard.openHandles--;
+}
+
+void HandleTracker::onClose(HANDLE handle) {
+	if (!m_active) {
+		return;
+	}
+
+	const uint64_t key = makeKey(PsGetCurrentProcessId(), handle);
+	Shard& shard = shardOf(HandleToULong(PsGetCurrentProcessId()));
+	KIRQL irql = ExAcquireSpinLockExclusive(&shard.lock);
+	if (shard.handles) {
+		if (uint32_t* pLink = findHandle(shard, key)) {
+			unlinkHandle(shard, pLink);
+		}
+	}
+	ExReleaseSpinLockExclusive(&shard.lock, irql);
+}
+
+void HandleTracker::onCreated(DriverProbes::Syscall syscall, HANDLE handle) {
+	if (!m_active) {
+		return;
+	}
+
+	// the kernel frames are the same for every call through the probe, only the user mode ones tell creators apart
+	PVOID captured[CaptureDepth];
+	const ULONG capturedCount = KphCaptureStackBackTrace(0, CaptureDepth, captured);
+	uint64_t frames[STP_HANDLE_LEAK_MAX_FRAMES];
+	uint32_t frameCount = 0;
+	for (ULONG i = 0; i < capturedCount && frameCount < STP_HANDLE_LEAK_MAX_FRAMES; i++) {
+		if (captured[i] && (ULONG_PTR)captured[i] <= (ULONG_PTR)MM_HIGHEST_USER_ADDRESS) {
+			frames[frameCount++] = (uint64_t)captured[i];
+		}
+	}
+
+	const uint32_t processId = HandleToULong(PsGetCurrentProcessId());
+	const uint64_t key = makeKey(PsGetCurrentProcessId(), handle);
+
+	// FNV-1a over 64 bit words
+	uint64_t hash64 = 14695981039346656037ull;
+	hash64 = (hash64 ^ (((uint64_t)processId << 32) | syscall)) * 1099511628211ull;
+	for (uint32_t i = 0; i < frameCount; i++) {
+		hash64 = (hash64 ^ frames[i]) * 1099511628211ull;
+	}
+	const uint32_t hash = (uint32_t)(hash64 ^ (hash64 >> 32));
+
+	bool dropped = false;
+	Shard& shard = shardOf(processId);
+	KIRQL irql = ExAcquireSpinLockExclusive(&shard.lock);
+	if (shard.handles) {
+		// an entry for the same value is a handle that was closed without NtClose, the new one replaces it
+		uint32_t* pExisting = findHandle(shard, key);
+		const uint32_t stack = internStack(shard, processId, syscall, hash, frames, frameCount);
+		if (stack) {
+			// counted first, releasing the old entry's stack must not free it if it's the same one
+			shard.stacks[stack].openHandles++;
+			if (pExisting) {
+				HandleEntry& entry = shard.handles[*pExisting];
+				releaseStack(shard, entry.stack);
+				entry.stack = stack;
+			} else if (!insertHandle(shard, key, processId, stack)) {
+				releaseStack(shard, stack);
+				dropped = true;
+			}
+		} else {
+			if (pExisting) {
+				unlinkHandle(shard, pExisting);
+			}
+			dropped = true;
+		}
+	}
+	ExReleaseSpinLockExclusive(&shard.lock, irql);
+
+	if (dropped) {
+		InterlockedIncrement64(&m_dropped);
+	}
+}
+
+void HandleTracker::purgeProcess(HANDLE pid) {
+	const uint32_t processId = HandleToULong(pid);
+	Shard& shard = shardOf(processId);
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&shard.lock);
+	if (shard.handles) {
+		// the last handle takes the process entry with it
+		const uint32_t process = findProcess(shard, processId, false);
+		for (uint32_t index = process ? shard.processes[process].firstHandle : 0; index;) {
+			const uint32_t next = shard.handles[index].nextInProcess;
+			unlinkHandle(shard, linkOf(shard, index));
+			index = next;
+		}
+	}
+	ExReleaseSpinLockExclusive(&shard.lock, irql);
+}
+
+NTSTATUS HandleTracker::apply(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(StpHandleTrackRequest)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	StpHandleTrackRequest request;
+	memcpy(&request, Irp->AssociatedIrp.SystemBuffer, sizeof(request));
+
+	switch (request.op) {
+	case StpHandleTrackStart:
+		return start();
+	case StpHandleTrackStop:
+		stop();
+		return STATUS_SUCCESS;
+	case StpHandleTrackClear:
+		clear();
+		return STATUS_SUCCESS;
+	}
+	return STATUS_INVALID_PARAMETER;
+}
+
+NTSTATUS HandleTracker::dump(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const uint32_t outSize = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outSize < sizeof(StpHandleLeakHeader) || !Irp->MdlAddress) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pOut) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	StpHandleLeakHeader header = { 0 };
+	const uint32_t maxStacks = (outSize - sizeof(header)) / sizeof(StpHandleLeakStack);
+	auto pStacks = (StpHandleLeakStack*)(pOut + sizeof(header));
+	header.active = m_active;
+	header.droppedHandles = m_dropped;
+
+	// one shard at a time, the totals may mix moments a few calls apart
+	for (uint32_t s = 0; s < ShardCount; s++) {
+		Shard& shard = m_shards[s];
+		KIRQL irql = ExAcquireSpinLockShared(&shard.lock);
+		if (shard.stacks) {
+			header.stackCount += shard.stackCount;
+			header.openHandles += shard.openHandles;
+			for (uint32_t bucket = 0; bucket < StackBucketCount && header.returnedCount < maxStacks; bucket++) {
+				for (uint32_t i = shard.stackBuckets[bucket]; i && header.returnedCount < maxStacks; i = shard.stacks[i].next) {
+					const StackEntry& stack = shard.stacks[i];
+					StpHandleLeakStack out = { 0 };
+					out.processId = stack.processId;
+					out.openHandles = stack.openHandles;
+					out.stackId = stack.hash;
+					out.frameCount = stack.frameCount;
+					memcpy(out.frames, stack.frames, stack.frameCount * sizeof(uint64_t));
+
+					const char* name = DriverProbes::nameOf((DriverProbes::Syscall)stack.syscall);
+					const size_t length = strnlen(name, sizeof(out.syscall) - 1);
+					memcpy(out.syscall, name, length);
+
+					memcpy(&pStacks[header.returnedCount++], &out, sizeof(out));
+				}
+			}
+		}
+		ExReleaseSpinLockShared(&shard.lock, irql);
+	}
+
+	memcpy(pOut, &header, sizeof(header));
+	Irp->IoStatus.Information = sizeof(header) + header.returnedCount * sizeof(StpHandleLeakStack);
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "DriverProbes.h"
+#include "HandleLeakFormat.h"
+
+/*
+Handle leak tracking for long running processes, without logging every open and close and matching them up offline.
+While it's on the tracker holds every DriverProbes handle syscall. A handle created by a user mode caller is entered
+into a table keyed by (pid, handle) with the user mode stack that created it, NtClose takes it out again and a process's
+handles go when it exits. IOCTL_GET_HANDLE_LEAKS reports what's still open, grouped by process and creating stack.
+
+The state is split into ShardCount shards by pid, each with its own spin lock and tables, so processes creating and
+closing handles at once rarely contend. Within a shard a process's handles are chained off its ProcessEntry, its exit
+frees exactly those. A create costs a stack walk outside the lock and one lock acquisition for the stack and handle
+tables, a close one lock acquisition.
+
+Memory is fixed when tracking starts, every shard draws from its own preallocated arrays and a handle created while its
+shard is full is only counted as dropped. That bounds a single process to a shard's worth of handles, far more than it
+takes to see a leak grow. A stack is forgotten with its last open handle.
+
+A handle closed some other way than NtClose (DuplicateHandle with DUPLICATE_CLOSE_SOURCE, a kernel mode close) stays
+until its value is reused or its process exits, handles the tracker didn't see created are never reported.
+*/
+class HandleTracker {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// Probe hooks, see DriverProbes. IRQL <= DISPATCH_LEVEL
+	void onClose(HANDLE handle);
+	void onCreated(DriverProbes::Syscall syscall, HANDLE handle);
+
+	// PASSIVE_LEVEL, the driver's process notify. Drops the process's handles.
+	void onProcessExit(HANDLE ProcessId);
+
+	// IOCTL_SET_HANDLE_TRACKING
+	NTSTATUS apply(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+
+	// IOCTL_GET_HANDLE_LEAKS
+	NTSTATUS dump(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+private:
+	// Every table chains through indices into its shard's arrays, 0 is the end of a chain
+	struct HandleEntry {
+		uint32_t next;
+		uint32_t stack;
+		uint32_t process;
+		uint32_t prevInProcess;    // the process's handles, doubly linked so a close unlinks in place
+		uint32_t nextInProcess;
+		uint64_t key;              // (pid << 32) | handle
+	};
+
+	struct StackEntry {
+		uint32_t next;
+		uint32_t hash;
+		uint32_t processId;
+		uint32_t syscall;
+		uint32_t frameCount;
+		uint32_t openHandles;
+		uint64_t frames[STP_HANDLE_LEAK_MAX_FRAMES];
+	};
+
+	// exists while the process has handles in the shard
+	struct ProcessEntry {
+		uint32_t next;
+		uint32_t processId;
+		uint32_t firstHandle;
+	};
+
+	// a cache line each, the locks of different shards must not share one
+	struct alignas(64) Shard {
+		EX_SPIN_LOCK lock;
+		HandleEntry* handles;      // the shard's part of m_memory, null while not tracking
+		uint32_t* handleBuckets;
+		uint32_t freeHandle;       // free lists through next
+		StackEntry* stacks;
+		uint32_t* stackBuckets;
+		uint32_t freeStack;
+		ProcessEntry* processes;
+		uint32_t* processBuckets;
+		uint32_t freeProcess;
+		uint32_t openHandles;
+		uint32_t stackCount;
+	};
+
+	static const uint32_t ShardBits = 3;
+	static const uint32_t ShardCount = 1 << ShardBits;
+
+	// per shard, the bucket counts are powers of two
+	static const uint32_t MaxHandles = 8 * 1024;
+	static const uint32_t HandleBucketCount = 2 * 1024;
+	static const uint32_t MaxStacks = 512;
+	static const uint32_t StackBucketCount = 128;
+	static const uint32_t MaxProcesses = 512;
+	static const uint32_t ProcessBucketCount = 128;
+
+	// entries start at 1, the arrays come first so every one stays 8 byte aligned
+	static const SIZE_T ShardBytes = ((MaxHandles + 1) * sizeof(HandleEntry) + (MaxStacks + 1) * sizeof(StackEntry) +
+		(MaxProcesses + 1) * sizeof(ProcessEntry) + (HandleBucketCount + StackBucketCount + ProcessBucketCount) * sizeof(uint32_t) + 7) & ~(SIZE_T)7;
+
+	// kernel frames below the probe are walked and thrown away, this leaves room for the user mode ones
+	static const uint32_t CaptureDepth = 64;
+
+	static uint64_t makeKey(HANDLE pid, HANDLE handle) {
+		return ((uint64_t)HandleToULong(pid) << 32) | HandleToULong(handle);
+	}
+
+	// fibonacci hashing, pids and handle values are multiples of 4
+	static uint32_t hashOf(uint64_t value) {
+		return (uint32_t)((value * 0x9E3779B97F4A7C15ull) >> 32);
+	}
+
+	Shard& shardOf(uint32_t processId) {
+		return m_shards[hashOf(processId) >> (32 - ShardBits)];
+	}
+
+	NTSTATUS start();
+	void stop();
+	void clear();
+
+	// The shard's lock must be held exclusive
+	static void resetShard(Shard& shard);
+	static uint32_t internStack(Shard& shard, uint32_t processId, uint32_t syscall, uint32_t hash, const uint64_t* frames, uint32_t frameCount);
+	static void releaseStack(Shard& shard, uint32_t index);
+	static uint32_t findProcess(Shard& shard, uint32_t processId, bool create);
+	static void releaseProcess(Shard& shard, uint32_t index);
+	static uint32_t* findHandle(Shard& shard, uint64_t key);
+	static uint32_t* linkOf(Shard& shard, uint32_t index);
+	static bool insertHandle(Shard& shard, uint64_t key, uint32_t processId, uint32_t stack);
+	static void unlinkHandle(Shard& shard, uint32_t* pLink);
+
+	void purgeProcess(HANDLE pid);
+
+	volatile bool m_active;
+	Shard m_shards[ShardCount];
+	uint8_t* m_memory;              // every shard's arrays, ShardBytes each
+	volatile LONG64 m_dropped;
+	FAST_MUTEX m_controlLock;
+};
+
+extern HandleTracker g_HandleTracker;
@@ -20,6 +20,18 @@ public:
 	uint64_t* pStackArgs;
 	uint64_t* pRegArgs;
 
+	// captured once by the driver, so plugins don't each ask the kernel
+	uint64_t threadId;
+	uint32_t processorIndex;    // KeGetCurrentProcessorNumberEx
+	uint64_t timestamp;         // KeQueryPerformanceCounter when the probe ran
+	uint64_t duration;          // return probe only, ticks since the call's entry probe. 0 on entry or if unknown
+	uint64_t frequency;         // KeQueryPerformanceCounter ticks per second
+
+	// entry: a zeroed block the plugin may fill, return: the same block as the matching entry left it. Released after
+	// the return callback. Null unless the plugin asked for one with pSetCallContextSize, or if the entry wasn't seen.
+	void* pCallContext;
+	uint32_t callContextSize;
+
 	uint64_t read_argument(const uint32_t idx)
 	{
 		if (idx > paramCount || regArgsSize > paramCount)
@@ -45,13 +57,20 @@ typedef NTSTATUS(*tSetEtwCallbackApi)(GUID providerGuid);
 typedef NTSTATUS(*tUnSetEtwCallbackApi)();
 typedef PVOID(NTAPI*tMmGetSystemRoutineAddress)(PUNICODE_STRING SystemRoutineName);
 typedef BOOLEAN(*tTraceAccessMemory)(PVOID SafeAddress, ULONG_PTR UnsafeAddress, SIZE_T NumberOfBytes, SIZE_T ChunkSize, BOOLEAN DoRead);
+typedef NTSTATUS(*tEnableHandlePathsApi)();
+typedef NTSTATUS(*tGetHandlePathApi)(HANDLE handle, wchar_t* path, uint32_t pathChars, uint32_t* pathLength);
+typedef NTSTATUS(*tRegisterThreadVarApi)(const char* name, uint32_t size, uint32_t alignment, uint32_t* offset);
+typedef uint8_t*(*tGetThreadVarsApi)();
+typedef NTSTATUS(*tSetCallContextSizeApi)(uint32_t size);
 
 class PluginApis {
 public:
 	PluginApis() = default;
 	PluginApis(tMmGetSystemRoutineAddress getAddress, tLogPrintApi print, tEtwTraceApi etwTrace, tSetCallbackApi setCallback,
 		tUnSetCallbackApi unsetCallback, tSetEtwCallbackApi etwSetCallback, tUnSetEtwCallbackApi etwUnSetCallback,
-		tTraceAccessMemory accessMemory, tSetTlsData setTlsData, tGetTlsData getTlsData) {
+		tTraceAccessMemory accessMemory, tSetTlsData setTlsData, tGetTlsData getTlsData, tEnableHandlePathsApi enableHandlePaths,
+		tGetHandlePathApi getHandlePath, tRegisterThreadVarApi registerThreadVar, tGetThreadVarsApi getThreadVars,
+		tSetCallContextSizeApi setCallContextSize) {
 
 		pSetTlsData = setTlsData;
 		pGetTlsData = getTlsData;
@@ -63,6 +82,11 @@ public:
 		pEtwUnSetCallback = etwUnSetCallback;
 		pGetSystemRoutineAddress = getAddress;
 		pTraceAccessMemory = accessMemory;
+		pEnableHandlePaths = enableHandlePaths;
+		pGetHandlePath = getHandlePath;
+		pRegisterThreadVar = registerThreadVar;
+		pGetThreadVars = getThreadVars;
+		pSetCallContextSize = setCallContextSize;
 	}
 
 	tSetTlsData pSetTlsData;
@@ -75,15 +99,80 @@ public:
 	tUnSetEtwCallbackApi pEtwUnSetCallback;
 	tMmGetSystemRoutineAddress pGetSystemRoutineAddress;
 	tTraceAccessMemory pTraceAccessMemory;
+
+	// Starts the driver's (process, handle) -> path cache, it stays on until the plugin unloads. Call from StpInitialize.
+	tEnableHandlePathsApi pEnableHandlePaths;
+
+	// Path of a file handle of the calling process, a hash lookup once the cache is on. See HandleCache.h
+	tGetHandlePathApi pGetHandlePath;
+
+	// Named per-thread variable, call from StpInitialize. See ThreadVars.h, ThreadVar<T> below wraps it.
+	tRegisterThreadVarApi pRegisterThreadVar;
+
+	// The calling thread's variable block, null if there is none. Look it up once per callback.
+	tGetThreadVarsApi pGetThreadVars;
+
+	// Size of MachineState::pCallContext, up to 256 bytes. Call from StpInitialize, see CallContexts.h
+	tSetCallContextSizeApi pSetCallContextSize;
+};
+
+/*
+A typed thread variable. Register once from StpInitialize, then index the block from pGetThreadVars:
+
+	ThreadVar<uint64_t> g_ReadBytes;
+	g_ReadBytes.registerVar(apis, "readBytes");
+	...
+	if (uint8_t* vars = g_Apis.pGetThreadVars())
+		g_ReadBytes.in(vars) += bytes;
+*/
+template<typename T>
+class ThreadVar {
+public:
+	NTSTATUS registerVar(const PluginApis& apis, const char* name) {
+		return apis.pRegisterThreadVar(name, sizeof(T), alignof(T), &m_offset);
+	}
+
+	T& in(uint8_t* vars) const {
+		return *reinterpret_cast<T*>(vars + m_offset);
+	}
+private:
+	uint32_t m_offset = 0;
 };
 
 extern "C" NTKERNELAPI char* NTAPI PsGetProcessImageFileName(PEPROCESS Process);
 extern "C" NTKERNELAPI PVOID NTAPI PsGetProcessWow64Process(IN PEPROCESS Process);
 extern "C" NTKERNELAPI PPEB NTAPI PsGetProcessPeb(IN PEPROCESS Process);
+extern "C" NTKERNELAPI HANDLE NTAPI PsGetProcessInheritedFromUniqueProcessId(IN PEPROCESS Process);
+extern "C" NTKERNELAPI ULONG NTAPI PsGetProcessSessionId(IN PEPROCESS Process);
+extern "C" NTKERNELAPI BOOLEAN NTAPI PsGetProcessExitProcessCalled(IN PEPROCESS Process);
 
 #define MAX_PATH 260
 #define MAX_FRAME_DEPTH 50
 
+// Built once per process by ProcessCache, shared by every CallerInfo of that process. Valid for the duration of the callback it's passed to.
+struct ProcessIdentity {
+	uint64_t processId;
+	uint64_t parentProcessId;
+	int64_t createTime;         // 100ns since 1601, tells a reused pid apart
+	uint32_t sessionId;
+	uint32_t nameHash;          // hashName(imageName)
+	bool isWow64;
+	char imageName[16];         // as truncated by the OS
+	wchar_t imagePath[MAX_PATH];   // full NT path, empty if it wasn't available when the process was first seen
+
+	// FNV-1a, case sensitive like IsTargetProcName. Hash a target name once and compare nameHash instead of the string.
+	static uint32_t hashName(const char* name) {
+		uint32_t hash = 2166136261u;
+		for (; *name; name++) {
+			hash = (hash ^ (uint8_t)*name) * 16777619u;
+		}
+		return hash;
+	}
+};
+
+// ProcessCache.cpp. The identity of the current thread's process, null if it couldn't be built.
+const ProcessIdentity* LookupProcessIdentity();
+
 class CallerInfo
 {
 public:
@@ -99,10 +188,22 @@ public:
 	uint8_t frameDepth;
 	bool isWow64;
 
+	// appended, plugins built against the fields above keep working
+	const ProcessIdentity* process;
+
 	CallerInfo() {
 		frames = nullptr;
 		frameDepth = 0;
 
+		// a hash lookup once the process was seen, instead of querying and copying its identity on every call
+		process = LookupProcessIdentity();
+		if (process) {
+			processId = process->processId;
+			isWow64 = process->isWow64;
+			memcpy(processName, process->imageName, sizeof(process->imageName));
+			return;
+		}
+
 		memset(processName, 0, sizeof(processName));
 
 		processId = ULONG64(PsGetCurrentProcessId());
@@ -130,11 +231,13 @@ public:
 		return strcmp((const char*)processName, procName) == 0;
 	}
 
-	__forceinline void CaptureStackTrace(uint32_t skipFrameCount = 0) {
+	// maxFrames is clamped to MAX_FRAME_DEPTH. Without resolveModules only the addresses are filled in, modulebase
+	// stays 0, the module enumeration is most of the cost
+	__forceinline void CaptureStackTrace(uint32_t skipFrameCount = 0, uint32_t maxFrames = MAX_FRAME_DEPTH, bool resolveModules = true) {
 		uint64_t StackTraceData[MAX_FRAME_DEPTH] = { 0 };
 
 		// we forceinlined, so *this* frame should not exist, so we can skip nothing
-		const uint8_t StackTraceFramesCount = (uint8_t)KphCaptureStackBackTrace((ULONG)skipFrameCount, MAX_FRAME_DEPTH, (PVOID*)StackTraceData);
+		const uint8_t StackTraceFramesCount = (uint8_t)KphCaptureStackBackTrace((ULONG)skipFrameCount, maxFrames < MAX_FRAME_DEPTH ? maxFrames : MAX_FRAME_DEPTH, (PVOID*)StackTraceData);
 
 		// trace done, alloc our copy
 		frames = (StackFrame*)ExAllocatePoolWithTag(NonPagedPoolNx, StackTraceFramesCount * sizeof(StackFrame), DRIVER_POOL_TAG);
@@ -150,6 +253,10 @@ public:
 			frames[i].frameaddress = StackTraceData[i];
 		}
 
+		if (!resolveModules) {
+			return;
+		}
+
 		EnumKernelModeModules([&](char* modulePath, uint64_t base, uint64_t size) {
 			for (uint32_t i = 0; i < frameDepth; i++) {
 				uint64_t frameaddress = StackTraceData[i];
@@ -0,0 +1,38 @@
+#pragma once
+
+// Shared between the driver and STraceCLI. Only fixed width types are used and the includer is responsible for
+// providing them, so this must stay free of any windows or kernel headers.
+
+/*
+IOCTL_GET_IO_COUNTERS returns an StpIoCounterHeader followed by rowCount StpIoCounterRow. The first call switches
+I/O accounting on, it stays on until the client's handle is closed. Every call returns what NtReadFile and
+NtWriteFile moved since the previous call, so a client polling at an interval reads per interval figures directly:
+one row with handle 0 for each process's totals and one per file it read or wrote through, with the handle that did
+so first. Rows that don't fit the buffer stay in the driver and come with the next call.
+
+Bytes are the IO_STATUS_BLOCK Information of calls that completed synchronously. A call that returned STATUS_PENDING
+only counts its requested length, its transfer isn't seen.
+*/
+#define STP_IO_PATH_LENGTH 128
+
+struct StpIoCounterRow {
+	uint32_t pid;
+	uint32_t handle;             // 0 for the process's totals
+	uint64_t reads;              // successful or pending calls
+	uint64_t writes;
+	uint64_t readBytes;          // transferred
+	uint64_t writeBytes;
+	uint64_t readRequested;      // Length
+	uint64_t writeRequested;
+	uint64_t pending;            // calls that returned STATUS_PENDING
+	uint16_t path[STP_IO_PATH_LENGTH];    // NUL terminated, the end of a longer path, empty if unknown
+};
+
+struct StpIoCounterHeader {
+	uint32_t rowCount;           // rows following the header
+	uint32_t totalRows;          // rows the driver had, more than rowCount if the buffer was too small
+	uint64_t timestamp;          // QueryPerformanceCounter at this call
+	uint64_t qpcFrequency;
+	uint64_t intervalTicks;      // since the previous call, 0 for the first
+	uint64_t overflow;           // calls counted only in their process's totals or not at all, a table was full
+};
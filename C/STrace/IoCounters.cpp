@@ -0,0 +1,407 @@
+#include "IoCounters.h"
+#include "Constants.h"
+#include "DynamicTrace.h"
+
+IoCounters g_IoCounters;
+
+static const DriverProbes::Syscall IoSyscalls[] = { DriverProbes::ReadFile, DriverProbes::WriteFile };
+
+static bool isIoSyscall(DriverProbes::Syscall syscall) {
+	return syscall == DriverProbes::ReadFile || syscall == DriverProbes::WriteFile;
+}
+
+void IoCounters::initialize() {
+	m_active = false;
+	m_owner = nullptr;
+	m_tables.initialize();
+	m_rows.initialize();
+	m_lastSnapshot = 0;
+	m_files = nullptr;
+	m_fileCount = 0;
+	m_epoch = 0;
+	KeInitializeSpinLock(&m_filesLock);
+	ExInitializeFastMutex(&m_lock);
+}
+
+void IoCounters::Destruct() {
+	stop();
+	m_tables.Destruct();
+	m_rows.Destruct();
+
+	if (m_files) {
+		evictFiles(~0u);
+		ExFreePoolWithTag(m_files, DRIVER_POOL_TAG);
+		m_files = nullptr;
+	}
+}
+
+// m_lock must be held
+bool IoCounters::activate(PFILE_OBJECT fileObject) {
+	if (m_active)
+		return true;
+
+	if (!m_files) {
+		m_files = (File**)ExAllocatePoolWithTag(NonPagedPoolNx, FileBuckets * sizeof(File*), DRIVER_POOL_TAG);
+		if (!m_files)
+			return false;
+		memset(m_files, 0, FileBuckets * sizeof(File*));
+	}
+
+	// every client starts counting from zero
+	if (!m_tables.reset() || !m_rows.reset())
+		return false;
+
+	evictFiles(~0u);
+	m_lastSnapshot = 0;
+
+	// active first, the probes must be recognized from their first call on
+	m_active = true;
+	NTSTATUS status = STATUS_SUCCESS;
+	uint32_t acquired = 0;
+	for (; acquired < ARRAYSIZE(IoSyscalls); acquired++) {
+		status = g_DriverProbes.acquire(IoSyscalls[acquired]);
+		if (!NT_SUCCESS(status))
+			break;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		for (uint32_t i = 0; i < acquired; i++) {
+			g_DriverProbes.release(IoSyscalls[i]);
+		}
+		m_active = false;
+		return false;
+	}
+
+	m_owner = fileObject;
+	return true;
+}
+
+void IoCounters::stop(PFILE_OBJECT fileObject) {
+	KeEnterCriticalRegion();
+	ExAcquireFastMutexUnsafe(&m_lock);
+	if (m_active && (!fileObject || fileObject == m_owner)) {
+		// the tables stay allocated, a probe may still be counting into them
+		m_active = false;
+		m_owner = nullptr;
+		for (uint32_t i = 0; i < ARRAYSIZE(IoSyscalls); i++) {
+			g_DriverProbes.release(IoSyscalls[i]);
+		}
+
+		// don't keep files referenced while nothing counts, a probe still past the active check may record one more
+		evictFiles(~0u);
+	}
+	ExReleaseFastMutexUnsafe(&m_lock);
+	KeLeaveCriticalRegion();
+}
+
+void IoCounters::add(Tables::Slot* pSlot, bool isRead, uint64_t length, uint64_t transferred, bool pending) {
+	InterlockedIncrement64(&pSlot->counts[isRead ? Reads : Writes]);
+	InterlockedAdd64(&pSlot->counts[isRead ? ReadRequested : WriteRequested], (LONG64)length);
+	if (transferred) {
+		InterlockedAdd64(&pSlot->counts[isRead ? ReadBytes : WriteBytes], (LONG64)transferred);
+	}
+
+	if (pending) {
+		InterlockedIncrement64(&pSlot->counts[Pending]);
+	}
+}
+
+IoCounters::File* IoCounters::findFile(uint64_t key) const {
+	for (File* pFile = m_files[fileBucketOf(key)]; pFile; pFile = pFile->next) {
+		if ((uint64_t)pFile->fileObject == key)
+			return pFile;
+	}
+	return nullptr;
+}
+
+bool IoCounters::noteFile(PFILE_OBJECT fileObject, HANDLE handle) {
+	// a key claims one slot per CPU, the file may well be known already
+	const uint64_t key = (uint64_t)fileObject;
+	KIRQL irql;
+	KeAcquireSpinLock(&m_filesLock, &irql);
+	File* pKnown = findFile(key);
+	if (pKnown) {
+		pKnown->lastSeen = m_epoch;
+	}
+	KeReleaseSpinLock(&m_filesLock, irql);
+	if (pKnown)
+		return true;
+
+	auto pFile = (File*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(File), DRIVER_POOL_TAG);
+	if (!pFile)
+		return false;
+
+	pFile->fileObject = fileObject;
+	pFile->pid = HandleToULong(PsGetCurrentProcessId());
+	pFile->handle = HandleToULong(handle);
+	pFile->named = false;
+	pFile->path[0] = 0;
+
+	KeAcquireSpinLock(&m_filesLock, &irql);
+	pKnown = findFile(key);
+	if (pKnown) {
+		pKnown->lastSeen = m_epoch;
+	} else if (m_fileCount < MaxFiles) {
+		// held until the record is evicted, the address names this file only as long as the object lives
+		ObReferenceObject(fileObject);
+		const uint32_t bucket = fileBucketOf(key);
+		pFile->lastSeen = m_epoch;
+		pFile->next = m_files[bucket];
+		m_files[bucket] = pFile;
+		m_fileCount++;
+		pKnown = pFile;
+		pFile = nullptr;
+	}
+	KeReleaseSpinLock(&m_filesLock, irql);
+
+	if (pFile) {
+		ExFreePoolWithTag(pFile, DRIVER_POOL_TAG);
+	}
+	return pKnown != nullptr;
+}
+
+void IoCounters::nameFiles(uint32_t rowCount) {
+	POBJECT_NAME_INFORMATION pInfo = nullptr;
+	const ULONG infoSize = sizeof(OBJECT_NAME_INFORMATION) + MaxNameChars * sizeof(wchar_t);
+
+	for (uint32_t i = 0; i < rowCount; i++) {
+		const uint64_t key = m_rows.at(i).key;
+		if (!isFileKey(key))
+			continue;
+
+		// records are only freed under m_lock, the pointer stays good once the spin lock is dropped
+		KIRQL irql;
+		KeAcquireSpinLock(&m_filesLock, &irql);
+		File* pFile = findFile(key);
+		KeReleaseSpinLock(&m_filesLock, irql);
+		if (!pFile || pFile->named)
+			continue;
+
+		pFile->named = true;
+
+		// a name query on a synchronous pipe can block behind another thread's pending read, such files stay nameless
+		const PDEVICE_OBJECT pDevice = pFile->fileObject->DeviceObject;
+		const DEVICE_TYPE deviceType = pDevice ? pDevice->DeviceType : 0;
+		if (deviceType == FILE_DEVICE_NAMED_PIPE || deviceType == FILE_DEVICE_MAILSLOT)
+			continue;
+
+		if (!pInfo) {
+			pInfo = (POBJECT_NAME_INFORMATION)ExAllocatePoolWithTag(PagedPool, infoSize, DRIVER_POOL_TAG);
+			if (!pInfo)
+				break;
+		}
+
+		ULONG returned = 0;
+		if (!NT_SUCCESS(ObQueryNameString(pFile->fileObject, pInfo, infoSize, &returned)) || !pInfo->Name.Buffer)
+			continue;
+
+		// the end of the path names the file, keep that
+		const uint32_t length = pInfo->Name.Length / sizeof(wchar_t);
+		const uint32_t start = length >= STP_IO_PATH_LENGTH ? length - (STP_IO_PATH_LENGTH - 1) : 0;
+		memcpy(pFile->path, pInfo->Name.Buffer + start, (length - start) * sizeof(wchar_t));
+		pFile->path[length - start] = 0;
+	}
+
+	if (pInfo) {
+		ExFreePoolWithTag(pInfo, DRIVER_POOL_TAG);
+	}
+}
+
+void IoCounters::evictFiles(uint32_t epoch) {
+	File* pFree = nullptr;
+
+	// unlinked under the lock, freed after it
+	KIRQL irql;
+	KeAcquireSpinLock(&m_filesLock, &irql);
+	for (uint32_t i = 0; m_files && i < FileBuckets; i++) {
+		File** ppLink = &m_files[i];
+		while (*ppLink) {
+			File* pFile = *ppLink;
+			if (epoch == ~0u || pFile->lastSeen < epoch) {
+				*ppLink = pFile->next;
+				pFile->next = pFree;
+				pFree = pFile;
+				m_fileCount--;
+			} else {
+				ppLink = &pFile->next;
+			}
+		}
+	}
+	KeReleaseSpinLock(&m_filesLock, irql);
+
+	while (pFree) {
+		File* pNext = pFree->next;
+		ObDereferenceObject(pFree->fileObject);
+		ExFreePoolWithTag(pFree, DRIVER_POOL_TAG);
+		pFree = pNext;
+	}
+}
+
+void IoCounters::onEntry(DriverProbes::Syscall syscall, uint32_t paramCount, const uint64_t* pArgs, uint32_t argCount, const uint64_t* pStackArgs, IoCall& call) {
+	if (!m_active || !isIoSyscall(syscall) || ExGetPreviousMode() != UserMode) {
+		return;
+	}
+
+	MachineState args = { 0 };
+	args.paramCount = paramCount;
+	args.regArgsSize = argCount;
+	args.pRegArgs = (uint64_t*)pArgs;
+	args.pStackArgs = (uint64_t*)pStackArgs;
+
+	// FileHandle, Event, ApcRoutine, ApcContext, IoStatusBlock, Buffer, Length, ByteOffset, Key
+	call.handle = args.read_argument(0);
+	call.pIoStatus = args.read_argument(4);
+	call.length = (uint32_t)args.read_argument(6);
+	call.syscall = (uint32_t)syscall + 1;
+}
+
+void IoCounters::onReturn(DriverProbes::Syscall syscall, NTSTATUS status, IoCall& call) {
+	// a nested kernel mode call returns with its own previous mode and mustn't consume the outer call's arguments
+	if (!isIoSyscall(syscall) || ExGetPreviousMode() != UserMode) {
+		return;
+	}
+
+	const IoCall ioCall = call;
+	call.syscall = 0;
+
+	// STATUS_PENDING is a success code too
+	if (!m_active || ioCall.syscall != (uint32_t)syscall + 1 || !NT_SUCCESS(status)) {
+		return;
+	}
+
+	const bool pending = status == STATUS_PENDING;
+	uint64_t transferred = 0;
+	if (!pending && ioCall.pIoStatus && KeGetCurrentIrql() == PASSIVE_LEVEL) {
+		ULONG_PTR information = 0;
+		if (TraceAccessMemory(&information, (ULONG_PTR)ioCall.pIoStatus + FIELD_OFFSET(IO_STATUS_BLOCK, Information), sizeof(information), sizeof(information), TRUE)) {
+			transferred = information;
+		}
+	}
+
+	const bool isRead = syscall == DriverProbes::ReadFile;
+	if (Tables::Slot* pSlot = m_tables.slotFor(HandleToULong(PsGetCurrentProcessId()))) {
+		add(pSlot, isRead, ioCall.length, transferred, pending);
+	}
+
+	// the handle could have been closed and its value reused since the call took it, too rare a race to guard
+	const HANDLE handle = (HANDLE)ioCall.handle;
+	PFILE_OBJECT pFileObject = nullptr;
+	if (KeGetCurrentIrql() != PASSIVE_LEVEL ||
+		!NT_SUCCESS(ObReferenceObjectByHandle(handle, 0, *IoFileObjectType, UserMode, (PVOID*)&pFileObject, nullptr))) {
+		m_tables.addOverflow(1);
+		return;
+	}
+
+	const uint64_t key = (uint64_t)pFileObject;
+	bool claimed = false;
+	Tables::Slot* pSlot = m_tables.slotFor(key, &claimed);
+	if (pSlot) {
+		if (claimed && !noteFile(pFileObject, handle)) {
+			m_tables.release(pSlot, key);
+			m_tables.addOverflow(1);
+		} else {
+			add(pSlot, isRead, ioCall.length, transferred, pending);
+		}
+	}
+	ObDereferenceObject(pFileObject);
+}
+
+// m_lock must be held
+void IoCounters::drain() {
+	m_tables.drain([this](uint64_t key, const uint64_t* counts) {
+		if (!m_rows.merge(key, counts)) {
+			m_tables.addOverflow(counts[Reads] + counts[Writes]);
+		}
+	});
+}
+
+NTSTATUS IoCounters::snapshot(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const uint32_t outSize = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outSize < sizeof(StpIoCounterHeader) || !Irp->MdlAddress) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pOut) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// stays at PASSIVE_LEVEL, the name queries are made under it
+	KeEnterCriticalRegion();
+	ExAcquireFastMutexUnsafe(&m_lock);
+	if (!activate(IrpStack->FileObject)) {
+		ExReleaseFastMutexUnsafe(&m_lock);
+		KeLeaveCriticalRegion();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	drain();
+
+	LARGE_INTEGER frequency;
+	StpIoCounterHeader header = { 0 };
+	header.timestamp = KeQueryPerformanceCounter(&frequency).QuadPart;
+	header.qpcFrequency = frequency.QuadPart;
+	header.intervalTicks = m_lastSnapshot ? header.timestamp - m_lastSnapshot : 0;
+	header.overflow = m_tables.takeOverflow();
+	m_lastSnapshot = header.timestamp;
+
+	const uint32_t maxRows = (outSize - sizeof(header)) / sizeof(StpIoCounterRow);
+	const uint32_t taken = m_rows.count() < maxRows ? m_rows.count() : maxRows;
+	header.totalRows = m_rows.count();
+	nameFiles(taken);
+
+	// every file with a row is kept, those reported now and those that wait for the next snapshot
+	KIRQL irql;
+	KeAcquireSpinLock(&m_filesLock, &irql);
+	const uint32_t epoch = m_epoch++;
+	for (uint32_t i = 0; i < m_rows.count(); i++) {
+		if (File* pFile = findFile(m_rows.at(i).key)) {
+			pFile->lastSeen = epoch;
+		}
+	}
+
+	auto pRows = (StpIoCounterRow*)(pOut + sizeof(header));
+	for (uint32_t i = 0; i < taken; i++) {
+		const Rows::Row& merged = m_rows.at(i);
+		StpIoCounterRow row = { 0 };
+		row.pid = (uint32_t)merged.key;
+		if (isFileKey(merged.key)) {
+			// only a call racing its slot's claim or the drain that gave it back counts without a file
+			const File* pFile = findFile(merged.key);
+			if (!pFile) {
+				header.overflow += merged.counts[Reads] + merged.counts[Writes];
+				header.totalRows--;
+				continue;
+			}
+
+			row.pid = pFile->pid;
+			row.handle = pFile->handle;
+			for (uint32_t c = 0; c < STP_IO_PATH_LENGTH; c++) {
+				row.path[c] = (uint16_t)pFile->path[c];
+				if (!pFile->path[c])
+					break;
+			}
+		}
+		row.reads = merged.counts[Reads];
+		row.writes = merged.counts[Writes];
+		row.readBytes = merged.counts[ReadBytes];
+		row.writeBytes = merged.counts[WriteBytes];
+		row.readRequested = merged.counts[ReadRequested];
+		row.writeRequested = merged.counts[WriteRequested];
+		row.pending = merged.counts[Pending];
+		memcpy(&pRows[header.rowCount++], &row, sizeof(row));
+	}
+	KeReleaseSpinLock(&m_filesLock, irql);
+
+	// what didn't fit waits for the next snapshot, a file with no row had no I/O since the last one
+	m_rows.removeFirst(taken);
+	evictFiles(epoch);
+	ExReleaseFastMutexUnsafe(&m_lock);
+	KeLeaveCriticalRegion();
+
+	const uint32_t size = sizeof(header) + header.rowCount * sizeof(StpIoCounterRow);
+	memcpy(pOut, &header, sizeof(header));
+	Irp->IoStatus.Information = size;
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "DriverProbes.h"
+#include "IoCounterFormat.h"
+#include "PerCpuCounters.h"
+
+// What the entry probe of NtReadFile or NtWriteFile keeps for its return, in the call's g_DriverCalls frame
+struct IoCall {
+	uint32_t syscall;           // DriverProbes::Syscall + 1, 0 if there's nothing to consume
+	uint32_t length;
+	uint64_t handle;
+	uint64_t pIoStatus;         // PIO_STATUS_BLOCK
+};
+
+/*
+Bytes read and written per process and per file object, for "STraceCLI io". A call costs two per-CPU slot updates, the
+process's totals and the file's, and a reference on the file object behind its handle, the same handle table lookup
+the syscall itself just made. Files are counted by object rather than handle value, a value closed and reused for
+another file between two snapshots gets a row of its own. A file object shared by several processes (an inherited or
+duplicated handle) has one row, with the process and handle that first did I/O through it.
+
+When a file first claims a per-CPU slot its object is referenced and recorded with the process and handle, nothing
+else, so its address can't be reused for another file while the record is kept. Only the snapshot names the files it
+reports, once per record. A file with no counts for a whole interval is dropped and its reference released, its slots
+were given back by the same drain and its next I/O claims and records it again.
+
+A snapshot drains the per-CPU counters into the merged rows, copies out what fits and keeps the rest for the next one.
+
+Accounting is off until a client asks for the first snapshot and stops again when that client's handle is closed.
+*/
+class IoCounters {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// IOCTL_GET_IO_COUNTERS, PASSIVE_LEVEL. Enables accounting on first use
+	NTSTATUS snapshot(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+
+	// PASSIVE_LEVEL. Releases the probes, the tables stay allocated. From IRP_MJ_CLEANUP stops only if fileObject is the
+	// handle accounting was enabled from, null always stops.
+	void stop(PFILE_OBJECT fileObject = nullptr);
+
+	// Probe hooks, see DriverProbes. The entry remembers the call's arguments in call, the return consumes them.
+	void onEntry(DriverProbes::Syscall syscall, uint32_t paramCount, const uint64_t* pArgs, uint32_t argCount, const uint64_t* pStackArgs, IoCall& call);
+	void onReturn(DriverProbes::Syscall syscall, NTSTATUS status, IoCall& call);
+private:
+	enum Counter : uint32_t {
+		Reads,
+		Writes,
+		ReadBytes,
+		WriteBytes,
+		ReadRequested,
+		WriteRequested,
+		Pending,
+		CounterCount,
+	};
+
+	typedef PerCpuCounters<CounterCount, 1024> Tables;   // key is the pid for the totals, the file object for a file
+	typedef MergedCounters<CounterCount, 8192> Rows;
+
+	// What a file key stands for
+	struct File {
+		File* next;
+		PFILE_OBJECT fileObject;   // referenced, the key
+		uint32_t pid;
+		uint32_t handle;
+		uint32_t lastSeen;     // m_epoch of its claim or of the last snapshot that had a row for it
+		bool named;            // path was queried, by a snapshot
+		wchar_t path[STP_IO_PATH_LENGTH];
+	};
+
+	static const uint32_t FileBuckets = 1024;          // power of two
+	static const uint32_t MaxFiles = 16 * 1024;
+	static const uint32_t MaxNameChars = 1024;
+
+	// pids are below 2^32, file objects are kernel addresses
+	static bool isFileKey(uint64_t key) {
+		return key > MAXULONG;
+	}
+
+	static uint32_t fileBucketOf(uint64_t key) {
+		return counterKeyHash(key) & (FileBuckets - 1);
+	}
+
+	// m_lock must be held
+	bool activate(PFILE_OBJECT fileObject);
+	void drain();
+
+	static void add(Tables::Slot* pSlot, bool isRead, uint64_t length, uint64_t transferred, bool pending);
+
+	// IRQL <= DISPATCH_LEVEL. Records a file that just claimed a slot, false if there's no room.
+	bool noteFile(PFILE_OBJECT fileObject, HANDLE handle);
+
+	// m_filesLock must be held
+	File* findFile(uint64_t key) const;
+
+	// m_lock must be held. Queries the paths of the first rowCount rows' files that have none yet
+	void nameFiles(uint32_t rowCount);
+
+	// PASSIVE_LEVEL. Frees the files last seen before epoch, every file if epoch is ~0
+	void evictFiles(uint32_t epoch);
+
+	volatile bool m_active;
+	PFILE_OBJECT m_owner;      // the handle whose first snapshot enabled accounting
+	Tables m_tables;
+	Rows m_rows;
+	uint64_t m_lastSnapshot;
+	File** m_files;
+	uint32_t m_fileCount;
+	uint32_t m_epoch;          // snapshots taken, under m_filesLock
+	KSPIN_LOCK m_filesLock;
+	FAST_MUTEX m_lock;         // acquired unsafe in a critical region, held at PASSIVE_LEVEL
+};
+
+extern IoCounters g_IoCounters;
@@ -32,21 +32,20 @@
 #if defined(ENABLE_LOG)
 
 #include "Logger.h"
+#include "RecordStream.h"
 #include <ntimage.h>
 #include <apiset.h>
  ///
  /// < Macros >
  ///
 
- // A size for log buffer in NonPagedPool. Two buffers are allocated with this
- // size. Exceeded logs are ignored silently. Make it bigger if a buffered log
- // size often reach this size.
+ // A default size for log buffer in NonPagedPool. Two buffers are allocated with
+ // this size. Exceeded logs are ignored silently. Make it bigger (LogSetBufferSize)
+ // if a buffered log size often reach this size.
 #define LOG_BUFFER_SIZE_IN_PAGES    (64UL)
-// An actual log buffer size in bytes.
-#define LOG_BUFFER_SIZE             (LOG_BUFFER_SIZE_IN_PAGES << PAGE_SHIFT)
 // A size that is usable for logging. Minus one because the last byte is kept for \0.
-#define LOG_BUFFER_USABLE_SIZE      (LOG_BUFFER_SIZE - 1)
-// An interval in milliseconds to flush buffered log entries into a log file.
+#define LOG_BUFFER_USABLE_SIZE(Info) ((Info)->LogBufferSize - 1)
+// A default interval in milliseconds to flush buffered log entries into a log file.
 #define LOG_FLUSH_INTERVAL          (50)
 
 ///
@@ -62,6 +61,8 @@ typedef struct _LOG_BUFFER_INFO
     volatile CHAR* LogBufferTail;
     CHAR* LogBuffer1;
     CHAR* LogBuffer2;
+    // Size of each buffer in bytes.
+    SIZE_T LogBufferSize;
     // Holds the biggest buffer usage to determine a necessary buffer size.
     SIZE_T LogMaxUsage;
     HANDLE LogFileHandle;
@@ -194,6 +195,13 @@ static PNT_FLUSH_BUFFERS_FILE NtFlushBuffersFile = NULL;
 
 static ULONG LogFlags = LogPutLevelDisable;
 static LOG_BUFFER_INFO LogBufferInfo = { 0 };
+static ULONG LogBufferSizeInPages = LOG_BUFFER_SIZE_IN_PAGES;
+static volatile ULONG LogFlushInterval = LOG_FLUSH_INTERVAL;
+
+// Held by LogpPut() while it touches LogBufferInfo, so LogInitialize() can tear
+// down and replace the buffers of a running log system. A zeroed EX_RUNDOWN_REF
+// is an initialized one.
+static EX_RUNDOWN_REF LogRundown = { 0 };
 
 /**
  * Log Implementation
@@ -207,6 +215,19 @@ LogInitialize(
 {
     NTSTATUS Status;
     BOOLEAN ReinitializeNeeded = FALSE;
+
+    //
+    // Re-initialization, e.g. a new log file or buffer size. Wait until no
+    // message is being put, then flush and release the current buffers.
+    //
+    if (LogBufferInfo.ResourceInitialized)
+    {
+        LogFlags = LogPutLevelDisable;
+        ExWaitForRundownProtectionRelease(&LogRundown);
+        LogpFinalizeBufferInfo(&LogBufferInfo);
+        ExReInitializeRundownProtection(&LogRundown);
+    }
+
     LogFlags = Flag;
 
     RtlZeroMemory(&LogBufferInfo, sizeof(LOG_BUFFER_INFO));
@@ -292,26 +313,27 @@ LogpInitializeBufferInfo(
     //
     // Allocate two log buffers as NonPagedPools.
     //
+    Info->LogBufferSize = (SIZE_T)LogBufferSizeInPages << PAGE_SHIFT;
     HighestAcceptableAddress.QuadPart = MAXUINT64;
-    Info->LogBuffer1 = (CHAR*)MmAllocateContiguousMemory(LOG_BUFFER_SIZE * 2,
+    Info->LogBuffer1 = (CHAR*)MmAllocateContiguousMemory(Info->LogBufferSize * 2,
         HighestAcceptableAddress);
     if (!Info->LogBuffer1)
     {
         LogpFinalizeBufferInfo(Info);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
-    Info->LogBuffer2 = Info->LogBuffer1 + LOG_BUFFER_SIZE;
+    Info->LogBuffer2 = Info->LogBuffer1 + Info->LogBufferSize;
 
     //
     // Initialize these buffers
     //
-    RtlFillMemory(Info->LogBuffer1, LOG_BUFFER_SIZE, 0xFFFFFFFF);  // for debugging
+    RtlFillMemory(Info->LogBuffer1, Info->LogBufferSize, 0xFFFFFFFF);  // for debugging
     Info->LogBuffer1[0] = '\0';
-    Info->LogBuffer1[LOG_BUFFER_SIZE - 1] = '\0';
+    Info->LogBuffer1[Info->LogBufferSize - 1] = '\0';
 
-    RtlFillMemory(Info->LogBuffer2, LOG_BUFFER_SIZE, 0xFFFFFFFF); // for debugging
+    RtlFillMemory(Info->LogBuffer2, Info->LogBufferSize, 0xFFFFFFFF); // for debugging
     Info->LogBuffer2[0] = '\0';
-    Info->LogBuffer2[LOG_BUFFER_SIZE - 1] = '\0';
+    Info->LogBuffer2[Info->LogBufferSize - 1] = '\0';
 
     //
     // Buffer should be used is LogBuffer1, and location should be written
@@ -436,7 +458,7 @@ LogpInitializeLogFile(
     //
     while (!Info->BufferFlushThreadStarted)
     {
-        Interval = RtlConvertLongToLargeInteger((INT32)(-10000 * LOG_FLUSH_INTERVAL));
+        Interval = RtlConvertLongToLargeInteger((INT32)(-10000 * (INT32)LogFlushInterval));
         KeDelayExecutionThread(KernelMode, FALSE, &Interval);
     }
 
@@ -480,6 +502,30 @@ LogpReinitializationRoutine(
     }
 }
 
+VOID
+LogSetFlags(
+    IN ULONG Flag
+)
+{
+    LogFlags = Flag;
+}
+
+VOID
+LogSetFlushInterval(
+    IN ULONG Milliseconds
+)
+{
+    LogFlushInterval = Milliseconds ? Milliseconds : 1;
+}
+
+VOID
+LogSetBufferSize(
+    IN ULONG Pages
+)
+{
+    LogBufferSizeInPages = Pages ? Pages : 1;
+}
+
 // Terminates the log functions without releasing resources.
 VOID
 LogIrpShutdownHandler(
@@ -504,7 +550,7 @@ LogIrpShutdownHandler(
     //
     while (LogBufferInfo.LogBufferHead[0])
     {
-        Interval = RtlConvertLongToLargeInteger((INT32)(-10000 * LOG_FLUSH_INTERVAL));
+        Interval = RtlConvertLongToLargeInteger((INT32)(-10000 * (INT32)LogFlushInterval));
         KeDelayExecutionThread(KernelMode, FALSE, &Interval);
     }
 }
@@ -520,7 +566,9 @@ LogDestroy(
 #endif
 
     LogFlags = LogPutLevelDisable;
+    ExWaitForRundownProtectionRelease(&LogRundown);
     LogpFinalizeBufferInfo(&LogBufferInfo);
+    ExReInitializeRundownProtection(&LogRundown);
 }
 
 // Terminates a log file related code.
@@ -548,6 +596,9 @@ LogpFinalizeBufferInfo(
 
         ZwClose(Info->BufferFlushThreadHandle);
         Info->BufferFlushThreadHandle = NULL;
+
+        // Write out whatever the thread didn't get to.
+        LogpFlushLogBuffer(Info);
     }
 
     // Clean up other things.
@@ -928,9 +979,10 @@ LogpPut(
     NTSTATUS Status = STATUS_SUCCESS;
 
     //
-    // Log the entry to a file or buffer.
+    // Log the entry to a file or buffer, unless LogInitialize() is replacing them.
     //
-    if (LogpIsLogFileEnabled(&LogBufferInfo))
+    BOOLEAN RundownAcquired = ExAcquireRundownProtection(&LogRundown);
+    if (RundownAcquired && LogpIsLogFileEnabled(&LogBufferInfo))
     {
 
         // Can it log it to a file now?
@@ -945,7 +997,7 @@ LogpPut(
 
                 // Yes, it can! Lets see if we can buffer it though for performance
                 auto UsedBufferSize = (SIZE_T)(LogBufferInfo.LogBufferTail - LogBufferInfo.LogBufferHead);
-                auto UsableSpaceLeft = UsedBufferSize > LOG_BUFFER_USABLE_SIZE ? 0 : LOG_BUFFER_USABLE_SIZE - UsedBufferSize;
+                auto UsableSpaceLeft = UsedBufferSize > LOG_BUFFER_USABLE_SIZE(&LogBufferInfo) ? 0 : LOG_BUFFER_USABLE_SIZE(&LogBufferInfo) - UsedBufferSize;
                 if (strlen(Message) + 1 <= UsableSpaceLeft) {
                     Status = LogpBufferMessage(Message, &LogBufferInfo);
                 } else {
@@ -963,10 +1015,21 @@ LogpPut(
         }
     }
 
+    if (RundownAcquired)
+    {
+        ExReleaseRundownProtection(&LogRundown);
+    }
+
     // Print to kernel debugger?
-    // if( KeGetCurrentIrql() < CLOCK_LEVEL) {
-    LogpDoDbgPrint(Message);
-    // }
+    if (LogFlags & LogOptEnableDbgPrint)
+    {
+        LogpDoDbgPrint(Message);
+    }
+
+    // Mirror to live stream clients
+    if (g_RecordStream.isActive() && KeGetCurrentIrql() <= DISPATCH_LEVEL) {
+        g_RecordStream.writeLog(Message);
+    }
 
     return Status;
 }
@@ -1131,7 +1194,7 @@ LogpBufferMessage(
     //
     UsedBufferSize = (SIZE_T)(Info->LogBufferTail - Info->LogBufferHead);
     Status = RtlStringCchCopyA((NTSTRSAFE_PSTR)Info->LogBufferTail,
-        LOG_BUFFER_USABLE_SIZE - UsedBufferSize,
+        LOG_BUFFER_USABLE_SIZE(Info) - UsedBufferSize,
         Message);
 
     //
@@ -1154,7 +1217,7 @@ LogpBufferMessage(
     else
     {
 
-        Info->LogMaxUsage = LOG_BUFFER_SIZE;  // Indicates overflow
+        Info->LogMaxUsage = Info->LogBufferSize;  // Indicates overflow
     }
 
     *Info->LogBufferTail = '\0';
@@ -1181,12 +1244,18 @@ LogpDoDbgPrint(
     IN CHAR* Message
 )
 {
-    UNREFERENCED_PARAMETER(Message);
-    /*size_t LocationOfCr;
-    LocationOfCr = strlen(Message) - 2;
-    Message[LocationOfCr] = '\n';
-    Message[LocationOfCr + 1] = '\0';
-    DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "%s", Message);*/
+    // The message is shared with the file and stream writers, convert a copy
+    CHAR Line[512];
+    SIZE_T Length = strnlen(Message, RTL_NUMBER_OF(Line) - 1);
+    RtlCopyMemory(Line, Message, Length);
+    if (Length >= 2 && Line[Length - 2] == '\r' && Line[Length - 1] == '\n')
+    {
+        Line[Length - 2] = '\n';
+        Length--;
+    }
+    Line[Length] = '\0';
+
+    DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "%s", Line);
 }
 
 // Returns true when a log file is enabled.
@@ -1280,9 +1349,9 @@ LogpBufferFlushThreadRoutine(
         }
 
         //
-        // Sleep the current thread's execution for LOG_FLUSH_INTERVAL milliseconds.
+        // Sleep the current thread's execution for LogFlushInterval milliseconds.
         //
-        Interval.QuadPart = -(LOG_FLUSH_INTERVAL * 1000 * 10);
+        Interval.QuadPart = -((LONGLONG)LogFlushInterval * 1000 * 10);
         KeDelayExecutionThread(KernelMode, FALSE, &Interval);
     }
 
@@ -183,7 +183,10 @@ typedef enum _LOG_LEVEL_OPTIONS
     LogOptDisableProcessorNumber = 0x400ul,
 
     // For LogInit(). Do not append to log file.
-    LogOptDisableAppend = 0x800ul
+    LogOptDisableAppend = 0x800ul,
+
+    // For LogInit(). Echo every message to the kernel debugger.
+    LogOptEnableDbgPrint = 0x1000ul
 } LOG_LEVEL_OPTIONS;
 
 #if defined(ENABLE_LOG)
@@ -217,6 +220,41 @@ LogInitialize(
     IN CONST WCHAR* LogFilePath OPTIONAL
 );
 
+/**
+ * Changes log levels and options of an initialized log system.
+ *
+ * @param[in] Flag  A OR-ed flag to control a log level and options
+ *
+ * Takes effect for the next message. LogOptDisableAppend only matters when a
+ * log file is opened, use LogInitialize() to switch files.
+ */
+VOID
+LogSetFlags(
+    IN ULONG Flag
+);
+
+/**
+ * Sets how often the flush thread writes buffered messages to the log file.
+ *
+ * @param[in] Milliseconds  Flush interval, takes effect after the current sleep
+ */
+VOID
+LogSetFlushInterval(
+    IN ULONG Milliseconds
+);
+
+/**
+ * Sets the size of each of the two log buffers.
+ *
+ * @param[in] Pages  Buffer size in pages
+ *
+ * Applies to the next LogInitialize() call.
+ */
+VOID
+LogSetBufferSize(
+    IN ULONG Pages
+);
+
 /**
  * Registers re-initialization.
  *
@@ -276,5 +314,8 @@ LogPrint(
     (void)LogFilePath
 
 #define LogDestroy() ((void)0)
+#define LogSetFlags(Flag) ((void)Flag)
+#define LogSetFlushInterval(Milliseconds) ((void)Milliseconds)
+#define LogSetBufferSize(Pages) ((void)Pages)
 
 #endif // ENABLE_LOG
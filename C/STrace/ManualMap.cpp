@@ -4,6 +4,7 @@
 #include "ManualMap.h"
 #include "Logger.h"
 #include "Constants.h"
+#include "NtStructs.h"
 
 /*
 Modified from: https://github.com/ItsJustMeChris/Manual-Mapper/blob/master/Heroin/needle.cpp
@@ -40,7 +41,6 @@ bool ManualMapper::loadImage(char* pBase) {
 	auto dosHeader = (IMAGE_DOS_HEADER*)pBase;
 	auto ntHeader = (IMAGE_NT_HEADERS64*)(pBase + dosHeader->e_lfanew);
 	auto pOptionalHeader = &ntHeader->OptionalHeader;
-	auto _DllMain = pOptionalHeader->AddressOfEntryPoint ? (tDllMain)(pBase + pOptionalHeader->AddressOfEntryPoint) : 0;
 
 	// I'm assuming this is signed, not sure?
 	int64_t dwDelta = (int64_t)(pBase - pOptionalHeader->ImageBase);
@@ -80,25 +80,6 @@ bool ManualMapper::loadImage(char* pBase) {
 		}
 	}
 
-	// Initialize security cookies (needed on drivers Win8+). They do a cmp against the constant in the header
-	if (pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG].VirtualAddress) {
-		uint64_t pCookie = 0;
-
-		switch (ntHeader->FileHeader.Machine)
-		case IMAGE_FILE_MACHINE_AMD64: {
-			pCookie = (uint64_t)(((IMAGE_LOAD_CONFIG_DIRECTORY64*)(pBase + pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG].VirtualAddress))->SecurityCookie);
-
-			//*(uint64_t*)pCookie = rand();
-			*(uint64_t*)pCookie = 0x1337;
-
-			// if we somehow hit default ++ it
-			if (*(uint64_t*)pCookie == 0x2B992DDFA232)
-				(*(uint64_t*)pCookie)++;
-
-			break;
-		}
-	}
-
 	// Walk imports
 	if (pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size) {
 		auto* pImportDescr = (IMAGE_IMPORT_DESCRIPTOR*)(pBase + pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress);
@@ -120,13 +101,8 @@ bool ManualMapper::loadImage(char* pBase) {
 				} else {
 					auto pImport = (IMAGE_IMPORT_BY_NAME*)(pBase + (*pThunkRef));
 					char* name = pImport->Name;
-					if (strcmp(szMod, "ntoskrnl.exe") == 0) {
-						ANSI_STRING name_ansi = {0};
-						UNICODE_STRING name_unicode = {0};
-
-						RtlInitAnsiString(&name_ansi, name);
-						RtlAnsiStringToUnicodeString(&name_unicode, &name_ansi, TRUE);
-						uint64_t pFn = (uint64_t)MmGetSystemRoutineAddress(&name_unicode);
+					if (_stricmp(szMod, "ntoskrnl.exe") == 0 || _stricmp(szMod, "hal.dll") == 0) {
+						uint64_t pFn = resolveKernelImport(szMod, name, ExportIndex::hashName(name));
 						if (!pFn) {
 							LOG_ERROR("[!] DLL Import %s from %s couldn't be found!...fatal\r\n", name, szMod);
 							*pFuncRef = 0;
@@ -134,7 +110,6 @@ bool ManualMapper::loadImage(char* pBase) {
 						} else {
 							*pFuncRef = pFn;
 						}
-						RtlFreeUnicodeString(&name_unicode);
 					} else {
 						LOG_ERROR("[!] DLL Imports %s from %s. Imports are not supported...fatal\r\n", name, szMod);
 						importsAtLeastOneBad = true;
@@ -148,6 +123,34 @@ bool ManualMapper::loadImage(char* pBase) {
 			return false;
 		}
 	}
+	return true;
+}
+
+// Everything after relocation and import resolution, shared by raw and prelinked images
+bool ManualMapper::initializeImage(char* pBase) {
+	auto dosHeader = (IMAGE_DOS_HEADER*)pBase;
+	auto ntHeader = (IMAGE_NT_HEADERS64*)(pBase + dosHeader->e_lfanew);
+	auto pOptionalHeader = &ntHeader->OptionalHeader;
+	auto _DllMain = pOptionalHeader->AddressOfEntryPoint ? (tDllMain)(pBase + pOptionalHeader->AddressOfEntryPoint) : 0;
+
+	// Initialize security cookies (needed on drivers Win8+). They do a cmp against the constant in the header
+	if (pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG].VirtualAddress) {
+		uint64_t pCookie = 0;
+
+		switch (ntHeader->FileHeader.Machine)
+		case IMAGE_FILE_MACHINE_AMD64: {
+			pCookie = (uint64_t)(((IMAGE_LOAD_CONFIG_DIRECTORY64*)(pBase + pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG].VirtualAddress))->SecurityCookie);
+
+			//*(uint64_t*)pCookie = rand();
+			*(uint64_t*)pCookie = 0x1337;
+
+			// if we somehow hit default ++ it
+			if (*(uint64_t*)pCookie == 0x2B992DDFA232)
+				(*(uint64_t*)pCookie)++;
+
+			break;
+		}
+	}
 
 	// Execute TLS
 	if (pOptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_TLS].Size) {
@@ -191,12 +194,31 @@ bool ManualMapper::validateImage(char* pBase) {
 	return true;
 }
 
+void ManualMapper::initialize() {
+	ExInitializeFastMutex(&m_streamLock);
+	ExInitializeFastMutex(&m_imageCacheLock);
+}
+
 uint64_t ManualMapper::mapImage(char* imageData, uint64_t imageSize) {
 	IMAGE_NT_HEADERS64* pOldNtHeader = nullptr;
 	IMAGE_OPTIONAL_HEADER64* pOldOptionalHeader = nullptr;
 	IMAGE_FILE_HEADER* pOldFileHeader = nullptr;
 	uint8_t* pTargetBase = nullptr;
 
+	// identical bytes were mapped before, skip straight to initialization
+	ContentHash contentHash;
+	Sha256 hash;
+	hash.update(imageData, imageSize);
+	hash.finish(contentHash.digest);
+	if (uint64_t cachedBase = mapCachedImage(contentHash, imageSize)) {
+		return cachedBase;
+	}
+
+	// STracePrelink output, the loader work was done offline
+	if (imageSize >= sizeof(PrelinkHeader) && ((PrelinkHeader*)imageData)->magic == STP_PRELINK_MAGIC) {
+		return mapPrelinkedImage(imageData, imageSize, contentHash);
+	}
+
 	// layout is DOS_HEADER -> DOS_STUB -> NTHDR
 	// 1. Ensure up to DOS_HEADER size
 	// 2. Ensure up to start of NTHDR + Size of nthdr
@@ -261,46 +283,559 @@ uint64_t ManualMapper::mapImage(char* imageData, uint64_t imageSize) {
 
 	if (!loadImage((char*)pTargetBase)) {
 		LOG_ERROR("[!] DLL Load Failed\r\n");
+		ExFreePoolWithTag(pTargetBase, DRIVER_POOL_TAG);
+		return NULL;
+	}
+
+	return finishImage(pTargetBase, contentHash, imageSize);
+}
+
+uint64_t ManualMapper::mapPrelinkedImage(char* imageData, uint64_t imageSize, const ContentHash& contentHash) {
+	auto pHeader = (PrelinkHeader*)imageData;
+	if (pHeader->version != STP_PRELINK_VERSION) {
+		LOG_ERROR("[!] Prelinked plugin version %d is not supported, re-run STracePrelink\r\n", pHeader->version);
+		return NULL;
+	}
+
+	// every section is bounds checked against the upload once here, the loops below trust it
+	const uint64_t imageOffset = sizeof(PrelinkHeader);
+	const uint64_t relocOffset = imageOffset + pHeader->sizeOfImage;
+	const uint64_t importOffset = relocOffset + pHeader->relocBytes;
+	if (pHeader->sizeOfImage < sizeof(IMAGE_DOS_HEADER) || importOffset + (uint64_t)pHeader->importCount * sizeof(PrelinkImport) > imageSize) {
+		LOG_ERROR("[!] Prelinked plugin appears truncated\r\n");
 		return NULL;
 	}
 
+	uint8_t* pTargetBase = (uint8_t*)ExAllocatePoolWithTag(NonPagedPoolExecute, pHeader->sizeOfImage, DRIVER_POOL_TAG);
+	if (!pTargetBase) {
+		LOG_ERROR("[!] Failed to allocate final mapped image memory at any address\r\n");
+		return NULL;
+	}
+
+	// one copy, sections are already at their RVAs
+	memcpy(pTargetBase, imageData + imageOffset, pHeader->sizeOfImage);
+	auto dosHeader = (IMAGE_DOS_HEADER*)pTargetBase;
+	if ((uint64_t)(uint32_t)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS64) > pHeader->sizeOfImage || !validateImage((char*)pTargetBase) ||
+		((IMAGE_NT_HEADERS64*)(pTargetBase + dosHeader->e_lfanew))->OptionalHeader.SizeOfImage != pHeader->sizeOfImage) {
+		LOG_ERROR("[!] Prelinked plugin headers don't match the prelink header\r\n");
+		ExFreePoolWithTag(pTargetBase, DRIVER_POOL_TAG);
+		return NULL;
+	}
+
+	// sizeOfImage was checked to hold at least the DOS header, none of these subtract below zero
+	const uint64_t lastSlot = pHeader->sizeOfImage - sizeof(uint64_t);
+	const int64_t delta = (int64_t)((uint64_t)pTargetBase - pHeader->preferredBase);
+	const uint8_t* pReloc = (uint8_t*)imageData + relocOffset;
+	const uint8_t* pRelocEnd = pReloc + pHeader->relocBytes;
+	uint64_t rva = 0;
+	for (uint32_t i = 0; i < pHeader->relocCount; i++) {
+		uint64_t rvaDelta = 0;
+		if (!StpReadRelocDelta(pReloc, pRelocEnd, rvaDelta) || rvaDelta > lastSlot || rva > lastSlot - rvaDelta) {
+			LOG_ERROR("[!] Prelinked relocation %d is malformed or outside the image...fatal\r\n", i);
+			ExFreePoolWithTag(pTargetBase, DRIVER_POOL_TAG);
+			return NULL;
+		}
+
+		rva += rvaDelta;
+		*(int64_t*)(pTargetBase + rva) += delta;
+	}
+
+	auto pImports = (PrelinkImport*)(imageData + importOffset);
+	bool importsAtLeastOneBad = false;
+	for (uint32_t i = 0; i < pHeader->importCount; i++) {
+		const PrelinkImport& import = pImports[i];
+
+		// the name is read in place, its terminator must be inside the image too
+		if (import.iatRva > lastSlot || import.nameRva >= pHeader->sizeOfImage ||
+			!memchr(pTargetBase + import.nameRva, 0, pHeader->sizeOfImage - import.nameRva)) {
+			LOG_ERROR("[!] Prelinked import %d is outside the image...fatal\r\n", i);
+			importsAtLeastOneBad = true;
+			continue;
+		}
+
+		const char* szMod = import.module == PrelinkModuleHal ? "hal.dll" : "ntoskrnl.exe";
+		const char* name = (const char*)pTargetBase + import.nameRva;
+		uint64_t pFn = resolveKernelImport(szMod, name, import.hash);
+		if (!pFn) {
+			LOG_ERROR("[!] DLL Import %s from %s couldn't be found!...fatal\r\n", name, szMod);
+			importsAtLeastOneBad = true;
+		}
+		*(uint64_t*)(pTargetBase + import.iatRva) = pFn;
+	}
+
+	if (importsAtLeastOneBad) {
+		LOG_ERROR("[!] DLL Load Failed\r\n");
+		ExFreePoolWithTag(pTargetBase, DRIVER_POOL_TAG);
+		return NULL;
+	}
+
+	return finishImage(pTargetBase, contentHash, imageSize);
+}
+
+// Snapshot the relocated, import resolved image for the cache then run its initializers
+uint64_t ManualMapper::finishImage(uint8_t* pTargetBase, const ContentHash& contentHash, uint64_t contentSize) {
+	// a previous plugin may have lived at this same address, don't let its cached exports leak into this one
+	if (m_exportCache.hModule == (uint64_t)pTargetBase) {
+		resetExportCache(0);
+	}
+
+	cacheImage(pTargetBase, contentHash, contentSize);
+	if (!initializeImage((char*)pTargetBase)) {
+		LOG_ERROR("[!] DLL Load Failed\r\n");
+		unmapImage((uint64_t)pTargetBase);
+		return NULL;
+	}
 	return (uint64_t)pTargetBase;
 }
 
-ManualMapper::ExportDirectoryPtrs ManualMapper::getExportDir(uint64_t hModule) {
-	ExportDirectoryPtrs exportPtrs;
-	exportPtrs.addressOfFunctions = nullptr;
-	exportPtrs.addressOfNameOrdinals = nullptr;
-	exportPtrs.addressOfNames = nullptr;
-	exportPtrs.exports = nullptr;
+uint64_t ManualMapper::mapCachedImage(const ContentHash& contentHash, uint64_t contentSize) {
+	// claimed under the lock, the initializers run without it like they do for a fresh image
+	uint8_t* image = nullptr;
+	ExAcquireFastMutex(&m_imageCacheLock);
+	for (uint32_t i = 0; i < ImageCacheSize; i++) {
+		CachedImage& entry = m_imageCache[i];
+		if (!entry.image || entry.inUse || entry.contentSize != contentSize ||
+			memcmp(entry.contentHash.digest, contentHash.digest, sizeof(contentHash.digest)) != 0)
+			continue;
+
+		entry.inUse = true;
+		entry.lastUse = ++m_imageCacheClock;
+		image = entry.image;
+		break;
+	}
+	ExReleaseFastMutex(&m_imageCacheLock);
+
+	if (!image)
+		return NULL;
+
+	LOG_INFO("[+] Reusing cached image at %I64X\r\n", (uint64_t)image);
+	if (!initializeImage((char*)image)) {
+		unmapImage((uint64_t)image);
+		return NULL;
+	}
+	return (uint64_t)image;
+}
+
+void ManualMapper::cacheImage(uint8_t* pTargetBase, const ContentHash& contentHash, uint64_t contentSize) {
+	// the snapshot is taken before the initializers run, nothing else can see this image yet
+	auto pNtHeader = (IMAGE_NT_HEADERS64*)(pTargetBase + ((IMAGE_DOS_HEADER*)pTargetBase)->e_lfanew);
+	const uint32_t sizeOfImage = pNtHeader->OptionalHeader.SizeOfImage;
+	uint8_t* pristine = (uint8_t*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeOfImage, DRIVER_POOL_TAG);
+	if (!pristine) {
+		// not fatal, the image just won't be reusable
+		return;
+	}
+	memcpy(pristine, pTargetBase, sizeOfImage);
+
+	// pick an empty slot, otherwise the least recently used image that isn't loaded right now
+	ExAcquireFastMutex(&m_imageCacheLock);
+	CachedImage* pSlot = nullptr;
+	for (uint32_t i = 0; i < ImageCacheSize; i++) {
+		CachedImage& entry = m_imageCache[i];
+		if (!entry.image) {
+			pSlot = &entry;
+			break;
+		}
 
-	IMAGE_DOS_HEADER* pDos = (IMAGE_DOS_HEADER*)hModule;
-	IMAGE_NT_HEADERS64* pNT = RVA2VA(IMAGE_NT_HEADERS64*, hModule, pDos->e_lfanew);
-	IMAGE_DATA_DIRECTORY* pDataDir = (IMAGE_DATA_DIRECTORY*)pNT->OptionalHeader.DataDirectory;
+		if (!entry.inUse && (!pSlot || entry.lastUse < pSlot->lastUse)) {
+			pSlot = &entry;
+		}
+	}
 
-	if (pDataDir[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress == NULL) {
-		return exportPtrs;
+	if (!pSlot) {
+		ExReleaseFastMutex(&m_imageCacheLock);
+		ExFreePoolWithTag(pristine, DRIVER_POOL_TAG);
+		return;
 	}
 
-	IMAGE_EXPORT_DIRECTORY* pExports = RVA2VA(IMAGE_EXPORT_DIRECTORY*, hModule, pDataDir[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
+	if (pSlot->image) {
+		ExFreePoolWithTag(pSlot->image, DRIVER_POOL_TAG);
+		ExFreePoolWithTag(pSlot->pristine, DRIVER_POOL_TAG);
+	}
+
+	pSlot->contentHash = contentHash;
+	pSlot->contentSize = contentSize;
+	pSlot->image = pTargetBase;
+	pSlot->pristine = pristine;
+	pSlot->sizeOfImage = sizeOfImage;
+	pSlot->inUse = true;
+	pSlot->lastUse = ++m_imageCacheClock;
+	ExReleaseFastMutex(&m_imageCacheLock);
+}
+
+void ManualMapper::unmapImage(uint64_t hModule) {
+	// restored before the entry is released, another load may claim it the moment inUse is cleared
+	ExAcquireFastMutex(&m_imageCacheLock);
+	for (uint32_t i = 0; i < ImageCacheSize; i++) {
+		CachedImage& entry = m_imageCache[i];
+		if ((uint64_t)entry.image == hModule && entry.inUse) {
+			// undo everything the cookie init, TLS callbacks, DllMain and the plugin itself wrote
+			memcpy(entry.image, entry.pristine, entry.sizeOfImage);
+			entry.inUse = false;
+			ExReleaseFastMutex(&m_imageCacheLock);
+			return;
+		}
+	}
+	ExReleaseFastMutex(&m_imageCacheLock);
+	ExFreePoolWithTag((char*)hModule, DRIVER_POOL_TAG);
+}
 
-	exportPtrs.addressOfFunctions = RVA2VA(uint32_t*, hModule, pExports->AddressOfFunctions);
-	exportPtrs.addressOfNames = RVA2VA(uint32_t*, hModule, pExports->AddressOfNames);
-	exportPtrs.addressOfNameOrdinals = RVA2VA(uint16_t*, hModule, pExports->AddressOfNameOrdinals);
-	exportPtrs.exports = pExports;
-	return exportPtrs;
+void ManualMapper::freeImageCache() {
+	ExAcquireFastMutex(&m_imageCacheLock);
+	for (uint32_t i = 0; i < ImageCacheSize; i++) {
+		CachedImage& entry = m_imageCache[i];
+		if (entry.image) {
+			ExFreePoolWithTag(entry.image, DRIVER_POOL_TAG);
+			ExFreePoolWithTag(entry.pristine, DRIVER_POOL_TAG);
+		}
+	}
+	memset(m_imageCache, 0, sizeof(m_imageCache));
+	ExReleaseFastMutex(&m_imageCacheLock);
+}
+
+bool ManualMapper::beginStreamedImage(PFILE_OBJECT fileObject, uint64_t fileSize) {
+	ExAcquireFastMutex(&m_streamLock);
+	if (m_stream.owner && m_stream.owner != fileObject) {
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] Another client is uploading a DLL\r\n");
+		return false;
+	}
+
+	// the same client starting over
+	resetStreamedImage();
+	if (fileSize < sizeof(IMAGE_DOS_HEADER)) {
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] DLL appears truncated\r\n");
+		return false;
+	}
+
+	// headers are almost always a single 0x400 file alignment, 64KB is plenty
+	m_stream.headersCapacity = (uint32_t)min(fileSize, 0x10000);
+	m_stream.headers = (uint8_t*)ExAllocatePoolWithTag(NonPagedPoolNx, m_stream.headersCapacity, DRIVER_POOL_TAG);
+	if (!m_stream.headers) {
+		resetStreamedImage();
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] Failed to allocate header staging memory\r\n");
+		return false;
+	}
+	m_stream.owner = fileObject;
+	m_stream.fileSize = fileSize;
+	m_stream.contentHash.reset();
+	ExReleaseFastMutex(&m_streamLock);
+	return true;
+}
+
+bool ManualMapper::stageStreamedHeaders(const char*& data, uint64_t& dataSize, bool& complete) {
+	// How much of the file makes up the headers is learned in steps: DOS header -> NT headers -> SizeOfHeaders
+	complete = false;
+	while (true) {
+		uint64_t needed = sizeof(IMAGE_DOS_HEADER);
+		if (m_stream.received >= needed) {
+			auto dosHeader = (IMAGE_DOS_HEADER*)m_stream.headers;
+			needed = (uint64_t)(uint32_t)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS64);
+			if (m_stream.received >= needed) {
+				needed = max(needed, ((IMAGE_NT_HEADERS64*)(m_stream.headers + dosHeader->e_lfanew))->OptionalHeader.SizeOfHeaders);
+			}
+		}
+
+		if (needed > m_stream.headersCapacity) {
+			LOG_ERROR("[!] DLL headers are truncated or too large\r\n");
+			return false;
+		}
+
+		if (m_stream.received >= needed) {
+			complete = true;
+			return true;
+		}
+
+		if (!dataSize)
+			return true;
+
+		uint64_t take = min(needed - m_stream.received, dataSize);
+		memcpy(m_stream.headers + m_stream.received, data, take);
+		m_stream.received += take;
+		data += take;
+		dataSize -= take;
+	}
+}
+
+bool ManualMapper::allocateStreamedImage() {
+	if (!validateImage((char*)m_stream.headers))
+		return false;
+
+	auto pNtHeader = (IMAGE_NT_HEADERS64*)(m_stream.headers + ((IMAGE_DOS_HEADER*)m_stream.headers)->e_lfanew);
+	if (pNtHeader->FileHeader.Machine != IMAGE_FILE_MACHINE_AMD64) {
+		LOG_ERROR("[!] Only 64Bit DLLs are supported\r\n");
+		return false;
+	}
+
+	if (pNtHeader->FileHeader.NumberOfSections <= 0) {
+		LOG_ERROR("[!] DLL has no sections, fatal\r\n");
+		return false;
+	}
+
+	// the section table must be inside the staged headers, and every section inside the image
+	const uint32_t sizeOfHeaders = pNtHeader->OptionalHeader.SizeOfHeaders;
+	const uint32_t sizeOfImage = pNtHeader->OptionalHeader.SizeOfImage;
+	auto* pSectionHeader = IMAGE_FIRST_SECTION(pNtHeader);
+	if ((uint8_t*)(pSectionHeader + pNtHeader->FileHeader.NumberOfSections) > m_stream.headers + sizeOfHeaders || sizeOfHeaders > sizeOfImage) {
+		LOG_ERROR("[!] DLL section table is malformed\r\n");
+		return false;
+	}
+
+	for (USHORT i = 0; i != pNtHeader->FileHeader.NumberOfSections; ++i, ++pSectionHeader) {
+		if ((uint64_t)pSectionHeader->VirtualAddress + pSectionHeader->SizeOfRawData > sizeOfImage) {
+			LOG_ERROR("[!] DLL section %d is outside of the image\r\n", i);
+			return false;
+		}
+	}
+
+	m_stream.image = (uint8_t*)ExAllocatePoolWithTag(NonPagedPoolExecute, sizeOfImage, DRIVER_POOL_TAG);
+	if (!m_stream.image) {
+		LOG_ERROR("[!] Failed to allocate final mapped image memory at any address\r\n");
+		return false;
+	}
+
+	// zeroed, the tail of a section past its raw data is never streamed
+	memset(m_stream.image, 0, sizeOfImage);
+	memcpy(m_stream.image, m_stream.headers, sizeOfHeaders);
+	m_stream.sizeOfImage = sizeOfImage;
+
+	ExFreePoolWithTag(m_stream.headers, DRIVER_POOL_TAG);
+	m_stream.headers = nullptr;
+	return true;
+}
+
+bool ManualMapper::appendStreamedImage(PFILE_OBJECT fileObject, uint64_t fileOffset, const char* data, uint64_t dataSize) {
+	ExAcquireFastMutex(&m_streamLock);
+	if (!m_stream.owner || m_stream.owner != fileObject) {
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] DLL upload chunk from a client that didn't begin the upload\r\n");
+		return false;
+	}
+
+	if (!m_stream.fileSize || fileOffset != m_stream.received || dataSize > m_stream.fileSize - fileOffset) {
+		resetStreamedImage();
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] DLL upload chunk at %I64X is out of order\r\n", fileOffset);
+		return false;
+	}
+
+	m_stream.contentHash.update(data, dataSize);
+	if (!m_stream.image) {
+		bool complete = false;
+		if (!stageStreamedHeaders(data, dataSize, complete) || (complete && !allocateStreamedImage())) {
+			resetStreamedImage();
+			ExReleaseFastMutex(&m_streamLock);
+			return false;
+		}
+
+		if (!complete) {
+			ExReleaseFastMutex(&m_streamLock);
+			return true;
+		}
+	}
+
+	// copy whatever parts of [offset, offset + size) belong to a section directly to its final address, the rest
+	// of the file (debug directory, overlay, ...) is never needed
+	const uint64_t chunkStart = m_stream.received;
+	const uint64_t chunkEnd = chunkStart + dataSize;
+	auto pNtHeader = (IMAGE_NT_HEADERS64*)(m_stream.image + ((IMAGE_DOS_HEADER*)m_stream.image)->e_lfanew);
+	auto* pSectionHeader = IMAGE_FIRST_SECTION(pNtHeader);
+	for (USHORT i = 0; i != pNtHeader->FileHeader.NumberOfSections; ++i, ++pSectionHeader) {
+		const uint64_t sectionStart = pSectionHeader->PointerToRawData;
+		const uint64_t sectionEnd = sectionStart + pSectionHeader->SizeOfRawData;
+		const uint64_t lo = max(chunkStart, sectionStart);
+		const uint64_t hi = min(chunkEnd, sectionEnd);
+		if (lo < hi) {
+			memcpy(m_stream.image + pSectionHeader->VirtualAddress + (lo - sectionStart), data + (lo - chunkStart), hi - lo);
+		}
+	}
+
+	m_stream.received = chunkEnd;
+	ExReleaseFastMutex(&m_streamLock);
+	return true;
+}
+
+uint64_t ManualMapper::commitStreamedImage(PFILE_OBJECT fileObject) {
+	ExAcquireFastMutex(&m_streamLock);
+	if (!m_stream.owner || m_stream.owner != fileObject) {
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] DLL commit from a client that didn't begin the upload\r\n");
+		return NULL;
+	}
+
+	if (!m_stream.fileSize || m_stream.received != m_stream.fileSize) {
+		resetStreamedImage();
+		ExReleaseFastMutex(&m_streamLock);
+		LOG_ERROR("[!] DLL appears truncated\r\n");
+		return NULL;
+	}
+
+	if (!m_stream.image) {
+		const char* none = nullptr;
+		uint64_t noneSize = 0;
+		bool complete = false;
+		if (!stageStreamedHeaders(none, noneSize, complete) || !complete || !allocateStreamedImage()) {
+			resetStreamedImage();
+			ExReleaseFastMutex(&m_streamLock);
+			return NULL;
+		}
+	}
+
+	// the image is ours from here, relocating and initializing it runs without the lock
+	ContentHash contentHash;
+	m_stream.contentHash.finish(contentHash.digest);
+	const uint64_t contentSize = m_stream.fileSize;
+	uint8_t* pTargetBase = m_stream.image;
+	m_stream.image = nullptr;
+	resetStreamedImage();
+	ExReleaseFastMutex(&m_streamLock);
+
+	// identical bytes were mapped before, the streamed copy isn't needed
+	if (uint64_t cachedBase = mapCachedImage(contentHash, contentSize)) {
+		ExFreePoolWithTag(pTargetBase, DRIVER_POOL_TAG);
+		return cachedBase;
+	}
+
+	if (!loadImage((char*)pTargetBase)) {
+		LOG_ERROR("[!] DLL Load Failed\r\n");
+		ExFreePoolWithTag(pTargetBase, DRIVER_POOL_TAG);
+		return NULL;
+	}
+
+	return finishImage(pTargetBase, contentHash, contentSize);
+}
+
+void ManualMapper::abortStreamedImage(PFILE_OBJECT fileObject) {
+	ExAcquireFastMutex(&m_streamLock);
+	if (!fileObject || m_stream.owner == fileObject) {
+		resetStreamedImage();
+	}
+	ExReleaseFastMutex(&m_streamLock);
+}
+
+// m_streamLock must be held
+void ManualMapper::resetStreamedImage() {
+	if (m_stream.headers) {
+		ExFreePoolWithTag(m_stream.headers, DRIVER_POOL_TAG);
+	}
+
+	if (m_stream.image) {
+		ExFreePoolWithTag(m_stream.image, DRIVER_POOL_TAG);
+	}
+	memset(&m_stream, 0, sizeof(m_stream));
+}
+
+void ManualMapper::resetExportCache(uint64_t hModule) {
+	if (m_exportCache.names.ciSortedNameIdxs) {
+		ExFreePoolWithTag(m_exportCache.names.ciSortedNameIdxs, DRIVER_POOL_TAG);
+	}
+	memset(&m_exportCache, 0, sizeof(m_exportCache));
+	m_exportCache.hModule = hModule;
+
+	// our own mapping, SizeOfImage is what was allocated for it
+	if (hModule) {
+		auto pNtHeader = RVA2VA(IMAGE_NT_HEADERS64*, hModule, ((IMAGE_DOS_HEADER*)hModule)->e_lfanew);
+		m_exportCache.hasExports = StpReadExportDirectory((const uint8_t*)hModule, pNtHeader->OptionalHeader.SizeOfImage, m_exportCache.exports);
+	}
 }
 
 uint64_t ManualMapper::getExport(uint64_t hModule, const char* procName) {
-	ExportDirectoryPtrs exportPtrs = getExportDir(hModule);
-	if (!exportPtrs.exports) {
+	if (m_exportCache.hModule != hModule) {
+		resetExportCache(hModule);
+	}
+
+	if (!m_exportCache.hasExports) {
+		return 0;
+	}
+
+	int64_t nameIdx = StpResolveExportName(m_exportCache.exports, m_exportCache.names, procName, [](uint32_t count) {
+		return (uint32_t*)ExAllocatePoolWithTag(NonPagedPoolNx, count * sizeof(uint32_t), DRIVER_POOL_TAG);
+	});
+	if (nameIdx < 0) {
 		return 0;
 	}
 
-	for (uint32_t i = 0; i < exportPtrs.exports->NumberOfNames; i++) {
-		char* exportName = RVA2VA(char*, hModule, exportPtrs.addressOfNames[i]);
-		if (_stricmp(exportName, procName) == 0)
-			return RVA2VA(uint64_t, hModule, exportPtrs.addressOfFunctions[i]);
+	// a plugin forwarding its callbacks elsewhere has nothing we could call
+	StpExport exp = StpExportAt(m_exportCache.exports, (uint32_t)nameIdx);
+	return exp.rva ? hModule + exp.rva : 0;
+}
+
+bool ManualMapper::buildKernelExportIndex() {
+	uint64_t ntoskrnlBase = 0;
+	uint32_t ntoskrnlSize = 0;
+	uint64_t halBase = 0;
+	uint32_t halSize = 0;
+
+	// ntoskrnl may be named ntkrnlmp.exe and friends, so find it by an address we know lives inside of it
+	const uint64_t knownNtoskrnlAddress = (uint64_t)&MmGetSystemRoutineAddress;
+	KphEnumerateSystemModules([&](PRTL_PROCESS_MODULES modules) {
+		for (size_t i = 0; i < modules->NumberOfModules; i++) {
+			auto& module = modules->Modules[i];
+			uint64_t base = (uint64_t)module.ImageBase;
+
+			if (knownNtoskrnlAddress >= base && knownNtoskrnlAddress < base + module.ImageSize) {
+				ntoskrnlBase = base;
+				ntoskrnlSize = module.ImageSize;
+			} else if (module.OffsetToFileName < sizeof(module.FullPathName) && _stricmp(&module.FullPathName[module.OffsetToFileName], "hal.dll") == 0) {
+				halBase = base;
+				halSize = module.ImageSize;
+			}
+		}
+	});
+
+	if (!ntoskrnlBase || !m_ntoskrnlExports.build(ntoskrnlBase, ntoskrnlSize)) {
+		LOG_ERROR("[!] Failed to index ntoskrnl exports, imports will fall back to MmGetSystemRoutineAddress\r\n");
+		return false;
+	}
+
+	// hal is optional, modern hals are mostly forwarders back into ntoskrnl anyways
+	if (halBase) {
+		m_halExports.build(halBase, halSize);
+	}
+	return true;
+}
+
+void ManualMapper::Destruct() {
+	abortStreamedImage(nullptr);
+	freeImageCache();
+	resetExportCache(0);
+	m_ntoskrnlExports.Destruct();
+	m_halExports.Destruct();
+}
+
+uint64_t ManualMapper::resolveKernelImport(const char* moduleName, const char* importName, uint32_t importHash) {
+	ExportIndex* pIndex = _stricmp(moduleName, "hal.dll") == 0 ? &m_halExports : &m_ntoskrnlExports;
+
+	ExportIndex::Export exp;
+	if (!pIndex->isBuilt() || !pIndex->lookup(importName, importHash, exp)) {
+		return getSystemRoutineAddress(importName);
+	}
+
+	if (exp.forwarder) {
+		// forwarders are "MODULE.Function", we only chase ones that land back in ntoskrnl
+		const char* dot = strchr(exp.forwarder, '.');
+		if (dot && (dot - exp.forwarder) == 8 && _strnicmp(exp.forwarder, "ntoskrnl", 8) == 0 && m_ntoskrnlExports.lookup(dot + 1, exp) && exp.address) {
+			return exp.address;
+		}
+		return getSystemRoutineAddress(importName);
+	}
+	return exp.address;
+}
+
+// Slow path for anything the index can't answer. Still allocation free, the name is widened into a stack buffer
+uint64_t ManualMapper::getSystemRoutineAddress(const char* routineName) {
+	WCHAR nameBuffer[256] = { 0 };
+
+	ANSI_STRING name_ansi = { 0 };
+	UNICODE_STRING name_unicode = { 0 };
+	name_unicode.Buffer = nameBuffer;
+	name_unicode.MaximumLength = sizeof(nameBuffer);
+
+	RtlInitAnsiString(&name_ansi, routineName);
+	if (!NT_SUCCESS(RtlAnsiStringToUnicodeString(&name_unicode, &name_ansi, FALSE))) {
+		return 0;
 	}
-	return 0;
+	return (uint64_t)MmGetSystemRoutineAddress(&name_unicode);
 }
\ No newline at end of file
@@ -3,24 +3,109 @@
 #define WIN32_LEAN_AND_MEAN
 #include <ntimage.h>
 #include "MyStdint.h"
+#include "ExportIndex.h"
+#include "Sha256.h"
 
 #define RVA2VA(type, base, rva) (type)((ULONG_PTR) base + rva)
 
 class ManualMapper {
 public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
 	uint64_t mapImage(char* imageData, uint64_t imageSize);
+
+	/*
+	Streamed alternative to mapImage for raw DLLs. The file is pushed in order with appendStreamedImage, the headers are
+	staged until SizeOfHeaders is known, after that the final image is allocated and every chunk is copied straight
+	into the section(s) it overlaps. Any failure aborts the upload, commit relocates/imports/initializes and returns
+	the base just like mapImage does.
+
+	There is one upload at a time and it belongs to the handle (fileObject) that began it, every other handle's append,
+	commit or abort is refused and a begin from one fails while it's in progress. PASSIVE_LEVEL.
+	*/
+	bool beginStreamedImage(PFILE_OBJECT fileObject, uint64_t fileSize);
+	bool appendStreamedImage(PFILE_OBJECT fileObject, uint64_t fileOffset, const char* data, uint64_t dataSize);
+	uint64_t commitStreamedImage(PFILE_OBJECT fileObject);
+
+	// fileObject's upload if it has one, null aborts any
+	void abortStreamedImage(PFILE_OBJECT fileObject);
 	uint64_t getExport(uint64_t hModule,const char* procName);
+
+	// Release an image returned by mapImage/commitStreamedImage. Cached images are reset to pristine and kept for reuse
+	void unmapImage(uint64_t hModule);
+
+	// Index the exports of the kernel modules plugins may import from. Done once, must be called at PASSIVE_LEVEL
+	bool buildKernelExportIndex();
+	void Destruct();
 private:
-	struct ExportDirectoryPtrs {
-		uint32_t* addressOfFunctions;
-		uint32_t* addressOfNames;
-		uint16_t* addressOfNameOrdinals;
-		IMAGE_EXPORT_DIRECTORY* exports;
+	// Name lookups for the image most recently queried with getExport, see StpExportCache
+	struct ImageExportCache {
+		uint64_t hModule;
+		bool hasExports;
+		StpExportDirectory exports;
+		StpExportCache names;
+	};
+
+	// SHA-256 of the uploaded bytes, keys the image cache
+	struct ContentHash {
+		uint8_t digest[Sha256::DigestSize];
+	};
+
+	struct StreamedImage {
+		PFILE_OBJECT owner;   // the handle that began the upload, null while there's none
+		uint64_t fileSize;
+		uint64_t received;
+		uint8_t* headers;     // staging for [0, SizeOfHeaders), freed once the image is allocated
+		uint32_t headersCapacity;
+		uint8_t* image;
+		uint32_t sizeOfImage;
+		Sha256 contentHash;
 	};
 
-	ExportDirectoryPtrs getExportDir(uint64_t moduleBase);
+	/*
+	Images whose relocations and imports are done but that were never initialized, keyed by a hash of the uploaded bytes.
+	Unloading a cached plugin copies the pristine snapshot back over it in place, so mapping the same bytes again only
+	re-runs initializeImage at the same address. Least recently used entries that aren't loaded are evicted.
+
+	Loads aren't serialized by the IOCTL handlers, m_imageCacheLock covers every lookup, claim, eviction and restore.
+	An entry is claimed (inUse) under it before its initializers run, so two loads of the same bytes never both
+	initialize one image and an image that's being mapped can't be evicted.
+	*/
+	struct CachedImage {
+		ContentHash contentHash;
+		uint64_t contentSize;
+		uint8_t* image;
+		uint8_t* pristine;
+		uint32_t sizeOfImage;
+		bool inUse;
+		uint64_t lastUse;
+	};
+	static const uint32_t ImageCacheSize = 4;
+
+	void resetExportCache(uint64_t hModule);
 	bool loadImage(char* imageBase);
+	bool initializeImage(char* imageBase);
+	uint64_t finishImage(uint8_t* imageBase, const ContentHash& contentHash, uint64_t contentSize);
+	uint64_t mapCachedImage(const ContentHash& contentHash, uint64_t contentSize);
+	void cacheImage(uint8_t* imageBase, const ContentHash& contentHash, uint64_t contentSize);
+	void freeImageCache();
+	uint64_t mapPrelinkedImage(char* imageData, uint64_t imageSize, const ContentHash& contentHash);
 	bool validateImage(char* imageBase);
+	bool stageStreamedHeaders(const char*& data, uint64_t& dataSize, bool& complete);
+	bool allocateStreamedImage();
+	void resetStreamedImage();
+	uint64_t resolveKernelImport(const char* moduleName, const char* importName, uint32_t importHash);
+	uint64_t getSystemRoutineAddress(const char* routineName);
+
+	ExportIndex m_ntoskrnlExports;
+	ExportIndex m_halExports;
+	ImageExportCache m_exportCache = {};
+	StreamedImage m_stream = {};
+	FAST_MUTEX m_streamLock;      // m_stream
+	FAST_MUTEX m_imageCacheLock;  // m_imageCache, m_imageCacheClock
+	CachedImage m_imageCache[ImageCacheSize] = {};
+	uint64_t m_imageCacheClock = 0;
 };
 
 typedef bool(__stdcall* tDllMain)(char* hDll, uint32_t dwReason, char* pReserved);
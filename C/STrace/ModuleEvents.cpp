@@ -0,0 +1,149 @@
+#include "ModuleEvents.h"
+#include <ntimage.h>
+#include "Constants.h"
+#include "DynamicTrace.h"
+#include "NtStructs.h"
+#include "RecordStream.h"
+
+ModuleEvents g_ModuleEvents;
+
+void ModuleEvents::initialize() {
+	m_notifyRegistered = false;
+
+	// without it only the kernel modules of a reader's first read are reported
+	if (NT_SUCCESS(PsSetLoadImageNotifyRoutine(&ModuleEvents::loadImageNotify))) {
+		m_notifyRegistered = true;
+	}
+}
+
+void ModuleEvents::Destruct() {
+	if (m_notifyRegistered) {
+		PsRemoveLoadImageNotifyRoutine(&ModuleEvents::loadImageNotify);
+		m_notifyRegistered = false;
+	}
+}
+
+void ModuleEvents::loadImageNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo) {
+	if (!g_RecordStream.isActive() || !ImageInfo) {
+		return;
+	}
+
+	StpModuleRecord record = {};
+	record.pid = ImageInfo->SystemModeImage ? 0 : HandleToULong(ProcessId);
+	record.flags = ImageInfo->SystemModeImage ? StpModuleFlagKernel : 0;
+	record.base = (uint64_t)ImageInfo->ImageBase;
+	record.size = (uint64_t)ImageInfo->ImageSize;
+
+	// a path too long for the record keeps its end, the file name matters most
+	char path[STP_MODULE_MAX_PATH] = { 0 };
+	if (FullImageName && FullImageName->Buffer && FullImageName->Length) {
+		const ULONG maxChars = (STP_MODULE_MAX_PATH - 1) / 3;    // at most 3 bytes of UTF-8 per UTF-16 unit
+		ULONG chars = FullImageName->Length / sizeof(WCHAR);
+		PCWCH pChars = FullImageName->Buffer;
+		if (chars > maxChars) {
+			pChars += chars - maxChars;
+			chars = maxChars;
+		}
+
+		ULONG bytes = 0;
+		if (!NT_SUCCESS(RtlUnicodeToUTF8N(path, STP_MODULE_MAX_PATH - 1, &bytes, pChars, chars * sizeof(WCHAR)))) {
+			bytes = 0;
+		}
+		path[bytes] = 0;
+	}
+
+	write(record, path);
+}
+
+void ModuleEvents::writeKernelModules() {
+	KphEnumerateSystemModules([](PRTL_PROCESS_MODULES modules) {
+		for (ULONG i = 0; i < modules->NumberOfModules; i++) {
+			const RTL_PROCESS_MODULE_INFORMATION& module = modules->Modules[i];
+
+			StpModuleRecord record = {};
+			record.flags = StpModuleFlagKernel | StpModuleFlagSnapshot;
+			record.base = (uint64_t)module.ImageBase;
+			record.size = (uint64_t)module.ImageSize;
+
+			char path[sizeof(module.FullPathName) + 1];
+			memcpy(path, module.FullPathName, sizeof(module.FullPathName));
+			path[sizeof(module.FullPathName)] = 0;
+			write(record, path);
+		}
+	});
+}
+
+void ModuleEvents::write(StpModuleRecord& record, const char* path) {
+	if (!readIdentity(record)) {
+		record.flags |= StpModuleFlagNoIdentity;
+		record.timeDateStamp = 0;
+		record.pdbAge = 0;
+		memset(record.pdbGuid, 0, sizeof(record.pdbGuid));
+	}
+	g_RecordStream.writeModule(record, path);
+}
+
+bool ModuleEvents::readImage(const StpModuleRecord& record, uint64_t offset, void* pOut, uint32_t size) {
+	if (offset >= record.size || size > record.size - offset) {
+		return false;
+	}
+
+	// a kernel fault isn't caught, only read pages that are there
+	const uint64_t address = record.base + offset;
+	if (address >= (uint64_t)MmSystemRangeStart && (!MmIsAddressValid((PVOID)address) || !MmIsAddressValid((PVOID)(address + size - 1)))) {
+		return false;
+	}
+	return TraceAccessMemory(pOut, (ULONG_PTR)address, size, 1, TRUE) != FALSE;
+}
+
+bool ModuleEvents::readIdentity(StpModuleRecord& record) {
+	IMAGE_DOS_HEADER dos;
+	if (!readImage(record, 0, &dos, sizeof(dos)) || dos.e_magic != IMAGE_DOS_SIGNATURE) {
+		return false;
+	}
+
+	// PE32 and PE32+ agree up to the optional header's magic
+	union {
+		IMAGE_NT_HEADERS32 nt32;
+		IMAGE_NT_HEADERS64 nt64;
+	} nt;
+	const uint64_t ntOffset = (uint32_t)dos.e_lfanew;
+	if (!readImage(record, ntOffset, &nt.nt32, sizeof(nt.nt32)) || nt.nt32.Signature != IMAGE_NT_SIGNATURE) {
+		return false;
+	}
+	record.timeDateStamp = nt.nt32.FileHeader.TimeDateStamp;
+
+	IMAGE_DATA_DIRECTORY debug = { 0 };
+	if (nt.nt32.OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+		record.flags |= StpModuleFlag32Bit;
+		if (nt.nt32.OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_DEBUG) {
+			debug = nt.nt32.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+		}
+	} else if (nt.nt32.OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+		if (readImage(record, ntOffset, &nt.nt64, sizeof(nt.nt64)) && nt.nt64.OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_DEBUG) {
+			debug = nt.nt64.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+		}
+	}
+
+	// an image without a PDB still has its timestamp
+	uint32_t entries = debug.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+	entries = entries < MaxDebugEntries ? entries : MaxDebugEntries;
+	for (uint32_t i = 0; debug.VirtualAddress && i < entries; i++) {
+		IMAGE_DEBUG_DIRECTORY entry;
+		if (!readImage(record, (uint64_t)debug.VirtualAddress + i * sizeof(entry), &entry, sizeof(entry))) {
+			break;
+		}
+
+		if (entry.Type != IMAGE_DEBUG_TYPE_CODEVIEW || !entry.AddressOfRawData || entry.SizeOfData < sizeof(CodeViewRsds)) {
+			continue;
+		}
+
+		CodeViewRsds codeView;
+		if (readImage(record, entry.AddressOfRawData, &codeView, sizeof(codeView)) && codeView.signature == RsdsSignature) {
+			memcpy(record.pdbGuid, codeView.guid, sizeof(record.pdbGuid));
+			record.pdbAge = codeView.age;
+			break;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "RecordFormat.h"
+
+/*
+Module loads for offline symbolication, see StpModuleRecord. Every image mapped while a stream reader is attached,
+user or kernel, is written with its base, size, PE timestamp and the CodeView GUID and age of its PDB, and a reader
+that attaches gets every loaded kernel module first. With STraceCLI config raw-stacks=on the probes then skip the
+module enumeration of every captured stack and the stream carries raw return addresses instead, which the reader maps
+back to module + offset itself.
+
+A process's user modules are only known if they were mapped after the reader attached, start the stream before the
+process of interest. There's no notification for unloads.
+*/
+class ModuleEvents {
+public:
+	// Must be called from DriverEntry before any other member. Registers the image load notification
+	void initialize();
+
+	// DeviceUnload, before the record stream goes away
+	void Destruct();
+
+	// PASSIVE_LEVEL, a reader attached
+	void writeKernelModules();
+private:
+	static const uint32_t MaxDebugEntries = 16;
+	static const uint32_t RsdsSignature = 0x53445352; // 'RSDS'
+
+	struct CodeViewRsds {
+		uint32_t signature;
+		uint8_t guid[16];
+		uint32_t age;
+	};
+
+	static void loadImageNotify(PUNICODE_STRING FullImageName, HANDLE ProcessId, PIMAGE_INFO ImageInfo);
+
+	// Fills the timestamp and PDB fields from the mapped image's headers, false if they couldn't be read
+	static bool readIdentity(StpModuleRecord& record);
+	static bool readImage(const StpModuleRecord& record, uint64_t offset, void* pOut, uint32_t size);
+	static void write(StpModuleRecord& record, const char* path);
+
+	bool m_notifyRegistered;
+};
+
+extern ModuleEvents g_ModuleEvents;
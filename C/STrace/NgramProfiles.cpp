@@ -0,0 +1,213 @@
+#include "NgramProfiles.h"
+#include "Constants.h"
+#include "Logger.h"
+#include "RecordStream.h"
+#include "ThreadVars.h"
+
+NgramProfiles g_NgramProfiles;
+
+static const char HistoryVarName[] = "$ngrams";
+
+void NgramProfiles::initialize() {
+	m_active = false;
+	m_hasHistory = false;
+	m_historyOffset = 0;
+	m_generation = 0;
+	m_tables.initialize();
+	m_rows.initialize();
+	ExInitializeFastMutex(&m_lock);
+	ExInitializeFastMutex(&m_controlLock);
+}
+
+void NgramProfiles::Destruct() {
+	stop();
+	m_tables.Destruct();
+	m_rows.Destruct();
+}
+
+NTSTATUS NgramProfiles::start() {
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_active) {
+		ExReleaseFastMutex(&m_controlLock);
+		return STATUS_SUCCESS;
+	}
+
+	// the tables outlive a stop, a probe may still be counting into them
+	ExAcquireFastMutex(&m_lock);
+	// every start counts from zero
+	if (!m_tables.reset() || !m_rows.reset()) {
+		ExReleaseFastMutex(&m_lock);
+		ExReleaseFastMutex(&m_controlLock);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	ExReleaseFastMutex(&m_lock);
+
+	// histories written before this start are stale
+	m_generation++;
+	m_active = true;
+	ExReleaseFastMutex(&m_controlLock);
+	return STATUS_SUCCESS;
+}
+
+void NgramProfiles::stop() {
+	ExAcquireFastMutex(&m_controlLock);
+	m_active = false;
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+void NgramProfiles::registerHistory() {
+	uint32_t offset = 0;
+	NTSTATUS status = g_ThreadVars.registerVar(HistoryVarName, sizeof(History), 4, &offset);
+	if (!NT_SUCCESS(status)) {
+		LOG_WARN("[!] No thread variable for syscall n-grams 0x%08X, they won't be counted\r\n", status);
+		return;
+	}
+
+	m_historyOffset = offset;
+	m_hasHistory = true;
+}
+
+void NgramProfiles::resetHistory() {
+	m_hasHistory = false;
+	m_historyOffset = 0;
+}
+
+void NgramProfiles::onProcessExit(HANDLE ProcessId) {
+	if (m_active) {
+		flushProcess(HandleToULong(ProcessId));
+	}
+}
+
+void NgramProfiles::add(uint64_t key) {
+	if (Tables::Slot* pSlot = m_tables.slotFor(key)) {
+		InterlockedIncrement64(&pSlot->counts[0]);
+	}
+}
+
+void NgramProfiles::onEntry(uint32_t probeId) {
+	if (!m_active || !m_hasHistory || ExGetPreviousMode() != UserMode) {
+		return;
+	}
+
+	uint8_t* pVars = g_ThreadVars.current();
+	if (!pVars) {
+		return;
+	}
+
+	History& history = *(History*)(pVars + m_historyOffset);
+	const uint32_t generation = m_generation;
+	if (history.generation != generation) {
+		history.generation = generation;
+		history.length = 0;
+	}
+
+	const uint32_t probe = probeId < STP_NGRAM_OTHER_PROBE ? probeId : STP_NGRAM_OTHER_PROBE;
+	const uint32_t processId = HandleToULong(PsGetCurrentProcessId());
+	if (history.length >= 1) {
+		add(keyOf(processId, 2, history.probes[1], probe, 0));
+	}
+
+	if (history.length >= 2) {
+		add(keyOf(processId, 3, history.probes[0], history.probes[1], probe));
+	}
+
+	history.probes[0] = history.probes[1];
+	history.probes[1] = (uint16_t)probe;
+	if (history.length < STP_NGRAM_MAX_N - 1) {
+		history.length++;
+	}
+}
+
+void NgramProfiles::gramOf(uint64_t key, StpNgram& gram) {
+	const uint32_t mask = (1u << ProbeBits) - 1;
+	gram.n = (uint16_t)((key >> (3 * ProbeBits)) & 3);
+	gram.probes[0] = (uint16_t)((key >> (2 * ProbeBits)) & mask);
+	gram.probes[1] = (uint16_t)((key >> ProbeBits) & mask);
+	gram.probes[2] = (uint16_t)(key & mask);
+}
+
+// m_lock must be held
+void NgramProfiles::drain() {
+	m_tables.drain([this](uint64_t key, const uint64_t* counts) {
+		if (!m_rows.merge(key, counts)) {
+			m_tables.addOverflow(counts[0]);
+		}
+	});
+}
+
+void NgramProfiles::flushProcess(uint32_t processId) {
+	ExAcquireFastMutex(&m_lock);
+	if (!m_tables.isAllocated() || !m_rows.isAllocated()) {
+		ExReleaseFastMutex(&m_lock);
+		return;
+	}
+
+	drain();
+
+	// the process's rows go to the record stream and are dropped, the others keep their order
+	uint32_t batched = 0;
+	bool written = false;
+	for (uint32_t i = 0; i < m_rows.count(); i++) {
+		const Rows::Row& row = m_rows.at(i);
+		if ((uint32_t)(row.key >> 32) != processId)
+			continue;
+
+		StpNgram& gram = m_batch[batched++];
+		gramOf(row.key, gram);
+		gram.count = row.counts[0];
+		if (batched == STP_NGRAM_RECORD_GRAMS) {
+			g_RecordStream.writeNgrams(processId, m_batch, batched, false);
+			batched = 0;
+			written = true;
+		}
+	}
+
+	if (batched || written) {
+		g_RecordStream.writeNgrams(processId, m_batch, batched, true);
+		m_rows.removeIf([processId](const Rows::Row& row) {
+			return (uint32_t)(row.key >> 32) == processId;
+		});
+	}
+	ExReleaseFastMutex(&m_lock);
+}
+
+NTSTATUS NgramProfiles::snapshot(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const uint32_t outSize = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outSize < sizeof(StpNgramHeader) || !Irp->MdlAddress) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pOut) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	StpNgramHeader header = { 0 };
+	header.active = m_active ? 1 : 0;
+
+	ExAcquireFastMutex(&m_lock);
+	if (m_tables.isAllocated() && m_rows.isAllocated()) {
+		drain();
+
+		const uint32_t maxRows = (outSize - sizeof(header)) / sizeof(StpNgramRow);
+		header.totalRows = m_rows.count();
+		header.rowCount = header.totalRows < maxRows ? header.totalRows : maxRows;
+		header.overflow = m_tables.overflow();
+
+		auto pRows = (StpNgramRow*)(pOut + sizeof(header));
+		for (uint32_t i = 0; i < header.rowCount; i++) {
+			StpNgramRow row = { 0 };
+			const Rows::Row& merged = m_rows.at(i);
+			row.pid = (uint32_t)(merged.key >> 32);
+			gramOf(merged.key, row.gram);
+			row.gram.count = merged.counts[0];
+			memcpy(&pRows[i], &row, sizeof(row));
+		}
+	}
+	ExReleaseFastMutex(&m_lock);
+
+	memcpy(pOut, &header, sizeof(header));
+	Irp->IoStatus.Information = sizeof(header) + header.rowCount * sizeof(StpNgramRow);
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "RecordFormat.h"
+#include "PerCpuCounters.h"
+
+/*
+Syscall sequence profiles for triage: bigram and trigram counts of probe ids per process, kept while STraceCLI config
+ngrams=on. Every user mode call that reaches a probe, in any process, extends its thread's history and bumps two
+counters, the gram ending in the previous call and the one ending in the two before it. Nothing is recorded per call.
+
+The history is a driver owned thread variable ("$ngrams"), TLSData only lives as long as one call. Thread variables
+only exist while a plugin is loaded, as do the probes worth counting, so grams are counted only then. A history left
+from before n-grams were last turned on is discarded on its thread's next call.
+
+The per-CPU counters are keyed by (pid, n, probes), IOCTL_GET_NGRAMS and process exit drain them into the cumulative
+rows. When a process exits its grams are written to the
+record stream and dropped, which costs a pass over every CPU's table per exiting process.
+*/
+class NgramProfiles {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// PASSIVE_LEVEL
+	NTSTATUS start();
+	void stop();
+
+	// PASSIVE_LEVEL. Plugin load, before the thread variable layout is sealed, and plugin unload
+	void registerHistory();
+	void resetHistory();
+
+	// IRQL <= DISPATCH_LEVEL, every call that isn't one of the driver's own probes
+	void onEntry(uint32_t probeId);
+
+	// PASSIVE_LEVEL, the driver's process notify
+	void onProcessExit(HANDLE ProcessId);
+
+	// IOCTL_GET_NGRAMS, PASSIVE_LEVEL
+	NTSTATUS snapshot(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+private:
+	// The last probes of one thread, oldest first
+	struct History {
+		uint32_t generation;     // m_generation when this was written
+		uint16_t length;
+		uint16_t probes[STP_NGRAM_MAX_N - 1];
+	};
+
+	typedef PerCpuCounters<1, 4096> Tables;   // key is keyOf
+	typedef MergedCounters<1, 16384> Rows;
+
+	static const uint32_t ProbeBits = 10;              // fits STP_NGRAM_OTHER_PROBE
+
+	static uint64_t keyOf(uint32_t processId, uint32_t n, uint32_t a, uint32_t b, uint32_t c) {
+		return ((uint64_t)processId << 32) | ((uint64_t)n << (3 * ProbeBits)) | ((uint64_t)a << (2 * ProbeBits)) | ((uint64_t)b << ProbeBits) | c;
+	}
+
+	static void gramOf(uint64_t key, StpNgram& gram);
+
+	// m_lock must be held
+	void drain();
+	void flushProcess(uint32_t processId);
+
+	void add(uint64_t key);
+
+	volatile bool m_active;
+	volatile bool m_hasHistory;
+	uint32_t m_historyOffset;
+	volatile uint32_t m_generation;
+	Tables m_tables;
+	Rows m_rows;
+	StpNgram m_batch[STP_NGRAM_RECORD_GRAMS];    // one exiting process's record, under m_lock
+	FAST_MUTEX m_lock;         // tables and rows
+	FAST_MUTEX m_controlLock;  // start and stop
+};
+
+extern NgramProfiles g_NgramProfiles;
@@ -0,0 +1,313 @@
+#pragma once
+
+// Export directory parsing and lookups, shared by the driver (ExportIndex, ManualMapper::getExport) and the host side
+// tests. Like PrelinkFormat.h only fixed width types are used and the includer provides them together with memset,
+// memchr and strcmp, so this must stay free of any windows or kernel headers.
+#include "PrelinkFormat.h"
+
+#define STP_DOS_SIGNATURE   0x5A4D     // MZ
+#define STP_NT_SIGNATURE    0x4550     // PE\0\0
+#define STP_PE32PLUS_MAGIC  0x20B
+
+/*
+The export directory of an image mapped at its RVAs. StpReadExportDirectory checks every table and name it points
+to lies inside of [image, image + imageSize), after that nothing here bounds checks again.
+*/
+struct StpExportDirectory {
+	const uint8_t* image;
+	uint32_t imageSize;
+
+	// function rvas within [start, end) are forwarder strings ("MODULE.Function") rather than code
+	uint32_t start;
+	uint32_t end;
+
+	uint32_t numberOfFunctions;
+	uint32_t numberOfNames;
+	const uint32_t* functions;
+	const uint32_t* names;      // sorted by strcmp, the linker emits them that way for the loader's binary search
+	const uint16_t* nameOrdinals;
+};
+
+struct StpExport {
+	uint32_t rva;            // zero if the export is a forwarder
+	const char* forwarder;   // "MODULE.Function", or null
+};
+
+inline uint16_t StpRead16(const uint8_t* p) {
+	uint16_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+inline uint32_t StpRead32(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// False if the image has no export directory or any part of it is malformed
+inline bool StpReadExportDirectory(const uint8_t* image, uint32_t imageSize, StpExportDirectory& dir) {
+	memset(&dir, 0, sizeof(dir));
+	if (imageSize < 0x40 || StpRead16(image) != STP_DOS_SIGNATURE)
+		return false;
+
+	// NT signature, file header and the optional header up to and including the export data directory
+	const uint64_t ntOffset = StpRead32(image + 0x3C);
+	const uint64_t optionalHeader = ntOffset + 4 + 20;
+	if (optionalHeader + 0x78 > imageSize || StpRead32(image + ntOffset) != STP_NT_SIGNATURE ||
+		StpRead16(image + optionalHeader) != STP_PE32PLUS_MAGIC || !StpRead32(image + optionalHeader + 0x6C))
+		return false;
+
+	const uint32_t rva = StpRead32(image + optionalHeader + 0x70);
+	const uint32_t size = StpRead32(image + optionalHeader + 0x74);
+	if (!rva || (uint64_t)rva + size > imageSize || (uint64_t)rva + 40 > imageSize)
+		return false;
+
+	const uint8_t* pExports = image + rva;
+	const uint32_t numberOfFunctions = StpRead32(pExports + 20);
+	const uint32_t numberOfNames = StpRead32(pExports + 24);
+	const uint32_t functionsRva = StpRead32(pExports + 28);
+	const uint32_t namesRva = StpRead32(pExports + 32);
+	const uint32_t nameOrdinalsRva = StpRead32(pExports + 36);
+	if ((uint64_t)functionsRva + (uint64_t)numberOfFunctions * sizeof(uint32_t) > imageSize ||
+		(uint64_t)namesRva + (uint64_t)numberOfNames * sizeof(uint32_t) > imageSize ||
+		(uint64_t)nameOrdinalsRva + (uint64_t)numberOfNames * sizeof(uint16_t) > imageSize)
+		return false;
+
+	const uint32_t* names = (const uint32_t*)(image + namesRva);
+	const uint16_t* nameOrdinals = (const uint16_t*)(image + nameOrdinalsRva);
+	for (uint32_t i = 0; i < numberOfNames; i++) {
+		if (nameOrdinals[i] >= numberOfFunctions || names[i] >= imageSize || !memchr(image + names[i], 0, imageSize - names[i]))
+			return false;
+	}
+
+	dir.image = image;
+	dir.imageSize = imageSize;
+	dir.start = rva;
+	dir.end = rva + size;
+	dir.numberOfFunctions = numberOfFunctions;
+	dir.numberOfNames = numberOfNames;
+	dir.functions = (const uint32_t*)(image + functionsRva);
+	dir.names = names;
+	dir.nameOrdinals = nameOrdinals;
+	return true;
+}
+
+inline const char* StpExportName(const StpExportDirectory& dir, uint32_t nameIdx) {
+	return (const char*)dir.image + dir.names[nameIdx];
+}
+
+// What the nameIdx-th name exports, names index the ordinal table which is what indexes the function table
+inline StpExport StpExportAt(const StpExportDirectory& dir, uint32_t nameIdx) {
+	StpExport result = { dir.functions[dir.nameOrdinals[nameIdx]], nullptr };
+
+	// the forwarder string lives inside the directory, so it's inside the image, but its terminator may not be
+	if (result.rva >= dir.start && result.rva < dir.end) {
+		if (memchr(dir.image + result.rva, 0, dir.imageSize - result.rva)) {
+			result.forwarder = (const char*)dir.image + result.rva;
+		}
+		result.rva = 0;
+	}
+	return result;
+}
+
+/*
+Open addressed hash table over the names of an export directory, ExportIndex's storage. Linear probing, sized to a
+power of two at least twice the number of names. Only RVAs are stored, names are compared in place.
+*/
+struct StpExportEntry {
+	uint32_t hash;
+	uint32_t nameRva;     // zero marks an empty slot, a real name can never live at rva 0 (the DOS header)
+	uint32_t nameIdx;
+};
+
+inline uint32_t StpExportTableSize(const StpExportDirectory& dir) {
+	uint32_t tableSize = 16;
+	while (tableSize < (uint64_t)dir.numberOfNames * 2) {
+		tableSize <<= 1;
+	}
+	return tableSize;
+}
+
+// entries must hold StpExportTableSize(dir) zeroed slots
+inline void StpFillExportTable(const StpExportDirectory& dir, StpExportEntry* entries, uint32_t tableSize) {
+	const uint32_t mask = tableSize - 1;
+	for (uint32_t i = 0; i < dir.numberOfNames; i++) {
+		if (!dir.names[i])
+			continue;
+
+		const uint32_t hash = StpHashExportName(StpExportName(dir, i));
+		uint32_t slot = hash & mask;
+		while (entries[slot].nameRva) {
+			slot = (slot + 1) & mask;
+		}
+
+		entries[slot].hash = hash;
+		entries[slot].nameRva = dir.names[i];
+		entries[slot].nameIdx = i;
+	}
+}
+
+// Case sensitive, hash is StpHashExportName(name). Null if the name isn't exported
+inline const StpExportEntry* StpProbeExportTable(const StpExportDirectory& dir, const StpExportEntry* entries, uint32_t tableSize,
+	const char* name, uint32_t hash) {
+	const uint32_t mask = tableSize - 1;
+	for (uint32_t slot = hash & mask; entries[slot].nameRva; slot = (slot + 1) & mask) {
+		const StpExportEntry& entry = entries[slot];
+		if (entry.hash == hash && strcmp((const char*)dir.image + entry.nameRva, name) == 0)
+			return &entry;
+	}
+	return nullptr;
+}
+
+// ASCII case folding, the same order _stricmp sorts in
+inline uint8_t StpFoldCase(uint8_t c) {
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+inline int StpCompareNameCi(const char* a, const char* b) {
+	for (;; a++, b++) {
+		const uint8_t ca = StpFoldCase((uint8_t)*a);
+		const uint8_t cb = StpFoldCase((uint8_t)*b);
+		if (ca != cb || !ca)
+			return (int)ca - (int)cb;
+	}
+}
+
+// StpHashExportName of the case folded name
+inline uint32_t StpHashExportNameCi(const char* name) {
+	uint64_t hash = 14695981039346656037ull;
+	for (; *name; name++) {
+		hash = (hash ^ StpFoldCase((uint8_t)*name)) * 1099511628211ull;
+	}
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Binary search for an exact match, -1 if there is none
+inline int64_t StpFindExportName(const StpExportDirectory& dir, const char* name) {
+	int64_t lo = 0;
+	int64_t hi = (int64_t)dir.numberOfNames - 1;
+	while (lo <= hi) {
+		const int64_t mid = lo + (hi - lo) / 2;
+		const int cmp = strcmp(StpExportName(dir, (uint32_t)mid), name);
+		if (cmp == 0)
+			return mid;
+
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return -1;
+}
+
+// Fills idxs with every name index sorted case-insensitively. True if no two names are equal ignoring case
+inline bool StpSortExportNamesCi(const StpExportDirectory& dir, uint32_t* idxs) {
+	const uint32_t count = dir.numberOfNames;
+	for (uint32_t i = 0; i < count; i++) {
+		idxs[i] = i;
+	}
+
+	// shell sort, there's no qsort with a context argument in the kernel and export counts are small
+	for (uint32_t gap = count / 2; gap > 0; gap /= 2) {
+		for (uint32_t i = gap; i < count; i++) {
+			const uint32_t tmp = idxs[i];
+			const char* tmpName = StpExportName(dir, tmp);
+
+			uint32_t j = i;
+			for (; j >= gap && StpCompareNameCi(StpExportName(dir, idxs[j - gap]), tmpName) > 0; j -= gap) {
+				idxs[j] = idxs[j - gap];
+			}
+			idxs[j] = tmp;
+		}
+	}
+
+	for (uint32_t i = 1; i < count; i++) {
+		if (StpCompareNameCi(StpExportName(dir, idxs[i - 1]), StpExportName(dir, idxs[i])) == 0)
+			return false;
+	}
+	return true;
+}
+
+// Binary search over idxs as sorted by StpSortExportNamesCi, -1 if no name matches ignoring case
+inline int64_t StpFindExportNameCi(const StpExportDirectory& dir, const uint32_t* idxs, const char* name) {
+	int64_t lo = 0;
+	int64_t hi = (int64_t)dir.numberOfNames - 1;
+	while (lo <= hi) {
+		const int64_t mid = lo + (hi - lo) / 2;
+		const int cmp = StpCompareNameCi(StpExportName(dir, idxs[mid]), name);
+		if (cmp == 0)
+			return idxs[mid];
+
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return -1;
+}
+
+/*
+Name lookups of one image, what ManualMapper::getExport keeps for the image it was last asked about. Exact matches
+are binary searched, callers have always been allowed to differ in case so a miss falls back to a case-insensitively
+sorted copy of the name indices, built on the first miss.
+
+Resolved names are remembered, keyed by the case folded name so a query that only differs in case hits too. That's
+only right if the image has no two names that are equal ignoring case, otherwise a case-insensitive hit could hide an
+exact match, so until the sorted copy proves there are none (or if there are) a hit must match exactly.
+*/
+struct StpExportCache {
+	struct Resolved {
+		uint32_t hash;      // StpHashExportNameCi
+		uint32_t nameIdx;
+	};
+
+	uint32_t* ciSortedNameIdxs;   // owned by the includer, who also frees it
+	bool ciUnique;
+	Resolved resolved[8];
+	uint32_t resolvedCount;
+};
+
+// allocateIdxs(count) returns room for count uint32_t or null. Returns the name index, -1 if name isn't exported
+template<typename AllocateIdxs>
+inline int64_t StpResolveExportName(const StpExportDirectory& dir, StpExportCache& cache, const char* name, AllocateIdxs allocateIdxs) {
+	const uint32_t hash = StpHashExportNameCi(name);
+	const bool anyCase = cache.ciSortedNameIdxs && cache.ciUnique;
+	for (uint32_t i = 0; i < cache.resolvedCount; i++) {
+		const auto& resolved = cache.resolved[i];
+		if (resolved.hash != hash)
+			continue;
+
+		const char* exportName = StpExportName(dir, resolved.nameIdx);
+		if (anyCase ? StpCompareNameCi(exportName, name) == 0 : strcmp(exportName, name) == 0)
+			return resolved.nameIdx;
+	}
+
+	int64_t nameIdx = StpFindExportName(dir, name);
+	if (nameIdx < 0) {
+		if (!cache.ciSortedNameIdxs) {
+			cache.ciSortedNameIdxs = dir.numberOfNames ? allocateIdxs(dir.numberOfNames) : nullptr;
+			if (!cache.ciSortedNameIdxs)
+				return -1;
+
+			cache.ciUnique = StpSortExportNamesCi(dir, cache.ciSortedNameIdxs);
+		}
+
+		nameIdx = StpFindExportNameCi(dir, cache.ciSortedNameIdxs, name);
+		if (nameIdx < 0)
+			return -1;
+	}
+
+	// a case-insensitive hit on a name that's already cached (as an exact one) doesn't need a second slot
+	for (uint32_t i = 0; i < cache.resolvedCount; i++) {
+		if (cache.resolved[i].nameIdx == (uint32_t)nameIdx)
+			return nameIdx;
+	}
+
+	if (cache.resolvedCount < sizeof(cache.resolved) / sizeof(cache.resolved[0])) {
+		cache.resolved[cache.resolvedCount++] = { hash, (uint32_t)nameIdx };
+	}
+	return nameIdx;
+}
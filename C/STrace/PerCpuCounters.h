@@ -0,0 +1,310 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "Constants.h"
+
+// fibonacci hashing, pids, handles and probe ids are all far from uniform in their low bits
+inline uint32_t counterKeyHash(uint64_t key) {
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/*
+Counter tables for SyscallCounters, IoCounters and NgramProfiles. Every CPU owns an open addressing table of
+SlotsPerCpu slots keyed by a 64 bit key, a probe only touches the table of the CPU it runs on so the counters stay in
+that CPU's cache and no lock is taken. A thread can still be preempted and migrate mid update, slots are therefore
+claimed and bumped with interlocked ops, which are uncontended and cheap on a line the CPU already owns.
+
+Anything but slotFor and the counts is up to the owner to serialize, at PASSIVE_LEVEL.
+*/
+template<uint32_t CounterCount, uint32_t SlotsPerCpu>
+class PerCpuCounters {
+public:
+	static_assert((SlotsPerCpu & (SlotsPerCpu - 1)) == 0, "SlotsPerCpu must be a power of two");
+
+	struct Slot {
+		volatile LONG64 key;   // EmptyKey until claimed
+		volatile LONG64 counts[CounterCount];
+	};
+
+	static const uint32_t MaxProbe = 16;       // linear probing gives up after this many slots
+	static const LONG64 EmptyKey = -1;
+
+	void initialize() {
+		m_tables = nullptr;
+		m_cpuCount = 0;
+		m_overflow = 0;
+	}
+
+	void Destruct() {
+		if (m_tables) {
+			ExFreePoolWithTag(m_tables, DRIVER_POOL_TAG);
+			m_tables = nullptr;
+		}
+	}
+
+	bool isAllocated() const {
+		return m_tables != nullptr;
+	}
+
+	// Empties every slot and the overflow count, the tables are allocated on first use. False if they couldn't be.
+	bool reset() {
+		if (!m_tables) {
+			m_cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+			m_tables = (Slot*)ExAllocatePoolWithTag(NonPagedPoolNx, (SIZE_T)m_cpuCount * SlotsPerCpu * sizeof(Slot), DRIVER_POOL_TAG);
+			if (!m_tables)
+				return false;
+		}
+
+		for (uint32_t i = 0; i < m_cpuCount * SlotsPerCpu; i++) {
+			m_tables[i].key = EmptyKey;
+			for (uint32_t c = 0; c < CounterCount; c++) {
+				m_tables[i].counts[c] = 0;
+			}
+		}
+		m_overflow = 0;
+		return true;
+	}
+
+	// IRQL <= DISPATCH_LEVEL. key's slot in the current CPU's table, claimed if it has none, claimed (optional) is set
+	// then. Null, and counted as one overflow, if the CPU has no table or the key's probe window is full.
+	Slot* slotFor(uint64_t key, bool* claimed = nullptr) {
+		const uint32_t cpu = KeGetCurrentProcessorNumberEx(nullptr);
+		if (!m_tables || cpu >= m_cpuCount)
+			return nullptr;
+
+		Slot* pTable = m_tables + (SIZE_T)cpu * SlotsPerCpu;
+		const uint32_t start = counterKeyHash(key);
+		for (uint32_t i = 0; i < MaxProbe; i++) {
+			Slot* pSlot = &pTable[(start + i) & (SlotsPerCpu - 1)];
+			LONG64 current = pSlot->key;
+			if (current == (LONG64)key)
+				return pSlot;
+
+			if (current == EmptyKey) {
+				// a migrated thread may race us for the same slot
+				current = InterlockedCompareExchange64(&pSlot->key, (LONG64)key, EmptyKey);
+				if (current == EmptyKey && claimed) {
+					*claimed = true;
+				}
+
+				if (current == EmptyKey || current == (LONG64)key)
+					return pSlot;
+			}
+		}
+
+		InterlockedIncrement64(&m_overflow);
+		return nullptr;
+	}
+
+	// Gives back a slot slotFor just claimed and nothing was counted in yet
+	void release(Slot* pSlot, uint64_t key) {
+		InterlockedCompareExchange64(&pSlot->key, EmptyKey, (LONG64)key);
+	}
+
+	// Calls fn(key, counts) for every claimed slot. The counts are read while probes keep counting, each value is
+	// consistent on its own.
+	template<typename Fn>
+	void forEach(Fn fn) const {
+		for (uint32_t i = 0; m_tables && i < m_cpuCount * SlotsPerCpu; i++) {
+			const Slot& slot = m_tables[i];
+			const LONG64 key = slot.key;
+			if (key == EmptyKey)
+				continue;
+
+			uint64_t counts[CounterCount];
+			for (uint32_t c = 0; c < CounterCount; c++) {
+				counts[c] = (uint64_t)slot.counts[c];
+			}
+			fn((uint64_t)key, (const uint64_t*)counts);
+		}
+	}
+
+	// Swaps every slot's counts with 0 and calls fn(key, counts) for those that had any. A slot that had none since
+	// the previous drain is given back, a call racing that can land its counts on whichever key takes the slot next.
+	template<typename Fn>
+	void drain(Fn fn) {
+		for (uint32_t i = 0; m_tables && i < m_cpuCount * SlotsPerCpu; i++) {
+			Slot& slot = m_tables[i];
+			const LONG64 key = slot.key;
+			if (key == EmptyKey)
+				continue;
+
+			uint64_t counts[CounterCount];
+			bool idle = true;
+			for (uint32_t c = 0; c < CounterCount; c++) {
+				counts[c] = (uint64_t)InterlockedExchange64(&slot.counts[c], 0);
+				idle &= counts[c] == 0;
+			}
+
+			if (idle) {
+				InterlockedCompareExchange64(&slot.key, EmptyKey, key);
+				continue;
+			}
+			fn((uint64_t)key, (const uint64_t*)counts);
+		}
+	}
+
+	// Empties every slot whose key fn(key) returns true for. Only for keys nothing counts into any more, such as an
+	// exited process's, a call still counting would have its slot taken from under it.
+	template<typename Fn>
+	void removeIf(Fn fn) {
+		for (uint32_t i = 0; m_tables && i < m_cpuCount * SlotsPerCpu; i++) {
+			Slot& slot = m_tables[i];
+			const LONG64 key = slot.key;
+			if (key == EmptyKey || !fn((uint64_t)key))
+				continue;
+
+			for (uint32_t c = 0; c < CounterCount; c++) {
+				InterlockedExchange64(&slot.counts[c], 0);
+			}
+			InterlockedCompareExchange64(&slot.key, EmptyKey, key);
+		}
+	}
+
+	uint64_t overflow() const {
+		return (uint64_t)m_overflow;
+	}
+
+	// counts lost after leaving the tables, e.g. to a full merged table
+	void addOverflow(uint64_t count) {
+		InterlockedAdd64(&m_overflow, (LONG64)count);
+	}
+
+	uint64_t takeOverflow() {
+		return (uint64_t)InterlockedExchange64(&m_overflow, 0);
+	}
+private:
+	Slot* m_tables;
+	uint32_t m_cpuCount;
+	volatile LONG64 m_overflow;
+};
+
+/*
+The cumulative side of IoCounters and NgramProfiles, what drained per-CPU counts are merged into. Rows are kept in
+order of first appearance with an open addressing index over them, so a snapshot can hand out a prefix and keep the
+rest. Owner's lock, PASSIVE_LEVEL.
+*/
+template<uint32_t CounterCount, uint32_t MaxRows>
+class MergedCounters {
+public:
+	struct Row {
+		uint64_t key;
+		uint64_t counts[CounterCount];
+	};
+
+	void initialize() {
+		m_rows = nullptr;
+		m_rowCount = 0;
+		m_rowIndex = nullptr;
+	}
+
+	void Destruct() {
+		if (m_rows) {
+			ExFreePoolWithTag(m_rows, DRIVER_POOL_TAG);
+			m_rows = nullptr;
+		}
+
+		if (m_rowIndex) {
+			ExFreePoolWithTag(m_rowIndex, DRIVER_POOL_TAG);
+			m_rowIndex = nullptr;
+		}
+	}
+
+	bool isAllocated() const {
+		return m_rows && m_rowIndex;
+	}
+
+	// Drops every row, the rows are allocated on first use. False if they couldn't be.
+	bool reset() {
+		if (!m_rows) {
+			m_rows = (Row*)ExAllocatePoolWithTag(NonPagedPoolNx, MaxRows * sizeof(Row), DRIVER_POOL_TAG);
+		}
+
+		if (!m_rowIndex) {
+			m_rowIndex = (uint32_t*)ExAllocatePoolWithTag(NonPagedPoolNx, RowIndexSize * sizeof(uint32_t), DRIVER_POOL_TAG);
+		}
+
+		if (!isAllocated())
+			return false;
+
+		m_rowCount = 0;
+		rebuildIndex();
+		return true;
+	}
+
+	uint32_t count() const {
+		return m_rowCount;
+	}
+
+	const Row& at(uint32_t row) const {
+		return m_rows[row];
+	}
+
+	// Adds counts to key's row. False if key is new and there's no room for it.
+	bool merge(uint64_t key, const uint64_t* counts) {
+		// never full, it has twice as many entries as there can be rows
+		uint32_t h = hashOf(key);
+		for (; m_rowIndex[h]; h = (h + 1) & (RowIndexSize - 1)) {
+			Row& row = m_rows[m_rowIndex[h] - 1];
+			if (row.key == key) {
+				for (uint32_t c = 0; c < CounterCount; c++) {
+					row.counts[c] += counts[c];
+				}
+				return true;
+			}
+		}
+
+		if (m_rowCount == MaxRows)
+			return false;
+
+		Row& row = m_rows[m_rowCount];
+		row.key = key;
+		memcpy(row.counts, counts, sizeof(row.counts));
+		m_rowIndex[h] = ++m_rowCount;
+		return true;
+	}
+
+	// Drops the first count rows, the ones a snapshot handed out
+	void removeFirst(uint32_t count) {
+		m_rowCount -= count;
+		memmove(m_rows, m_rows + count, m_rowCount * sizeof(Row));
+		rebuildIndex();
+	}
+
+	// Drops every row fn(row) returns true for, the others keep their order
+	template<typename Fn>
+	void removeIf(Fn fn) {
+		uint32_t kept = 0;
+		for (uint32_t i = 0; i < m_rowCount; i++) {
+			if (!fn((const Row&)m_rows[i])) {
+				m_rows[kept++] = m_rows[i];
+			}
+		}
+
+		if (kept != m_rowCount) {
+			m_rowCount = kept;
+			rebuildIndex();
+		}
+	}
+private:
+	static const uint32_t RowIndexSize = 2 * MaxRows;
+
+	static uint32_t hashOf(uint64_t key) {
+		return counterKeyHash(key) & (RowIndexSize - 1);
+	}
+
+	void rebuildIndex() {
+		memset(m_rowIndex, 0, RowIndexSize * sizeof(uint32_t));
+		for (uint32_t row = 0; row < m_rowCount; row++) {
+			uint32_t h = hashOf(m_rows[row].key);
+			while (m_rowIndex[h]) {
+				h = (h + 1) & (RowIndexSize - 1);
+			}
+			m_rowIndex[h] = row + 1;
+		}
+	}
+
+	Row* m_rows;
+	uint32_t m_rowCount;
+	uint32_t* m_rowIndex;      // open addressing over m_rows, row + 1, 0 is empty
+};
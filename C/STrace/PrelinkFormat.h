@@ -0,0 +1,74 @@
+#pragma once
+
+// Shared between the driver and the host side STracePrelink tool. Only fixed width types are used and the includer
+// is responsible for providing them (MyStdint.h in the driver, <cstdint> on the host), so this must stay free of any
+// windows or kernel headers.
+
+/*
+A prelinked plugin is a plugin DLL that STracePrelink has already done all the position independent loader work for.
+IOCTL_LOADDLL accepts it exactly like a raw DLL, the driver recognizes it by the magic at offset zero.
+
+File layout, packed back to back:
+	PrelinkHeader
+	uint8_t       image[sizeOfImage]     headers and sections already laid out at their RVAs, as if mapped at preferredBase
+	uint8_t       relocs[relocBytes]     ULEB128 deltas between successive IMAGE_REL_BASED_DIR64 sites, ascending, first from rva 0
+	PrelinkImport imports[importCount]   sorted by (module, hash)
+
+The PE headers are kept inside of image so export lookup, the load config cookie, TLS callbacks and DllMain still work
+unchanged. Loading is a single copy, a tight relocation loop and one hash probe per import.
+*/
+#define STP_PRELINK_MAGIC   0x4B4C5053 // 'SPLK'
+#define STP_PRELINK_VERSION 1
+
+enum PrelinkModule : uint32_t {
+	PrelinkModuleNtoskrnl = 0,
+	PrelinkModuleHal = 1,
+};
+
+#pragma pack(push, 1)
+struct PrelinkHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t preferredBase;
+	uint32_t sizeOfImage;
+	uint32_t relocCount;
+	uint32_t relocBytes;
+	uint32_t importCount;
+};
+
+struct PrelinkImport {
+	uint32_t module;   // PrelinkModule
+	uint32_t hash;     // StpHashExportName of the import name
+	uint32_t nameRva;  // IMAGE_IMPORT_BY_NAME::Name inside image, for the slow path and error messages
+	uint32_t iatRva;   // 8 byte IAT slot the resolved address is written to
+};
+#pragma pack(pop)
+
+// FNV-1a, folded to 32bits. This is the export hash the driver's ExportIndex is keyed by, so it must never change
+// without bumping STP_PRELINK_VERSION.
+inline uint32_t StpHashExportName(const char* name) {
+	uint64_t hash = 14695981039346656037ull;
+	for (; *name; name++) {
+		hash = (hash ^ (uint8_t)*name) * 1099511628211ull;
+	}
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Decodes the next relocation delta and advances pReloc. False if the stream ends before the delta does or the delta
+// doesn't fit 64 bits, the image must then be rejected.
+inline bool StpReadRelocDelta(const uint8_t*& pReloc, const uint8_t* pRelocEnd, uint64_t& delta) {
+	delta = 0;
+	for (uint32_t shift = 0; shift < 64; shift += 7) {
+		if (pReloc == pRelocEnd)
+			return false;
+
+		const uint8_t byte = *pReloc++;
+		if (shift == 63 && (byte & 0x7E))
+			return false;
+
+		delta |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,181 @@
+#include "ProcessCache.h"
+#include "Constants.h"
+
+ProcessCache g_ProcessCache;
+
+const ProcessIdentity* LookupProcessIdentity() {
+	return g_ProcessCache.current();
+}
+
+void ProcessCache::initialize() {
+	m_entryCount = 0;
+	m_lock = 0;
+
+	// without either CallerInfo keeps querying the process itself
+	m_buckets = (Entry**)ExAllocatePoolWithTag(NonPagedPoolNx, BucketCount * sizeof(Entry*), DRIVER_POOL_TAG);
+	if (!m_buckets) {
+		return;
+	}
+	memset(m_buckets, 0, BucketCount * sizeof(Entry*));
+}
+
+void ProcessCache::Destruct() {
+	freeAll();
+
+	if (m_buckets) {
+		ExFreePoolWithTag(m_buckets, DRIVER_POOL_TAG);
+		m_buckets = nullptr;
+	}
+}
+
+void ProcessCache::onProcessExit(HANDLE ProcessId) {
+	// records are built on first sight, a process that never hits a probe costs nothing
+	remove(ProcessId);
+}
+
+const ProcessIdentity* ProcessCache::current() {
+	if (!m_buckets) {
+		return nullptr;
+	}
+
+	PEPROCESS process = IoThreadToProcess(PsGetCurrentThread());
+	const ProcessIdentity* pIdentity = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	for (Entry* pEntry = m_buckets[bucketOf(process)]; pEntry; pEntry = pEntry->next) {
+		if (pEntry->process == process) {
+			pIdentity = &pEntry->identity;
+			break;
+		}
+	}
+	ExReleaseSpinLockShared(&m_lock, irql);
+
+	// the image path can only be looked up at PASSIVE_LEVEL
+	if (pIdentity || KeGetCurrentIrql() != PASSIVE_LEVEL) {
+		return pIdentity;
+	}
+
+	// the last thread still makes calls after the exit notification ran, a record added then would outlive the process
+	if (PsGetProcessExitProcessCalled(process)) {
+		return nullptr;
+	}
+
+	Entry* pEntry = build(process);
+	return pEntry ? insert(pEntry) : nullptr;
+}
+
+// PASSIVE_LEVEL
+ProcessCache::Entry* ProcessCache::build(PEPROCESS process) {
+	auto pEntry = (Entry*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Entry), DRIVER_POOL_TAG);
+	if (!pEntry) {
+		return nullptr;
+	}
+	memset(pEntry, 0, sizeof(Entry));
+	pEntry->process = process;
+
+	ProcessIdentity& identity = pEntry->identity;
+	identity.processId = HandleToULong(PsGetProcessId(process));
+	identity.parentProcessId = HandleToULong(PsGetProcessInheritedFromUniqueProcessId(process));
+	identity.createTime = PsGetProcessCreateTimeQuadPart(process);
+	identity.sessionId = PsGetProcessSessionId(process);
+	identity.isWow64 = PsGetProcessWow64Process(process) != NULL;
+
+	// this name is truncated by the OS
+	const char* imageName = PsGetProcessImageFileName(process);
+	if (imageName) {
+		strncpy_s(identity.imageName, imageName, _TRUNCATE);
+	}
+	identity.nameHash = ProcessIdentity::hashName(identity.imageName);
+
+	PUNICODE_STRING pImagePath = nullptr;
+	if (NT_SUCCESS(SeLocateProcessImageName(process, &pImagePath)) && pImagePath) {
+		const USHORT chars = (USHORT)min(pImagePath->Length / sizeof(wchar_t), MAX_PATH - 1);
+		memcpy(identity.imagePath, pImagePath->Buffer, chars * sizeof(wchar_t));
+		identity.imagePath[chars] = 0;
+		ExFreePool(pImagePath);
+	}
+	return pEntry;
+}
+
+const ProcessIdentity* ProcessCache::insert(Entry* pEntry) {
+	const ProcessIdentity* pIdentity = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if ((ULONG)m_entryCount >= MaxEntries) {
+		ExReleaseSpinLockExclusive(&m_lock, irql);
+		ExFreePoolWithTag(pEntry, DRIVER_POOL_TAG);
+		return nullptr;
+	}
+
+	// another thread of the process may have missed at the same time and won
+	const uint32_t bucket = bucketOf(pEntry->process);
+	for (Entry* pOther = m_buckets[bucket]; pOther; pOther = pOther->next) {
+		if (pOther->process == pEntry->process) {
+			pIdentity = &pOther->identity;
+			break;
+		}
+	}
+
+	if (!pIdentity) {
+		pEntry->next = m_buckets[bucket];
+		m_buckets[bucket] = pEntry;
+		m_entryCount++;
+		pIdentity = &pEntry->identity;
+		pEntry = nullptr;
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pEntry) {
+		ExFreePoolWithTag(pEntry, DRIVER_POOL_TAG);
+	}
+	return pIdentity;
+}
+
+void ProcessCache::remove(HANDLE pid) {
+	const uint64_t processId = HandleToULong(pid);
+	Entry* pOld = nullptr;
+
+	// exit only, keyed by EPROCESS so this is a scan
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount && !pOld; i++) {
+			for (Entry** ppLink = &m_buckets[i]; *ppLink; ppLink = &(*ppLink)->next) {
+				if ((*ppLink)->identity.processId == processId) {
+					pOld = *ppLink;
+					*ppLink = pOld->next;
+					m_entryCount--;
+					break;
+				}
+			}
+		}
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pOld) {
+		ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+	}
+}
+
+void ProcessCache::freeAll() {
+	Entry* pFree = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount; i++) {
+			while (m_buckets[i]) {
+				Entry* pEntry = m_buckets[i];
+				m_buckets[i] = pEntry->next;
+				pEntry->next = pFree;
+				pFree = pEntry;
+			}
+		}
+	}
+	m_entryCount = 0;
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	while (pFree) {
+		Entry* pNext = pFree->next;
+		ExFreePoolWithTag(pFree, DRIVER_POOL_TAG);
+		pFree = pNext;
+	}
+}
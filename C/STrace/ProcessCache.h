@@ -0,0 +1,59 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "Interface.h"
+
+/*
+EPROCESS -> ProcessIdentity, so building a CallerInfo for each new TLSData is one shared-lock hash lookup instead of
+several process queries and string copies. A process's record is built the first time one of its threads hits a
+probe and freed on process exit, the driver's process notify only runs once the last thread is gone, so no CallerInfo
+can still point at it.
+
+Records are keyed by the process owning the current thread rather than PsGetCurrentProcess, a thread attached to
+another process must not create a record for a process whose exit notification may already have run.
+*/
+class ProcessCache {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	// IRQL <= DISPATCH_LEVEL. A miss above PASSIVE_LEVEL returns null, the caller falls back to querying the process.
+	const ProcessIdentity* current();
+
+	// PASSIVE_LEVEL, the driver's process notify, after every other component is done with the process
+	void onProcessExit(HANDLE ProcessId);
+
+	// TargetSet's cached answer for the process, see TargetSet.h. pIdentity must come from current().
+	static volatile LONG64& targetCache(const ProcessIdentity* pIdentity) {
+		return CONTAINING_RECORD(pIdentity, Entry, identity)->targetCache;
+	}
+private:
+	struct Entry {
+		Entry* next;
+		PEPROCESS process;
+		volatile LONG64 targetCache;    // (TargetSet generation << 1) | targeted, 0 until first asked
+		ProcessIdentity identity;
+	};
+
+	static const uint32_t BucketCount = 1024;       // power of two
+	static const uint32_t MaxEntries = 16 * 1024;
+
+	static uint32_t bucketOf(PEPROCESS process) {
+		// fibonacci hashing, EPROCESSes are pool allocations with the low bits clear
+		return (uint32_t)(((uint64_t)process * 0x9E3779B97F4A7C15ull) >> 54);
+	}
+
+	Entry* build(PEPROCESS process);
+	const ProcessIdentity* insert(Entry* pEntry);
+	void remove(HANDLE pid);
+	void freeAll();
+
+	Entry** m_buckets;
+	volatile LONG m_entryCount;
+	EX_SPIN_LOCK m_lock;
+};
+
+extern ProcessCache g_ProcessCache;
@@ -0,0 +1,215 @@
+#pragma once
+
+// Shared between the driver, STraceCLI and the portable STraceDecode tool. Only fixed width types are used and the
+// includer is responsible for providing them (MyStdint.h in the driver, <cstdint> on the host), so this must stay free
+// of any windows or kernel headers.
+
+/*
+IOCTL_READ_RECORDS fills the caller's buffer with whole records, back to back. Every record starts with a
+StpRecordHeader whose size covers the header and payload and is always a multiple of 8. Readers must skip types they
+don't know using size. Timestamps are QueryPerformanceCounter ticks, StpStreamStats::qpcFrequency converts them.
+
+A raw dump written by "STraceCLI stream --raw" is a StpDumpHeader followed by the records exactly as read.
+*/
+#define STP_RECORD_ALIGNMENT 8
+#define STP_RECORD_MAX_ARGS  4
+
+enum StpRecordType : uint16_t {
+	StpRecordPad = 0,            // driver internal, never delivered
+	StpRecordLog = 1,            // NUL terminated log line follows the header
+	StpRecordSyscallEntry = 2,   // StpSyscallRecord
+	StpRecordSyscallReturn = 3,  // StpSyscallRecord, args[0] is the return value
+	StpRecordProbeName = 4,      // StpProbeNameRecord, NUL terminated syscall name follows
+	StpRecordDropped = 5,        // StpDroppedRecord, records lost to a full buffer since the previous record
+	StpRecordMemory = 6,         // StpMemoryRecord, see VmTracker.h
+	StpRecordNgrams = 7,         // StpNgramRecord, gramCount StpNgram follow, see NgramProfiles.h
+	StpRecordModule = 8,         // StpModuleRecord, NUL terminated UTF-8 path follows, see ModuleEvents.h
+	StpRecordStack = 9,          // StpStackRecord, frameCount uint64_t return addresses follow
+};
+
+struct StpRecordHeader {
+	uint32_t size;
+	uint16_t type;
+	uint16_t cpu;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t timestamp;
+};
+
+struct StpSyscallRecord {
+	StpRecordHeader header;
+	uint32_t probeId;
+	uint32_t paramCount;
+	uint64_t service;
+	uint64_t args[STP_RECORD_MAX_ARGS];
+};
+
+struct StpProbeNameRecord {
+	StpRecordHeader header;
+	uint32_t probeId;
+	uint32_t nameLength;   // without the terminator
+};
+
+struct StpDroppedRecord {
+	StpRecordHeader header;
+	uint64_t count;
+};
+
+// Memory tracking (STraceCLI config memory=on) only reports these transitions. header.pid is the process that made the
+// call, targetPid the process whose memory it was.
+enum StpMemoryEvent : uint32_t {
+	StpMemoryWriteToExecute = 1,         // a region that was writable or written from another process became executable
+	StpMemoryWritableExecutable = 2,     // allocated, mapped or protected both writable and executable
+	StpMemoryCrossProcessWrite = 3,      // NtWriteVirtualMemory into another process, oldProtect is the region's
+	StpMemoryCrossProcessMap = 4,        // an executable view mapped into another process
+};
+
+enum StpMemoryFlags : uint32_t {
+	StpMemoryFlagMapped = 1 << 0,        // the region is a view of a section, image relocations look like StpMemoryWriteToExecute
+	StpMemoryFlagUnknown = 1 << 1,       // created before tracking started, oldProtect is what the call reported
+	StpMemoryFlagRemoteWrite = 1 << 2,   // written by another process since it was last made executable
+};
+
+struct StpMemoryRecord {
+	StpRecordHeader header;
+	uint32_t event;              // StpMemoryEvent
+	uint32_t flags;              // StpMemoryFlags
+	uint32_t targetPid;
+	uint32_t oldProtect;         // PAGE_*, 0 if there was none
+	uint32_t newProtect;
+	uint32_t reserved;
+	uint64_t address;
+	uint64_t size;
+};
+
+/*
+Syscall n-grams (STraceCLI config ngrams=on) are consecutive probe ids of one thread's user mode calls, counted per
+process. Probe ids above STP_NGRAM_OTHER_PROBE are folded into it and the unused probes of a bigram are 0. When a
+process exits its grams are written as StpRecordNgrams records, as many as it takes.
+*/
+#define STP_NGRAM_MAX_N        3
+#define STP_NGRAM_OTHER_PROBE  1023
+#define STP_NGRAM_RECORD_GRAMS 56    // per StpNgramRecord, keeps a record well below the stream's read granularity
+
+struct StpNgram {
+	uint16_t n;                  // 2 or 3
+	uint16_t probes[STP_NGRAM_MAX_N];    // oldest first
+	uint64_t count;
+};
+
+struct StpNgramRecord {
+	StpRecordHeader header;
+	uint32_t pid;                // the process that exited
+	uint32_t gramCount;
+	uint32_t last;               // non zero on the process's final record
+	uint32_t reserved;
+};
+
+/*
+Module loads for offline symbolication. A module is reported when it's mapped while a reader is attached, and a new
+reader first gets every loaded kernel module (StpModuleFlagSnapshot). With STraceCLI config raw-stacks=on stacks
+aren't resolved by the driver, a StpRecordStack follows the call's StpRecordSyscallEntry from the same thread and its
+addresses are looked up in the modules of header.pid, or of pid 0 for kernel addresses. A later module over the same
+range replaces an earlier one, there are no unload records.
+*/
+#define STP_MODULE_MAX_PATH 512      // bytes of UTF-8 including the terminator, longer paths are cut
+#define STP_STACK_MAX_FRAMES 64
+
+enum StpModuleFlags : uint32_t {
+	StpModuleFlagKernel = 1 << 0,
+	StpModuleFlagSnapshot = 1 << 1,      // already loaded when the reader attached
+	StpModuleFlag32Bit = 1 << 2,         // PE32, a WOW64 process's module
+	StpModuleFlagNoIdentity = 1 << 3,    // the headers couldn't be read, timestamp and PDB fields are 0
+};
+
+struct StpModuleRecord {
+	StpRecordHeader header;
+	uint32_t pid;                // the process the module was mapped into, 0 for kernel modules
+	uint32_t flags;              // StpModuleFlags
+	uint64_t base;
+	uint64_t size;
+	uint32_t timeDateStamp;      // IMAGE_FILE_HEADER, with size the key for fetching the binary from a symbol server
+	uint32_t pdbAge;             // CodeView RSDS, with pdbGuid the key for fetching the PDB, 0 if there's none
+	uint8_t pdbGuid[16];
+	uint32_t pathLength;         // without the terminator
+	uint32_t reserved;
+};
+
+struct StpStackRecord {
+	StpRecordHeader header;
+	uint32_t probeId;
+	uint32_t frameCount;         // innermost first
+};
+
+// IOCTL_GET_STATS output
+struct StpStreamStats {
+	uint64_t qpcFrequency;
+	uint64_t produced;
+	uint64_t dropped;
+	uint64_t delivered;
+	uint64_t deliveredBytes;
+	uint32_t bufferSize;
+	uint32_t bufferUsed;
+	uint32_t pendingReads;
+	uint32_t pluginLoaded;
+};
+
+#define STP_DUMP_MAGIC   0x44525453 // 'STRD'
+#define STP_DUMP_VERSION 1
+
+struct StpDumpHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t qpcFrequency;
+};
+
+/*
+IOCTL_GET_COUNTERS output, a StpCounterSnapshotHeader followed by rowCount rows. Counters are kept per CPU and
+copied out unmerged, a (pid, probe) pair appears once for every CPU it ran on and consumers sum them up. All values
+are cumulative since the counters were enabled, rates are the difference between two snapshots. If the buffer was too
+small totalRows is larger than rowCount.
+
+"STraceCLI top -o FILE" records snapshots back to back exactly as returned, size steps to the next one.
+*/
+#define STP_COUNTERS_MAGIC 0x43525453 // 'STRC'
+
+struct StpCounterRow {
+	uint32_t pid;
+	uint32_t probeId;
+	uint64_t calls;
+	uint64_t completed;    // returns that were paired with an entry, the denominator for latency
+	uint64_t totalTicks;   // entry to return, QueryPerformanceCounter ticks
+};
+
+struct StpCounterSnapshotHeader {
+	uint32_t magic;
+	uint32_t size;         // header and rows
+	uint32_t rowCount;
+	uint32_t totalRows;
+	uint64_t timestamp;
+	uint64_t qpcFrequency;
+	uint64_t overflow;     // events not counted because the CPU's table was full
+};
+
+/*
+IOCTL_GET_NGRAMS output, a StpNgramHeader followed by rowCount rows. Counts are cumulative since n-grams were turned
+on and are not reset by reading them, a process's rows are dropped when it exits. If the buffer was too small totalRows
+is larger than rowCount.
+*/
+struct StpNgramRow {
+	uint32_t pid;
+	uint32_t reserved;
+	StpNgram gram;
+};
+
+struct StpNgramHeader {
+	uint32_t active;             // n-grams are being counted
+	uint32_t rowCount;
+	uint32_t totalRows;
+	uint32_t reserved;
+	uint64_t overflow;           // grams not counted because a table was full
+};
+
+inline uint32_t StpRecordAlign(uint32_t size) {
+	return (size + STP_RECORD_ALIGNMENT - 1) & ~(uint32_t)(STP_RECORD_ALIGNMENT - 1);
+}
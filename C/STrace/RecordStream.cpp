@@ -0,0 +1,539 @@
+#include "RecordStream.h"
+#include "Constants.h"
+#include "ModuleEvents.h"
+
+RecordStream g_RecordStream;
+
+void RecordStream::initialize() {
+	m_active = false;
+	m_owner = nullptr;
+	m_buffer = nullptr;
+	m_bufferSize = 0;
+	m_requestedBufferSize = DefaultBufferSize;
+	m_head = 0;
+	m_tail = 0;
+	m_droppedPending = 0;
+	m_pendingReads = 0;
+	m_probeNames = nullptr;
+	m_produced = 0;
+	m_dropped = 0;
+	m_delivered = 0;
+	m_deliveredBytes = 0;
+
+	KeInitializeSpinLock(&m_writeLock);
+	KeInitializeSpinLock(&m_readLock);
+	KeInitializeSpinLock(&m_csqLock);
+	InitializeListHead(&m_pendingIrps);
+	IoCsqInitialize(&m_csq, CsqInsertIrp, CsqRemoveIrp, CsqPeekNextIrp, CsqAcquireLock, CsqReleaseLock, CsqCompleteCanceledIrp);
+	KeInitializeDpc(&m_dpc, DeliverDpc, this);
+	ExInitializeFastMutex(&m_probeNamesLock);
+}
+
+void RecordStream::Destruct() {
+	stop();
+
+	// a DPC queued by a producer may still be running
+	KeFlushQueuedDpcs();
+
+	if (m_buffer) {
+		ExFreePoolWithTag(m_buffer, DRIVER_POOL_TAG);
+		m_buffer = nullptr;
+	}
+
+	if (m_probeNames) {
+		ExFreePoolWithTag(m_probeNames, DRIVER_POOL_TAG);
+		m_probeNames = nullptr;
+	}
+}
+
+bool RecordStream::activate() {
+	// producers only touch the ring while active, but one may have checked just before the last stop
+	if (!m_active && m_buffer && m_bufferSize != m_requestedBufferSize) {
+		KIRQL readIrql;
+		KLOCK_QUEUE_HANDLE writeLock;
+		KeAcquireSpinLock(&m_readLock, &readIrql);
+		KeAcquireInStackQueuedSpinLockAtDpcLevel(&m_writeLock, &writeLock);
+		uint8_t* pOld = m_buffer;
+		m_buffer = nullptr;
+		KeReleaseInStackQueuedSpinLockFromDpcLevel(&writeLock);
+		KeReleaseSpinLock(&m_readLock, readIrql);
+
+		if (pOld) {
+			ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+		}
+	}
+
+	if (!m_buffer) {
+		const uint32_t size = m_requestedBufferSize;
+		uint8_t* pBuffer = (uint8_t*)ExAllocatePoolWithTag(NonPagedPoolNx, size, DRIVER_POOL_TAG);
+		if (!pBuffer)
+			return false;
+
+		KIRQL readIrql;
+		KLOCK_QUEUE_HANDLE writeLock;
+		KeAcquireSpinLock(&m_readLock, &readIrql);
+		KeAcquireInStackQueuedSpinLockAtDpcLevel(&m_writeLock, &writeLock);
+		// two first reads may race here, the loser frees its copy
+		if (!m_buffer) {
+			m_buffer = pBuffer;
+			m_bufferSize = size;
+			m_head = m_tail = 0;
+			pBuffer = nullptr;
+		}
+		KeReleaseInStackQueuedSpinLockFromDpcLevel(&writeLock);
+		KeReleaseSpinLock(&m_readLock, readIrql);
+
+		if (pBuffer) {
+			ExFreePoolWithTag(pBuffer, DRIVER_POOL_TAG);
+		}
+	}
+
+	if (!m_active) {
+		m_active = true;
+
+		ExAcquireFastMutex(&m_probeNamesLock);
+		for (uint32_t i = 0; m_probeNames && i < MaxProbeNames; i++) {
+			if (m_probeNames[i].name[0]) {
+				writeProbeName(m_probeNames[i]);
+			}
+		}
+		ExReleaseFastMutex(&m_probeNamesLock);
+
+		// user modules are reported as they load, kernel modules were mostly loaded at boot
+		g_ModuleEvents.writeKernelModules();
+	}
+	return true;
+}
+
+void RecordStream::stop(PFILE_OBJECT fileObject) {
+	// the peek context picks this handle's reads, null picks all
+	PIRP Irp;
+	while ((Irp = IoCsqRemoveNextIrp(&m_csq, fileObject)) != nullptr) {
+		Irp->IoStatus.Status = STATUS_CANCELLED;
+		Irp->IoStatus.Information = 0;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+
+	if (fileObject && fileObject != m_owner) {
+		return;
+	}
+
+	m_active = false;
+
+	// the next client starts from an empty ring
+	KIRQL readIrql;
+	KLOCK_QUEUE_HANDLE writeLock;
+	KeAcquireSpinLock(&m_readLock, &readIrql);
+	KeAcquireInStackQueuedSpinLockAtDpcLevel(&m_writeLock, &writeLock);
+	m_head = m_tail;
+	m_droppedPending = 0;
+	KeReleaseInStackQueuedSpinLockFromDpcLevel(&writeLock);
+	KeReleaseSpinLock(&m_readLock, readIrql);
+
+	// only now, a new reader must find the ring empty
+	m_owner = nullptr;
+}
+
+void RecordStream::setBufferSize(uint32_t size) {
+	m_requestedBufferSize = size;
+}
+
+void RecordStream::getStats(StpStreamStats& stats) {
+	LARGE_INTEGER frequency;
+	KeQueryPerformanceCounter(&frequency);
+
+	stats.qpcFrequency = frequency.QuadPart;
+	stats.produced = m_produced;
+	stats.dropped = m_dropped;
+	stats.delivered = m_delivered;
+	stats.deliveredBytes = m_deliveredBytes;
+	stats.bufferSize = m_buffer ? m_bufferSize : 0;
+	stats.bufferUsed = (uint32_t)(m_tail - m_head);
+	stats.pendingReads = (uint32_t)m_pendingReads;
+}
+
+NTSTATUS RecordStream::read(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const uint32_t outSize = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outSize < MinReadSize || !Irp->MdlAddress) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	// the first read claims the stream for its handle
+	PFILE_OBJECT fileObject = IrpStack->FileObject;
+	PFILE_OBJECT owner = (PFILE_OBJECT)InterlockedCompareExchangePointer((PVOID volatile*)&m_owner, fileObject, nullptr);
+	if (owner && owner != fileObject) {
+		return STATUS_DEVICE_BUSY;
+	}
+
+	if (!activate()) {
+		if (!owner) {
+			InterlockedExchangePointer((PVOID volatile*)&m_owner, nullptr);
+		}
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pOut) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	KIRQL irql;
+	KeAcquireSpinLock(&m_readLock, &irql);
+	uint32_t copied = drain(pOut, outSize);
+	KeReleaseSpinLock(&m_readLock, irql);
+
+	if (copied) {
+		Irp->IoStatus.Information = copied;
+		return STATUS_SUCCESS;
+	}
+
+	// marks the IRP pending
+	IoCsqInsertIrp(&m_csq, Irp, nullptr);
+
+	// a record may have landed after the drain, before any producer could see this read
+	KeInsertQueueDpc(&m_dpc, nullptr, nullptr);
+	return STATUS_PENDING;
+}
+
+// m_readLock must be held. Copies whole records only, the rest stays buffered for the next read
+uint32_t RecordStream::drain(uint8_t* pOut, uint32_t outSize) {
+	int64_t head = m_head;
+	const int64_t tail = InterlockedAdd64(&m_tail, 0);
+	uint32_t copied = 0;
+	uint32_t records = 0;
+	while (head < tail) {
+		const uint32_t pos = (uint32_t)(head & (m_bufferSize - 1));
+		const uint32_t remaining = m_bufferSize - pos;
+
+		// too small for a header, the producer skipped to the start
+		if (remaining < sizeof(StpRecordHeader)) {
+			head += remaining;
+			continue;
+		}
+
+		auto pRecord = (StpRecordHeader*)(m_buffer + pos);
+		if (pRecord->type == StpRecordPad) {
+			head += pRecord->size;
+			continue;
+		}
+
+		if (copied + pRecord->size > outSize)
+			break;
+
+		memcpy(pOut + copied, pRecord, pRecord->size);
+		copied += pRecord->size;
+		head += pRecord->size;
+		records++;
+	}
+
+	InterlockedExchange64(&m_head, head);
+	InterlockedAdd64(&m_delivered, records);
+	InterlockedAdd64(&m_deliveredBytes, copied);
+	return copied;
+}
+
+// m_writeLock must be held
+bool RecordStream::append(const StpRecordHeader& header, const void* body, uint32_t bodySize, const void* tail, uint32_t tailSize) {
+	const int64_t head = InterlockedAdd64(&m_head, 0);
+	int64_t writeAt = m_tail;
+	uint32_t pos = (uint32_t)(writeAt & (m_bufferSize - 1));
+
+	// records never wrap, the end of the ring is padded instead
+	uint32_t pad = m_bufferSize - pos < header.size ? m_bufferSize - pos : 0;
+	if (writeAt + pad + header.size - head > m_bufferSize)
+		return false;
+
+	if (pad) {
+		if (pad >= sizeof(StpRecordHeader)) {
+			auto pPad = (StpRecordHeader*)(m_buffer + pos);
+			pPad->size = pad;
+			pPad->type = StpRecordPad;
+		}
+		writeAt += pad;
+		pos = 0;
+	}
+
+	uint8_t* pRecord = m_buffer + pos;
+	memcpy(pRecord, &header, sizeof(header));
+	if (bodySize) {
+		memcpy(pRecord + sizeof(header), body, bodySize);
+	}
+
+	if (tailSize) {
+		memcpy(pRecord + sizeof(header) + bodySize, tail, tailSize);
+	}
+
+	// alignment slack goes to the client, don't leak stale ring contents
+	const uint32_t used = sizeof(header) + bodySize + tailSize;
+	memset(pRecord + used, 0, header.size - used);
+
+	InterlockedExchange64(&m_tail, writeAt + header.size);
+	return true;
+}
+
+void RecordStream::write(StpRecordType type, const void* body, uint32_t bodySize, const void* tail, uint32_t tailSize) {
+	if (!m_active)
+		return;
+
+	StpRecordHeader header;
+	header.size = StpRecordAlign(sizeof(StpRecordHeader) + bodySize + tailSize);
+	header.type = type;
+	header.cpu = (uint16_t)KeGetCurrentProcessorNumberEx(nullptr);
+	header.pid = HandleToULong(PsGetCurrentProcessId());
+	header.tid = HandleToULong(PsGetCurrentThreadId());
+	header.timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+	bool written = false;
+	KLOCK_QUEUE_HANDLE lockHandle;
+	KeAcquireInStackQueuedSpinLock(&m_writeLock, &lockHandle);
+	if (m_buffer) {
+		// a gap is reported in order, right before the first record that fit again
+		if (m_droppedPending) {
+			StpDroppedRecord dropped;
+			dropped.header = header;
+			dropped.header.size = sizeof(StpDroppedRecord);
+			dropped.header.type = StpRecordDropped;
+			dropped.count = m_droppedPending;
+			if (append(dropped.header, &dropped.count, sizeof(dropped.count), nullptr, 0)) {
+				m_droppedPending = 0;
+			}
+		}
+
+		if (!m_droppedPending) {
+			written = append(header, body, bodySize, tail, tailSize);
+		}
+
+		if (!written) {
+			m_droppedPending++;
+		}
+	}
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+	if (written) {
+		InterlockedIncrement64(&m_produced);
+		if (m_pendingReads) {
+			KeInsertQueueDpc(&m_dpc, nullptr, nullptr);
+		}
+	} else {
+		InterlockedIncrement64(&m_dropped);
+	}
+}
+
+void RecordStream::writeLog(const char* message) {
+	write(StpRecordLog, nullptr, 0, message, (uint32_t)strlen(message) + 1);
+}
+
+void RecordStream::writeSyscall(StpRecordType type, uint64_t service, uint32_t probeId, uint32_t paramCount, const uint64_t* pArgs, uint32_t argCount) {
+	if (!m_active)
+		return;
+
+	StpSyscallRecord record = {};
+	record.probeId = probeId;
+	record.paramCount = paramCount;
+	record.service = service;
+	for (uint32_t i = 0; pArgs && i < argCount && i < STP_RECORD_MAX_ARGS; i++) {
+		record.args[i] = pArgs[i];
+	}
+
+	write(type, &record.probeId, sizeof(record) - sizeof(StpRecordHeader), nullptr, 0);
+}
+
+void RecordStream::writeMemory(StpMemoryEvent event, uint32_t flags, uint32_t targetPid, uint64_t address, uint64_t size, uint32_t oldProtect, uint32_t newProtect) {
+	if (!m_active)
+		return;
+
+	StpMemoryRecord record = {};
+	record.event = event;
+	record.flags = flags;
+	record.targetPid = targetPid;
+	record.oldProtect = oldProtect;
+	record.newProtect = newProtect;
+	record.address = address;
+	record.size = size;
+
+	write(StpRecordMemory, &record.event, sizeof(record) - sizeof(StpRecordHeader), nullptr, 0);
+}
+
+void RecordStream::writeNgrams(uint32_t pid, const StpNgram* pGrams, uint32_t gramCount, bool last) {
+	if (!m_active || gramCount > STP_NGRAM_RECORD_GRAMS)
+		return;
+
+	StpNgramRecord record = {};
+	record.pid = pid;
+	record.gramCount = gramCount;
+	record.last = last ? 1 : 0;
+	write(StpRecordNgrams, &record.pid, sizeof(record) - sizeof(StpRecordHeader), pGrams, gramCount * sizeof(StpNgram));
+}
+
+void RecordStream::writeModule(const StpModuleRecord& module, const char* path) {
+	if (!m_active)
+		return;
+
+	StpModuleRecord record = module;
+	record.pathLength = (uint32_t)strnlen(path, STP_MODULE_MAX_PATH - 1);
+	if (path[record.pathLength]) {
+		return;
+	}
+	write(StpRecordModule, &record.pid, sizeof(record) - sizeof(StpRecordHeader), path, record.pathLength + 1);
+}
+
+void RecordStream::writeStack(uint32_t probeId, const uint64_t* pFrames, uint32_t frameCount) {
+	if (!m_active || !pFrames)
+		return;
+
+	StpStackRecord record = {};
+	record.probeId = probeId;
+	record.frameCount = frameCount < STP_STACK_MAX_FRAMES ? frameCount : STP_STACK_MAX_FRAMES;
+	write(StpRecordStack, &record.probeId, sizeof(record) - sizeof(StpRecordHeader), pFrames, record.frameCount * sizeof(uint64_t));
+}
+
+void RecordStream::writeProbeName(const ProbeName& probe) {
+	StpProbeNameRecord record;
+	record.probeId = probe.probeId;
+	record.nameLength = (uint32_t)strlen(probe.name);
+	write(StpRecordProbeName, &record.probeId, sizeof(record) - sizeof(StpRecordHeader), probe.name, record.nameLength + 1);
+}
+
+void RecordStream::setProbeName(uint32_t probeId, const char* name) {
+	ExAcquireFastMutex(&m_probeNamesLock);
+	if (!m_probeNames) {
+		m_probeNames = (ProbeName*)ExAllocatePoolWithTag(NonPagedPoolNx, MaxProbeNames * sizeof(ProbeName), DRIVER_POOL_TAG);
+		if (m_probeNames) {
+			memset(m_probeNames, 0, MaxProbeNames * sizeof(ProbeName));
+		}
+	}
+
+	// a later plugin may reuse the id for another syscall, the newest name wins
+	ProbeName* pSlot = nullptr;
+	for (uint32_t i = 0; m_probeNames && i < MaxProbeNames; i++) {
+		if (m_probeNames[i].name[0] && m_probeNames[i].probeId == probeId) {
+			pSlot = &m_probeNames[i];
+			break;
+		}
+
+		if (!pSlot && !m_probeNames[i].name[0]) {
+			pSlot = &m_probeNames[i];
+		}
+	}
+
+	if (pSlot) {
+		pSlot->probeId = probeId;
+		uint32_t i = 0;
+		for (; name[i] && i < sizeof(pSlot->name) - 1; i++) {
+			pSlot->name[i] = name[i];
+		}
+		pSlot->name[i] = 0;
+		writeProbeName(*pSlot);
+	}
+	ExReleaseFastMutex(&m_probeNamesLock);
+}
+
+NTSTATUS RecordStream::copyProbeNames(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const uint32_t outSize = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (!Irp->MdlAddress) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pOut) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	NTSTATUS status = STATUS_SUCCESS;
+	uint32_t copied = 0;
+	ExAcquireFastMutex(&m_probeNamesLock);
+	for (uint32_t i = 0; m_probeNames && i < MaxProbeNames; i++) {
+		const ProbeName& probe = m_probeNames[i];
+		if (!probe.name[0])
+			continue;
+
+		StpProbeNameRecord record = {};
+		record.probeId = probe.probeId;
+		record.nameLength = (uint32_t)strlen(probe.name);
+		record.header.type = StpRecordProbeName;
+		record.header.size = StpRecordAlign(sizeof(record) + record.nameLength + 1);
+		if (copied + record.header.size > outSize) {
+			// whole records only, the client retries with a larger buffer
+			status = STATUS_BUFFER_OVERFLOW;
+			break;
+		}
+
+		memset(pOut + copied, 0, record.header.size);
+		memcpy(pOut + copied, &record, sizeof(record));
+		memcpy(pOut + copied + sizeof(record), probe.name, record.nameLength);
+		copied += record.header.size;
+	}
+	ExReleaseFastMutex(&m_probeNamesLock);
+
+	Irp->IoStatus.Information = copied;
+	return status;
+}
+
+void RecordStream::DeliverDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	auto self = (RecordStream*)DeferredContext;
+	while (InterlockedAdd64(&self->m_head, 0) != InterlockedAdd64(&self->m_tail, 0)) {
+		PIRP Irp = IoCsqRemoveNextIrp(&self->m_csq, nullptr);
+		if (!Irp)
+			break;
+
+		auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+		uint32_t copied = 0;
+		if (pOut) {
+			KeAcquireSpinLockAtDpcLevel(&self->m_readLock);
+			copied = self->drain(pOut, IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength);
+			KeReleaseSpinLockFromDpcLevel(&self->m_readLock);
+		}
+
+		// zero bytes is legal (only padding was left), the client just re-issues the read
+		Irp->IoStatus.Status = pOut ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+		Irp->IoStatus.Information = copied;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+}
+
+void RecordStream::CsqInsertIrp(PIO_CSQ Csq, PIRP Irp) {
+	auto self = CONTAINING_RECORD(Csq, RecordStream, m_csq);
+	InsertTailList(&self->m_pendingIrps, &Irp->Tail.Overlay.ListEntry);
+	InterlockedIncrement(&self->m_pendingReads);
+}
+
+void RecordStream::CsqRemoveIrp(PIO_CSQ Csq, PIRP Irp) {
+	auto self = CONTAINING_RECORD(Csq, RecordStream, m_csq);
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+	InterlockedDecrement(&self->m_pendingReads);
+}
+
+// PeekContext is a FILE_OBJECT to only return that handle's reads, or null for any
+PIRP RecordStream::CsqPeekNextIrp(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext) {
+	auto self = CONTAINING_RECORD(Csq, RecordStream, m_csq);
+	for (PLIST_ENTRY pNext = Irp ? Irp->Tail.Overlay.ListEntry.Flink : self->m_pendingIrps.Flink; pNext != &self->m_pendingIrps; pNext = pNext->Flink) {
+		PIRP pNextIrp = CONTAINING_RECORD(pNext, IRP, Tail.Overlay.ListEntry);
+		if (!PeekContext || IoGetCurrentIrpStackLocation(pNextIrp)->FileObject == (PFILE_OBJECT)PeekContext)
+			return pNextIrp;
+	}
+	return nullptr;
+}
+
+void RecordStream::CsqAcquireLock(PIO_CSQ Csq, PKIRQL Irql) {
+	auto self = CONTAINING_RECORD(Csq, RecordStream, m_csq);
+	KeAcquireSpinLock(&self->m_csqLock, Irql);
+}
+
+void RecordStream::CsqReleaseLock(PIO_CSQ Csq, KIRQL Irql) {
+	auto self = CONTAINING_RECORD(Csq, RecordStream, m_csq);
+	KeReleaseSpinLock(&self->m_csqLock, Irql);
+}
+
+void RecordStream::CsqCompleteCanceledIrp(PIO_CSQ Csq, PIRP Irp) {
+	UNREFERENCED_PARAMETER(Csq);
+
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "RecordFormat.h"
+
+/*
+Binary record stream for live consumers (STraceCLI stream/aggregate). Producers (log lines, syscall probes) append
+whole records to a single non-paged ring under an in-stack queued spinlock, nothing is written until a reader has
+attached so an idle driver pays one flag check per event. When the ring is full records are dropped and counted, the
+reader later sees a StpRecordDropped in their place.
+
+Readers use the inverted call pattern: IOCTL_READ_RECORDS (METHOD_OUT_DIRECT) completes immediately if records are
+buffered, otherwise the IRP is parked in a cancel safe queue and completed from a DPC the next time a producer writes.
+A client keeps several reads outstanding to never leave the ring without a reader. The ring has a single head, so the
+handle whose read started the stream owns it until its cleanup and reads from any other handle fail.
+*/
+class RecordStream {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload, completes pending reads and frees the ring
+	void Destruct();
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// May return STATUS_PENDING, in which case the IRP is owned by the stream and must not be completed by the caller
+	NTSTATUS read(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+
+	// PASSIVE_LEVEL. IRP_MJ_CLEANUP of fileObject cancels its parked reads, and stops producing if it owns the stream.
+	// Null stops and cancels everything.
+	void stop(PFILE_OBJECT fileObject = nullptr);
+
+	void getStats(StpStreamStats& stats);
+
+	// Power of two. The ring is reallocated the next time a reader attaches, a running stream keeps its size
+	void setBufferSize(uint32_t size);
+
+	uint32_t bufferSize() const {
+		return m_requestedBufferSize;
+	}
+
+	// IRQL <= DISPATCH_LEVEL
+	void writeLog(const char* message);
+	void writeSyscall(StpRecordType type, uint64_t service, uint32_t probeId, uint32_t paramCount, const uint64_t* pArgs, uint32_t argCount);
+	void writeMemory(StpMemoryEvent event, uint32_t flags, uint32_t targetPid, uint64_t address, uint64_t size, uint32_t oldProtect, uint32_t newProtect);
+	void writeNgrams(uint32_t pid, const StpNgram* pGrams, uint32_t gramCount, bool last);   // at most STP_NGRAM_RECORD_GRAMS
+	void writeModule(const StpModuleRecord& module, const char* path);   // path terminated within STP_MODULE_MAX_PATH
+	void writeStack(uint32_t probeId, const uint64_t* pFrames, uint32_t frameCount);   // cut to STP_STACK_MAX_FRAMES
+
+	// PASSIVE_LEVEL. Names are remembered and replayed to every new reader, probes are usually set before a client attaches
+	void setProbeName(uint32_t probeId, const char* name);
+
+	// IOCTL_GET_PROBE_NAMES, every known name as StpRecordProbeName records. For clients that don't read the stream
+	NTSTATUS copyProbeNames(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+private:
+	struct ProbeName {
+		uint32_t probeId;
+		char name[60];   // empty marks a free slot
+	};
+
+	static const uint32_t DefaultBufferSize = 1024 * 1024;  // power of two
+	static const uint32_t MinReadSize = 1024;        // larger than any single record
+	static const uint32_t MaxProbeNames = 2048;
+
+	bool activate();
+	void write(StpRecordType type, const void* body, uint32_t bodySize, const void* tail, uint32_t tailSize);
+	bool append(const StpRecordHeader& header, const void* body, uint32_t bodySize, const void* tail, uint32_t tailSize);
+	uint32_t drain(uint8_t* pOut, uint32_t outSize);
+	void writeProbeName(const ProbeName& probe);
+
+	static KDEFERRED_ROUTINE DeliverDpc;
+	static IO_CSQ_INSERT_IRP CsqInsertIrp;
+	static IO_CSQ_REMOVE_IRP CsqRemoveIrp;
+	static IO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp;
+	static IO_CSQ_ACQUIRE_LOCK CsqAcquireLock;
+	static IO_CSQ_RELEASE_LOCK CsqReleaseLock;
+	static IO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp;
+
+	volatile bool m_active;
+	PFILE_OBJECT volatile m_owner;     // the reader's handle, set by its first read
+
+	// [head, tail) is readable, both only ever grow. Producers own tail under m_writeLock, the one reader owns head under m_readLock
+	uint8_t* m_buffer;
+	uint32_t m_bufferSize;
+	volatile uint32_t m_requestedBufferSize;
+	volatile int64_t m_head;
+	volatile int64_t m_tail;
+	uint64_t m_droppedPending;
+	KSPIN_LOCK m_writeLock;
+	KSPIN_LOCK m_readLock;
+
+	IO_CSQ m_csq;
+	LIST_ENTRY m_pendingIrps;
+	KSPIN_LOCK m_csqLock;
+	volatile LONG m_pendingReads;
+	KDPC m_dpc;
+
+	ProbeName* m_probeNames;
+	FAST_MUTEX m_probeNamesLock;
+
+	volatile int64_t m_produced;
+	volatile int64_t m_dropped;
+	volatile int64_t m_delivered;
+	volatile int64_t m_deliveredBytes;
+};
+
+extern RecordStream g_RecordStream;
@@ -0,0 +1,220 @@
+#include "RegionTree.h"
+#include "Constants.h"
+
+void RegionTree::initialize(volatile LONG* pBudget) {
+	m_root = nullptr;
+	m_count = 0;
+	m_pBudget = pBudget;
+}
+
+void RegionTree::clear() {
+	freeNodes(m_root);
+	m_root = nullptr;
+	m_count = 0;
+}
+
+void RegionTree::freeNodes(Node* pNode) {
+	if (!pNode) {
+		return;
+	}
+
+	freeNodes(pNode->left);
+	freeNodes(pNode->right);
+	ExFreePoolWithTag(pNode, DRIVER_POOL_TAG);
+	InterlockedIncrement(m_pBudget);
+}
+
+void RegionTree::update(Node* pNode) {
+	const int32_t left = heightOf(pNode->left);
+	const int32_t right = heightOf(pNode->right);
+	pNode->height = 1 + (left > right ? left : right);
+}
+
+RegionTree::Node* RegionTree::rotateLeft(Node* pNode) {
+	Node* pRight = pNode->right;
+	pNode->right = pRight->left;
+	pRight->left = pNode;
+	update(pNode);
+	update(pRight);
+	return pRight;
+}
+
+RegionTree::Node* RegionTree::rotateRight(Node* pNode) {
+	Node* pLeft = pNode->left;
+	pNode->left = pLeft->right;
+	pLeft->right = pNode;
+	update(pNode);
+	update(pLeft);
+	return pLeft;
+}
+
+RegionTree::Node* RegionTree::balance(Node* pNode) {
+	update(pNode);
+
+	const int32_t diff = heightOf(pNode->left) - heightOf(pNode->right);
+	if (diff > 1) {
+		if (heightOf(pNode->left->left) < heightOf(pNode->left->right)) {
+			pNode->left = rotateLeft(pNode->left);
+		}
+		return rotateRight(pNode);
+	}
+
+	if (diff < -1) {
+		if (heightOf(pNode->right->right) < heightOf(pNode->right->left)) {
+			pNode->right = rotateRight(pNode->right);
+		}
+		return rotateLeft(pNode);
+	}
+	return pNode;
+}
+
+RegionTree::Node* RegionTree::insertNode(Node* pNode, Node* pNew) {
+	if (!pNode) {
+		return pNew;
+	}
+
+	if (pNew->region.start < pNode->region.start) {
+		pNode->left = insertNode(pNode->left, pNew);
+	} else {
+		pNode->right = insertNode(pNode->right, pNew);
+	}
+	return balance(pNode);
+}
+
+RegionTree::Node* RegionTree::removeMin(Node* pNode, Node** ppMin) {
+	if (!pNode->left) {
+		*ppMin = pNode;
+		return pNode->right;
+	}
+
+	pNode->left = removeMin(pNode->left, ppMin);
+	return balance(pNode);
+}
+
+RegionTree::Node* RegionTree::removeNode(Node* pNode, uint64_t start, Node** ppRemoved) {
+	if (!pNode) {
+		return nullptr;
+	}
+
+	if (start < pNode->region.start) {
+		pNode->left = removeNode(pNode->left, start, ppRemoved);
+	} else if (start > pNode->region.start) {
+		pNode->right = removeNode(pNode->right, start, ppRemoved);
+	} else {
+		*ppRemoved = pNode;
+		if (!pNode->right) {
+			return pNode->left;
+		}
+
+		// the successor takes the removed node's place
+		Node* pMin = nullptr;
+		Node* pRight = removeMin(pNode->right, &pMin);
+		pMin->left = pNode->left;
+		pMin->right = pRight;
+		return balance(pMin);
+	}
+	return balance(pNode);
+}
+
+RegionTree::Region* RegionTree::firstOverlap(uint64_t start, uint64_t end) {
+	// the last region starting at or below start is the only one that can hold start
+	Node* pFloor = nullptr;
+	for (Node* pNode = m_root; pNode; ) {
+		if (pNode->region.start <= start) {
+			pFloor = pNode;
+			pNode = pNode->right;
+		} else {
+			pNode = pNode->left;
+		}
+	}
+
+	if (pFloor && pFloor->region.end > start) {
+		return &pFloor->region;
+	}
+
+	// otherwise the first one starting above it, if it starts before end
+	Node* pCeiling = nullptr;
+	for (Node* pNode = m_root; pNode; ) {
+		if (pNode->region.start > start) {
+			pCeiling = pNode;
+			pNode = pNode->left;
+		} else {
+			pNode = pNode->right;
+		}
+	}
+
+	if (pCeiling && pCeiling->region.start < end) {
+		return &pCeiling->region;
+	}
+	return nullptr;
+}
+
+bool RegionTree::insert(const Region& region) {
+	if (region.start >= region.end) {
+		return true;
+	}
+
+	if (InterlockedDecrement(m_pBudget) < 0) {
+		InterlockedIncrement(m_pBudget);
+		return false;
+	}
+
+	auto pNode = (Node*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Node), DRIVER_POOL_TAG);
+	if (!pNode) {
+		InterlockedIncrement(m_pBudget);
+		return false;
+	}
+
+	pNode->left = nullptr;
+	pNode->right = nullptr;
+	pNode->height = 1;
+	pNode->region = region;
+	m_root = insertNode(m_root, pNode);
+	m_count++;
+	return true;
+}
+
+void RegionTree::remove(uint64_t start) {
+	Node* pRemoved = nullptr;
+	m_root = removeNode(m_root, start, &pRemoved);
+	if (pRemoved) {
+		ExFreePoolWithTag(pRemoved, DRIVER_POOL_TAG);
+		InterlockedIncrement(m_pBudget);
+		m_count--;
+	}
+}
+
+bool RegionTree::keepOutside(const Region& old, uint64_t start, uint64_t end) {
+	bool complete = true;
+	if (old.start < start) {
+		Region before = old;
+		before.end = start;
+		complete &= insert(before);
+	}
+
+	if (old.end > end) {
+		Region after = old;
+		after.start = end;
+		complete &= insert(after);
+	}
+	return complete;
+}
+
+bool RegionTree::erase(uint64_t start, uint64_t end) {
+	bool complete = true;
+	while (Region* pOld = firstOverlap(start, end)) {
+		const Region old = *pOld;
+		remove(old.start);
+		complete &= keepOutside(old, start, end);
+	}
+	return complete;
+}
+
+void RegionTree::eraseAllocation(uint64_t allocationBase) {
+	Region* pRegion = firstOverlap(allocationBase, ~0ull);
+	while (pRegion && pRegion->allocationBase == allocationBase) {
+		const uint64_t end = pRegion->end;
+		remove(pRegion->start);
+		pRegion = firstOverlap(end, ~0ull);
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+
+/*
+A process's memory regions ordered by start address, kept in an AVL tree. Regions never overlap, assigning a range
+first cuts away whatever it covers, so this is all an interval tree has to be here: the region holding an address is
+the last one starting at or below it, and lookups, inserts and removes are O(log n).
+
+Not synchronized, the owner locks. Nodes come from non-paged pool and count against a budget shared by every tree.
+*/
+class RegionTree {
+public:
+	struct Region {
+		uint64_t start;
+		uint64_t end;               // exclusive
+		uint64_t allocationBase;    // start of the allocation or view the region was cut from
+		uint32_t protect;           // PAGE_*
+		uint32_t flags;             // StpMemoryFlags
+	};
+
+	// pBudget is decremented for every node and incremented when it's freed, nothing is allocated below 0
+	void initialize(volatile LONG* pBudget);
+
+	// Frees every region
+	void clear();
+
+	uint32_t count() const {
+		return m_count;
+	}
+
+	// Of the root, 0 when empty. An AVL tree of n regions is at most about 1.44 log2(n + 2) high.
+	int32_t height() const {
+		return heightOf(m_root);
+	}
+
+	// The first region overlapping [start, end), null if there is none. Valid until the tree changes.
+	Region* firstOverlap(uint64_t start, uint64_t end);
+
+	// Calls callback(Region&) for every region overlapping [start, end), in address order. It may change anything but
+	// start and end.
+	template<typename T>
+	void forEachOverlap(uint64_t start, uint64_t end, T&& callback) {
+		for (Region* pRegion = firstOverlap(start, end); pRegion; pRegion = firstOverlap(pRegion->end, end)) {
+			callback(*pRegion);
+		}
+	}
+
+	// Makes [region.start, region.end) one region. Every region it overlaps is passed to onOverlap(const Region& old,
+	// Region& region) first, which may adjust anything in the new region but its range. Parts of the old regions outside
+	// the range are kept. False if the budget ran out, part of the range or its surroundings is then unknown.
+	template<typename T>
+	bool assign(Region region, T&& onOverlap) {
+		bool complete = true;
+		while (Region* pOld = firstOverlap(region.start, region.end)) {
+			const Region old = *pOld;
+			onOverlap(old, region);
+			remove(old.start);
+			complete &= keepOutside(old, region.start, region.end);
+		}
+		return insert(region) && complete;
+	}
+
+	// Removes [start, end), parts of overlapping regions outside it are kept
+	bool erase(uint64_t start, uint64_t end);
+
+	// Removes the regions at and after start that were cut from the allocation or view starting there
+	void eraseAllocation(uint64_t allocationBase);
+private:
+	struct Node {
+		Node* left;
+		Node* right;
+		int32_t height;
+		Region region;
+	};
+
+	static int32_t heightOf(const Node* pNode) {
+		return pNode ? pNode->height : 0;
+	}
+
+	static void update(Node* pNode);
+	static Node* rotateLeft(Node* pNode);
+	static Node* rotateRight(Node* pNode);
+	static Node* balance(Node* pNode);
+	static Node* insertNode(Node* pNode, Node* pNew);
+	static Node* removeMin(Node* pNode, Node** ppMin);
+	static Node* removeNode(Node* pNode, uint64_t start, Node** ppRemoved);
+
+	bool insert(const Region& region);
+	void remove(uint64_t start);
+	bool keepOutside(const Region& old, uint64_t start, uint64_t end);
+	void freeNodes(Node* pNode);
+
+	Node* m_root;
+	uint32_t m_count;
+	volatile LONG* m_pBudget;
+};
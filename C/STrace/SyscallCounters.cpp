@@ -0,0 +1,121 @@
+#include "SyscallCounters.h"
+#include "Constants.h"
+
+SyscallCounters g_SyscallCounters;
+
+void SyscallCounters::initialize() {
+	m_active = false;
+	m_owner = nullptr;
+	m_sets[0].initialize();
+	m_sets[1].initialize();
+	m_tables = &m_sets[0];
+	ExInitializeFastMutex(&m_lock);
+}
+
+void SyscallCounters::Destruct() {
+	stop();
+	m_sets[0].Destruct();
+	m_sets[1].Destruct();
+}
+
+// m_lock must be held
+bool SyscallCounters::activate(PFILE_OBJECT fileObject) {
+	if (m_active)
+		return true;
+
+	// every client starts counting from zero, in the set no probe was handed since the previous client started
+	Tables* pNext = m_tables == &m_sets[0] ? &m_sets[1] : &m_sets[0];
+	if (!pNext->reset())
+		return false;
+
+	m_tables = pNext;
+	m_owner = fileObject;
+	m_active = true;
+	return true;
+}
+
+void SyscallCounters::stop(PFILE_OBJECT fileObject) {
+	ExAcquireFastMutex(&m_lock);
+	if (!fileObject || fileObject == m_owner) {
+		// the tables stay allocated, a probe may still be counting into them
+		m_active = false;
+		m_owner = nullptr;
+	}
+	ExReleaseFastMutex(&m_lock);
+}
+
+void SyscallCounters::count(uint32_t probeId, bool isReturn, uint64_t ticks) {
+	if (!m_active)
+		return;
+
+	const uint64_t key = ((uint64_t)HandleToULong(PsGetCurrentProcessId()) << 32) | probeId;
+	Tables::Slot* pSlot = m_tables->slotFor(key);
+	if (!pSlot)
+		return;
+
+	if (!isReturn) {
+		InterlockedIncrement64(&pSlot->counts[Calls]);
+	} else if (ticks) {
+		InterlockedIncrement64(&pSlot->counts[Completed]);
+		InterlockedAdd64(&pSlot->counts[TotalTicks], (LONG64)ticks);
+	}
+}
+
+void SyscallCounters::onProcessExit(HANDLE ProcessId) {
+	ExAcquireFastMutex(&m_lock);
+	if (m_active) {
+		const uint32_t processId = HandleToULong(ProcessId);
+		m_tables->removeIf([processId](uint64_t key) {
+			return (uint32_t)(key >> 32) == processId;
+		});
+	}
+	ExReleaseFastMutex(&m_lock);
+}
+
+NTSTATUS SyscallCounters::snapshot(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const uint32_t outSize = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outSize < sizeof(StpCounterSnapshotHeader) || !Irp->MdlAddress) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	auto pOut = (uint8_t*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (!pOut) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ExAcquireFastMutex(&m_lock);
+	if (!activate(IrpStack->FileObject)) {
+		ExReleaseFastMutex(&m_lock);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	LARGE_INTEGER frequency;
+	StpCounterSnapshotHeader header = { 0 };
+	header.magic = STP_COUNTERS_MAGIC;
+	header.timestamp = KeQueryPerformanceCounter(&frequency).QuadPart;
+	header.qpcFrequency = frequency.QuadPart;
+	header.overflow = m_tables->overflow();
+
+	// rows are read while probes keep counting, each value is consistent on its own which is all a rate needs
+	const uint32_t maxRows = (outSize - sizeof(header)) / sizeof(StpCounterRow);
+	auto pRows = (StpCounterRow*)(pOut + sizeof(header));
+	m_tables->forEach([&](uint64_t key, const uint64_t* counts) {
+		if (header.rowCount < maxRows) {
+			StpCounterRow row;
+			row.pid = (uint32_t)(key >> 32);
+			row.probeId = (uint32_t)key;
+			row.calls = counts[Calls];
+			row.completed = counts[Completed];
+			row.totalTicks = counts[TotalTicks];
+			memcpy(&pRows[header.rowCount++], &row, sizeof(row));
+		}
+		header.totalRows++;
+	});
+	ExReleaseFastMutex(&m_lock);
+
+	header.size = sizeof(header) + header.rowCount * sizeof(StpCounterRow);
+	memcpy(pOut, &header, sizeof(header));
+	Irp->IoStatus.Information = header.size;
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "RecordFormat.h"
+#include "PerCpuCounters.h"
+
+/*
+Per-CPU call counters for "STraceCLI top", keyed by (pid, probe). Counting is off until a client asks for the first
+snapshot and stops again when that client's handle is closed.
+
+Every client starts from zero. There are two sets of tables and enabling counting zeroes the idle one and makes it
+current, count() reads the current set once, so a probe still counting from before only lands in the set that was just
+retired. Only a probe preempted inside count() across a whole session, until the next client zeroes its set again,
+could carry a stale count into it. An exited process's rows are dropped from the current set.
+*/
+class SyscallCounters {
+public:
+	void initialize();
+	void Destruct();
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// IOCTL_GET_COUNTERS, enables counting on first use
+	NTSTATUS snapshot(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+
+	// PASSIVE_LEVEL. From IRP_MJ_CLEANUP stops only if fileObject is the handle counting was enabled from, null always stops
+	void stop(PFILE_OBJECT fileObject = nullptr);
+
+	// IRQL <= DISPATCH_LEVEL. ticks is the entry to return duration, 0 for entries and for returns without an entry
+	void count(uint32_t probeId, bool isReturn, uint64_t ticks);
+
+	// PASSIVE_LEVEL, the driver's process notify
+	void onProcessExit(HANDLE ProcessId);
+private:
+	enum Counter { Calls, Completed, TotalTicks, CounterCount };
+
+	typedef PerCpuCounters<CounterCount, 1024> Tables;   // key is (pid << 32) | probeId
+
+	bool activate(PFILE_OBJECT fileObject);
+
+	volatile bool m_active;
+	PFILE_OBJECT m_owner;      // the handle whose first snapshot enabled counting
+	Tables m_sets[2];
+	Tables* volatile m_tables; // the set probes count into, one of m_sets
+	FAST_MUTEX m_lock;
+};
+
+extern SyscallCounters g_SyscallCounters;
@@ -0,0 +1,51 @@
+#pragma once
+
+// Shared between the driver and STraceCLI. Only fixed width types are used and the includer is responsible for
+// providing them, so this must stay free of any windows or kernel headers.
+
+/*
+IOCTL_SET_TARGETS takes one StpTargetRequest. Once anything was added only targeted processes reach the plugin and
+the record stream, until the targets are cleared. A targeted process passes its targeting on to the processes it
+creates for depth generations. A name rule targets every process with that image name as it makes its first call
+after the rule was added, processes it created before that aren't followed. Adding a pid fails unless it's a running
+process.
+
+IOCTL_GET_TARGETS returns an StpTargetState followed by up to the output buffer's worth of StpTargetProcess.
+*/
+enum StpTargetOp : uint32_t {
+	StpTargetAddProcess = 1,
+	StpTargetAddName = 2,
+	StpTargetRemoveProcess = 3,
+	StpTargetClear = 4,
+};
+
+#define STP_TARGET_NAME_LENGTH      16          // image names are truncated to 15 characters by the OS
+#define STP_TARGET_MAX_NAMES        16
+#define STP_TARGET_DEPTH_UNLIMITED  0xFFFFFFFF
+
+struct StpTargetRequest {
+	uint32_t op;                 // StpTargetOp
+	uint32_t depth;              // generations of children to follow, 0 is the process alone
+	uint64_t processId;          // StpTargetAddProcess, StpTargetRemoveProcess
+	char imageName[STP_TARGET_NAME_LENGTH];   // StpTargetAddName, NUL terminated, case insensitive
+};
+
+struct StpTargetName {
+	uint32_t depth;
+	char imageName[STP_TARGET_NAME_LENGTH];
+};
+
+struct StpTargetProcess {
+	uint64_t processId;
+	uint64_t rootProcessId;      // the process that was added by pid or matched a name
+	uint32_t depth;              // generations still followed below this one
+	uint32_t reserved;
+};
+
+struct StpTargetState {
+	uint32_t active;             // non zero while targeting filters calls
+	uint32_t processCount;       // targeted processes, may be more than were returned
+	uint32_t returnedCount;      // StpTargetProcess entries following this header
+	uint32_t nameCount;
+	StpTargetName names[STP_TARGET_MAX_NAMES];
+};
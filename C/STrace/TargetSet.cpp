@@ -0,0 +1,354 @@
+#include "TargetSet.h"
+#include "Constants.h"
+#include "ProcessCache.h"
+
+TargetSet g_Targets;
+
+void TargetSet::initialize() {
+	m_active = false;
+	m_generation = 1;
+	m_entryCount = 0;
+	m_nameCount = 0;
+	m_lock = 0;
+
+	m_buckets = (Entry**)ExAllocatePoolWithTag(NonPagedPoolNx, BucketCount * sizeof(Entry*), DRIVER_POOL_TAG);
+	if (!m_buckets) {
+		return;
+	}
+	memset(m_buckets, 0, BucketCount * sizeof(Entry*));
+}
+
+void TargetSet::Destruct() {
+	m_active = false;
+	freeAll();
+
+	if (m_buckets) {
+		ExFreePoolWithTag(m_buckets, DRIVER_POOL_TAG);
+		m_buckets = nullptr;
+	}
+}
+
+void TargetSet::onProcessCreated(HANDLE ParentId, HANDLE ProcessId) {
+	if (!m_active) {
+		return;
+	}
+
+	uint64_t rootProcessId = 0;
+	int64_t parentCreateTime = 0;
+	uint32_t depth = 0;
+
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	Entry* pParent = find(HandleToULong(ParentId));
+	if (pParent && pParent->depth) {
+		rootProcessId = pParent->rootProcessId;
+		parentCreateTime = pParent->createTime;
+		depth = pParent->depth == STP_TARGET_DEPTH_UNLIMITED ? STP_TARGET_DEPTH_UNLIMITED : pParent->depth - 1;
+	}
+	ExReleaseSpinLockShared(&m_lock, irql);
+
+	if (!rootProcessId) {
+		return;
+	}
+
+	// ParentId is the pid the child inherited from, by now it may name a newer process that got the value after the
+	// targeted one exited. Only the process the entry was made for, created before the child, hands its tree on.
+	PEPROCESS pParentProcess = nullptr;
+	if (!NT_SUCCESS(PsLookupProcessByProcessId(ParentId, &pParentProcess))) {
+		return;
+	}
+	const int64_t parentCreated = PsGetProcessCreateTimeQuadPart(pParentProcess);
+	ObDereferenceObject(pParentProcess);
+
+	PEPROCESS pProcess = nullptr;
+	if (!NT_SUCCESS(PsLookupProcessByProcessId(ProcessId, &pProcess))) {
+		return;
+	}
+	const int64_t created = PsGetProcessCreateTimeQuadPart(pProcess);
+	ObDereferenceObject(pProcess);
+
+	if (parentCreated == parentCreateTime && parentCreated <= created) {
+		add(HandleToULong(ProcessId), rootProcessId, depth, created);
+	}
+}
+
+void TargetSet::onProcessExit(HANDLE ProcessId) {
+	// the exited process's cached answer dies with its ProcessCache record, no need for a new generation
+	if (m_active) {
+		remove(HandleToULong(ProcessId), false);
+	}
+}
+
+bool TargetSet::lookup(const CallerInfo& callerInfo) {
+	// read before the lookup, a change made meanwhile leaves a stale generation behind and is looked up again next call
+	const LONG generation = m_generation;
+
+	volatile LONG64* pCache = callerInfo.process ? &ProcessCache::targetCache(callerInfo.process) : nullptr;
+	if (pCache) {
+		const LONG64 cached = *pCache;
+		if ((LONG)(cached >> 1) == generation)
+			return (cached & 1) != 0;
+	}
+
+	uint32_t depth = 0;
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	bool targeted = find(callerInfo.processId) != nullptr;
+	const bool nameMatched = !targeted && matchName(callerInfo.processName, depth);
+	ExReleaseSpinLockShared(&m_lock, irql);
+
+	// a process matching a name joins the set on its first call, from then on its children are followed. The new
+	// generation makes this process look itself up once more and find its entry.
+	if (nameMatched) {
+		const int64_t created = callerInfo.process ? callerInfo.process->createTime : PsGetProcessCreateTimeQuadPart(PsGetCurrentProcess());
+		add(callerInfo.processId, callerInfo.processId, depth, created);
+		return true;
+	}
+
+	if (pCache) {
+		*pCache = ((LONG64)generation << 1) | (targeted ? 1 : 0);
+	}
+	return targeted;
+}
+
+// m_lock must be held
+bool TargetSet::matchName(const char* imageName, uint32_t& depth) {
+	for (uint32_t i = 0; i < m_nameCount; i++) {
+		if (_stricmp(m_names[i].imageName, imageName) == 0) {
+			depth = m_names[i].depth;
+			return true;
+		}
+	}
+	return false;
+}
+
+// m_lock must be held
+TargetSet::Entry* TargetSet::find(uint64_t processId) {
+	if (!m_buckets) {
+		return nullptr;
+	}
+
+	for (Entry* pEntry = m_buckets[bucketOf(processId)]; pEntry; pEntry = pEntry->next) {
+		if (pEntry->processId == processId)
+			return pEntry;
+	}
+	return nullptr;
+}
+
+// m_lock must be held exclusively. Cached answers are only thrown away when the set changes, every new generation makes
+// each process take the lock once more.
+void TargetSet::newGeneration() {
+	// 0 is what a fresh ProcessCache record holds, skip it on wrap
+	if (InterlockedIncrement(&m_generation) == 0) {
+		InterlockedIncrement(&m_generation);
+	}
+}
+
+// IRQL <= DISPATCH_LEVEL. A process that's already targeted keeps the deeper of the two depths.
+bool TargetSet::add(uint64_t processId, uint64_t rootProcessId, uint32_t depth, int64_t createTime) {
+	auto pNew = (Entry*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Entry), DRIVER_POOL_TAG);
+	if (!pNew) {
+		return false;
+	}
+	pNew->processId = processId;
+	pNew->rootProcessId = rootProcessId;
+	pNew->createTime = createTime;
+	pNew->depth = depth;
+
+	// a deeper depth only matters to children created later, they look up their parent's entry, not the generation
+	bool added = false;
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	Entry* pEntry = find(processId);
+	if (pEntry) {
+		if (depth > pEntry->depth) {
+			pEntry->depth = depth;
+		}
+		added = true;
+	} else if (m_buckets && m_entryCount < MaxEntries) {
+		const uint32_t bucket = bucketOf(processId);
+		pNew->next = m_buckets[bucket];
+		m_buckets[bucket] = pNew;
+		m_entryCount++;
+		pNew = nullptr;
+		added = true;
+		newGeneration();
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pNew) {
+		ExFreePoolWithTag(pNew, DRIVER_POOL_TAG);
+	}
+	return added;
+}
+
+void TargetSet::remove(uint64_t processId, bool invalidate) {
+	Entry* pOld = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (Entry** ppLink = &m_buckets[bucketOf(processId)]; *ppLink; ppLink = &(*ppLink)->next) {
+			if ((*ppLink)->processId == processId) {
+				pOld = *ppLink;
+				*ppLink = pOld->next;
+				m_entryCount--;
+				break;
+			}
+		}
+	}
+
+	if (pOld && invalidate) {
+		newGeneration();
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pOld) {
+		ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+	}
+}
+
+void TargetSet::freeAll() {
+	Entry* pFree = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount; i++) {
+			while (m_buckets[i]) {
+				Entry* pEntry = m_buckets[i];
+				m_buckets[i] = pEntry->next;
+				pEntry->next = pFree;
+				pFree = pEntry;
+			}
+		}
+	}
+	m_entryCount = 0;
+	m_nameCount = 0;
+	newGeneration();
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	while (pFree) {
+		Entry* pNext = pFree->next;
+		ExFreePoolWithTag(pFree, DRIVER_POOL_TAG);
+		pFree = pNext;
+	}
+}
+
+NTSTATUS TargetSet::apply(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(StpTargetRequest)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	if (!m_buckets) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	StpTargetRequest request;
+	memcpy(&request, Irp->AssociatedIrp.SystemBuffer, sizeof(request));
+
+	switch (request.op) {
+	case StpTargetAddProcess: {
+		if (!request.processId || request.processId > MAXULONG) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		// a pid that isn't running would stay in the set until the value is reused by some unrelated process
+		PEPROCESS pProcess = nullptr;
+		NTSTATUS status = PsLookupProcessByProcessId(ULongToHandle((ULONG)request.processId), &pProcess);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		if (PsGetProcessExitProcessCalled(pProcess)) {
+			ObDereferenceObject(pProcess);
+			return STATUS_PROCESS_IS_TERMINATING;
+		}
+
+		// active first, the new process's children must be followed from the moment it's in the set
+		m_active = true;
+		status = add(request.processId, request.processId, request.depth, PsGetProcessCreateTimeQuadPart(pProcess)) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+
+		// the exit notification may have run between the check and the add, its remove came too early then
+		if (NT_SUCCESS(status) && PsGetProcessExitProcessCalled(pProcess)) {
+			remove(request.processId, true);
+			status = STATUS_PROCESS_IS_TERMINATING;
+		}
+		ObDereferenceObject(pProcess);
+		return status;
+	}
+	case StpTargetAddName: {
+		const size_t length = strnlen(request.imageName, sizeof(request.imageName));
+		if (!length || length == sizeof(request.imageName)) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		NTSTATUS status = STATUS_SUCCESS;
+		KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+		uint32_t i = 0;
+		for (; i < m_nameCount; i++) {
+			if (_stricmp(m_names[i].imageName, request.imageName) == 0)
+				break;
+		}
+
+		// a known name only changes the depth of processes that match it from now on
+		if (i < m_nameCount) {
+			m_names[i].depth = request.depth;
+		} else if (m_nameCount < STP_TARGET_MAX_NAMES) {
+			m_names[m_nameCount].depth = request.depth;
+			memcpy(m_names[m_nameCount].imageName, request.imageName, length + 1);
+			m_nameCount++;
+
+			// processes that already said no have to ask again
+			newGeneration();
+		} else {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		ExReleaseSpinLockExclusive(&m_lock, irql);
+
+		if (NT_SUCCESS(status)) {
+			m_active = true;
+		}
+		return status;
+	}
+	case StpTargetRemoveProcess:
+		remove(request.processId, true);
+		return STATUS_SUCCESS;
+	case StpTargetClear:
+		m_active = false;
+		freeAll();
+		return STATUS_SUCCESS;
+	}
+	return STATUS_INVALID_PARAMETER;
+}
+
+NTSTATUS TargetSet::query(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+	Irp->IoStatus.Information = 0;
+	const ULONG outputLength = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outputLength < sizeof(StpTargetState)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	auto pState = (StpTargetState*)Irp->AssociatedIrp.SystemBuffer;
+	auto pProcesses = (StpTargetProcess*)(pState + 1);
+	const uint32_t maxProcesses = (outputLength - sizeof(StpTargetState)) / sizeof(StpTargetProcess);
+	memset(pState, 0, sizeof(StpTargetState));
+
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	pState->active = m_active;
+	pState->processCount = m_entryCount;
+	pState->nameCount = m_nameCount;
+	memcpy(pState->names, m_names, m_nameCount * sizeof(StpTargetName));
+
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount && pState->returnedCount < maxProcesses; i++) {
+			for (Entry* pEntry = m_buckets[i]; pEntry && pState->returnedCount < maxProcesses; pEntry = pEntry->next) {
+				StpTargetProcess& process = pProcesses[pState->returnedCount++];
+				process.processId = pEntry->processId;
+				process.rootProcessId = pEntry->rootProcessId;
+				process.depth = pEntry->depth;
+				process.reserved = 0;
+			}
+		}
+	}
+	ExReleaseSpinLockShared(&m_lock, irql);
+
+	Irp->IoStatus.Information = sizeof(StpTargetState) + pState->returnedCount * sizeof(StpTargetProcess);
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "Interface.h"
+#include "TargetFormat.h"
+
+/*
+Driver side process targeting, seeded by pid or image name through IOCTL_SET_TARGETS and extended to children by the
+driver's process notify, so whole process trees are traced without plugins tracking them.
+
+The set itself is a small hash table under a spin lock, but the dispatch path rarely touches it: every process caches
+its answer in its ProcessCache record together with the set's generation, which changes whenever a process or a name
+is added or a process is removed. A call then costs one load and compare until the set changes, after which each
+process looks itself up again once.
+*/
+class TargetSet {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	// IRQL <= DISPATCH_LEVEL. True for every process while no targets are set
+	bool isTarget(const CallerInfo& callerInfo) {
+		if (!m_active)
+			return true;
+		return lookup(callerInfo);
+	}
+
+	// PASSIVE_LEVEL, the driver's process notify. A child of a targeted process inherits its tree, an exited process
+	// leaves the set. ParentId is only a pid, the parent must be the very process its entry was made for and older than
+	// the child.
+	void onProcessCreated(HANDLE ParentId, HANDLE ProcessId);
+	void onProcessExit(HANDLE ProcessId);
+
+	// IOCTL_SET_TARGETS
+	NTSTATUS apply(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+
+	// IOCTL_GET_TARGETS
+	NTSTATUS query(PIRP Irp, PIO_STACK_LOCATION IrpStack);
+private:
+	struct Entry {
+		Entry* next;
+		uint64_t processId;
+		uint64_t rootProcessId;
+		int64_t createTime;         // 100ns since 1601, tells a reused pid apart
+		uint32_t depth;
+	};
+
+	static const uint32_t BucketCount = 256;        // power of two
+	static const uint32_t MaxEntries = 4096;
+
+	static uint32_t bucketOf(uint64_t processId) {
+		// pids are multiples of 4
+		return (uint32_t)(processId >> 2) & (BucketCount - 1);
+	}
+
+	bool lookup(const CallerInfo& callerInfo);
+	bool matchName(const char* imageName, uint32_t& depth);
+	Entry* find(uint64_t processId);
+	bool add(uint64_t processId, uint64_t rootProcessId, uint32_t depth, int64_t createTime);
+	void remove(uint64_t processId, bool invalidate);
+	void newGeneration();
+	void freeAll();
+
+	volatile bool m_active;
+	volatile LONG m_generation;     // never 0, a ProcessCache record starts out with 0
+	Entry** m_buckets;
+	uint32_t m_entryCount;
+	StpTargetName m_names[STP_TARGET_MAX_NAMES];
+	uint32_t m_nameCount;
+	EX_SPIN_LOCK m_lock;
+};
+
+extern TargetSet g_Targets;
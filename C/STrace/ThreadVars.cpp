@@ -0,0 +1,314 @@
+#include "ThreadVars.h"
+#include "Constants.h"
+
+ThreadVars g_ThreadVars;
+
+void ThreadVars::initialize() {
+	m_sealed = false;
+	m_notifyRegistered = false;
+	m_varCount = 0;
+	m_layoutBytes = 0;
+	m_builtinVars = 0;
+	m_builtinBytes = 0;
+	m_generation = 0;
+	m_layout = 0;
+	m_indexed = nullptr;
+	m_buckets = nullptr;
+	m_blockCount = 0;
+	m_lock = 0;
+	ExInitializeFastMutex(&m_controlLock);
+}
+
+void ThreadVars::Destruct() {
+	reset();
+	InterlockedExchange64(&m_layout, 0);
+
+	if (m_notifyRegistered) {
+		PsRemoveCreateThreadNotifyRoutine(&ThreadVars::threadNotify);
+		m_notifyRegistered = false;
+	}
+
+	freeAll();
+
+	if (m_indexed) {
+		ExFreePoolWithTag(m_indexed, DRIVER_POOL_TAG);
+		m_indexed = nullptr;
+	}
+
+	if (m_buckets) {
+		ExFreePoolWithTag(m_buckets, DRIVER_POOL_TAG);
+		m_buckets = nullptr;
+	}
+}
+
+NTSTATUS ThreadVars::registerVar(const char* name, uint32_t size, uint32_t alignment, uint32_t* offset) {
+	if (!name || !offset || !size || !alignment || (alignment & (alignment - 1)) || alignment > CacheLine) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	const size_t nameLength = strlen(name);
+	if (!nameLength || nameLength > MaxNameLength) {
+		return STATUS_NAME_TOO_LONG;
+	}
+
+	NTSTATUS status = STATUS_SUCCESS;
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_sealed) {
+		status = STATUS_TOO_LATE;
+	} else {
+		uint32_t i = 0;
+		for (; i < m_varCount; i++) {
+			if (strcmp(m_vars[i].name, name) == 0)
+				break;
+		}
+
+		if (i < m_varCount) {
+			// same variable from another part of the plugin, a different type under the same name is a mistake
+			if (m_vars[i].size == size && m_vars[i].alignment == alignment) {
+				*offset = m_vars[i].offset;
+			} else {
+				status = STATUS_OBJECT_NAME_COLLISION;
+			}
+		} else {
+			const uint32_t start = (m_layoutBytes + alignment - 1) & ~(alignment - 1);
+			if (m_varCount >= MaxVars || size > MaxBytes || start > MaxBytes - size) {
+				status = STATUS_INSUFFICIENT_RESOURCES;
+			} else {
+				Var& var = m_vars[m_varCount++];
+				memcpy(var.name, name, nameLength + 1);
+				var.size = size;
+				var.alignment = alignment;
+				var.offset = start;
+				m_layoutBytes = start + size;
+				*offset = start;
+			}
+		}
+	}
+	ExReleaseFastMutex(&m_controlLock);
+	return status;
+}
+
+void ThreadVars::sealBuiltins() {
+	ExAcquireFastMutex(&m_controlLock);
+	m_layoutBytes = (m_layoutBytes + CacheLine - 1) & ~(CacheLine - 1);
+	m_builtinVars = m_varCount;
+	m_builtinBytes = m_layoutBytes;
+	if (m_varCount) {
+		publish();
+	}
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+void ThreadVars::seal() {
+	ExAcquireFastMutex(&m_controlLock);
+	// the builtin layout is too small for the plugin's offsets, no blocks rather than that
+	if (!m_sealed && m_varCount > m_builtinVars && !publish()) {
+		InterlockedExchange64(&m_layout, 0);
+	}
+	m_sealed = true;
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+void ThreadVars::reset() {
+	ExAcquireFastMutex(&m_controlLock);
+	const bool changed = m_varCount > m_builtinVars;
+	m_sealed = false;
+	m_varCount = m_builtinVars;
+	m_layoutBytes = m_builtinBytes;
+	if (changed) {
+		if (!m_builtinVars || !publish()) {
+			InterlockedExchange64(&m_layout, 0);
+		}
+	}
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+// m_controlLock held. Hands out blocks for the current layout.
+bool ThreadVars::publish() {
+	if (!m_indexed) {
+		m_indexed = (Block**)ExAllocatePoolWithTag(NonPagedPoolNx, IndexedThreads * sizeof(Block*), DRIVER_POOL_TAG);
+		if (!m_indexed) {
+			return false;
+		}
+		memset(m_indexed, 0, IndexedThreads * sizeof(Block*));
+	}
+
+	if (!m_buckets) {
+		m_buckets = (Block**)ExAllocatePoolWithTag(NonPagedPoolNx, BucketCount * sizeof(Block*), DRIVER_POOL_TAG);
+		if (!m_buckets) {
+			return false;
+		}
+		memset(m_buckets, 0, BucketCount * sizeof(Block*));
+	}
+
+	// without the exit notification blocks would outlive their threads, so no blocks at all then. It stays registered
+	// until DeviceUnload, blocks outlive the plugin.
+	if (!m_notifyRegistered) {
+		if (!NT_SUCCESS(PsSetCreateThreadNotifyRoutine(&ThreadVars::threadNotify))) {
+			return false;
+		}
+		m_notifyRegistered = true;
+	}
+
+	m_layoutBytes = (m_layoutBytes + CacheLine - 1) & ~(CacheLine - 1);
+
+	// a new generation, every thread zeroes its block again past the builtins before handing it out
+	m_generation++;
+	InterlockedExchange64(&m_layout, (LONG64)(((uint64_t)m_generation << 32) | m_layoutBytes));
+	return true;
+}
+
+void ThreadVars::threadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create) {
+	UNREFERENCED_PARAMETER(ProcessId);
+
+	// exit notifications run on the exiting thread
+	if (!Create) {
+		g_ThreadVars.remove(KeGetCurrentThread(), HandleToULong(ThreadId) / 4);
+	}
+}
+
+ThreadVars::Block* ThreadVars::find(PKTHREAD thread) {
+	Block* pFound = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	if (m_buckets) {
+		for (Block* pBlock = m_buckets[bucketOf(thread)]; pBlock; pBlock = pBlock->next) {
+			if (pBlock->thread == thread) {
+				pFound = pBlock;
+				break;
+			}
+		}
+	}
+	ExReleaseSpinLockShared(&m_lock, irql);
+	return pFound;
+}
+
+// pBlock is the thread's own block from an older layout, or null. Only the thread itself gets here for its block, so
+// nothing can be using the block it replaces.
+uint8_t* ThreadVars::refresh(Block* pBlock, uint64_t layout) {
+	const uint32_t generation = (uint32_t)(layout >> 32);
+	const uint32_t bytes = (uint32_t)layout;
+	const uint32_t kept = m_builtinBytes;
+	if (pBlock && pBlock->capacity >= bytes) {
+		memset(pBlock->data + kept, 0, bytes - kept);
+		pBlock->generation = generation;
+		return pBlock->data;
+	}
+
+	// past its exit notification nothing would free a new block, and the id is about to be reused
+	if (PsIsThreadTerminating(PsGetCurrentThread())) {
+		return nullptr;
+	}
+
+	PKTHREAD thread = KeGetCurrentThread();
+	auto pNew = (Block*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(Block) + CacheLine - 1 + bytes, DRIVER_POOL_TAG);
+	if (!pNew) {
+		return nullptr;
+	}
+
+	pNew->next = nullptr;
+	pNew->thread = thread;
+	pNew->generation = generation;
+	pNew->capacity = bytes;
+	pNew->data = (uint8_t*)(((ULONG_PTR)(pNew + 1) + CacheLine - 1) & ~(ULONG_PTR)(CacheLine - 1));
+	memset(pNew->data, 0, bytes);
+	if (pBlock) {
+		memcpy(pNew->data, pBlock->data, kept);
+	}
+
+	// replaces the block too small for this layout (pBlock), or one left in the slot by a thread that never got its notification
+	const ULONG index = HandleToULong(PsGetCurrentThreadId()) / 4;
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	Block* pOld = unlink(thread, index);
+	if ((ULONG)m_blockCount >= MaxBlocks) {
+		ExReleaseSpinLockExclusive(&m_lock, irql);
+		ExFreePoolWithTag(pNew, DRIVER_POOL_TAG);
+		if (pOld) {
+			ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+		}
+		return nullptr;
+	}
+
+	if (index < IndexedThreads) {
+		m_indexed[index] = pNew;
+	} else {
+		const uint32_t bucket = bucketOf(thread);
+		pNew->next = m_buckets[bucket];
+		m_buckets[bucket] = pNew;
+	}
+	m_blockCount++;
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pOld) {
+		ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+	}
+	return pNew->data;
+}
+
+// m_lock held exclusive. The block in index's slot, or thread's block in the hash past the table.
+ThreadVars::Block* ThreadVars::unlink(PKTHREAD thread, ULONG index) {
+	if (index < IndexedThreads) {
+		Block* pOld = m_indexed ? m_indexed[index] : nullptr;
+		if (pOld) {
+			m_indexed[index] = nullptr;
+			m_blockCount--;
+		}
+		return pOld;
+	}
+
+	if (m_buckets) {
+		for (Block** ppLink = &m_buckets[bucketOf(thread)]; *ppLink; ppLink = &(*ppLink)->next) {
+			if ((*ppLink)->thread == thread) {
+				Block* pOld = *ppLink;
+				*ppLink = pOld->next;
+				m_blockCount--;
+				return pOld;
+			}
+		}
+	}
+	return nullptr;
+}
+
+void ThreadVars::remove(PKTHREAD thread, ULONG index) {
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	Block* pOld = unlink(thread, index);
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pOld) {
+		ExFreePoolWithTag(pOld, DRIVER_POOL_TAG);
+	}
+}
+
+void ThreadVars::freeAll() {
+	Block* pFree = nullptr;
+
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	if (m_indexed) {
+		for (uint32_t i = 0; i < IndexedThreads; i++) {
+			if (m_indexed[i]) {
+				m_indexed[i]->next = pFree;
+				pFree = m_indexed[i];
+				m_indexed[i] = nullptr;
+			}
+		}
+	}
+
+	if (m_buckets) {
+		for (uint32_t i = 0; i < BucketCount; i++) {
+			while (m_buckets[i]) {
+				Block* pBlock = m_buckets[i];
+				m_buckets[i] = pBlock->next;
+				pBlock->next = pFree;
+				pFree = pBlock;
+			}
+		}
+	}
+	m_blockCount = 0;
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	while (pFree) {
+		Block* pNext = pFree->next;
+		ExFreePoolWithTag(pFree, DRIVER_POOL_TAG);
+		pFree = pNext;
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+
+/*
+Named per-thread variables for plugins, like DTrace's self-> variables. The 64 TLS slots are raw, unnamed and die when
+the outermost probe returns, these are fixed size values a plugin registers by name from StpInitialize and that keep
+their value for the lifetime of the thread.
+
+Registering a variable assigns it an offset in the per-thread block, the layout is fixed once StpInitialize returns. A
+probe gets its thread's block with GetThreadVars, a load from a table indexed by thread id (a hash lookup for the rare
+thread id past the table), and every variable is then a load at block + offset. Blocks are zeroed for each layout,
+start and size are cache line aligned so two threads' variables never share a line.
+
+Only the thread itself allocates, grows or re-zeroes its block, and its exit notification frees it, so a block is never
+freed under a probe running on another thread. Unloading the plugin just forgets the layout, every block is tagged with
+the generation of the layout it was zeroed for and its thread zeroes it again on first use under a newer one.
+
+The driver's own variables (names starting with $) registered from DriverEntry come first and outlive plugins, a new
+layout only zeroes what follows them.
+*/
+class ThreadVars {
+public:
+	static const uint32_t MaxVars = 128;
+	static const uint32_t MaxNameLength = 31;
+	static const uint32_t MaxBytes = 4096;          // per thread, including CallContexts' stack
+	static const uint32_t CacheLine = 64;
+
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload, after every probe is gone. Frees every block.
+	void Destruct();
+
+	// DriverEntry, after the driver's own variables are registered. Blocks are handed out from here on.
+	void sealBuiltins();
+
+	// PASSIVE_LEVEL, before seal. Registering a name again returns the offset it already has if size and alignment match.
+	// alignment is a power of two up to CacheLine.
+	NTSTATUS registerVar(const char* name, uint32_t size, uint32_t alignment, uint32_t* offset);
+
+	// PASSIVE_LEVEL. Fixes the layout after the plugin's StpInitialize
+	void seal();
+
+	// PASSIVE_LEVEL. Plugin unload, forgets the plugin's variables. Blocks stay with their threads until they exit.
+	void reset();
+
+	// IRQL <= DISPATCH_LEVEL. The current thread's block, allocated on first use. Null if no variables are registered, the
+	// layout isn't sealed yet or out of memory.
+	uint8_t* current() {
+		const uint64_t layout = (uint64_t)m_layout;
+		if (!(uint32_t)layout) {
+			return nullptr;
+		}
+
+		PKTHREAD thread = KeGetCurrentThread();
+		const ULONG index = HandleToULong(PsGetCurrentThreadId()) / 4;
+		Block* pBlock = index < IndexedThreads ? m_indexed[index] : find(thread);
+		if (pBlock && pBlock->thread == thread && pBlock->generation == (uint32_t)(layout >> 32)) {
+			return pBlock->data;
+		}
+		return refresh(pBlock && pBlock->thread == thread ? pBlock : nullptr, layout);
+	}
+private:
+	struct Var {
+		char name[MaxNameLength + 1];
+		uint32_t size;
+		uint32_t alignment;
+		uint32_t offset;
+	};
+
+	struct Block {
+		Block* next;          // hash chain, thread ids past the table only
+		PKTHREAD thread;
+		uint32_t generation;  // of the layout data was last zeroed for
+		uint32_t capacity;
+		uint8_t* data;        // CacheLine aligned, inside this allocation
+	};
+
+	static const uint32_t IndexedThreads = 64 * 1024;   // thread ids are multiples of 4, ids below 4 * this are indexed
+	static const uint32_t BucketCount = 1024;           // power of two
+	static const uint32_t MaxBlocks = 64 * 1024;
+
+	static uint32_t bucketOf(PKTHREAD thread) {
+		// fibonacci hashing, KTHREADs are pool allocations with the low bits clear
+		return (uint32_t)(((uint64_t)thread * 0x9E3779B97F4A7C15ull) >> 54);
+	}
+
+	static void threadNotify(HANDLE ProcessId, HANDLE ThreadId, BOOLEAN Create);
+
+	Block* find(PKTHREAD thread);
+	uint8_t* refresh(Block* pBlock, uint64_t layout);
+	Block* unlink(PKTHREAD thread, ULONG index);
+	void remove(PKTHREAD thread, ULONG index);
+	void freeAll();
+	bool publish();
+
+	bool m_sealed;
+	bool m_notifyRegistered;
+	Var m_vars[MaxVars];
+	uint32_t m_varCount;
+	uint32_t m_layoutBytes;      // rounded up to CacheLine when sealed
+	uint32_t m_builtinVars;
+	uint32_t m_builtinBytes;     // the driver's own variables, kept when the layout changes
+	uint32_t m_generation;
+	volatile LONG64 m_layout;    // what current() hands out, generation << 32 | bytes, no blocks while bytes is zero
+	Block** m_indexed;           // IndexedThreads entries, written under m_lock, read without it
+	Block** m_buckets;
+	volatile LONG m_blockCount;
+	EX_SPIN_LOCK m_lock;
+	FAST_MUTEX m_controlLock;
+};
+
+extern ThreadVars g_ThreadVars;
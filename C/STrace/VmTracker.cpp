@@ -0,0 +1,440 @@
+#include "VmTracker.h"
+#include "Constants.h"
+#include "DynamicTrace.h"
+#include "Logger.h"
+#include "RecordStream.h"
+
+VmTracker g_VmTracker;
+
+static const DriverProbes::Syscall VmSyscalls[] = {
+	DriverProbes::AllocateVirtualMemory,
+	DriverProbes::ProtectVirtualMemory,
+	DriverProbes::WriteVirtualMemory,
+	DriverProbes::MapViewOfSection,
+	DriverProbes::FreeVirtualMemory,
+	DriverProbes::UnmapViewOfSection,
+};
+
+static bool isWritable(uint32_t protect) {
+	switch (protect & 0xFF) {
+	case PAGE_READWRITE:
+	case PAGE_WRITECOPY:
+	case PAGE_EXECUTE_READWRITE:
+	case PAGE_EXECUTE_WRITECOPY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool isExecutable(uint32_t protect) {
+	switch (protect & 0xFF) {
+	case PAGE_EXECUTE:
+	case PAGE_EXECUTE_READ:
+	case PAGE_EXECUTE_READWRITE:
+	case PAGE_EXECUTE_WRITECOPY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void VmTracker::initialize() {
+	m_active = false;
+	memset(m_buckets, 0, sizeof(m_buckets));
+	m_processCount = 0;
+	m_regionBudget = MaxRegions;
+	m_exhausted = 0;
+	m_lock = 0;
+	ExInitializeFastMutex(&m_controlLock);
+}
+
+void VmTracker::Destruct() {
+	stop();
+}
+
+NTSTATUS VmTracker::start() {
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_active) {
+		ExReleaseFastMutex(&m_controlLock);
+		return STATUS_SUCCESS;
+	}
+
+	m_exhausted = 0;
+
+	// active first, the probes must be recognized from their first call on
+	m_active = true;
+	NTSTATUS status = STATUS_SUCCESS;
+	uint32_t acquired = 0;
+	for (; acquired < ARRAYSIZE(VmSyscalls); acquired++) {
+		status = g_DriverProbes.acquire(VmSyscalls[acquired]);
+		if (!NT_SUCCESS(status))
+			break;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		for (uint32_t i = 0; i < acquired; i++) {
+			g_DriverProbes.release(VmSyscalls[i]);
+		}
+		m_active = false;
+	}
+	ExReleaseFastMutex(&m_controlLock);
+
+	if (!NT_SUCCESS(status)) {
+		stop();
+	}
+	return status;
+}
+
+void VmTracker::stop() {
+	ExAcquireFastMutex(&m_controlLock);
+	if (m_active) {
+		m_active = false;
+		for (uint32_t i = 0; i < ARRAYSIZE(VmSyscalls); i++) {
+			g_DriverProbes.release(VmSyscalls[i]);
+		}
+	}
+
+	// unlinked under the lock, a call still using a process's regions frees them when it's done
+	ProcessRegions* pList = nullptr;
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	for (uint32_t i = 0; i < BucketCount; i++) {
+		while (ProcessRegions* pRegions = m_buckets[i]) {
+			m_buckets[i] = pRegions->next;
+			pRegions->next = pList;
+			pList = pRegions;
+		}
+	}
+	m_processCount = 0;
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	while (pList) {
+		ProcessRegions* pNext = pList->next;
+		release(pList);
+		pList = pNext;
+	}
+	ExReleaseFastMutex(&m_controlLock);
+}
+
+void VmTracker::onProcessExit(HANDLE ProcessId) {
+	// stop frees every process's regions
+	if (m_active) {
+		purgeProcess(HandleToULong(ProcessId));
+	}
+}
+
+VmTracker::ProcessRegions* VmTracker::lookup(uint32_t processId, bool create) {
+	ProcessRegions* pFound = nullptr;
+	KIRQL irql = ExAcquireSpinLockShared(&m_lock);
+	for (ProcessRegions* pRegions = m_buckets[bucketOf(processId)]; pRegions; pRegions = pRegions->next) {
+		if (pRegions->processId == processId) {
+			InterlockedIncrement(&pRegions->refCount);
+			pFound = pRegions;
+			break;
+		}
+	}
+	ExReleaseSpinLockShared(&m_lock, irql);
+
+	if (pFound || !create) {
+		return pFound;
+	}
+
+	auto pNew = (ProcessRegions*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(ProcessRegions), DRIVER_POOL_TAG);
+	if (!pNew) {
+		return nullptr;
+	}
+
+	pNew->processId = processId;
+	pNew->refCount = 2;
+	ExInitializeFastMutex(&pNew->lock);
+	pNew->tree.initialize(&m_regionBudget);
+
+	irql = ExAcquireSpinLockExclusive(&m_lock);
+
+	// another call may have added the process since
+	ProcessRegions** pBucket = &m_buckets[bucketOf(processId)];
+	for (ProcessRegions* pRegions = *pBucket; pRegions; pRegions = pRegions->next) {
+		if (pRegions->processId == processId) {
+			InterlockedIncrement(&pRegions->refCount);
+			pFound = pRegions;
+			break;
+		}
+	}
+
+	if (!pFound && m_active && m_processCount < MaxProcesses) {
+		pNew->next = *pBucket;
+		*pBucket = pNew;
+		m_processCount++;
+		pFound = pNew;
+		pNew = nullptr;
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pNew) {
+		ExFreePoolWithTag(pNew, DRIVER_POOL_TAG);
+	}
+	return pFound;
+}
+
+void VmTracker::release(ProcessRegions* pRegions) {
+	if (InterlockedDecrement(&pRegions->refCount) == 0) {
+		pRegions->tree.clear();
+		ExFreePoolWithTag(pRegions, DRIVER_POOL_TAG);
+	}
+}
+
+void VmTracker::purgeProcess(uint32_t processId) {
+	ProcessRegions* pFound = nullptr;
+	KIRQL irql = ExAcquireSpinLockExclusive(&m_lock);
+	for (ProcessRegions** pLink = &m_buckets[bucketOf(processId)]; *pLink; pLink = &(*pLink)->next) {
+		if ((*pLink)->processId == processId) {
+			pFound = *pLink;
+			*pLink = pFound->next;
+			m_processCount--;
+			break;
+		}
+	}
+	ExReleaseSpinLockExclusive(&m_lock, irql);
+
+	if (pFound) {
+		release(pFound);
+	}
+}
+
+void VmTracker::noteExhausted(bool complete) {
+	if (!complete && InterlockedExchange(&m_exhausted, 1) == 0) {
+		LOG_WARN("[!] Memory tracking is out of regions, changes are being lost\r\n");
+	}
+}
+
+void VmTracker::assignProtection(ProcessRegions* pRegions, uint64_t start, uint64_t end, uint32_t protect, uint32_t reportedOld, uint32_t flags, bool inheritBase) {
+	bool seen = false;
+	bool wasWritableExecutable = true;
+	bool madeExecutable = false;    // something writable or written from another process is becoming executable
+	uint32_t oldProtect = 0;
+	uint32_t oldFlags = 0;
+
+	const RegionTree::Region region = { start, end, start, protect, flags };
+	const bool complete = pRegions->tree.assign(region, [&](const RegionTree::Region& old, RegionTree::Region& replacement) {
+		if (!seen) {
+			seen = true;
+			oldProtect = old.protect ? old.protect : reportedOld;
+			if (inheritBase) {
+				replacement.allocationBase = old.allocationBase;
+			}
+		}
+
+		const bool written = isWritable(old.protect) || (old.flags & StpMemoryFlagRemoteWrite);
+		if (written && !isExecutable(old.protect) && !madeExecutable) {
+			madeExecutable = true;
+			oldProtect = old.protect ? old.protect : reportedOld;
+		}
+
+		wasWritableExecutable &= isWritable(old.protect) && isExecutable(old.protect);
+		oldFlags |= old.flags;
+
+		// remote writes only count until the region is next made executable
+		replacement.flags |= old.flags & StpMemoryFlagMapped;
+		if (!isExecutable(protect)) {
+			replacement.flags |= old.flags & StpMemoryFlagRemoteWrite;
+		}
+	});
+	noteExhausted(complete);
+
+	uint32_t eventFlags = flags | (oldFlags & (StpMemoryFlagMapped | StpMemoryFlagRemoteWrite | StpMemoryFlagUnknown));
+	if (!seen && reportedOld) {
+		oldProtect = reportedOld;
+		madeExecutable = isWritable(reportedOld) && !isExecutable(reportedOld);
+		eventFlags |= StpMemoryFlagUnknown;
+	}
+
+	// views of images are mapped copy on write and executable, only a view asking for write access is interesting
+	const bool writableExecutable = (eventFlags & StpMemoryFlagMapped) ? (protect & 0xFF) == PAGE_EXECUTE_READWRITE :
+		isWritable(protect) && isExecutable(protect);
+	const uint32_t targetPid = pRegions->processId;
+	if (writableExecutable) {
+		if (!seen || !wasWritableExecutable) {
+			g_RecordStream.writeMemory(StpMemoryWritableExecutable, eventFlags, targetPid, start, end - start, oldProtect, protect);
+		}
+	} else if (isExecutable(protect) && madeExecutable) {
+		g_RecordStream.writeMemory(StpMemoryWriteToExecute, eventFlags, targetPid, start, end - start, oldProtect, protect);
+	}
+}
+
+void VmTracker::markRemoteWrite(ProcessRegions* pRegions, uint64_t start, uint64_t end) {
+	bool seen = false;
+	pRegions->tree.forEachOverlap(start, end, [&](RegionTree::Region& region) {
+		region.flags |= StpMemoryFlagRemoteWrite;
+		seen = true;
+	});
+
+	// remembered even without knowing the protection, so making it executable later is still caught
+	if (!seen) {
+		const RegionTree::Region region = { start, end, start, 0, StpMemoryFlagUnknown | StpMemoryFlagRemoteWrite };
+		noteExhausted(pRegions->tree.assign(region, [](const RegionTree::Region&, RegionTree::Region&) {}));
+	}
+}
+
+void VmTracker::unmap(ProcessRegions* pRegions, uint64_t address) {
+	// any address inside the view unmaps all of it
+	const RegionTree::Region* pRegion = pRegions->tree.firstOverlap(address, address + 1);
+	if (pRegion) {
+		pRegions->tree.eraseAllocation(pRegion->allocationBase);
+	}
+}
+
+void VmTracker::onEntry(DriverProbes::Syscall syscall, uint32_t paramCount, const uint64_t* pArgs, uint32_t argCount, const uint64_t* pStackArgs, VmCall& call) {
+	// kernel mode callers are trusted, and mostly map and free on behalf of the caller anyway
+	if (!m_active || !isVmSyscall(syscall) || ExGetPreviousMode() != UserMode) {
+		return;
+	}
+
+	MachineState args = { 0 };
+	args.paramCount = paramCount;
+	args.regArgsSize = argCount;
+	args.pRegArgs = (uint64_t*)pArgs;
+	args.pStackArgs = (uint64_t*)pStackArgs;
+
+	memset(&call, 0, sizeof(call));
+	switch (syscall) {
+	case DriverProbes::AllocateVirtualMemory:
+		// ProcessHandle, *BaseAddress, ZeroBits, *RegionSize, AllocationType, Protect
+		call.processHandle = args.read_argument(0);
+		call.base = args.read_argument(1);
+		call.size = args.read_argument(3);
+		call.type = (uint32_t)args.read_argument(4);
+		call.protect = (uint32_t)args.read_argument(5);
+		break;
+	case DriverProbes::ProtectVirtualMemory:
+		// ProcessHandle, *BaseAddress, *RegionSize, NewProtect, *OldProtect
+		call.processHandle = args.read_argument(0);
+		call.base = args.read_argument(1);
+		call.size = args.read_argument(2);
+		call.protect = (uint32_t)args.read_argument(3);
+		call.pOldProtect = args.read_argument(4);
+		break;
+	case DriverProbes::WriteVirtualMemory:
+		// ProcessHandle, BaseAddress, Buffer, BufferSize, *NumberOfBytesWritten
+		call.processHandle = args.read_argument(0);
+		call.base = args.read_argument(1);
+		call.size = args.read_argument(3);
+		break;
+	case DriverProbes::MapViewOfSection:
+		// SectionHandle, ProcessHandle, *BaseAddress, ZeroBits, CommitSize, *SectionOffset, *ViewSize, InheritDisposition,
+		// AllocationType, Win32Protect
+		call.processHandle = args.read_argument(1);
+		call.base = args.read_argument(2);
+		call.size = args.read_argument(6);
+		call.type = (uint32_t)args.read_argument(8);
+		call.protect = (uint32_t)args.read_argument(9);
+		break;
+	case DriverProbes::FreeVirtualMemory:
+		// ProcessHandle, *BaseAddress, *RegionSize, FreeType
+		call.processHandle = args.read_argument(0);
+		call.base = args.read_argument(1);
+		call.size = args.read_argument(2);
+		call.type = (uint32_t)args.read_argument(3);
+		break;
+	case DriverProbes::UnmapViewOfSection:
+		// ProcessHandle, BaseAddress
+		call.processHandle = args.read_argument(0);
+		call.base = args.read_argument(1);
+		break;
+	default:
+		return;
+	}
+	call.syscall = (uint32_t)syscall + 1;
+}
+
+void VmTracker::onReturn(DriverProbes::Syscall syscall, NTSTATUS status, VmCall& call) {
+	// a nested kernel mode call returns with its own previous mode and mustn't consume the outer call's arguments
+	if (!isVmSyscall(syscall) || ExGetPreviousMode() != UserMode) {
+		return;
+	}
+
+	const VmCall vmCall = call;
+	call.syscall = 0;
+	if (!m_active || vmCall.syscall != (uint32_t)syscall + 1 || !NT_SUCCESS(status) || KeGetCurrentIrql() != PASSIVE_LEVEL) {
+		return;
+	}
+
+	// the kernel wrote the page aligned range back through the caller's pointers
+	uint64_t base = vmCall.base;
+	uint64_t size = vmCall.size;
+	if (syscall != DriverProbes::WriteVirtualMemory && syscall != DriverProbes::UnmapViewOfSection) {
+		if (!TraceAccessMemory(&base, (ULONG_PTR)vmCall.base, sizeof(base), sizeof(base), TRUE) ||
+			!TraceAccessMemory(&size, (ULONG_PTR)vmCall.size, sizeof(size), sizeof(size), TRUE))
+			return;
+	}
+
+	uint32_t oldProtect = 0;
+	if (syscall == DriverProbes::ProtectVirtualMemory && !TraceAccessMemory(&oldProtect, (ULONG_PTR)vmCall.pOldProtect, sizeof(oldProtect), sizeof(oldProtect), TRUE)) {
+		oldProtect = 0;
+	}
+
+	if (syscall != DriverProbes::UnmapViewOfSection && (!size || base + size < base)) {
+		return;
+	}
+
+	// the memory belongs to the process the handle names
+	const uint32_t callerPid = HandleToULong(PsGetCurrentProcessId());
+	uint32_t targetPid = callerPid;
+	if ((HANDLE)vmCall.processHandle != NtCurrentProcess()) {
+		PEPROCESS pProcess = nullptr;
+		if (!NT_SUCCESS(ObReferenceObjectByHandle((HANDLE)vmCall.processHandle, 0, *PsProcessType, UserMode, (PVOID*)&pProcess, nullptr))) {
+			return;
+		}
+		targetPid = HandleToULong(PsGetProcessId(pProcess));
+		ObDereferenceObject(pProcess);
+	}
+	const bool remote = targetPid != callerPid;
+
+	if (syscall == DriverProbes::WriteVirtualMemory && !remote) {
+		return;
+	}
+
+	// freeing memory the tracker never saw leaves nothing to update
+	const bool removes = syscall == DriverProbes::FreeVirtualMemory || syscall == DriverProbes::UnmapViewOfSection;
+	ProcessRegions* pRegions = lookup(targetPid, !removes);
+	if (!pRegions) {
+		return;
+	}
+
+	ExAcquireFastMutex(&pRegions->lock);
+	switch (syscall) {
+	case DriverProbes::AllocateVirtualMemory:
+		// committing part of a reservation keeps the reservation's base
+		if (vmCall.type & (MEM_COMMIT | MEM_RESERVE)) {
+			assignProtection(pRegions, base, base + size, vmCall.protect, 0, 0, !(vmCall.type & MEM_RESERVE));
+		}
+		break;
+	case DriverProbes::ProtectVirtualMemory:
+		assignProtection(pRegions, base, base + size, vmCall.protect, oldProtect, 0, true);
+		break;
+	case DriverProbes::MapViewOfSection:
+		if (remote && isExecutable(vmCall.protect)) {
+			g_RecordStream.writeMemory(StpMemoryCrossProcessMap, StpMemoryFlagMapped, targetPid, base, size, 0, vmCall.protect);
+		}
+		assignProtection(pRegions, base, base + size, vmCall.protect, 0, StpMemoryFlagMapped, false);
+		break;
+	case DriverProbes::WriteVirtualMemory: {
+		const RegionTree::Region* pRegion = pRegions->tree.firstOverlap(base, base + size);
+		g_RecordStream.writeMemory(StpMemoryCrossProcessWrite, pRegion ? pRegion->flags : StpMemoryFlagUnknown, targetPid, base, size,
+			pRegion ? pRegion->protect : 0, 0);
+		markRemoteWrite(pRegions, base, base + size);
+		break;
+	}
+	case DriverProbes::FreeVirtualMemory:
+		if (vmCall.type & (MEM_RELEASE | MEM_DECOMMIT)) {
+			noteExhausted(pRegions->tree.erase(base, base + size));
+		}
+		break;
+	case DriverProbes::UnmapViewOfSection:
+		unmap(pRegions, base);
+		break;
+	default:
+		break;
+	}
+	ExReleaseFastMutex(&pRegions->lock);
+	release(pRegions);
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <ntifs.h>
+#include "MyStdint.h"
+#include "DriverProbes.h"
+#include "RegionTree.h"
+
+// What the entry probe of a followed virtual memory call keeps for its return, in the call's g_DriverCalls frame
+struct VmCall {
+	uint32_t syscall;           // DriverProbes::Syscall + 1, 0 if there's nothing to consume
+	uint32_t protect;           // requested PAGE_* protection
+	uint32_t type;              // MEM_* allocation or free type
+	uint32_t reserved;
+	uint64_t processHandle;
+	uint64_t base;              // PVOID* of allocate, protect, map and free, the address itself for write and unmap
+	uint64_t size;              // PSIZE_T of allocate, protect, map and free, the byte count itself for write
+	uint64_t pOldProtect;       // PULONG of protect
+};
+
+/*
+Virtual memory tracking, to catch code that is written and then run without tracing every call. While it's on (STraceCLI
+config memory=on) the tracker holds the DriverProbes virtual memory syscalls and keeps, for every process a user mode
+caller touched, a RegionTree of the regions those calls produced with their current protection. The return probe of a
+successful call updates the tree of the process the memory belongs to and writes an StpMemoryRecord to the record
+stream for the transitions worth seeing: writable to executable, writable and executable at once, writes into and
+executable views mapped into another process. Nothing else is reported.
+
+Memory allocated before tracking started, or by kernel mode callers, is unknown. Protecting an unknown region falls
+back to the old protection the call reports, so the first transition is still seen. Regions of an exiting process are
+freed when it exits, and the regions of every process count against one node budget, once it's used up changes the
+tracker can't record are lost.
+*/
+class VmTracker {
+public:
+	// Must be called from DriverEntry before any other member
+	void initialize();
+
+	// DeviceUnload
+	void Destruct();
+
+	bool isActive() const {
+		return m_active;
+	}
+
+	// PASSIVE_LEVEL
+	NTSTATUS start();
+	void stop();
+
+	// Probe hooks, see DriverProbes. The entry remembers the call's arguments in call, the return consumes them.
+	void onEntry(DriverProbes::Syscall syscall, uint32_t paramCount, const uint64_t* pArgs, uint32_t argCount, const uint64_t* pStackArgs, VmCall& call);
+	void onReturn(DriverProbes::Syscall syscall, NTSTATUS status, VmCall& call);
+
+	// PASSIVE_LEVEL, the driver's process notify
+	void onProcessExit(HANDLE ProcessId);
+private:
+	struct ProcessRegions {
+		ProcessRegions* next;
+		uint32_t processId;
+		volatile LONG refCount;     // the table's reference plus one per call using it
+		FAST_MUTEX lock;
+		RegionTree tree;
+	};
+
+	static const uint32_t BucketCount = 256;        // power of two
+	static const uint32_t MaxProcesses = 1024;
+	static const LONG MaxRegions = 128 * 1024;      // over every process
+
+	static bool isVmSyscall(DriverProbes::Syscall syscall) {
+		return syscall >= DriverProbes::AllocateVirtualMemory && syscall <= DriverProbes::UnmapViewOfSection;
+	}
+
+	static uint32_t bucketOf(uint32_t processId) {
+		// process ids are multiples of 4
+		return (processId >> 2) & (BucketCount - 1);
+	}
+
+	// Referenced, null if the process has no regions and create is false, or if the table is full
+	ProcessRegions* lookup(uint32_t processId, bool create);
+	void release(ProcessRegions* pRegions);
+	void purgeProcess(uint32_t processId);
+
+	// pRegions->lock must be held
+	void assignProtection(ProcessRegions* pRegions, uint64_t start, uint64_t end, uint32_t protect, uint32_t reportedOld, uint32_t flags, bool inheritBase);
+	void markRemoteWrite(ProcessRegions* pRegions, uint64_t start, uint64_t end);
+	void unmap(ProcessRegions* pRegions, uint64_t address);
+	void noteExhausted(bool complete);
+
+	volatile bool m_active;
+	ProcessRegions* m_buckets[BucketCount];
+	uint32_t m_processCount;
+	volatile LONG m_regionBudget;
+	volatile LONG m_exhausted;      // logged once per start
+	EX_SPIN_LOCK m_lock;
+	FAST_MUTEX m_controlLock;
+};
+
+extern VmTracker g_VmTracker;
@@ -7,8 +7,24 @@
 #include "DynamicTrace.h"
 #include "Logger.h"
 #include "ManualMap.h"
+#include "RecordStream.h"
+#include "SyscallCounters.h"
+#include "DriverConfig.h"
+#include "DriverProbes.h"
+#include "HandleCache.h"
+#include "HandleTracker.h"
+#include "VmTracker.h"
+#include "IoCounters.h"
+#include "NgramProfiles.h"
+#include "ModuleEvents.h"
+#include "ThreadVars.h"
+#include "CallContexts.h"
+#include "ProcessCache.h"
+#include "TargetSet.h"
 #include "Interface.h"
 
+ManualMapper g_DllMapper;
+
 class PluginData {
 public:
     PluginData() {
@@ -43,7 +59,8 @@ public:
         auto atomicGot = (uint64_t)_InterlockedCompareExchange64((volatile LONG64*)&pImageBase, 0, expected);
 
         if (atomicGot == expected && expected != 0) {
-            ExFreePoolWithTag((char*)expected, DRIVER_POOL_TAG);
+            // may keep the image around for a reload of the same plugin
+            g_DllMapper.unmapImage(expected);
             zero();
             return true;
         }
@@ -82,11 +99,24 @@ NTSTATUS SetCallbackApi(const char* syscallName, ULONG64 probeId) {
         return STATUS_UNSUCCESSFUL;
     }
 
+    // the driver's own hooks have to recognize the plugin's id before the first call under it
+    g_DriverProbes.pluginSetCallback(syscallName, (uint32_t)probeId);
+
     // set both entry and exit callbacks. This is because this driver requires both due to how TLS data is managed in this design.
     NTSTATUS status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, true, (ULONG64)&StpCallbackEntry, probeId);
     if (NT_SUCCESS(status)) {
         status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, false, (ULONG64)&StpCallbackReturn, probeId);
     }
+
+    if (!NT_SUCCESS(status)) {
+        NTSTATUS ignored;
+        g_DriverProbes.pluginUnSetCallback(syscallName, ignored);
+    }
+
+    // lets stream clients print names instead of probe ids
+    if (NT_SUCCESS(status)) {
+        g_RecordStream.setProbeName((uint32_t)probeId, syscallName);
+    }
     return status;
 }
 
@@ -94,8 +124,14 @@ NTSTATUS UnSetCallbackApi(const char* syscallName) {
     if (!TraceSystemApi || !TraceSystemApi->KeSetSystemServiceCallback) {
         return STATUS_UNSUCCESSFUL;
     }
+
+    // while the driver follows the syscall itself the probe goes back to it rather than away
+    NTSTATUS status;
+    if (g_DriverProbes.pluginUnSetCallback(syscallName, status)) {
+        return status;
+    }
     
-    NTSTATUS status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, true, 0, 0);
+    status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, true, 0, 0);
     if (NT_SUCCESS(status)) {
         status = TraceSystemApi->KeSetSystemServiceCallback(syscallName, false, 0, 0);
     }
@@ -127,6 +163,35 @@ NTSTATUS UnSetEtwCallback()
     return EtwStopTracingSession();
 }
 
+NTSTATUS EnableHandlePathsApi()
+{
+    return g_HandleCache.start(HandleCache::UserPlugin);
+}
+
+NTSTATUS GetHandlePathApi(HANDLE handle, wchar_t* path, uint32_t pathChars, uint32_t* pathLength)
+{
+    return g_HandleCache.lookup(handle, path, pathChars, pathLength);
+}
+
+NTSTATUS RegisterThreadVarApi(const char* name, uint32_t size, uint32_t alignment, uint32_t* offset)
+{
+    // names starting with $ are the driver's own
+    if (!name || name[0] == '$') {
+        return STATUS_INVALID_PARAMETER;
+    }
+    return g_ThreadVars.registerVar(name, size, alignment, offset);
+}
+
+uint8_t* GetThreadVarsApi()
+{
+    return g_ThreadVars.current();
+}
+
+NTSTATUS SetCallContextSizeApi(uint32_t size)
+{
+    return g_CallContexts.setSize(size);
+}
+
 bool LogInitialized = false;
 PluginData pluginData;
 
@@ -135,7 +200,28 @@ NTSTATUS NotImplementedRoutine()
 	return STATUS_NOT_IMPLEMENTED;
 }
 
-ManualMapper g_DllMapper;
+// What the entry probe hands to the return probe of the same call, kept in g_DriverCalls. TLSData can't hold it, a
+// nested kernel mode syscall's return frees it before the outer call returns.
+struct CallState {
+    // the entry probe skipped this targeted call because of sampling, the return probe must skip it too
+    bool sampledOut;
+
+    // the entry probe pushed a g_CallContexts block for this call, only then may the return probe find and pop one
+    bool contextPushed;
+
+    // QueryPerformanceCounter at the entry probe while syscall counters are on or the call reaches the plugin, 0 if
+    // neither was
+    uint64_t entryTimestamp;
+
+    // the PHANDLE of a DriverProbes syscall that creates a handle
+    uint64_t handleOut;
+
+    // the arguments of a virtual memory syscall the VM tracker follows
+    VmCall vmCall;
+
+    // the arguments of an NtReadFile or NtWriteFile I/O accounting follows
+    IoCall ioCall;
+};
 
 /**
 pService: Pointer to system service from SSDT
@@ -156,15 +242,82 @@ extern "C" __declspec(dllexport) void StpCallbackEntry(ULONG64 pService, ULONG32
     if (!TraceSystemApi->isCallFromInsideProbe()) {
         TLSData* ptlsData = TraceSystemApi->getRawTLSData();
 
-        if (pluginData.isLoaded() && pluginData.pCallbackEntry && pluginData.pIsTarget && pluginData.pIsTarget(ptlsData->getCallerInfo())) {
-            ptlsData->getCallerInfo().CaptureStackTrace(calledChildren ? 1 : 0);
+        // without a frame (out of memory) the return probe sees the defaults
+        CallState scratch = { 0 };
+        CallState* pCall = (CallState*)g_DriverCalls.push(probeId);
+        CallState& call = pCall ? *pCall : scratch;
+
+        // the handle cache and the trackers follow every process, the driver's own probes end there
+        const DriverProbes::Syscall driverSyscall = g_DriverProbes.syscallFor(probeId);
+        if (driverSyscall == DriverProbes::Close) {
+            // dropped before the close, the value may be reused by another thread as soon as it's closed
+            if (ExGetPreviousMode() == UserMode) {
+                g_HandleCache.onClose((HANDLE)pArgs[0]);
+                g_HandleTracker.onClose((HANDLE)pArgs[0]);
+            }
+        } else if (driverSyscall != DriverProbes::None) {
+            DriverProbes::onEntry(driverSyscall, pArgs, call.handleOut);
+            g_VmTracker.onEntry(driverSyscall, paramCount, pArgs, pArgSize, (uint64_t*)pStackArgs, call.vmCall);
+            g_IoCounters.onEntry(driverSyscall, paramCount, pArgs, pArgSize, (uint64_t*)pStackArgs, call.ioCall);
+        }
+
+        if (DriverProbes::isInternalProbe(probeId)) {
+            TraceSystemApi->ExitProbe();
+            return;
+        }
+
+        // sampling is decided once per call, the return probe follows the entry's decision
+        const bool targeted = pluginData.isLoaded() && pluginData.pCallbackEntry && pluginData.pIsTarget && g_Targets.isTarget(ptlsData->getCallerInfo()) &&
+            pluginData.pIsTarget(ptlsData->getCallerInfo());
+        call.sampledOut = targeted && !g_Config.shouldSample();
+        const bool delivered = targeted && !call.sampledOut;
+
+        // one timestamp serves the counters and the plugin's context, the return probe turns it into a duration
+        LARGE_INTEGER frequency = { 0 };
+        if (g_SyscallCounters.isActive() || delivered) {
+            call.entryTimestamp = KeQueryPerformanceCounter(&frequency).QuadPart;
+        }
+
+        // counted for every process, the plugin's target filter only applies to its own callbacks
+        if (g_SyscallCounters.isActive()) {
+            g_SyscallCounters.count(probeId, false, 0);
+        }
+
+        if (g_NgramProfiles.isActive()) {
+            g_NgramProfiles.onEntry(probeId);
+        }
+
+        if (delivered) {
+            const uint32_t stackDepth = g_Config.stackDepth();
+            const bool rawStacks = g_Config.rawStacks();
+            if (stackDepth) {
+                ptlsData->getCallerInfo().CaptureStackTrace(calledChildren ? 1 : 0, stackDepth, !rawStacks);
+            }
     
             MachineState ctx = { 0 };
             ctx.pRegArgs = pArgs;
             ctx.regArgsSize = pArgSize;
             ctx.pStackArgs = (uint64_t*)pStackArgs;
             ctx.paramCount = paramCount;
-
+            ctx.threadId = HandleToULong(PsGetCurrentThreadId());
+            ctx.processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+            ctx.timestamp = call.entryTimestamp;
+            ctx.frequency = frequency.QuadPart;
+            ctx.pCallContext = g_CallContexts.push(probeId);
+            ctx.callContextSize = ctx.pCallContext ? g_CallContexts.size() : 0;
+            call.contextPushed = ctx.pCallContext != nullptr;
+
+            g_RecordStream.writeSyscall(StpRecordSyscallEntry, pService, probeId, paramCount, pArgs, pArgSize);
+
+            // symbolicated offline against the stream's module records
+            const CallerInfo& callerInfo = ptlsData->getCallerInfo();
+            if (rawStacks && callerInfo.frames && callerInfo.frameDepth && g_RecordStream.isActive()) {
+                uint64_t addresses[MAX_FRAME_DEPTH];
+                for (uint32_t i = 0; i < callerInfo.frameDepth; i++) {
+                    addresses[i] = callerInfo.frames[i].frameaddress;
+                }
+                g_RecordStream.writeStack(probeId, addresses, callerInfo.frameDepth);
+            }
             pluginData.pCallbackEntry(pService, probeId, ctx, ptlsData->getCallerInfo());
         }
     }
@@ -192,15 +345,71 @@ extern "C" __declspec(dllexport) void StpCallbackReturn(ULONG64 pService, ULONG3
     if (!TraceSystemApi->isCallFromInsideProbe()) {
         TLSData* ptlsData = TraceSystemApi->getRawTLSData();
 
-        if (pluginData.isLoaded() && pluginData.pCallbackReturn && pluginData.pIsTarget && pluginData.pIsTarget(ptlsData->getCallerInfo())) {
+        // this call's frame, anything above it belongs to nested calls that never returned
+        CallState call = { 0 };
+        if (const CallState* pCall = (const CallState*)g_DriverCalls.find(probeId)) {
+            call = *pCall;
+            g_DriverCalls.pop(probeId);
+        }
+
+        // the handle is read from the caller once for every user of it
+        const DriverProbes::Syscall driverSyscall = g_DriverProbes.syscallFor(probeId);
+        HANDLE createdHandle = NULL;
+        if (driverSyscall != DriverProbes::None && DriverProbes::createdHandle(driverSyscall, (NTSTATUS)pArgs[0], call.handleOut, createdHandle)) {
+            // only the plugin's targets are worth a name query now, any other handle is named if it's ever looked up
+            const bool named = g_HandleCache.isActive() && pluginData.isLoaded() && pluginData.pIsTarget && g_Targets.isTarget(ptlsData->getCallerInfo()) &&
+                pluginData.pIsTarget(ptlsData->getCallerInfo());
+            g_HandleCache.onCreated(driverSyscall, createdHandle, named);
+            g_HandleTracker.onCreated(driverSyscall, createdHandle);
+        }
+
+        if (driverSyscall != DriverProbes::None) {
+            g_VmTracker.onReturn(driverSyscall, (NTSTATUS)pArgs[0], call.vmCall);
+            g_IoCounters.onReturn(driverSyscall, (NTSTATUS)pArgs[0], call.ioCall);
+        }
+
+        if (DriverProbes::isInternalProbe(probeId)) {
+            TraceSystemApi->ExitProbe(true);
+            return;
+        }
+
+        const bool delivered = !call.sampledOut && pluginData.isLoaded() && pluginData.pCallbackReturn && pluginData.pIsTarget &&
+            g_Targets.isTarget(ptlsData->getCallerInfo()) && pluginData.pIsTarget(ptlsData->getCallerInfo());
+
+        LARGE_INTEGER frequency = { 0 };
+        uint64_t now = 0;
+        if (g_SyscallCounters.isActive() || delivered) {
+            now = KeQueryPerformanceCounter(&frequency).QuadPart;
+        }
+        const uint64_t duration = call.entryTimestamp && now ? now - call.entryTimestamp : 0;
+
+        if (g_SyscallCounters.isActive()) {
+            g_SyscallCounters.count(probeId, true, duration);
+        }
+
+        if (delivered) {
             MachineState ctx = { 0 };
             ctx.pRegArgs = pArgs;
             ctx.regArgsSize = pArgSize;
             ctx.pStackArgs = (uint64_t*)pStackArgs;
             ctx.paramCount = paramCount;
-
+            ctx.threadId = HandleToULong(PsGetCurrentThreadId());
+            ctx.processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+            ctx.timestamp = now;
+            ctx.duration = duration;
+            ctx.frequency = frequency.QuadPart;
+            // an entry that pushed nothing must not pick up an outer call's block with the same probe id
+            ctx.pCallContext = call.contextPushed ? g_CallContexts.find(probeId) : nullptr;
+            ctx.callContextSize = ctx.pCallContext ? g_CallContexts.size() : 0;
+
+            g_RecordStream.writeSyscall(StpRecordSyscallReturn, pService, probeId, paramCount, pArgs, pArgSize);
             pluginData.pCallbackReturn(pService, probeId, ctx, ptlsData->getCallerInfo());
         }
+
+        // released even if the plugin went away in between, the block belongs to this call alone
+        if (call.contextPushed) {
+            g_CallContexts.pop(probeId);
+        }
     }
 
     // return probes should de-allocate TLS data if the call depth is at zero for this thread (TLS data lives from Entry-Exit)
@@ -322,11 +531,6 @@ Return Value:
 {
     UNREFERENCED_PARAMETER(DeviceObject);
 
-    if (LogInitialized) {
-        LogDestroy();
-        LogInitialized = false;
-    }
-
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = 0;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -350,16 +554,19 @@ Return Value:
 --*/
 {
     UNREFERENCED_PARAMETER(DeviceObject);
+    PFILE_OBJECT fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
 
-    if (LogInitialized) {
-        LogIrpShutdownHandler();
-        LogInitialized = false;
-    }
+    // a client that went away mid upload never commits
+    g_DllMapper.abortStreamedImage(fileObject);
 
-    if (TlsLookasideInitialized) {
-        ExDeleteLookasideListEx(&TLSLookasideList);
-        TlsLookasideInitialized = false;
-    }
+    // parked reads must not outlive their handle, and whatever this handle started has nobody left to read it. Other
+    // clients' streams and counters keep running.
+    g_RecordStream.stop(fileObject);
+    g_SyscallCounters.stop(fileObject);
+    g_IoCounters.stop(fileObject);
+
+    // The logger and the TLS lookaside list are the driver's, not the handle's. CLI commands open and close their own
+    // handle, a loaded plugin's probes and other clients keep using both after it's gone. DeviceUnload frees them.
 
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = 0;
@@ -368,60 +575,182 @@ Return Value:
     return STATUS_SUCCESS;
 }
 
+NTSTATUS RegisterPlugin(uint64_t dllBase) {
+    LOG_INFO("[+] Dll Mapped at %I64X\r\n", dllBase);
+
+    auto entry = (tStpCallbackEntryPlugin)g_DllMapper.getExport(dllBase, "StpCallbackEntry");
+    auto ret = (tStpCallbackReturnPlugin)g_DllMapper.getExport(dllBase, "StpCallbackReturn");
+    auto init = (tStpInitialize)g_DllMapper.getExport(dllBase, "StpInitialize");
+    auto deinit = (tStpDeInitialize)g_DllMapper.getExport(dllBase, "StpDeInitialize");
+    auto istarget = (tStpIsTarget)g_DllMapper.getExport(dllBase, "StpIsTarget");
+    auto etw = (tDtEtwpEventCallback)g_DllMapper.getExport(dllBase, "DtEtwpEventCallback");
+
+    uint32_t tries = 0;
+    while (!pluginData.setPluginData(dllBase, istarget, entry, ret, init, deinit, etw)) {
+        if (tries++ >= 10) {
+            LOG_ERROR("[!] Atomic plugin load failed\r\n");
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+    
+    if (pluginData.pInitialize) {
+        // The plugin must immediately copy this structure. It must be a local to avoid C++ static initializers, which are created if its a global
+        PluginApis pluginApis(&MmGetSystemRoutineAddress, &LogPrint, &EtwTrace, &SetCallbackApi, &UnSetCallbackApi, &SetEtwCallback, &UnSetEtwCallback, &TraceAccessMemory, &SetTLSData, &GetTLSData,
+            &EnableHandlePathsApi, &GetHandlePathApi, &RegisterThreadVarApi, &GetThreadVarsApi,
+            &SetCallContextSizeApi);
+        pluginData.pInitialize(pluginApis);
+
+        // the driver's own thread variables go after the plugin's
+        g_NgramProfiles.registerHistory();
+
+        // thread variables and the call context size are set from StpInitialize only, their layout is fixed from here on
+        g_ThreadVars.seal();
+
+        // prevent double initialize regardless of rest
+        pluginData.pInitialize = 0;
+    }
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS HandleDllLoad(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
     char* input = (char*)Irp->AssociatedIrp.SystemBuffer;
     uint64_t inputLen = IrpStack->Parameters.DeviceIoControl.InputBufferLength;
 
+    // Nothing is returned, don't let the I/O manager copy SystemBuffer back out
+    Irp->IoStatus.Information = 0;
+
     // only 1 plugin is allowed to load at a time
-    NTSTATUS status = STATUS_SUCCESS;
-    if (!pluginData.isLoaded()) {
-        // Executes DLLMain if it exists
-        uint64_t dllBase = g_DllMapper.mapImage(input, inputLen);
-        if (!dllBase) {
-            LOG_ERROR("[!] Plugin Loading Failed\r\n");
-            status = STATUS_UNSUCCESSFUL;
-            goto exit;
-        }
+    if (pluginData.isLoaded()) {
+        LOG_ERROR("[!] Only one plugin may be loaded at a time, load failed\r\n");
+        return STATUS_UNSUCCESSFUL;
+    }
 
-        LOG_INFO("[+] Dll Mapped at %I64X\r\n", dllBase);
+    // Executes DLLMain if it exists
+    uint64_t dllBase = g_DllMapper.mapImage(input, inputLen);
+    if (!dllBase) {
+        LOG_ERROR("[!] Plugin Loading Failed\r\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+    return RegisterPlugin(dllBase);
+}
 
-        auto entry = (tStpCallbackEntryPlugin)g_DllMapper.getExport(dllBase, "StpCallbackEntry");
-        auto ret = (tStpCallbackReturnPlugin)g_DllMapper.getExport(dllBase, "StpCallbackReturn");
-        auto init = (tStpInitialize)g_DllMapper.getExport(dllBase, "StpInitialize");
-        auto deinit = (tStpDeInitialize)g_DllMapper.getExport(dllBase, "StpDeInitialize");
-        auto istarget = (tStpIsTarget)g_DllMapper.getExport(dllBase, "StpIsTarget");
-        auto etw = (tDtEtwpEventCallback)g_DllMapper.getExport(dllBase, "DtEtwpEventCallback");
+/*
+Streamed plugin upload: BEGIN(uint64_t fileSize) -> APPEND(uint64_t fileOffset, chunk)... -> COMMIT.
+APPEND is METHOD_IN_DIRECT, the offset comes in the (buffered) input buffer and the chunk is the caller's output buffer
+described by an MDL. Chunks are copied once, from the locked user pages straight into the final image.
+*/
+NTSTATUS HandleDllLoadBegin(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+    Irp->IoStatus.Information = 0;
+    if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(uint64_t)) {
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        uint32_t tries = 0;
-        while (!pluginData.setPluginData(dllBase, istarget, entry, ret, init, deinit, etw)) {
-            if (tries++ >= 10) {
-                LOG_ERROR("[!] Atomic plugin load failed\r\n");
-                status = STATUS_UNSUCCESSFUL;
-                goto exit;
-            }
-        }
-        
-        if (pluginData.pInitialize) {
-            // The plugin must immediately copy this structure. It must be a local to avoid C++ static initializers, which are created if its a global
-            PluginApis pluginApis(&MmGetSystemRoutineAddress, &LogPrint, &EtwTrace, &SetCallbackApi, &UnSetCallbackApi, &SetEtwCallback, &UnSetEtwCallback, &TraceAccessMemory, &SetTLSData, &GetTLSData);
-            pluginData.pInitialize(pluginApis);
+    if (pluginData.isLoaded()) {
+        LOG_ERROR("[!] Only one plugin may be loaded at a time, load failed\r\n");
+        return STATUS_UNSUCCESSFUL;
+    }
 
-            // prevent double initialize regardless of rest
-            pluginData.pInitialize = 0;
-        }
-        status = STATUS_SUCCESS;
-    } else {
+    uint64_t fileSize = *(uint64_t*)Irp->AssociatedIrp.SystemBuffer;
+    if (!g_DllMapper.beginStreamedImage(IrpStack->FileObject, fileSize)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HandleDllLoadAppend(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+    Irp->IoStatus.Information = 0;
+    if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(uint64_t) || !Irp->MdlAddress) {
+        g_DllMapper.abortStreamedImage(IrpStack->FileObject);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    const char* chunk = (const char*)MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+    if (!chunk) {
+        g_DllMapper.abortStreamedImage(IrpStack->FileObject);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    uint64_t fileOffset = *(uint64_t*)Irp->AssociatedIrp.SystemBuffer;
+    if (!g_DllMapper.appendStreamedImage(IrpStack->FileObject, fileOffset, chunk, IrpStack->Parameters.DeviceIoControl.OutputBufferLength)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HandleDllLoadCommit(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+    Irp->IoStatus.Information = 0;
+    if (pluginData.isLoaded()) {
         LOG_ERROR("[!] Only one plugin may be loaded at a time, load failed\r\n");
-        status = STATUS_UNSUCCESSFUL;
+        g_DllMapper.abortStreamedImage(IrpStack->FileObject);
+        return STATUS_UNSUCCESSFUL;
     }
 
-exit:
-    // Zero the output buffer (SystemBuffer is copied to output on IoCompletion)
-    memset(input, 0, inputLen);
+    // Executes DLLMain if it exists
+    uint64_t dllBase = g_DllMapper.commitStreamedImage(IrpStack->FileObject);
+    if (!dllBase) {
+        LOG_ERROR("[!] Plugin Loading Failed\r\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+    return RegisterPlugin(dllBase);
+}
 
-    // Assign read length to Information
-    Irp->IoStatus.Information = inputLen;
-    return status;
+NTSTATUS HandleGetStats(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+    Irp->IoStatus.Information = 0;
+    if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(StpStreamStats)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    auto pStats = (StpStreamStats*)Irp->AssociatedIrp.SystemBuffer;
+    memset(pStats, 0, sizeof(StpStreamStats));
+    g_RecordStream.getStats(*pStats);
+    pStats->pluginLoaded = pluginData.isLoaded();
+
+    Irp->IoStatus.Information = sizeof(StpStreamStats);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HandleGetConfig(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+    Irp->IoStatus.Information = 0;
+    if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(StpConfig)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    g_Config.get(*(StpConfig*)Irp->AssociatedIrp.SystemBuffer);
+    Irp->IoStatus.Information = sizeof(StpConfig);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HandleSetConfig(PIRP Irp, PIO_STACK_LOCATION IrpStack) {
+    Irp->IoStatus.Information = 0;
+    if (IrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(StpConfig)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // input and output share the system buffer
+    StpConfig config;
+    memcpy(&config, Irp->AssociatedIrp.SystemBuffer, sizeof(config));
+
+    bool logRestart = false;
+    NTSTATUS Status = g_Config.apply(config, logRestart);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    if (logRestart && LogInitialized) {
+        Status = LogInitialize(g_Config.logFlags(), g_Config.logPath());
+        if (!NT_SUCCESS(Status)) {
+            DBGPRINT("Failed to restart logger interface. Status = 0x%08x\r\n", Status);
+            LogInitialized = false;
+            return Status;
+        }
+        LOG_INFO("Logger restarted with new configuration\r\n");
+    }
+
+    if (IrpStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(StpConfig)) {
+        g_Config.get(*(StpConfig*)Irp->AssociatedIrp.SystemBuffer);
+        Irp->IoStatus.Information = sizeof(StpConfig);
+    }
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS HandleDllUnLoad() {
@@ -433,6 +762,13 @@ NTSTATUS HandleDllUnLoad() {
             pluginData.pDeInitialize = 0;
         }
 
+        // after DeInitialize, the plugin's callbacks on the driver's syscalls are gone by now
+        g_DriverProbes.pluginUnloaded();
+        g_HandleCache.stop(HandleCache::UserPlugin);
+        g_CallContexts.reset();
+        g_NgramProfiles.resetHistory();
+        g_ThreadVars.reset();
+
         uint32_t tries = 0;
         while (!pluginData.freePluginData()) {
             if (tries++ >= 10) {
@@ -478,7 +814,7 @@ Return Value:
     Ioctl = IrpStack->Parameters.DeviceIoControl.IoControlCode;
 
     if (!LogInitialized) {
-        Status = LogInitialize(LogPutLevelInfo | LogOptDisableFunctionName | LogOptDisableAppend, L"\\??\\C:\\strace.log");
+        Status = LogInitialize(g_Config.logFlags(), g_Config.logPath());
         if (!NT_SUCCESS(Status))
         {
             DBGPRINT("Failed to initialize logger interface. Status = 0x%08x\r\n", Status);
@@ -502,22 +838,96 @@ Return Value:
         LOG_INFO("Starting DLL load\r\n");
         Status = HandleDllLoad(Irp, IrpStack);
         break;
+    case IOCTL_LOADDLL_BEGIN:
+        LOG_INFO("Starting streamed DLL load\r\n");
+        Status = HandleDllLoadBegin(Irp, IrpStack);
+        break;
+    case IOCTL_LOADDLL_APPEND:
+        Status = HandleDllLoadAppend(Irp, IrpStack);
+        break;
+    case IOCTL_LOADDLL_COMMIT:
+        Status = HandleDllLoadCommit(Irp, IrpStack);
+        break;
     case IOCTL_UNLOADDLL:
         LOG_INFO("Starting DLL unload\r\n");
         Status = HandleDllUnLoad();
         break;
+    case IOCTL_READ_RECORDS:
+        Status = g_RecordStream.read(Irp, IrpStack);
+        break;
+    case IOCTL_GET_STATS:
+        Status = HandleGetStats(Irp, IrpStack);
+        break;
+    case IOCTL_GET_COUNTERS:
+        Status = g_SyscallCounters.snapshot(Irp, IrpStack);
+        break;
+    case IOCTL_GET_PROBE_NAMES:
+        Status = g_RecordStream.copyProbeNames(Irp, IrpStack);
+        break;
+    case IOCTL_GET_CONFIG:
+        Status = HandleGetConfig(Irp, IrpStack);
+        break;
+    case IOCTL_SET_CONFIG:
+        LOG_INFO("Applying configuration\r\n");
+        Status = HandleSetConfig(Irp, IrpStack);
+        break;
+    case IOCTL_SET_TARGETS:
+        LOG_INFO("Changing targets\r\n");
+        Status = g_Targets.apply(Irp, IrpStack);
+        break;
+    case IOCTL_GET_TARGETS:
+        Status = g_Targets.query(Irp, IrpStack);
+        break;
+    case IOCTL_SET_HANDLE_TRACKING:
+        LOG_INFO("Changing handle tracking\r\n");
+        Status = g_HandleTracker.apply(Irp, IrpStack);
+        break;
+    case IOCTL_GET_HANDLE_LEAKS:
+        Status = g_HandleTracker.dump(Irp, IrpStack);
+        break;
+    case IOCTL_GET_IO_COUNTERS:
+        Status = g_IoCounters.snapshot(Irp, IrpStack);
+        break;
+    case IOCTL_GET_NGRAMS:
+        Status = g_NgramProfiles.snapshot(Irp, IrpStack);
+        break;
     default:
         LOG_WARN("Unrecognized ioctl 0x%x\r\n", Ioctl);
         break;
     }
     
     exit:
+    // parked reads are completed later by the record stream
+    if (Status == STATUS_PENDING) {
+        return Status;
+    }
+
     Irp->IoStatus.Status = Status;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
     return Status;
 }
 
 
+/*
+The driver's one process notify, every component that follows processes hangs off it rather than registering its own.
+Exits go to ProcessCache last, the others may still look at the process's identity until then.
+*/
+VOID ProcessNotify(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create)
+{
+    if (Create) {
+        g_Targets.onProcessCreated(ParentId, ProcessId);
+        return;
+    }
+
+    g_NgramProfiles.onProcessExit(ProcessId);
+    g_SyscallCounters.onProcessExit(ProcessId);
+    g_VmTracker.onProcessExit(ProcessId);
+    g_HandleTracker.onProcessExit(ProcessId);
+    g_HandleCache.onProcessExit(ProcessId);
+    g_Targets.onProcessExit(ProcessId);
+    g_ProcessCache.onProcessExit(ProcessId);
+}
+
 VOID
 DeviceUnload (
     _In_ PDRIVER_OBJECT DriverObject
@@ -536,11 +946,90 @@ Return Value:
 {
     UNICODE_STRING  DosDevicesLinkName;
 
+    //
+    // Remove the process notify first, it waits for running callbacks and nothing below is told about processes after it.
+    // Removing it fails harmlessly when DriverEntry couldn't set it.
+    //
+    PsSetCreateProcessNotifyRoutine(ProcessNotify, TRUE);
+
     //
     // Unregister any registered ETW providers.
     //
     g_ProviderCache.Destruct();
 
+    //
+    // Free the plugin loader's kernel export index and cached plugin images.
+    //
+    g_DllMapper.Destruct();
+
+    //
+    // Remove the image load notification, nothing writes module records after this.
+    //
+    g_ModuleEvents.Destruct();
+
+    //
+    // Complete any parked record reads and free the record ring.
+    //
+    g_RecordStream.Destruct();
+
+    //
+    // Stop counting and free the per-CPU syscall counters.
+    //
+    g_SyscallCounters.Destruct();
+
+    //
+    // Stop I/O accounting, releasing its probes, and free its tables.
+    //
+    g_IoCounters.Destruct();
+
+    //
+    // Remove the handle cache's probes and free its entries.
+    //
+    g_HandleCache.Destruct();
+
+    //
+    // Stop handle tracking, releasing its probes.
+    //
+    g_HandleTracker.Destruct();
+
+    //
+    // Stop memory tracking, releasing its probes, and free every process's regions.
+    //
+    g_VmTracker.Destruct();
+
+    //
+    // Stop counting syscall n-grams and free their tables.
+    //
+    g_NgramProfiles.Destruct();
+
+    //
+    // Remove the thread exit notification and free every thread's variables.
+    //
+    g_ThreadVars.Destruct();
+
+    //
+    // Free every process identity.
+    //
+    g_ProcessCache.Destruct();
+
+    //
+    // Stop following process trees, free the targets.
+    //
+    g_Targets.Destruct();
+
+    //
+    // Nothing probes any more, free the TLS lookaside list and stop the logger last.
+    //
+    if (TlsLookasideInitialized) {
+        ExDeleteLookasideListEx(&TLSLookasideList);
+        TlsLookasideInitialized = false;
+    }
+
+    if (LogInitialized) {
+        LogDestroy();
+        LogInitialized = false;
+    }
+
     //
     // Delete the link from our device name to a name in the Win32 namespace.
     //
@@ -564,6 +1053,32 @@ NTSTATUS DriverEntry( PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath
     
     UNREFERENCED_PARAMETER(RegistryPath);
 
+    //
+    // Locks and queues only, the record ring itself is allocated when the first reader attaches.
+    //
+    g_RecordStream.initialize();
+    g_DllMapper.initialize();
+    g_ModuleEvents.initialize();
+    g_SyscallCounters.initialize();
+    g_IoCounters.initialize();
+    g_DriverProbes.initialize();
+    g_HandleCache.initialize();
+    g_HandleTracker.initialize();
+    g_VmTracker.initialize();
+    g_NgramProfiles.initialize();
+    g_ThreadVars.initialize();
+    g_CallContexts.initialize("$callContexts");
+    g_DriverCalls.initialize("$driverCalls");
+    g_ProcessCache.initialize();
+    g_Targets.initialize();
+    g_Config.initialize();
+
+    //
+    // The driver's own thread variables, they outlive plugins and come before theirs.
+    //
+    g_DriverCalls.setSize(sizeof(CallState));
+    g_ThreadVars.sealBuiltins();
+
     //LOG_INFO("DriverEntry()");
     //LOG_INFO("Use ed nt!Kd_IHVDRIVER_Mask 8 to enable more detailed printouts\n");
 
@@ -607,6 +1122,22 @@ NTSTATUS DriverEntry( PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath
         IoDeleteDevice(DriverObject->DeviceObject);
         return Status;
     }
+
+    //
+    // Follow processes. Without it exited processes' records would never be freed and targets couldn't follow children.
+    //
+    Status = PsSetCreateProcessNotifyRoutine(ProcessNotify, FALSE);
+
+    if (!NT_SUCCESS(Status)) {
+        // the image load notification is already set, tear everything down the way an unload does
+        DeviceUnload(DriverObject);
+        return Status;
+    }
+
+    //
+    // Index ntoskrnl's exports once up front, every plugin load reuses it. Failure isn't fatal, imports fall back to MmGetSystemRoutineAddress.
+    //
+    g_DllMapper.buildKernelExportIndex();
     
     return STATUS_SUCCESS;
 }
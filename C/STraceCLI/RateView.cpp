@@ -0,0 +1,110 @@
+#include "RateView.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+size_t CounterSnapshot::parse(const uint8_t* data, size_t size) {
+    StpCounterSnapshotHeader header;
+    if (size < sizeof(header))
+        return 0;
+
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != STP_COUNTERS_MAGIC || header.size > size ||
+        header.size != sizeof(header) + (size_t)header.rowCount * sizeof(StpCounterRow)) {
+        return 0;
+    }
+
+    timestamp = header.timestamp;
+    qpcFrequency = header.qpcFrequency;
+    overflow = header.overflow;
+    truncated = header.totalRows > header.rowCount;
+    rows.clear();
+
+    for (uint32_t i = 0; i < header.rowCount; i++) {
+        StpCounterRow row;
+        memcpy(&row, data + sizeof(header) + i * sizeof(StpCounterRow), sizeof(row));
+
+        StpCounterRow& merged = rows[((uint64_t)row.pid << 32) | row.probeId];
+        merged.pid = row.pid;
+        merged.probeId = row.probeId;
+        merged.calls += row.calls;
+        merged.completed += row.completed;
+        merged.totalTicks += row.totalTicks;
+    }
+    return header.size;
+}
+
+std::vector<RateRow> RateView::compute(const CounterSnapshot& previous, const CounterSnapshot& current) {
+    std::vector<RateRow> result;
+    double seconds = 0;
+    if (current.qpcFrequency && current.timestamp > previous.timestamp) {
+        seconds = (double)(current.timestamp - previous.timestamp) / (double)current.qpcFrequency;
+    }
+
+    for (const auto& kv : current.rows) {
+        const StpCounterRow& now = kv.second;
+        StpCounterRow before = {};
+        auto it = previous.rows.find(kv.first);
+        if (it != previous.rows.end() && it->second.calls <= now.calls && it->second.completed <= now.completed) {
+            before = it->second;
+        }
+
+        const uint64_t calls = now.calls - before.calls;
+        if (!calls)
+            continue;
+
+        RateRow row;
+        row.pid = now.pid;
+        row.probeId = now.probeId;
+        row.calls = calls;
+        row.callsPerSecond = seconds > 0 ? (double)calls / seconds : 0;
+        row.avgLatencyUs = 0;
+
+        const uint64_t completed = now.completed - before.completed;
+        if (completed && current.qpcFrequency) {
+            row.avgLatencyUs = (double)(now.totalTicks - before.totalTicks) / (double)completed * 1e6 / (double)current.qpcFrequency;
+        }
+        result.push_back(row);
+    }
+
+    std::sort(result.begin(), result.end(), [](const RateRow& a, const RateRow& b) {
+        return a.calls != b.calls ? a.calls > b.calls : (a.pid != b.pid ? a.pid < b.pid : a.probeId < b.probeId);
+    });
+    return result;
+}
+
+void RateView::render(const std::vector<RateRow>& rows, const CounterSnapshot& previous, const CounterSnapshot& current,
+    const RecordDecoder& names, std::ostream& out, size_t top) {
+    char buf[160];
+    uint64_t total = 0;
+    for (const RateRow& row : rows) {
+        total += row.calls;
+    }
+
+    double seconds = 0;
+    if (current.qpcFrequency && current.timestamp > previous.timestamp) {
+        seconds = (double)(current.timestamp - previous.timestamp) / (double)current.qpcFrequency;
+    }
+
+    snprintf(buf, sizeof(buf), "%" PRIu64 " calls in %.2fs, %zu (pid, probe) pairs\n", total, seconds, rows.size());
+    out << buf;
+    snprintf(buf, sizeof(buf), "%-8s %-40s %12s %12s\n", "PID", "PROBE", "CALLS/S", "AVG(us)");
+    out << buf;
+
+    const size_t shown = top && rows.size() > top ? top : rows.size();
+    for (size_t i = 0; i < shown; i++) {
+        const RateRow& row = rows[i];
+        snprintf(buf, sizeof(buf), "%-8u %-40s %12.1f %12.2f\n", row.pid, names.displayName(row.probeId).c_str(), row.callsPerSecond, row.avgLatencyUs);
+        out << buf;
+    }
+
+    if (current.overflow > previous.overflow) {
+        out << current.overflow - previous.overflow << " calls were not counted, the driver's per-CPU tables are full\n";
+    }
+
+    if (current.truncated) {
+        out << "snapshot was truncated, counts are a lower bound\n";
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Portable (std only) delta computation and rendering for "STraceCLI top", also used by STraceDecode to replay
+// recorded snapshots. Nothing windows specific may be used in here.
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "../STrace/RecordFormat.h"
+#include "RecordDecoder.h"
+
+// One IOCTL_GET_COUNTERS result with the per-CPU rows summed up by (pid, probe)
+struct CounterSnapshot {
+    uint64_t timestamp = 0;
+    uint64_t qpcFrequency = 0;
+    uint64_t overflow = 0;
+    bool truncated = false;   // the driver had more rows than fit the buffer
+    std::unordered_map<uint64_t, StpCounterRow> rows;
+
+    // Parses one snapshot from the start of data and returns its size, 0 if data doesn't start with a whole snapshot
+    size_t parse(const uint8_t* data, size_t size);
+};
+
+struct RateRow {
+    uint32_t pid;
+    uint32_t probeId;
+    uint64_t calls;           // in the interval
+    double callsPerSecond;
+    double avgLatencyUs;      // 0 if no call completed in the interval
+};
+
+class RateView {
+public:
+    // Rows with calls between the two snapshots, busiest first. A row that went backwards (counters were re-enabled)
+    // is taken as starting from zero.
+    static std::vector<RateRow> compute(const CounterSnapshot& previous, const CounterSnapshot& current);
+
+    // Prints at most top rows, 0 means all
+    static void render(const std::vector<RateRow>& rows, const CounterSnapshot& previous, const CounterSnapshot& current,
+        const RecordDecoder& names, std::ostream& out, size_t top);
+};
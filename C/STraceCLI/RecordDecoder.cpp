@@ -0,0 +1,343 @@
+#include "RecordDecoder.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+size_t RecordDecoder::decode(const uint8_t* data, size_t size, RecordVisitor& visitor) {
+    size_t offset = 0;
+    while (size - offset >= sizeof(StpRecordHeader)) {
+        StpRecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        if (header.size < sizeof(StpRecordHeader) || header.size % STP_RECORD_ALIGNMENT) {
+            return SIZE_MAX;
+        }
+
+        if (header.size > size - offset)
+            break;
+
+        const uint8_t* pRecord = data + offset;
+        switch (header.type) {
+        case StpRecordLog: {
+            // terminator is guaranteed by the driver, but don't trust a dump file
+            std::string text((const char*)pRecord + sizeof(header), strnlen((const char*)pRecord + sizeof(header), header.size - sizeof(header)));
+            visitor.onLog(header, text.c_str());
+            break;
+        }
+        case StpRecordSyscallEntry:
+        case StpRecordSyscallReturn:
+            if (header.size >= sizeof(StpSyscallRecord)) {
+                StpSyscallRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                visitor.onSyscall(record);
+            }
+            break;
+        case StpRecordProbeName:
+            if (header.size >= sizeof(StpProbeNameRecord)) {
+                StpProbeNameRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                const char* name = (const char*)pRecord + sizeof(record);
+                m_probeNames[record.probeId] = std::string(name, strnlen(name, header.size - sizeof(record)));
+            }
+            break;
+        case StpRecordDropped:
+            if (header.size >= sizeof(StpDroppedRecord)) {
+                StpDroppedRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                visitor.onDropped(header, record.count);
+            }
+            break;
+        case StpRecordMemory:
+            if (header.size >= sizeof(StpMemoryRecord)) {
+                StpMemoryRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                visitor.onMemory(record);
+            }
+            break;
+        case StpRecordNgrams:
+            if (header.size >= sizeof(StpNgramRecord)) {
+                StpNgramRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                const size_t count = std::min<size_t>(record.gramCount, (header.size - sizeof(record)) / sizeof(StpNgram));
+                std::vector<StpNgram> grams(count);
+                memcpy(grams.data(), pRecord + sizeof(record), count * sizeof(StpNgram));
+                visitor.onNgrams(record, grams);
+            }
+            break;
+        case StpRecordModule:
+            if (header.size >= sizeof(StpModuleRecord)) {
+                StpModuleRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                const char* path = (const char*)pRecord + sizeof(record);
+                std::string text(path, strnlen(path, header.size - sizeof(record)));
+                addModule(record, text.c_str());
+                visitor.onModule(record, text.c_str());
+            }
+            break;
+        case StpRecordStack:
+            if (header.size >= sizeof(StpStackRecord)) {
+                StpStackRecord record;
+                memcpy(&record, pRecord, sizeof(record));
+                const size_t count = std::min<size_t>(record.frameCount, (header.size - sizeof(record)) / sizeof(uint64_t));
+                std::vector<uint64_t> frames(count);
+                memcpy(frames.data(), pRecord + sizeof(record), count * sizeof(uint64_t));
+                visitor.onStack(record, frames);
+            }
+            break;
+        default:
+            // newer driver, skip what we don't understand
+            break;
+        }
+
+        m_records++;
+        offset += header.size;
+    }
+    return offset;
+}
+
+const std::string& RecordDecoder::probeName(uint32_t probeId) const {
+    static const std::string empty;
+    auto it = m_probeNames.find(probeId);
+    return it == m_probeNames.end() ? empty : it->second;
+}
+
+std::string RecordDecoder::displayName(uint32_t probeId) const {
+    const std::string& name = probeName(probeId);
+    return name.empty() ? "probe#" + std::to_string(probeId) : name;
+}
+
+std::string RecordDecoder::gramName(const StpNgram& gram) const {
+    std::string name;
+    for (uint32_t i = 0; i < gram.n && i < STP_NGRAM_MAX_N; i++) {
+        if (i) {
+            name += " > ";
+        }
+        name += gram.probes[i] == STP_NGRAM_OTHER_PROBE ? "other" : displayName(gram.probes[i]);
+    }
+    return name;
+}
+
+void RecordDecoder::addModule(const StpModuleRecord& record, const char* path) {
+    if (!record.size) {
+        return;
+    }
+
+    // whatever was mapped over this range before is gone
+    auto& modules = m_modules[(record.flags & StpModuleFlagKernel) ? 0 : record.pid];
+    auto it = modules.lower_bound(record.base);
+    if (it != modules.begin()) {
+        auto previous = std::prev(it);
+        if (previous->second.base + previous->second.size > record.base) {
+            it = previous;
+        }
+    }
+
+    while (it != modules.end() && it->second.base < record.base + record.size) {
+        it = modules.erase(it);
+    }
+
+    Module& module = modules[record.base];
+    module.base = record.base;
+    module.size = record.size;
+    module.flags = record.flags;
+    module.timeDateStamp = record.timeDateStamp;
+    module.pdb = pdbKey(record);
+    module.path = path;
+}
+
+const RecordDecoder::Module* RecordDecoder::moduleAt(uint32_t pid, uint64_t address) const {
+    for (uint32_t owner : { pid, 0u }) {
+        auto modules = m_modules.find(owner);
+        if (modules == m_modules.end()) {
+            continue;
+        }
+
+        auto it = modules->second.upper_bound(address);
+        if (it != modules->second.begin() && address - std::prev(it)->second.base < std::prev(it)->second.size) {
+            return &std::prev(it)->second;
+        }
+    }
+    return nullptr;
+}
+
+std::string RecordDecoder::pdbKey(const StpModuleRecord& record) {
+    const uint8_t* g = record.pdbGuid;
+    if (!record.pdbAge && std::all_of(g, g + sizeof(record.pdbGuid), [](uint8_t b) { return b == 0; })) {
+        return {};
+    }
+
+    // the first three fields are little endian integers, the last eight bytes are printed in order
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%X", g[3], g[2], g[1], g[0], g[5], g[4], g[7], g[6],
+        g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15], record.pdbAge);
+    return buf;
+}
+
+void TextPrinter::prefix(const StpRecordHeader& header) {
+    if (!m_firstTimestamp) {
+        m_firstTimestamp = header.timestamp;
+    }
+
+    char buf[96];
+    if (m_qpcFrequency) {
+        double seconds = (double)(header.timestamp - m_firstTimestamp) / (double)m_qpcFrequency;
+        snprintf(buf, sizeof(buf), "[%12.6f] cpu=%-3u pid=%-6u tid=%-6u ", seconds, header.cpu, header.pid, header.tid);
+    } else {
+        snprintf(buf, sizeof(buf), "[%12" PRIu64 "] cpu=%-3u pid=%-6u tid=%-6u ", header.timestamp - m_firstTimestamp, header.cpu, header.pid, header.tid);
+    }
+    m_out << buf;
+}
+
+void TextPrinter::onLog(const StpRecordHeader& header, const char* text) {
+    // log lines already carry their own line ending
+    size_t len = strlen(text);
+    while (len && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        len--;
+    }
+
+    prefix(header);
+    m_out.write(text, len);
+    m_out << '\n';
+}
+
+void TextPrinter::onSyscall(const StpSyscallRecord& record) {
+    prefix(record.header);
+
+    char buf[256];
+    if (record.header.type == StpRecordSyscallEntry) {
+        uint32_t shown = std::min<uint32_t>(record.paramCount, STP_RECORD_MAX_ARGS);
+        int len = snprintf(buf, sizeof(buf), "%s(", m_decoder.displayName(record.probeId).c_str());
+        for (uint32_t i = 0; i < shown && len > 0 && len < (int)sizeof(buf); i++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%s0x%" PRIx64, i ? ", " : "", record.args[i]);
+        }
+
+        if (len > 0 && len < (int)sizeof(buf)) {
+            snprintf(buf + len, sizeof(buf) - len, "%s)", record.paramCount > shown ? ", ..." : "");
+        }
+    } else {
+        snprintf(buf, sizeof(buf), "%s -> 0x%" PRIx64, m_decoder.displayName(record.probeId).c_str(), record.args[0]);
+    }
+    m_out << buf << '\n';
+}
+
+void TextPrinter::onDropped(const StpRecordHeader& header, uint64_t count) {
+    prefix(header);
+    m_out << "*** " << count << " records dropped, the driver's buffer was full ***\n";
+}
+
+void TextPrinter::onMemory(const StpMemoryRecord& record) {
+    static const char* events[] = { "?", "W->X", "RWX", "remote write", "remote map" };
+
+    prefix(record.header);
+
+    char buf[192];
+    snprintf(buf, sizeof(buf), "%s target=%u 0x%" PRIx64 "+0x%" PRIx64 " protect 0x%x -> 0x%x%s%s%s",
+        record.event < sizeof(events) / sizeof(events[0]) ? events[record.event] : events[0], record.targetPid, record.address, record.size,
+        record.oldProtect, record.newProtect, (record.flags & StpMemoryFlagMapped) ? " mapped" : "",
+        (record.flags & StpMemoryFlagRemoteWrite) ? " remote-written" : "", (record.flags & StpMemoryFlagUnknown) ? " untracked" : "");
+    m_out << buf << '\n';
+}
+
+void TextPrinter::onNgrams(const StpNgramRecord& record, const std::vector<StpNgram>& grams) {
+    for (const StpNgram& gram : grams) {
+        prefix(record.header);
+        m_out << "ngram exited=" << record.pid << ' ' << m_decoder.gramName(gram) << " x" << gram.count << '\n';
+    }
+}
+
+void TextPrinter::onModule(const StpModuleRecord& record, const char* path) {
+    prefix(record.header);
+
+    const std::string pdb = RecordDecoder::pdbKey(record);
+    char owner[32] = "kernel";
+    if (!(record.flags & StpModuleFlagKernel)) {
+        snprintf(owner, sizeof(owner), "process=%u", record.pid);
+    }
+
+    char buf[192];
+    snprintf(buf, sizeof(buf), "module %s 0x%" PRIx64 "+0x%" PRIx64 " timestamp=%08x pdb=%s%s%s%s ", owner, record.base, record.size, record.timeDateStamp,
+        pdb.empty() ? "-" : pdb.c_str(), (record.flags & StpModuleFlag32Bit) ? " 32bit" : "", (record.flags & StpModuleFlagSnapshot) ? " loaded" : "",
+        (record.flags & StpModuleFlagNoIdentity) ? " unreadable" : "");
+    m_out << buf << path << '\n';
+}
+
+void TextPrinter::onStack(const StpStackRecord& record, const std::vector<uint64_t>& frames) {
+    prefix(record.header);
+    m_out << "stack " << m_decoder.displayName(record.probeId) << ' ' << frames.size() << " frames\n";
+
+    // the plugin's stack trace format, PDBReSym symbolicates it the same way
+    char buf[64];
+    for (uint64_t address : frames) {
+        const RecordDecoder::Module* pModule = m_decoder.moduleAt(record.header.pid, address);
+        if (pModule) {
+            snprintf(buf, sizeof(buf), " +0x%08" PRIx64, address - pModule->base);
+            m_out << "  [" << pModule->path << ']' << buf << '\n';
+        } else {
+            snprintf(buf, sizeof(buf), "  %-18s 0x%016" PRIx64, "[UNKNOWN MODULE]", address);
+            m_out << buf << '\n';
+        }
+    }
+}
+
+void Aggregator::onSyscall(const StpSyscallRecord& record) {
+    Row& row = m_rows[key(record.header.pid, record.probeId)];
+    row.pid = record.header.pid;
+    row.probeId = record.probeId;
+
+    auto& open = m_open[key(record.header.tid, record.probeId)];
+    if (record.header.type == StpRecordSyscallEntry) {
+        row.calls++;
+        open.push_back(record.header.timestamp);
+    } else if (!open.empty()) {
+        // returns without an entry (stream started mid call) don't count towards latency
+        row.completed++;
+        row.totalTicks += record.header.timestamp - open.back();
+        open.pop_back();
+    }
+}
+
+void Aggregator::onDropped(const StpRecordHeader& /*header*/, uint64_t count) {
+    // pairing can't be trusted across a gap
+    m_dropped += count;
+    m_open.clear();
+}
+
+std::vector<Aggregator::Row> Aggregator::rows() const {
+    std::vector<Row> rows;
+    rows.reserve(m_rows.size());
+    for (const auto& kv : m_rows) {
+        rows.push_back(kv.second);
+    }
+
+    std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+        return a.calls != b.calls ? a.calls > b.calls : (a.pid != b.pid ? a.pid < b.pid : a.probeId < b.probeId);
+    });
+    return rows;
+}
+
+void Aggregator::print(const RecordDecoder& decoder, std::ostream& out, size_t top) const {
+    char buf[160];
+    snprintf(buf, sizeof(buf), "%-8s %-40s %12s %12s\n", "PID", "PROBE", "CALLS", "AVG(us)");
+    out << buf;
+
+    auto sorted = rows();
+    if (top && sorted.size() > top) {
+        sorted.resize(top);
+    }
+
+    for (const Row& row : sorted) {
+        double avgUs = 0;
+        if (row.completed && m_qpcFrequency) {
+            avgUs = (double)row.totalTicks / (double)row.completed * 1e6 / (double)m_qpcFrequency;
+        }
+
+        snprintf(buf, sizeof(buf), "%-8u %-40s %12" PRIu64 " %12.2f\n", row.pid, decoder.displayName(row.probeId).c_str(), row.calls, avgUs);
+        out << buf;
+    }
+
+    if (m_dropped) {
+        out << m_dropped << " records were dropped, counts are a lower bound\n";
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+// Portable (std only) decoding and printing of the driver's record stream. Shared by STraceCLI and STraceDecode, the
+// latter builds on Linux too, so nothing windows specific may be used in here.
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../STrace/RecordFormat.h"
+
+class RecordVisitor {
+public:
+    virtual ~RecordVisitor() = default;
+
+    virtual void onLog(const StpRecordHeader& /*header*/, const char* /*text*/) {}
+    virtual void onSyscall(const StpSyscallRecord& /*record*/) {}
+    virtual void onDropped(const StpRecordHeader& /*header*/, uint64_t /*count*/) {}
+    virtual void onMemory(const StpMemoryRecord& /*record*/) {}
+    virtual void onNgrams(const StpNgramRecord& /*record*/, const std::vector<StpNgram>& /*grams*/) {}
+    virtual void onModule(const StpModuleRecord& /*record*/, const char* /*path*/) {}
+    virtual void onStack(const StpStackRecord& /*record*/, const std::vector<uint64_t>& /*frames*/) {}
+};
+
+class RecordDecoder {
+public:
+    struct Module {
+        uint64_t base;
+        uint64_t size;
+        uint32_t flags;          // StpModuleFlags
+        uint32_t timeDateStamp;
+        std::string pdb;         // symbol server key, see pdbKey
+        std::string path;
+    };
+
+    // Decodes as many whole records as data holds and returns the number of bytes consumed, a trailing partial record
+    // is left for the caller to prepend to the next buffer. Returns SIZE_MAX if the data is corrupt.
+    size_t decode(const uint8_t* data, size_t size, RecordVisitor& visitor);
+
+    // Empty if the driver never reported a name for this probe
+    const std::string& probeName(uint32_t probeId) const;
+
+    // "NtCreateFile" or "probe#12"
+    std::string displayName(uint32_t probeId) const;
+
+    // "NtOpenFile > NtReadFile", folded probes show as "other"
+    std::string gramName(const StpNgram& gram) const;
+
+    // The module holding address in process pid, or a kernel module. Null if no module record covers it
+    const Module* moduleAt(uint32_t pid, uint64_t address) const;
+
+    // GUID and age as the symbol server names a PDB's directory, "1B72224D37B8179228200ED8994498B21", empty without one
+    static std::string pdbKey(const StpModuleRecord& record);
+
+    uint64_t recordCount() const {
+        return m_records;
+    }
+private:
+    void addModule(const StpModuleRecord& record, const char* path);
+
+    std::unordered_map<uint32_t, std::string> m_probeNames;
+    std::unordered_map<uint32_t, std::map<uint64_t, Module>> m_modules;   // pid, 0 for the kernel -> base -> module
+    uint64_t m_records = 0;
+};
+
+// One line per record, timestamps relative to the first record seen
+class TextPrinter : public RecordVisitor {
+public:
+    TextPrinter(const RecordDecoder& decoder, std::ostream& out, uint64_t qpcFrequency)
+        : m_decoder(decoder), m_out(out), m_qpcFrequency(qpcFrequency) {}
+
+    void onLog(const StpRecordHeader& header, const char* text) override;
+    void onSyscall(const StpSyscallRecord& record) override;
+    void onDropped(const StpRecordHeader& header, uint64_t count) override;
+    void onMemory(const StpMemoryRecord& record) override;
+    void onNgrams(const StpNgramRecord& record, const std::vector<StpNgram>& grams) override;
+    void onModule(const StpModuleRecord& record, const char* path) override;
+    void onStack(const StpStackRecord& record, const std::vector<uint64_t>& frames) override;
+private:
+    void prefix(const StpRecordHeader& header);
+
+    const RecordDecoder& m_decoder;
+    std::ostream& m_out;
+    uint64_t m_qpcFrequency;
+    uint64_t m_firstTimestamp = 0;
+};
+
+// Calls and average latency per (pid, probe), latency pairs each return with the thread's matching entry
+class Aggregator : public RecordVisitor {
+public:
+    struct Row {
+        uint32_t pid;
+        uint32_t probeId;
+        uint64_t calls;
+        uint64_t completed;
+        uint64_t totalTicks;
+    };
+
+    explicit Aggregator(uint64_t qpcFrequency) : m_qpcFrequency(qpcFrequency) {}
+
+    void onSyscall(const StpSyscallRecord& record) override;
+    void onDropped(const StpRecordHeader& header, uint64_t count) override;
+
+    // Sorted by calls, descending
+    std::vector<Row> rows() const;
+
+    // Prints at most top rows, 0 means all
+    void print(const RecordDecoder& decoder, std::ostream& out, size_t top) const;
+private:
+    static uint64_t key(uint32_t a, uint32_t b) {
+        return ((uint64_t)a << 32) | b;
+    }
+
+    uint64_t m_qpcFrequency;
+    uint64_t m_dropped = 0;
+    std::unordered_map<uint64_t, Row> m_rows;                     // (pid, probe)
+    std::unordered_map<uint64_t, std::vector<uint64_t>> m_open;   // (tid, probe) -> entry timestamps, nested calls stack
+};
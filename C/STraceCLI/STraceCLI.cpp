@@ -8,9 +8,27 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+
+#include "RecordDecoder.h"
+#include "RateView.h"
+#include "../STrace/ConfigFormat.h"
+#include "../STrace/TargetFormat.h"
+#include "../STrace/HandleLeakFormat.h"
+#include "../STrace/IoCounterFormat.h"
 
 HANDLE g_Driver;
 
+// stream and aggregate open the driver for overlapped I/O, every request must then carry an OVERLAPPED
+bool g_Overlapped = false;
+std::atomic<bool> g_Stop = false;
+
 std::filesystem::path AskForFile() {
     wchar_t szFileName[MAX_PATH] = { 0 };
     
@@ -21,7 +39,7 @@ std::filesystem::path AskForFile() {
 	ofn.lpstrFile = szFileName;
 	ofn.lpstrFile[0] = '\0';
 	ofn.nMaxFile = sizeof(szFileName);
-	ofn.lpstrFilter = L"All\0*.*\0DLL\0*.dll\0";
+	ofn.lpstrFilter = L"All\0*.*\0DLL\0*.dll\0Prelinked\0*.stp\0";
 	ofn.nFilterIndex =1;
 	ofn.lpstrFileTitle = NULL ;
 	ofn.nMaxFileTitle = 0 ;
@@ -35,28 +53,12 @@ std::filesystem::path AskForFile() {
     return szFileName;
 }
 
-void LoadDll() {
-    std::ifstream file(AskForFile(), std::ios::binary | std::ios::ate);
-
-    // Check if we can open the file
-    if (!file.good()) {
-        std::cout << "[!] failed to open file" << std::endl;
-        return;
-    }
-
-    std::unique_ptr<uint8_t> fileData;
-    uintptr_t fileSize = file.tellg();
-    fileData.reset(new uint8_t[fileSize]);
-    if (!fileData) {
-        std::cout << "[!] failed to allocate memory for file" << std::endl;
-    }
-
+// Prelinked plugins (STracePrelink output) are tiny and already laid out, they're sent whole with IOCTL_LOADDLL
+bool LoadPrelinkedDll(std::ifstream& file, uint64_t fileSize) {
+    std::unique_ptr<uint8_t[]> fileData(new uint8_t[fileSize]);
     file.seekg(0, std::ios::beg);
     file.read((char*)fileData.get(), fileSize);
 
-    // close as soon as possible
-    file.close();
-
     DWORD BytesReturned = 0;
     BOOL Result;
 
@@ -71,11 +73,79 @@ void LoadDll() {
 
     if (Result != TRUE) {
         printf("DeviceIoControl for LOADDLL failed, error %d\n", GetLastError());
-        return;
+        return false;
+    }
+    return true;
+}
+
+// Raw DLLs are streamed in chunks, the driver copies each chunk directly into the mapped sections
+bool LoadStreamedDll(std::ifstream& file, uint64_t fileSize) {
+    const uint64_t chunkSize = 1024 * 1024;
+    std::unique_ptr<uint8_t[]> chunk(new uint8_t[(size_t)min(fileSize, chunkSize)]);
+
+    DWORD BytesReturned = 0;
+    BOOL Result;
+
+    Result = DeviceIoControl(g_Driver, IOCTL_LOADDLL_BEGIN, &fileSize, sizeof(fileSize), 0, 0, &BytesReturned, NULL);
+    if (Result != TRUE) {
+        printf("DeviceIoControl for LOADDLL_BEGIN failed, error %d\n", GetLastError());
+        return false;
+    }
+
+    file.seekg(0, std::ios::beg);
+    for (uint64_t offset = 0; offset < fileSize; ) {
+        DWORD size = (DWORD)min(fileSize - offset, chunkSize);
+        if (!file.read((char*)chunk.get(), size)) {
+            std::cout << "[!] failed to read file" << std::endl;
+            return false;
+        }
+
+        // offset is the input buffer, the chunk goes in the direct (MDL backed) output buffer
+        Result = DeviceIoControl(g_Driver, IOCTL_LOADDLL_APPEND, &offset, sizeof(offset), chunk.get(), size, &BytesReturned, NULL);
+        if (Result != TRUE) {
+            printf("DeviceIoControl for LOADDLL_APPEND failed, error %d\n", GetLastError());
+            return false;
+        }
+        offset += size;
+    }
+
+    Result = DeviceIoControl(g_Driver, IOCTL_LOADDLL_COMMIT, 0, 0, 0, 0, &BytesReturned, NULL);
+    if (Result != TRUE) {
+        printf("DeviceIoControl for LOADDLL_COMMIT failed, error %d\n", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+bool LoadDll(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+    // Check if we can open the file
+    if (!file.good()) {
+        std::cout << "[!] failed to open file" << std::endl;
+        return false;
     }
+
+    uint64_t fileSize = file.tellg();
+    uint32_t magic = 0;
+    file.seekg(0, std::ios::beg);
+    file.read((char*)&magic, sizeof(magic));
+    if (!file.good()) {
+        std::cout << "[!] failed to read file" << std::endl;
+        return false;
+    }
+
+    if (magic == STP_PRELINK_MAGIC) {
+        return LoadPrelinkedDll(file, fileSize);
+    }
+    return LoadStreamedDll(file, fileSize);
 }
 
-void UnloadDll() {
+void LoadDll() {
+    LoadDll(AskForFile());
+}
+
+bool UnloadDll() {
     DWORD BytesReturned = 0;
     BOOL Result;
 
@@ -89,13 +159,930 @@ void UnloadDll() {
         NULL);
 
     if (Result != TRUE) {
-        printf("DeviceIoControl for LOADDLL failed, error %d\n", GetLastError());
+        printf("DeviceIoControl for UNLOADDLL failed, error %d\n", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+// Synchronous request that works on both kinds of driver handle
+BOOL DriverIoctl(DWORD code, LPVOID in, DWORD inSize, LPVOID out, DWORD outSize, DWORD* pBytesReturned) {
+    if (!g_Overlapped) {
+        return DeviceIoControl(g_Driver, code, in, inSize, out, outSize, pBytesReturned, NULL);
+    }
+
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    BOOL Result = DeviceIoControl(g_Driver, code, in, inSize, out, outSize, pBytesReturned, &ov);
+    if (!Result && GetLastError() == ERROR_IO_PENDING) {
+        Result = GetOverlappedResult(g_Driver, &ov, pBytesReturned, TRUE);
+    }
+    CloseHandle(ov.hEvent);
+    return Result;
+}
+
+bool GetStats(StpStreamStats& stats) {
+    DWORD BytesReturned = 0;
+    if (!DriverIoctl(IOCTL_GET_STATS, 0, 0, &stats, sizeof(stats), &BytesReturned) || BytesReturned < sizeof(stats)) {
+        std::cerr << "[!] DeviceIoControl for GET_STATS failed, error " << GetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool PrintStats() {
+    StpStreamStats stats = { 0 };
+    if (!GetStats(stats))
+        return false;
+
+    std::cout << "plugin loaded:     " << (stats.pluginLoaded ? "yes" : "no") << std::endl;
+    std::cout << "records produced:  " << stats.produced << std::endl;
+    std::cout << "records dropped:   " << stats.dropped << std::endl;
+    std::cout << "records delivered: " << stats.delivered << " (" << stats.deliveredBytes << " bytes)" << std::endl;
+    std::cout << "buffer:            " << stats.bufferUsed << " / " << stats.bufferSize << " bytes" << std::endl;
+    std::cout << "pending reads:     " << stats.pendingReads << std::endl;
+    return true;
+}
+
+BOOL WINAPI StopOnCtrlC(DWORD ctrlType) {
+    if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT) {
+        g_Stop = true;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+Inverted call: keep QueueDepth reads parked in the driver so there's always one ready the moment records arrive.
+The driver completes parked reads in the order they were issued, consuming them in the same order keeps records ordered.
+seconds <= 0 streams until Ctrl-C.
+*/
+bool StreamRecords(double seconds, const std::function<bool(const uint8_t*, size_t)>& onData) {
+    const int QueueDepth = 4;
+    const DWORD ReadSize = 256 * 1024;
+
+    struct Read {
+        OVERLAPPED ov;
+        std::unique_ptr<uint8_t[]> buffer;
+        bool inFlight;
+    };
+
+    std::vector<Read> reads(QueueDepth);
+    auto issue = [&](Read& read) {
+        HANDLE hEvent = read.ov.hEvent;
+        ZeroMemory(&read.ov, sizeof(read.ov));
+        read.ov.hEvent = hEvent;
+        ResetEvent(hEvent);
+
+        // no input, the records land in the direct (MDL backed) output buffer
+        BOOL Result = DeviceIoControl(g_Driver, IOCTL_READ_RECORDS, 0, 0, read.buffer.get(), ReadSize, NULL, &read.ov);
+        read.inFlight = Result || GetLastError() == ERROR_IO_PENDING;
+        if (!read.inFlight) {
+            std::cerr << "[!] DeviceIoControl for READ_RECORDS failed, error " << GetLastError() << std::endl;
+        }
+        return read.inFlight;
+    };
+
+    bool ok = true;
+    for (auto& read : reads) {
+        read.ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        read.buffer.reset(new uint8_t[ReadSize]);
+        read.inFlight = false;
+    }
+
+    for (auto& read : reads) {
+        if (!issue(read)) {
+            ok = false;
+            break;
+        }
+    }
+
+    SetConsoleCtrlHandler(StopOnCtrlC, TRUE);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)(seconds * 1000));
+    for (size_t next = 0; ok && !g_Stop; next = (next + 1) % reads.size()) {
+        Read& read = reads[next];
+        DWORD waited;
+        while ((waited = WaitForSingleObject(read.ov.hEvent, 100)) == WAIT_TIMEOUT) {
+            if (g_Stop || (seconds > 0 && std::chrono::steady_clock::now() >= deadline))
+                break;
+        }
+
+        if (waited != WAIT_OBJECT_0)
+            break;
+
+        DWORD BytesReturned = 0;
+        read.inFlight = false;
+        if (!GetOverlappedResult(g_Driver, &read.ov, &BytesReturned, FALSE)) {
+            std::cerr << "[!] READ_RECORDS failed, error " << GetLastError() << std::endl;
+            ok = false;
+            break;
+        }
+
+        if (BytesReturned && !onData(read.buffer.get(), BytesReturned)) {
+            ok = false;
+            break;
+        }
+
+        if (!issue(read)) {
+            ok = false;
+        }
+
+        if (seconds > 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+
+    // every parked read must be finished before its buffer goes away
+    CancelIoEx(g_Driver, NULL);
+    for (auto& read : reads) {
+        DWORD BytesReturned = 0;
+        if (read.inFlight) {
+            GetOverlappedResult(g_Driver, &read.ov, &BytesReturned, TRUE);
+        }
+        CloseHandle(read.ov.hEvent);
+    }
+    SetConsoleCtrlHandler(StopOnCtrlC, FALSE);
+    return ok;
+}
+
+// stream [-o FILE] [--raw] [-t SECONDS]
+int StreamCommand(const std::vector<std::string>& args) {
+    std::string outPath;
+    bool raw = false;
+    double seconds = 0;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-o" && i + 1 < args.size()) {
+            outPath = args[++i];
+        } else if (args[i] == "--raw") {
+            raw = true;
+        } else if (args[i] == "-t" && i + 1 < args.size()) {
+            seconds = std::stod(args[++i]);
+        } else {
+            std::cerr << "[!] unknown stream option " << args[i] << std::endl;
+            return 1;
+        }
+    }
+
+    StpStreamStats stats = { 0 };
+    if (!GetStats(stats))
+        return 1;
+
+    std::ofstream file;
+    if (!outPath.empty()) {
+        file.open(outPath, std::ios::binary | std::ios::trunc);
+        if (!file.good()) {
+            std::cerr << "[!] failed to open " << outPath << std::endl;
+            return 1;
+        }
+    } else if (raw) {
+        std::cerr << "[!] --raw requires -o FILE" << std::endl;
+        return 1;
+    }
+
+    std::ostream& out = outPath.empty() ? std::cout : file;
+    RecordDecoder decoder;
+    TextPrinter printer(decoder, out, stats.qpcFrequency);
+    if (raw) {
+        StpDumpHeader header = { STP_DUMP_MAGIC, STP_DUMP_VERSION, stats.qpcFrequency };
+        out.write((const char*)&header, sizeof(header));
+    }
+
+    bool ok = StreamRecords(seconds, [&](const uint8_t* data, size_t size) {
+        if (raw) {
+            out.write((const char*)data, size);
+        } else if (decoder.decode(data, size, printer) == SIZE_MAX) {
+            std::cerr << "[!] corrupt record stream" << std::endl;
+            return false;
+        }
+        return out.good();
+    });
+
+    out.flush();
+    return ok ? 0 : 1;
+}
+
+// aggregate [-t SECONDS] [-n TOP]
+int AggregateCommand(const std::vector<std::string>& args) {
+    double seconds = 10;
+    size_t top = 25;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-t" && i + 1 < args.size()) {
+            seconds = std::stod(args[++i]);
+        } else if (args[i] == "-n" && i + 1 < args.size()) {
+            top = std::stoul(args[++i]);
+        } else {
+            std::cerr << "[!] unknown aggregate option " << args[i] << std::endl;
+            return 1;
+        }
+    }
+
+    StpStreamStats stats = { 0 };
+    if (!GetStats(stats))
+        return 1;
+
+    RecordDecoder decoder;
+    Aggregator aggregator(stats.qpcFrequency);
+    bool ok = StreamRecords(seconds, [&](const uint8_t* data, size_t size) {
+        return decoder.decode(data, size, aggregator) != SIZE_MAX;
+    });
+
+    aggregator.print(decoder, std::cout, top);
+    return ok ? 0 : 1;
+}
+
+// Feeds the driver's probe name table to the decoder, top doesn't read the record stream that normally carries them
+bool LoadProbeNames(RecordDecoder& decoder) {
+    const DWORD bufferSize = 256 * 1024;
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[bufferSize]);
+    DWORD BytesReturned = 0;
+    if (!DriverIoctl(IOCTL_GET_PROBE_NAMES, 0, 0, buffer.get(), bufferSize, &BytesReturned) && GetLastError() != ERROR_MORE_DATA) {
+        std::cerr << "[!] DeviceIoControl for GET_PROBE_NAMES failed, error " << GetLastError() << std::endl;
+        return false;
+    }
+
+    RecordVisitor ignore;
+    return decoder.decode(buffer.get(), BytesReturned, ignore) != SIZE_MAX;
+}
+
+// Grows buffer until the driver's rows fit, the raw bytes stay in buffer for recording
+bool GetCounters(std::vector<uint8_t>& buffer, CounterSnapshot& snapshot, size_t& size) {
+    while (true) {
+        DWORD BytesReturned = 0;
+        if (!DriverIoctl(IOCTL_GET_COUNTERS, 0, 0, buffer.data(), (DWORD)buffer.size(), &BytesReturned)) {
+            std::cerr << "[!] DeviceIoControl for GET_COUNTERS failed, error " << GetLastError() << std::endl;
+            return false;
+        }
+
+        size = snapshot.parse(buffer.data(), BytesReturned);
+        if (!size) {
+            std::cerr << "[!] malformed counter snapshot" << std::endl;
+            return false;
+        }
+
+        if (!snapshot.truncated)
+            return true;
+
+        StpCounterSnapshotHeader header;
+        memcpy(&header, buffer.data(), sizeof(header));
+        buffer.resize(sizeof(header) + (size_t)header.totalRows * 2 * sizeof(StpCounterRow));
+    }
+}
+
+// top [-i SECONDS] [-n TOP] [-t SECONDS] [-o FILE]
+int TopCommand(const std::vector<std::string>& args) {
+    double interval = 1;
+    double seconds = 0;
+    size_t top = 30;
+    std::string outPath;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-i" && i + 1 < args.size()) {
+            interval = std::stod(args[++i]);
+        } else if (args[i] == "-n" && i + 1 < args.size()) {
+            top = std::stoul(args[++i]);
+        } else if (args[i] == "-t" && i + 1 < args.size()) {
+            seconds = std::stod(args[++i]);
+        } else if (args[i] == "-o" && i + 1 < args.size()) {
+            outPath = args[++i];
+        } else {
+            std::cerr << "[!] unknown top option " << args[i] << std::endl;
+            return 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!outPath.empty()) {
+        file.open(outPath, std::ios::binary | std::ios::trunc);
+        if (!file.good()) {
+            std::cerr << "[!] failed to open " << outPath << std::endl;
+            return 1;
+        }
+    }
+
+    // clearing the screen needs VT processing, off by default in a classic console
+    HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD consoleMode = 0;
+    bool console = GetConsoleMode(hStdout, &consoleMode) && SetConsoleMode(hStdout, consoleMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+    RecordDecoder names;
+    std::vector<uint8_t> buffer(256 * 1024);
+    CounterSnapshot previous, current;
+    size_t size = 0;
+
+    // the first snapshot switches counting on in the driver, it's the baseline for the first interval
+    if (!GetCounters(buffer, previous, size))
+        return 1;
+    if (file.is_open()) {
+        file.write((const char*)buffer.data(), size);
+    }
+
+    SetConsoleCtrlHandler(StopOnCtrlC, TRUE);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)(seconds * 1000));
+    bool ok = true;
+    while (!g_Stop) {
+        auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)(interval * 1000));
+        while (!g_Stop && std::chrono::steady_clock::now() < wake) {
+            Sleep(50);
+        }
+
+        if (!GetCounters(buffer, current, size)) {
+            ok = false;
+            break;
+        }
+        if (file.is_open()) {
+            file.write((const char*)buffer.data(), size);
+        }
+
+        auto rows = RateView::compute(previous, current);
+        for (const RateRow& row : rows) {
+            if (names.probeName(row.probeId).empty()) {
+                LoadProbeNames(names);
+                break;
+            }
+        }
+
+        if (console) {
+            std::cout << "\x1b[H\x1b[2J";
+        }
+        RateView::render(rows, previous, current, names, std::cout, top);
+        std::cout << std::endl;
+
+        previous = std::move(current);
+        if (seconds > 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    SetConsoleCtrlHandler(StopOnCtrlC, FALSE);
+    return ok ? 0 : 1;
+}
+
+void PrintConfig(const StpConfig& config) {
+    static const char* levels[] = { "off", "error", "warn", "info", "debug" };
+
+    std::wstring path;
+    for (size_t i = 0; i < STP_CONFIG_LOG_PATH_LENGTH && config.logPath[i]; i++) {
+        path += (wchar_t)config.logPath[i];
+    }
+
+    std::cout << "level=" << (config.logLevel <= StpLogLevelDebug ? levels[config.logLevel] : "?") << std::endl;
+    std::wcout << L"path=" << path << std::endl;
+    std::cout << "log-buffer-pages=" << config.logBufferPages << std::endl;
+    std::cout << "flush-ms=" << config.flushIntervalMs << std::endl;
+    std::cout << "echo=" << (config.debuggerEcho ? "on" : "off") << std::endl;
+    std::cout << "stack-depth=" << config.stackDepth << std::endl;
+    std::cout << "raw-stacks=" << (config.rawStacks ? "on" : "off") << std::endl;
+    std::cout << "sample=" << config.sampleRate << std::endl;
+    std::cout << "record-buffer=" << config.recordBufferSize << std::endl;
+    std::cout << "memory=" << (config.memoryTracking ? "on" : "off") << std::endl;
+    std::cout << "ngrams=" << (config.ngrams ? "on" : "off") << std::endl;
+}
+
+// Parses one key=value into config, false on an unknown key or malformed value
+bool ParseConfigSetting(const std::string& setting, StpConfig& config) {
+    static const char* levels[] = { "off", "error", "warn", "info", "debug" };
+
+    size_t eq = setting.find('=');
+    if (eq == std::string::npos || eq + 1 == setting.size())
+        return false;
+
+    std::string key = setting.substr(0, eq);
+    std::string value = setting.substr(eq + 1);
+    try {
+        if (key == "level") {
+            for (uint32_t i = 0; i <= StpLogLevelDebug; i++) {
+                if (value == levels[i]) {
+                    config.logLevel = i;
+                    config.fields |= StpConfigLogLevel;
+                    return true;
+                }
+            }
+            return false;
+        } else if (key == "path") {
+            // the driver opens NT paths, accept plain drive paths too
+            std::wstring path = std::filesystem::path(value).wstring();
+            if (path.rfind(L"\\", 0) != 0) {
+                path = L"\\??\\" + path;
+            }
+
+            if (path.size() >= STP_CONFIG_LOG_PATH_LENGTH)
+                return false;
+
+            for (size_t i = 0; i < path.size(); i++) {
+                config.logPath[i] = (uint16_t)path[i];
+            }
+            config.logPath[path.size()] = 0;
+            config.fields |= StpConfigLogPath;
+        } else if (key == "log-buffer-pages") {
+            config.logBufferPages = std::stoul(value);
+            config.fields |= StpConfigLogBufferPages;
+        } else if (key == "flush-ms") {
+            config.flushIntervalMs = std::stoul(value);
+            config.fields |= StpConfigFlushInterval;
+        } else if (key == "echo") {
+            if (value != "on" && value != "off")
+                return false;
+            config.debuggerEcho = value == "on";
+            config.fields |= StpConfigDebuggerEcho;
+        } else if (key == "stack-depth") {
+            config.stackDepth = std::stoul(value);
+            config.fields |= StpConfigStackDepth;
+        } else if (key == "raw-stacks") {
+            if (value != "on" && value != "off")
+                return false;
+            config.rawStacks = value == "on";
+            config.fields |= StpConfigRawStacks;
+        } else if (key == "sample") {
+            config.sampleRate = std::stoul(value);
+            config.fields |= StpConfigSampleRate;
+        } else if (key == "record-buffer") {
+            config.recordBufferSize = std::stoul(value);
+            config.fields |= StpConfigRecordBufferSize;
+        } else if (key == "memory") {
+            if (value != "on" && value != "off")
+                return false;
+            config.memoryTracking = value == "on";
+            config.fields |= StpConfigMemoryTracking;
+        } else if (key == "ngrams") {
+            if (value != "on" && value != "off")
+                return false;
+            config.ngrams = value == "on";
+            config.fields |= StpConfigNgrams;
+        } else {
+            return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// config [KEY=VALUE ...], prints the resulting configuration
+int ConfigCommand(const std::vector<std::string>& args) {
+    StpConfig config = { 0 };
+    for (const std::string& setting : args) {
+        if (!ParseConfigSetting(setting, config)) {
+            std::cerr << "[!] invalid setting " << setting << std::endl;
+            return 1;
+        }
+    }
+
+    DWORD BytesReturned = 0;
+    BOOL Result = config.fields
+        ? DriverIoctl(IOCTL_SET_CONFIG, &config, sizeof(config), &config, sizeof(config), &BytesReturned)
+        : DriverIoctl(IOCTL_GET_CONFIG, 0, 0, &config, sizeof(config), &BytesReturned);
+    if (!Result || BytesReturned < sizeof(config)) {
+        // the driver logs which value it rejected
+        std::cerr << "[!] DeviceIoControl for " << (config.fields ? "SET_CONFIG" : "GET_CONFIG") << " failed, error " << GetLastError() << std::endl;
+        return 1;
+    }
+
+    PrintConfig(config);
+    return 0;
+}
+
+void PrintTargets(const StpTargetState& state, const StpTargetProcess* processes) {
+    if (!state.active) {
+        std::cout << "no targets, every process is traced" << std::endl;
+        return;
+    }
+
+    auto depthString = [](uint32_t depth) {
+        return depth == STP_TARGET_DEPTH_UNLIMITED ? std::string("all") : std::to_string(depth);
+    };
+
+    for (uint32_t i = 0; i < state.nameCount && i < STP_TARGET_MAX_NAMES; i++) {
+        std::string name(state.names[i].imageName, strnlen(state.names[i].imageName, STP_TARGET_NAME_LENGTH));
+        std::cout << "name " << name << " depth " << depthString(state.names[i].depth) << std::endl;
+    }
+
+    for (uint32_t i = 0; i < state.returnedCount; i++) {
+        std::cout << "pid " << processes[i].processId << " root " << processes[i].rootProcessId << " depth " << depthString(processes[i].depth) << std::endl;
+    }
+
+    if (state.returnedCount < state.processCount) {
+        std::cout << "(" << state.processCount - state.returnedCount << " more)" << std::endl;
+    }
+}
+
+// Parses an optional DEPTH|all, false if malformed
+bool ParseTargetDepth(const std::vector<std::string>& args, size_t index, uint32_t& depth) {
+    depth = 0;
+    if (index >= args.size())
+        return true;
+
+    if (args[index] == "all") {
+        depth = STP_TARGET_DEPTH_UNLIMITED;
+        return true;
+    }
+
+    try {
+        depth = std::stoul(args[index]);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return depth != STP_TARGET_DEPTH_UNLIMITED;
+}
+
+// target [pid PID [DEPTH|all] | name IMAGE [DEPTH|all] | remove PID | clear], prints the resulting targets
+int TargetCommand(const std::vector<std::string>& args) {
+    if (!args.empty()) {
+        StpTargetRequest request = { 0 };
+        bool valid = false;
+        try {
+            if (args[0] == "pid" && (args.size() == 2 || args.size() == 3)) {
+                request.op = StpTargetAddProcess;
+                request.processId = std::stoull(args[1]);
+                valid = ParseTargetDepth(args, 2, request.depth);
+            } else if (args[0] == "name" && (args.size() == 2 || args.size() == 3)) {
+                // the OS keeps only the first 15 characters of an image name
+                request.op = StpTargetAddName;
+                strncpy_s(request.imageName, args[1].c_str(), _TRUNCATE);
+                valid = !args[1].empty() && ParseTargetDepth(args, 2, request.depth);
+            } else if (args[0] == "remove" && args.size() == 2) {
+                request.op = StpTargetRemoveProcess;
+                request.processId = std::stoull(args[1]);
+                valid = true;
+            } else if (args[0] == "clear" && args.size() == 1) {
+                request.op = StpTargetClear;
+                valid = true;
+            }
+        } catch (const std::exception&) {
+            valid = false;
+        }
+
+        if (!valid) {
+            std::cerr << "[!] invalid target arguments" << std::endl;
+            return 1;
+        }
+
+        DWORD BytesReturned = 0;
+        if (!DriverIoctl(IOCTL_SET_TARGETS, &request, sizeof(request), 0, 0, &BytesReturned)) {
+            std::cerr << "[!] DeviceIoControl for SET_TARGETS failed, error " << GetLastError() << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> buffer(sizeof(StpTargetState) + 4096 * sizeof(StpTargetProcess));
+    DWORD BytesReturned = 0;
+    if (!DriverIoctl(IOCTL_GET_TARGETS, 0, 0, buffer.data(), (DWORD)buffer.size(), &BytesReturned) || BytesReturned < sizeof(StpTargetState)) {
+        std::cerr << "[!] DeviceIoControl for GET_TARGETS failed, error " << GetLastError() << std::endl;
+        return 1;
+    }
+
+    const StpTargetState& state = *(const StpTargetState*)buffer.data();
+    PrintTargets(state, (const StpTargetProcess*)(buffer.data() + sizeof(StpTargetState)));
+    return 0;
+}
+
+void PrintHandleLeaks(const StpHandleLeakHeader& header, std::vector<StpHandleLeakStack> stacks, size_t top) {
+    if (!header.active) {
+        std::cout << "handle tracking is off" << std::endl;
         return;
     }
+
+    std::cout << header.openHandles << " open handles from " << header.stackCount << " stacks";
+    if (header.droppedHandles) {
+        std::cout << ", " << header.droppedHandles << " not tracked, the tables were full";
+    }
+    std::cout << std::endl;
+
+    std::sort(stacks.begin(), stacks.end(), [](const StpHandleLeakStack& a, const StpHandleLeakStack& b) {
+        return a.openHandles > b.openHandles;
+    });
+
+    for (size_t i = 0; i < stacks.size() && i < top; i++) {
+        const StpHandleLeakStack& stack = stacks[i];
+        std::string syscall(stack.syscall, strnlen(stack.syscall, STP_HANDLE_LEAK_SYSCALL_LENGTH));
+        std::cout << std::endl << "pid " << stack.processId << " Nt" << syscall << " " << stack.openHandles << " open, stack 0x"
+            << std::hex << std::setw(8) << std::setfill('0') << stack.stackId << std::dec << std::setfill(' ') << std::endl;
+        for (uint32_t f = 0; f < stack.frameCount && f < STP_HANDLE_LEAK_MAX_FRAMES; f++) {
+            std::cout << "    0x" << std::hex << stack.frames[f] << std::dec << std::endl;
+        }
+    }
+
+    if (stacks.size() < header.stackCount) {
+        std::cout << "(" << header.stackCount - stacks.size() << " stacks not returned)" << std::endl;
+    }
+}
+
+// handles [start | stop | clear] [-n TOP], prints the stacks with the most open handles
+int HandlesCommand(const std::vector<std::string>& args) {
+    size_t top = 20;
+    size_t i = 0;
+    if (!args.empty() && (args[0] == "start" || args[0] == "stop" || args[0] == "clear")) {
+        StpHandleTrackRequest request = { 0 };
+        request.op = args[0] == "start" ? StpHandleTrackStart : args[0] == "stop" ? StpHandleTrackStop : StpHandleTrackClear;
+
+        DWORD BytesReturned = 0;
+        if (!DriverIoctl(IOCTL_SET_HANDLE_TRACKING, &request, sizeof(request), 0, 0, &BytesReturned)) {
+            std::cerr << "[!] DeviceIoControl for SET_HANDLE_TRACKING failed, error " << GetLastError() << std::endl;
+            return 1;
+        }
+        i++;
+    }
+
+    for (; i < args.size(); i++) {
+        if (args[i] == "-n" && i + 1 < args.size()) {
+            top = std::stoul(args[++i]);
+        } else {
+            std::cerr << "[!] unknown handles option " << args[i] << std::endl;
+            return 1;
+        }
+    }
+
+    // stacks come and go while the buffer is grown, a second try is enough in practice
+    std::vector<uint8_t> buffer(sizeof(StpHandleLeakHeader) + 4096 * sizeof(StpHandleLeakStack));
+    StpHandleLeakHeader header;
+    for (int tries = 0; ; tries++) {
+        DWORD BytesReturned = 0;
+        if (!DriverIoctl(IOCTL_GET_HANDLE_LEAKS, 0, 0, buffer.data(), (DWORD)buffer.size(), &BytesReturned) || BytesReturned < sizeof(header)) {
+            std::cerr << "[!] DeviceIoControl for GET_HANDLE_LEAKS failed, error " << GetLastError() << std::endl;
+            return 1;
+        }
+
+        memcpy(&header, buffer.data(), sizeof(header));
+        if (header.returnedCount >= header.stackCount || tries == 1)
+            break;
+        buffer.resize(sizeof(header) + (size_t)header.stackCount * 2 * sizeof(StpHandleLeakStack));
+    }
+
+    std::vector<StpHandleLeakStack> stacks(header.returnedCount);
+    memcpy(stacks.data(), buffer.data() + sizeof(header), stacks.size() * sizeof(StpHandleLeakStack));
+    PrintHandleLeaks(header, std::move(stacks), top);
+    return 0;
+}
+
+// Rows of one interval, the per handle rows keep their path
+struct IoRow {
+    StpIoCounterRow counters;
+    std::wstring path;
+};
+
+// Fetches the I/O moved since the previous call, the driver keeps what doesn't fit for the next call
+bool GetIoCounters(std::vector<uint8_t>& buffer, StpIoCounterHeader& header, std::vector<IoRow>& rows) {
+    rows.clear();
+    DWORD BytesReturned = 0;
+    if (!DriverIoctl(IOCTL_GET_IO_COUNTERS, 0, 0, buffer.data(), (DWORD)buffer.size(), &BytesReturned) || BytesReturned < sizeof(header)) {
+        std::cerr << "[!] DeviceIoControl for GET_IO_COUNTERS failed, error " << GetLastError() << std::endl;
+        return false;
+    }
+
+    memcpy(&header, buffer.data(), sizeof(header));
+    if (sizeof(header) + (size_t)header.rowCount * sizeof(StpIoCounterRow) > BytesReturned) {
+        std::cerr << "[!] malformed I/O counter snapshot" << std::endl;
+        return false;
+    }
+
+    rows.resize(header.rowCount);
+    for (uint32_t i = 0; i < header.rowCount; i++) {
+        IoRow& row = rows[i];
+        memcpy(&row.counters, buffer.data() + sizeof(header) + i * sizeof(StpIoCounterRow), sizeof(StpIoCounterRow));
+        for (size_t c = 0; c < STP_IO_PATH_LENGTH && row.counters.path[c]; c++) {
+            row.path += (wchar_t)row.counters.path[c];
+        }
+    }
+    return true;
+}
+
+void PrintIoRows(const StpIoCounterHeader& header, std::vector<IoRow> rows, size_t top) {
+    const double seconds = header.intervalTicks && header.qpcFrequency ? (double)header.intervalTicks / header.qpcFrequency : 0;
+    auto rate = [&](uint64_t bytes) {
+        return seconds > 0 ? (double)bytes / seconds / 1024 : 0;
+    };
+
+    std::sort(rows.begin(), rows.end(), [](const IoRow& a, const IoRow& b) {
+        return a.counters.readBytes + a.counters.writeBytes > b.counters.readBytes + b.counters.writeBytes;
+    });
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "interval " << seconds << "s";
+    if (header.totalRows > header.rowCount) {
+        std::cout << ", " << header.totalRows - header.rowCount << " rows deferred to the next interval";
+    }
+    if (header.overflow) {
+        std::cout << ", " << header.overflow << " calls not counted, the tables were full";
+    }
+    std::cout << std::endl << std::endl;
+
+    std::cout << std::setw(8) << "PID" << std::setw(10) << "READS" << std::setw(12) << "READ KB/s"
+        << std::setw(10) << "WRITES" << std::setw(12) << "WRITE KB/s" << std::setw(10) << "PENDING" << std::endl;
+    size_t printed = 0;
+    for (const IoRow& row : rows) {
+        if (row.counters.handle || printed++ == top)
+            continue;
+        const StpIoCounterRow& c = row.counters;
+        std::cout << std::setw(8) << c.pid << std::setw(10) << c.reads << std::setw(12) << rate(c.readBytes)
+            << std::setw(10) << c.writes << std::setw(12) << rate(c.writeBytes) << std::setw(10) << c.pending << std::endl;
+    }
+
+    std::cout << std::endl << std::setw(8) << "PID" << std::setw(8) << "HANDLE" << std::setw(12) << "READ KB/s"
+        << std::setw(12) << "WRITE KB/s" << "  PATH" << std::endl;
+    printed = 0;
+    for (const IoRow& row : rows) {
+        if (!row.counters.handle || printed++ == top)
+            continue;
+        const StpIoCounterRow& c = row.counters;
+        std::cout << std::setw(8) << c.pid << std::setw(8) << std::hex << c.handle << std::dec << std::setw(12) << rate(c.readBytes)
+            << std::setw(12) << rate(c.writeBytes) << "  ";
+        std::wcout << (row.path.empty() ? L"?" : row.path) << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+// io [-i SECONDS] [-n TOP] [-t SECONDS], the processes and files moving the most bytes per interval
+int IoCommand(const std::vector<std::string>& args) {
+    double interval = 1;
+    double seconds = 0;
+    size_t top = 20;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-i" && i + 1 < args.size()) {
+            interval = std::stod(args[++i]);
+        } else if (args[i] == "-n" && i + 1 < args.size()) {
+            top = std::stoul(args[++i]);
+        } else if (args[i] == "-t" && i + 1 < args.size()) {
+            seconds = std::stod(args[++i]);
+        } else {
+            std::cerr << "[!] unknown io option " << args[i] << std::endl;
+            return 1;
+        }
+    }
+
+    HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD consoleMode = 0;
+    bool console = GetConsoleMode(hStdout, &consoleMode) && SetConsoleMode(hStdout, consoleMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+    std::vector<uint8_t> buffer(sizeof(StpIoCounterHeader) + 8192 * sizeof(StpIoCounterRow));
+    StpIoCounterHeader header;
+    std::vector<IoRow> rows;
+
+    // the first call switches accounting on, what it returns predates this client
+    if (!GetIoCounters(buffer, header, rows))
+        return 1;
+
+    SetConsoleCtrlHandler(StopOnCtrlC, TRUE);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)(seconds * 1000));
+    bool ok = true;
+    while (!g_Stop) {
+        auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)(interval * 1000));
+        while (!g_Stop && std::chrono::steady_clock::now() < wake) {
+            Sleep(50);
+        }
+
+        if (!GetIoCounters(buffer, header, rows)) {
+            ok = false;
+            break;
+        }
+
+        if (console) {
+            std::cout << "\x1b[H\x1b[2J";
+        }
+        PrintIoRows(header, std::move(rows), top);
+        std::cout << std::endl;
+
+        if (seconds > 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    SetConsoleCtrlHandler(StopOnCtrlC, FALSE);
+    return ok ? 0 : 1;
+}
+
+// ngrams [-p PID] [-n TOP], each process's most frequent syscall sequences
+int NgramsCommand(const std::vector<std::string>& args) {
+    uint32_t pid = 0;
+    size_t top = 10;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "-p" && i + 1 < args.size()) {
+            pid = std::stoul(args[++i]);
+        } else if (args[i] == "-n" && i + 1 < args.size()) {
+            top = std::stoul(args[++i]);
+        } else {
+            std::cerr << "[!] unknown ngrams option " << args[i] << std::endl;
+            return 1;
+        }
+    }
+
+    // counts are cumulative and stay in the driver, growing the buffer once is enough
+    std::vector<uint8_t> buffer(sizeof(StpNgramHeader) + 16384 * sizeof(StpNgramRow));
+    StpNgramHeader header;
+    for (int tries = 0; ; tries++) {
+        DWORD BytesReturned = 0;
+        if (!DriverIoctl(IOCTL_GET_NGRAMS, 0, 0, buffer.data(), (DWORD)buffer.size(), &BytesReturned) || BytesReturned < sizeof(header)) {
+            std::cerr << "[!] DeviceIoControl for GET_NGRAMS failed, error " << GetLastError() << std::endl;
+            return 1;
+        }
+
+        memcpy(&header, buffer.data(), sizeof(header));
+        if (header.rowCount >= header.totalRows || tries == 1)
+            break;
+        buffer.resize(sizeof(header) + (size_t)header.totalRows * 2 * sizeof(StpNgramRow));
+    }
+
+    if (!header.active) {
+        std::cout << "syscall n-grams are off, turn them on with config ngrams=on" << std::endl;
+    }
+
+    std::map<uint32_t, std::vector<StpNgram>> processes;
+    for (uint32_t i = 0; i < header.rowCount; i++) {
+        StpNgramRow row;
+        memcpy(&row, buffer.data() + sizeof(header) + i * sizeof(StpNgramRow), sizeof(row));
+        if (!pid || row.pid == pid) {
+            processes[row.pid].push_back(row.gram);
+        }
+    }
+
+    RecordDecoder names;
+    LoadProbeNames(names);
+    for (auto& process : processes) {
+        std::vector<StpNgram>& grams = process.second;
+        std::sort(grams.begin(), grams.end(), [](const StpNgram& a, const StpNgram& b) {
+            return a.count > b.count;
+        });
+
+        std::cout << std::endl << "pid " << process.first << ", " << grams.size() << " distinct grams" << std::endl;
+        for (size_t i = 0; i < grams.size() && i < top; i++) {
+            std::cout << std::setw(12) << grams[i].count << "  " << names.gramName(grams[i]) << std::endl;
+        }
+    }
+
+    if (header.totalRows > header.rowCount) {
+        std::cout << "(" << header.totalRows - header.rowCount << " grams not returned)" << std::endl;
+    }
+    if (header.overflow) {
+        std::cout << header.overflow << " grams not counted, the tables were full" << std::endl;
+    }
+    return 0;
+}
+
+void PrintUsage() {
+    std::cout << "Usage: STraceCLI                    interactive mode" << std::endl;
+    std::cout << "       STraceCLI load PATH          load a plugin (.dll or prelinked .stp)" << std::endl;
+    std::cout << "       STraceCLI unload" << std::endl;
+    std::cout << "       STraceCLI stats" << std::endl;
+    std::cout << "       STraceCLI stream [-o FILE] [--raw] [-t SECONDS]" << std::endl;
+    std::cout << "       STraceCLI aggregate [-t SECONDS] [-n TOP]" << std::endl;
+    std::cout << "       STraceCLI top [-i SECONDS] [-n TOP] [-t SECONDS] [-o FILE]" << std::endl;
+    std::cout << "       STraceCLI config [KEY=VALUE ...]" << std::endl;
+    std::cout << "           level=off|error|warn|info|debug  path=FILE  log-buffer-pages=N  flush-ms=N" << std::endl;
+    std::cout << "           echo=on|off  stack-depth=N  sample=N  record-buffer=BYTES  memory=on|off" << std::endl;
+    std::cout << "           ngrams=on|off  raw-stacks=on|off" << std::endl;
+    std::cout << "           raw-stacks records unresolved stacks and module loads for stream to symbolicate" << std::endl;
+    std::cout << "       STraceCLI target [pid PID [DEPTH|all] | name IMAGE [DEPTH|all] | remove PID | clear]" << std::endl;
+    std::cout << "           DEPTH is how many generations of children are followed, 0 by default" << std::endl;
+    std::cout << "       STraceCLI handles [start | stop | clear] [-n TOP]" << std::endl;
+    std::cout << "           open handles grouped by the stack that created them" << std::endl;
+    std::cout << "       STraceCLI io [-i SECONDS] [-n TOP] [-t SECONDS]" << std::endl;
+    std::cout << "           bytes read and written per process and file handle" << std::endl;
+    std::cout << "       STraceCLI ngrams [-p PID] [-n TOP]" << std::endl;
+    std::cout << "           syscall bigrams and trigrams per process, see config ngrams=on" << std::endl;
 }
 
-int main()
+int RunCommand(const std::string& command, const std::vector<std::string>& args) {
+    if (command == "load" && args.size() == 1) {
+        return LoadDll(args[0]) ? 0 : 1;
+    } else if (command == "unload") {
+        return UnloadDll() ? 0 : 1;
+    } else if (command == "stats") {
+        return PrintStats() ? 0 : 1;
+    } else if (command == "stream") {
+        return StreamCommand(args);
+    } else if (command == "aggregate") {
+        return AggregateCommand(args);
+    } else if (command == "top") {
+        return TopCommand(args);
+    } else if (command == "config") {
+        return ConfigCommand(args);
+    } else if (command == "target") {
+        return TargetCommand(args);
+    } else if (command == "handles") {
+        return HandlesCommand(args);
+    } else if (command == "io") {
+        return IoCommand(args);
+    } else if (command == "ngrams") {
+        return NgramsCommand(args);
+    }
+
+    PrintUsage();
+    return 1;
+}
+
+int main(int argc, char** argv)
 {
+    if (argc > 1) {
+        std::string command = argv[1];
+        if (command == "-h" || command == "--help") {
+            PrintUsage();
+            return 0;
+        }
+
+        g_Overlapped = command == "stream" || command == "aggregate";
+        g_Driver = CreateFileW(L"\\\\.\\STrace", GENERIC_ALL, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_SYSTEM | (g_Overlapped ? FILE_FLAG_OVERLAPPED : 0), 0);
+        if (g_Driver == INVALID_HANDLE_VALUE) {
+            std::cerr << "[!] Handle open to driver failed" << std::endl;
+            return 1;
+        }
+
+        int ret = RunCommand(command, std::vector<std::string>(argv + 2, argv + argc));
+        CloseHandle(g_Driver);
+        return ret;
+    }
+
     printf("[+] Opening driver\n");
     g_Driver = CreateFileW(L"\\\\.\\STrace", GENERIC_ALL, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_SYSTEM, 0);
     if (g_Driver == INVALID_HANDLE_VALUE) {
@@ -105,7 +1092,7 @@ int main()
     printf("[+] Driver Opened Successfully\n");
 
     while (true) {
-        std::cout << "Input command: load, unload, exit" << std::endl;
+        std::cout << "Input command: load, unload, stats, exit" << std::endl;
         std::string input;
         std::cin >> input;
         if (input == "load") {
@@ -114,6 +1101,8 @@ int main()
         } else if (input == "unload") {
             printf("[+] Unloading plugin\n");
             UnloadDll();
+        } else if (input == "stats") {
+            PrintStats();
         } else if (input == "exit") {
             break;
         }
@@ -121,4 +1110,3 @@ int main()
 
     printf("[+] Goodbye\n");
 }
-
@@ -7,5 +7,22 @@
 #include <tchar.h>
 #include <strsafe.h>
 
+#define STP_PRELINK_MAGIC       0x4B4C5053 // STrace/PrelinkFormat.h
+
 #define IOCTL_LOADDLL           CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 0), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
-#define IOCTL_UNLOADDLL           CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 1), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
\ No newline at end of file
+#define IOCTL_UNLOADDLL           CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 1), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_LOADDLL_BEGIN     CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 2), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_LOADDLL_APPEND    CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 3), METHOD_IN_DIRECT, FILE_SPECIAL_ACCESS)
+#define IOCTL_LOADDLL_COMMIT    CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 4), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_READ_RECORDS      CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 5), METHOD_OUT_DIRECT, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_STATS         CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 6), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_COUNTERS      CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 7), METHOD_OUT_DIRECT, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_PROBE_NAMES   CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 8), METHOD_OUT_DIRECT, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_CONFIG        CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 9), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_SET_CONFIG        CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 10), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_SET_TARGETS       CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 11), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_TARGETS       CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 12), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_SET_HANDLE_TRACKING CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 13), METHOD_BUFFERED, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_HANDLE_LEAKS  CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 14), METHOD_OUT_DIRECT, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_IO_COUNTERS   CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 15), METHOD_OUT_DIRECT, FILE_SPECIAL_ACCESS)
+#define IOCTL_GET_NGRAMS        CTL_CODE (FILE_DEVICE_UNKNOWN, (0x800 + 16), METHOD_OUT_DIRECT, FILE_SPECIAL_ACCESS)
@@ -0,0 +1,114 @@
+// STraceDecode.cpp : Offline decoder for raw record dumps written by "STraceCLI stream --raw" and counter snapshots
+// recorded with "STraceCLI top -o".
+//
+// Usage: STraceDecode <dump> [--aggregate [TOP]]
+//        STraceDecode <snapshots> [TOP]
+//
+// Portable, dumps can be taken off the traced host and decoded anywhere. Outside of Visual Studio:
+//   g++ -std=c++17 -O2 STraceDecode.cpp ../STraceCLI/RecordDecoder.cpp ../STraceCLI/RateView.cpp -o stracedecode
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "../STraceCLI/RecordDecoder.h"
+#include "../STraceCLI/RateView.h"
+
+// Renders the interval between every pair of consecutive snapshots, as "top" showed it live
+int ReplaySnapshots(std::ifstream& file, size_t top)
+{
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    RecordDecoder names;
+    CounterSnapshot previous, current;
+    size_t offset = previous.parse(data.data(), data.size());
+    if (!offset) {
+        std::cout << "[!] corrupt counter snapshot at offset 0" << std::endl;
+        return 1;
+    }
+
+    while (offset < data.size()) {
+        size_t size = current.parse(data.data() + offset, data.size() - offset);
+        if (!size) {
+            std::cout << "[!] corrupt counter snapshot at offset " << offset << std::endl;
+            return 1;
+        }
+
+        RateView::render(RateView::compute(previous, current), previous, current, names, std::cout, top);
+        std::cout << std::endl;
+        previous = std::move(current);
+        offset += size;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cout << "Usage: STraceDecode <dump> [--aggregate [TOP]]" << std::endl;
+        std::cout << "       STraceDecode <snapshots> [TOP]" << std::endl;
+        return 1;
+    }
+
+    bool aggregate = argc >= 3 && std::string(argv[2]) == "--aggregate";
+    size_t top = argc >= 4 ? std::stoul(argv[3]) : 0;
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file.good()) {
+        std::cout << "[!] failed to open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    StpDumpHeader header = {};
+    if (file.read((char*)&header, sizeof(header)) && header.magic == STP_COUNTERS_MAGIC) {
+        file.seekg(0);
+        return ReplaySnapshots(file, argc >= 3 ? std::stoul(argv[2]) : 0);
+    }
+
+    if (!file || header.magic != STP_DUMP_MAGIC) {
+        std::cout << "[!] not a STrace record dump" << std::endl;
+        return 1;
+    }
+
+    if (header.version != STP_DUMP_VERSION) {
+        std::cout << "[!] unsupported dump version " << header.version << std::endl;
+        return 1;
+    }
+
+    std::ios::sync_with_stdio(false);
+    RecordDecoder decoder;
+    TextPrinter printer(decoder, std::cout, header.qpcFrequency);
+    Aggregator aggregator(header.qpcFrequency);
+    RecordVisitor& visitor = aggregate ? (RecordVisitor&)aggregator : (RecordVisitor&)printer;
+
+    // records may straddle read boundaries, carry the partial tail over
+    std::vector<uint8_t> buffer(1024 * 1024);
+    size_t pending = 0;
+    while (file) {
+        file.read((char*)buffer.data() + pending, buffer.size() - pending);
+        size_t available = pending + (size_t)file.gcount();
+        if (available == pending)
+            break;
+
+        size_t consumed = decoder.decode(buffer.data(), available, visitor);
+        if (consumed == SIZE_MAX) {
+            std::cout << "[!] corrupt record after " << decoder.recordCount() << " records" << std::endl;
+            return 1;
+        }
+
+        pending = available - consumed;
+        memmove(buffer.data(), buffer.data() + consumed, pending);
+    }
+
+    if (pending) {
+        std::cout << "[!] dump ends with a truncated record" << std::endl;
+    }
+
+    if (aggregate) {
+        aggregator.print(decoder, std::cout, top);
+    }
+    return 0;
+}
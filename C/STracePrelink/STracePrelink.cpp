@@ -0,0 +1,365 @@
+// STracePrelink.cpp : Offline pre-linker for STrace plugins.
+//
+// Usage: STracePrelink <plugin.dll> <out.stp>
+//
+// Does the position independent part of ManualMapper::loadImage ahead of time: sections are laid out at their RVAs,
+// the relocation directory is flattened into a sorted list of DIR64 sites and every import is reduced to a
+// (module, export hash, IAT slot) triple. The output is loaded through the normal IOCTL_LOADDLL path, the driver
+// recognizes it by STP_PRELINK_MAGIC. See STrace/PrelinkFormat.h for the layout.
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "../STrace/PrelinkFormat.h"
+
+// Minimal PE definitions, this tool must build without windows headers
+namespace pe {
+    constexpr uint16_t DosSignature = 0x5A4D;
+    constexpr uint32_t NtSignature = 0x4550;
+    constexpr uint16_t MachineAmd64 = 0x8664;
+    constexpr uint16_t OptionalMagic64 = 0x20B;
+    constexpr uint32_t DirectoryImport = 1;
+    constexpr uint32_t DirectoryBaseReloc = 5;
+    constexpr uint16_t RelBasedAbsolute = 0;
+    constexpr uint16_t RelBasedDir64 = 10;
+    constexpr uint64_t OrdinalFlag64 = 0x8000000000000000ull;
+
+#pragma pack(push, 1)
+    struct ImageDataDirectory {
+        uint32_t VirtualAddress;
+        uint32_t Size;
+    };
+
+    struct ImageFileHeader {
+        uint16_t Machine;
+        uint16_t NumberOfSections;
+        uint32_t TimeDateStamp;
+        uint32_t PointerToSymbolTable;
+        uint32_t NumberOfSymbols;
+        uint16_t SizeOfOptionalHeader;
+        uint16_t Characteristics;
+    };
+
+    struct ImageOptionalHeader64 {
+        uint16_t Magic;
+        uint8_t MajorLinkerVersion;
+        uint8_t MinorLinkerVersion;
+        uint32_t SizeOfCode;
+        uint32_t SizeOfInitializedData;
+        uint32_t SizeOfUninitializedData;
+        uint32_t AddressOfEntryPoint;
+        uint32_t BaseOfCode;
+        uint64_t ImageBase;
+        uint32_t SectionAlignment;
+        uint32_t FileAlignment;
+        uint16_t MajorOperatingSystemVersion;
+        uint16_t MinorOperatingSystemVersion;
+        uint16_t MajorImageVersion;
+        uint16_t MinorImageVersion;
+        uint16_t MajorSubsystemVersion;
+        uint16_t MinorSubsystemVersion;
+        uint32_t Win32VersionValue;
+        uint32_t SizeOfImage;
+        uint32_t SizeOfHeaders;
+        uint32_t CheckSum;
+        uint16_t Subsystem;
+        uint16_t DllCharacteristics;
+        uint64_t SizeOfStackReserve;
+        uint64_t SizeOfStackCommit;
+        uint64_t SizeOfHeapReserve;
+        uint64_t SizeOfHeapCommit;
+        uint32_t LoaderFlags;
+        uint32_t NumberOfRvaAndSizes;
+        ImageDataDirectory DataDirectory[16];
+    };
+
+    struct NtHeaders64 {
+        uint32_t Signature;
+        ImageFileHeader FileHeader;
+        ImageOptionalHeader64 OptionalHeader;
+    };
+
+    struct SectionHeader {
+        char Name[8];
+        uint32_t VirtualSize;
+        uint32_t VirtualAddress;
+        uint32_t SizeOfRawData;
+        uint32_t PointerToRawData;
+        uint32_t PointerToRelocations;
+        uint32_t PointerToLinenumbers;
+        uint16_t NumberOfRelocations;
+        uint16_t NumberOfLinenumbers;
+        uint32_t Characteristics;
+    };
+
+    struct ImportDescriptor {
+        uint32_t OriginalFirstThunk;
+        uint32_t TimeDateStamp;
+        uint32_t ForwarderChain;
+        uint32_t Name;
+        uint32_t FirstThunk;
+    };
+
+    struct BaseRelocation {
+        uint32_t VirtualAddress;
+        uint32_t SizeOfBlock;
+    };
+#pragma pack(pop)
+}
+
+class Prelinker {
+public:
+    bool load(const std::vector<uint8_t>& file) {
+        if (file.size() < 0x40 || read<uint16_t>(file, 0) != pe::DosSignature) {
+            return fail("not a PE file (DOS magic)");
+        }
+
+        uint32_t lfanew = read<uint32_t>(file, 0x3C);
+        if ((uint64_t)lfanew + sizeof(pe::NtHeaders64) > file.size()) {
+            return fail("NT headers out of bounds");
+        }
+
+        pe::NtHeaders64 nt;
+        memcpy(&nt, file.data() + lfanew, sizeof(nt));
+        if (nt.Signature != pe::NtSignature || nt.FileHeader.Machine != pe::MachineAmd64 || nt.OptionalHeader.Magic != pe::OptionalMagic64) {
+            return fail("only PE32+ AMD64 plugins are supported");
+        }
+
+        const auto& opt = nt.OptionalHeader;
+        if (opt.SizeOfHeaders > file.size() || opt.SizeOfHeaders > opt.SizeOfImage) {
+            return fail("bad SizeOfHeaders");
+        }
+
+        m_preferredBase = opt.ImageBase;
+        m_image.assign(opt.SizeOfImage, 0);
+        memcpy(m_image.data(), file.data(), opt.SizeOfHeaders);
+
+        uint64_t sectionOffset = (uint64_t)lfanew + 4 + sizeof(pe::ImageFileHeader) + nt.FileHeader.SizeOfOptionalHeader;
+        for (uint16_t i = 0; i < nt.FileHeader.NumberOfSections; i++) {
+            if (sectionOffset + sizeof(pe::SectionHeader) > file.size()) {
+                return fail("section table out of bounds");
+            }
+
+            pe::SectionHeader section;
+            memcpy(&section, file.data() + sectionOffset, sizeof(section));
+            sectionOffset += sizeof(section);
+            if (!section.SizeOfRawData)
+                continue;
+
+            if ((uint64_t)section.PointerToRawData + section.SizeOfRawData > file.size() ||
+                (uint64_t)section.VirtualAddress + section.SizeOfRawData > m_image.size()) {
+                return fail("section raw data out of bounds");
+            }
+            memcpy(m_image.data() + section.VirtualAddress, file.data() + section.PointerToRawData, section.SizeOfRawData);
+        }
+
+        return collectRelocations(opt.DataDirectory[pe::DirectoryBaseReloc]) && collectImports(opt.DataDirectory[pe::DirectoryImport]);
+    }
+
+    bool write(const std::string& path) const {
+        std::vector<uint8_t> relocs;
+        uint32_t last = 0;
+        for (uint32_t rva : m_relocs) {
+            uint32_t delta = rva - last;
+            last = rva;
+            do {
+                uint8_t byte = delta & 0x7F;
+                delta >>= 7;
+                relocs.push_back(delta ? (byte | 0x80) : byte);
+            } while (delta);
+        }
+
+        PrelinkHeader header = {};
+        header.magic = STP_PRELINK_MAGIC;
+        header.version = STP_PRELINK_VERSION;
+        header.preferredBase = m_preferredBase;
+        header.sizeOfImage = (uint32_t)m_image.size();
+        header.relocCount = (uint32_t)m_relocs.size();
+        header.relocBytes = (uint32_t)relocs.size();
+        header.importCount = (uint32_t)m_imports.size();
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out.good()) {
+            return fail("failed to open output file");
+        }
+
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)m_image.data(), m_image.size());
+        out.write((const char*)relocs.data(), relocs.size());
+        out.write((const char*)m_imports.data(), m_imports.size() * sizeof(PrelinkImport));
+        if (!out.good()) {
+            return fail("failed to write output file");
+        }
+
+        std::cout << "[+] " << m_image.size() << " byte image, " << m_relocs.size() << " relocations (" << relocs.size()
+            << " bytes), " << m_imports.size() << " imports" << std::endl;
+        return true;
+    }
+
+private:
+    template<typename T>
+    static T read(const std::vector<uint8_t>& buf, uint64_t offset) {
+        T value;
+        memcpy(&value, buf.data() + offset, sizeof(T));
+        return value;
+    }
+
+    static bool fail(const char* msg) {
+        std::cout << "[!] " << msg << std::endl;
+        return false;
+    }
+
+    bool inImage(uint64_t rva, uint64_t size) const {
+        return rva + size <= m_image.size();
+    }
+
+    // null terminated and fully inside the image
+    const char* imageString(uint32_t rva) const {
+        if (rva >= m_image.size() || !memchr(m_image.data() + rva, 0, m_image.size() - rva))
+            return nullptr;
+        return (const char*)m_image.data() + rva;
+    }
+
+    bool collectRelocations(const pe::ImageDataDirectory& dir) {
+        if (!dir.VirtualAddress || !dir.Size)
+            return true;
+
+        if (!inImage(dir.VirtualAddress, dir.Size)) {
+            return fail("relocation directory out of bounds");
+        }
+
+        uint64_t offset = dir.VirtualAddress;
+        const uint64_t end = offset + dir.Size;
+        while (offset + sizeof(pe::BaseRelocation) <= end) {
+            pe::BaseRelocation block = read<pe::BaseRelocation>(m_image, offset);
+            if (block.SizeOfBlock < sizeof(block) || offset + block.SizeOfBlock > end) {
+                return fail("malformed relocation block");
+            }
+
+            for (uint64_t entry = offset + sizeof(block); entry + sizeof(uint16_t) <= offset + block.SizeOfBlock; entry += sizeof(uint16_t)) {
+                uint16_t value = read<uint16_t>(m_image, entry);
+                uint16_t type = value >> 12;
+                uint32_t rva = block.VirtualAddress + (value & 0xFFF);
+                if (type == pe::RelBasedAbsolute)
+                    continue;
+
+                if (type != pe::RelBasedDir64) {
+                    std::cout << "[!] unsupported relocation type " << type << " at rva 0x" << std::hex << rva << std::dec << std::endl;
+                    return false;
+                }
+
+                if (!inImage(rva, sizeof(uint64_t))) {
+                    return fail("relocation target out of bounds");
+                }
+                m_relocs.push_back(rva);
+            }
+            offset += block.SizeOfBlock;
+        }
+
+        std::sort(m_relocs.begin(), m_relocs.end());
+        m_relocs.erase(std::unique(m_relocs.begin(), m_relocs.end()), m_relocs.end());
+        return true;
+    }
+
+    bool collectImports(const pe::ImageDataDirectory& dir) {
+        if (!dir.VirtualAddress || !dir.Size)
+            return true;
+
+        for (uint64_t offset = dir.VirtualAddress; ; offset += sizeof(pe::ImportDescriptor)) {
+            if (!inImage(offset, sizeof(pe::ImportDescriptor))) {
+                return fail("import descriptor out of bounds");
+            }
+
+            pe::ImportDescriptor desc = read<pe::ImportDescriptor>(m_image, offset);
+            if (!desc.Name)
+                break;
+
+            const char* szMod = imageString(desc.Name);
+            if (!szMod) {
+                return fail("import module name out of bounds");
+            }
+
+            PrelinkModule module;
+            std::string lower(szMod);
+            std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)tolower(c); });
+            if (lower == "ntoskrnl.exe") {
+                module = PrelinkModuleNtoskrnl;
+            } else if (lower == "hal.dll") {
+                module = PrelinkModuleHal;
+            } else {
+                std::cout << "[!] plugins may only import from ntoskrnl.exe and hal.dll, found " << szMod << std::endl;
+                return false;
+            }
+
+            // Same as the driver, the lookup table may be absent in which case the IAT holds the names
+            uint32_t lookupRva = desc.OriginalFirstThunk ? desc.OriginalFirstThunk : desc.FirstThunk;
+            for (uint32_t i = 0; ; i++) {
+                uint64_t thunkRva = (uint64_t)lookupRva + i * sizeof(uint64_t);
+                uint64_t iatRva = (uint64_t)desc.FirstThunk + i * sizeof(uint64_t);
+                if (!inImage(thunkRva, sizeof(uint64_t)) || !inImage(iatRva, sizeof(uint64_t))) {
+                    return fail("import thunk out of bounds");
+                }
+
+                uint64_t thunk = read<uint64_t>(m_image, thunkRva);
+                if (!thunk)
+                    break;
+
+                if (thunk & pe::OrdinalFlag64) {
+                    std::cout << "[!] import by ordinal from " << szMod << " is not supported" << std::endl;
+                    return false;
+                }
+
+                // skip IMAGE_IMPORT_BY_NAME::Hint
+                uint32_t nameRva = (uint32_t)thunk + sizeof(uint16_t);
+                const char* name = imageString(nameRva);
+                if (!name) {
+                    return fail("import name out of bounds");
+                }
+
+                PrelinkImport import = {};
+                import.module = module;
+                import.hash = StpHashExportName(name);
+                import.nameRva = nameRva;
+                import.iatRva = (uint32_t)iatRva;
+                m_imports.push_back(import);
+            }
+        }
+
+        // grouped by module and hash, the driver's export index probes are then mostly in ascending order
+        std::sort(m_imports.begin(), m_imports.end(), [](const PrelinkImport& a, const PrelinkImport& b) {
+            return a.module != b.module ? a.module < b.module : a.hash < b.hash;
+        });
+        return true;
+    }
+
+    uint64_t m_preferredBase = 0;
+    std::vector<uint8_t> m_image;
+    std::vector<uint32_t> m_relocs;
+    std::vector<PrelinkImport> m_imports;
+};
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::cout << "Usage: STracePrelink <plugin.dll> <out.stp>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file.good()) {
+        std::cout << "[!] failed to open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> fileData((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    Prelinker prelinker;
+    if (!prelinker.load(fileData) || !prelinker.write(argv[2])) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Throughput of the plugins' ConcurrentMap against a std::mutex guarded std::unordered_map, for 1 to N threads. The
+// mixes are what the plugins do: per process counters (add), handle lookups (mostly get) and short lived entries
+// (insert then remove).
+#include "KernelApis.h"
+#include "concurrent_map.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+static const uint64_t OpsPerThread = 2000000;
+static const uint64_t Keys = 4096;
+
+enum class Mix { Add, Get, InsertRemove };
+
+static const char* mixName(Mix mix) {
+    switch (mix) {
+    case Mix::Add: return "add";
+    case Mix::Get: return "90% get";
+    default: return "insert/remove";
+    }
+}
+
+// results are written here so the lookups aren't optimized away
+static std::atomic<uint64_t> g_sink;
+
+// xorshift, so key choice costs next to nothing and isn't shared between threads
+static uint64_t nextKey(uint64_t& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state % Keys;
+}
+
+struct LockedMap {
+    std::mutex lock;
+    std::unordered_map<uint64_t, uint64_t> map;
+
+    void add(uint64_t key, uint64_t delta) {
+        std::lock_guard<std::mutex> guard(lock);
+        map[key] += delta;
+    }
+
+    bool get(uint64_t key, uint64_t& value) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = map.find(key);
+        if (it == map.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+
+    bool insert(uint64_t key, uint64_t value) {
+        std::lock_guard<std::mutex> guard(lock);
+        return map.emplace(key, value).second;
+    }
+
+    bool remove(uint64_t key) {
+        std::lock_guard<std::mutex> guard(lock);
+        return map.erase(key) != 0;
+    }
+};
+
+template<typename Map>
+static void runMix(Map& map, Mix mix, uint64_t seed) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+    uint64_t sink = 0;
+    for (uint64_t i = 0; i < OpsPerThread; i++) {
+        const uint64_t key = nextKey(state);
+        if (mix == Mix::Add) {
+            map.add(key, 1);
+        } else if (mix == Mix::Get) {
+            uint64_t value = 0;
+            if (i % 10 == 0) {
+                map.add(key, 1);
+            } else if (map.get(key, value)) {
+                sink += value;
+            }
+        } else if (!map.insert(key, i)) {
+            map.remove(key);
+        }
+    }
+    g_sink.fetch_add(sink, std::memory_order_relaxed);
+}
+
+template<typename Map>
+static double measure(Map& map, Mix mix, unsigned threadCount) {
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threadCount; t++) {
+        threads.emplace_back([&map, mix, t] { runMix(map, mix, t + 1); });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return threadCount * OpsPerThread / seconds / 1e6;
+}
+
+int main() {
+    unsigned maxThreads = std::thread::hardware_concurrency();
+    if (!maxThreads) {
+        maxThreads = 4;
+    }
+
+    printf("%-14s %8s %14s %14s\n", "mix", "threads", "map Mops/s", "mutex Mops/s");
+    for (Mix mix : { Mix::Add, Mix::Get, Mix::InsertRemove }) {
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            ConcurrentMap map(Keys * 4);
+            LockedMap locked;
+            if (!map.valid()) {
+                fprintf(stderr, "allocation failed\n");
+                return 1;
+            }
+
+            const double lockFree = measure(map, mix, threads);
+            const double mutexed = measure(locked, mix, threads);
+            printf("%-14s %8u %14.1f %14.1f\n", mixName(mix), threads, lockFree, mutexed);
+        }
+    }
+    return 0;
+}
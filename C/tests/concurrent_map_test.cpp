@@ -0,0 +1,259 @@
+// Multi-threaded stress test of the plugins' ConcurrentMap. Every check is on totals that only hold if no update was
+// lost or duplicated, whatever order the threads ran in.
+#include "KernelApis.h"
+#include "concurrent_map.h"
+#include "test.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static const unsigned Threads = 8;
+
+template<typename Fn>
+static void runThreads(unsigned count, Fn fn) {
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < count; t++) {
+        threads.emplace_back(fn, t);
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// every thread adds 1 to keys spread over the whole table, lookups in between
+static void testConcurrentAdd() {
+    ConcurrentMap map(1 << 16);
+    CHECK(map.valid());
+
+    const uint64_t keys = 20000;
+    const uint64_t perThread = 200000;
+    runThreads(Threads, [&](unsigned) {
+        for (uint64_t i = 0; i < perThread; i++) {
+            const uint64_t key = (i * 7919) % keys;
+            CHECK(map.add(key, 1));
+
+            uint64_t value = 0;
+            if (i % 5 == 0) {
+                CHECK(map.get(key, value) && value >= 1);
+            }
+        }
+    });
+
+    uint64_t total = 0;
+    uint64_t present = 0;
+    map.forEach([&](uint64_t, uint64_t value) {
+        total += value;
+        present++;
+    });
+    CHECK_EQ(total, Threads * perThread);
+    CHECK_EQ(present, keys);
+    CHECK_EQ(map.used(), keys);
+}
+
+// threads race to insert and remove the same few keys, every successful insert is matched by one successful remove or
+// is still there at the end
+static void testInsertRemoveRace() {
+    ConcurrentMap map(1024);
+    std::atomic<int64_t> live(0);
+    runThreads(Threads, [&](unsigned t) {
+        for (uint64_t i = 0; i < 100000; i++) {
+            const uint64_t key = i % 100;
+            if (map.insert(key, t + 1)) {
+                live++;
+            }
+
+            uint64_t value = 0;
+            if (map.remove(key, &value)) {
+                CHECK(value >= 1 && value <= Threads);
+                live--;
+            }
+        }
+    });
+
+    int64_t present = 0;
+    map.forEach([&](uint64_t, uint64_t) {
+        present++;
+    });
+    CHECK_EQ(live.load(), present);
+
+    // a key has one slot at most, tombstones went to other keys rather than new slots
+    CHECK(map.used() <= 100u);
+}
+
+// one key at a time, each removed before the next. Far more keys than slots all get in once tombstones are reused.
+static void testTombstoneReuse() {
+    ConcurrentMap map(1024);
+    uint64_t failed = 0;
+    for (uint64_t key = 0; key < 1000000; key++) {
+        failed += !map.insert(key, key + 1);
+        failed += !map.remove(key);
+    }
+    CHECK_EQ(failed, 0u);
+    CHECK(map.used() <= map.capacity());
+
+    uint64_t present = 0;
+    map.forEach([&](uint64_t, uint64_t) {
+        present++;
+    });
+    CHECK_EQ(present, 0u);
+}
+
+// threads churn through short lived keys of their own while they all count on a few shared keys that are never
+// removed. Slots keep changing hands around the counters, not a single add may land on a reclaimed slot or be lost.
+static void testChurnAroundCounters() {
+    ConcurrentMap map(1024);
+    const uint64_t counters = 64;
+    const uint64_t live = 32;
+    const uint64_t perThread = 200000;
+    std::atomic<uint64_t> failed(0);
+
+    runThreads(Threads, [&](unsigned t) {
+        const uint64_t base = ((uint64_t)t + 1) << 40;
+        for (uint64_t i = 0; i < perThread; i++) {
+            if (!map.insert(base + i, i + 1)) {
+                failed++;
+            }
+
+            uint64_t value = 0;
+            if (i >= live && (!map.remove(base + i - live, &value) || value != i - live + 1)) {
+                failed++;
+            }
+
+            if (!map.add(i % counters, 1)) {
+                failed++;
+            }
+        }
+
+        for (uint64_t i = perThread - live; i < perThread; i++) {
+            if (!map.remove(base + i)) {
+                failed++;
+            }
+        }
+    });
+    CHECK_EQ(failed.load(), 0u);
+
+    uint64_t present = 0;
+    uint64_t total = 0;
+    map.forEach([&](uint64_t key, uint64_t value) {
+        CHECK(key < counters);
+        present++;
+        total += value;
+    });
+    CHECK_EQ(present, counters);
+    CHECK_EQ(total, Threads * perThread);
+}
+
+// writers store values that carry their key, readers must never see another key's value or a torn one
+static void testSetGetConsistency() {
+    ConcurrentMap map(4096);
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> mismatches(0);
+
+    std::thread reader([&] {
+        while (!stop) {
+            for (uint64_t key = 0; key < 1000; key++) {
+                uint64_t value = 0;
+                if (map.get(key, value) && (value >> 32) != key) {
+                    mismatches++;
+                }
+            }
+        }
+    });
+
+    runThreads(Threads, [&](unsigned t) {
+        for (uint64_t round = 0; round < 200; round++) {
+            for (uint64_t key = 0; key < 1000; key++) {
+                CHECK(map.set(key, (key << 32) | (round * Threads + t)));
+            }
+        }
+    });
+    stop = true;
+    reader.join();
+    CHECK_EQ(mismatches.load(), 0u);
+}
+
+// compare exchange increments of one key from every thread, none may be lost
+static void testCompareExchange() {
+    ConcurrentMap map(16);
+    CHECK(map.set(42, 0));
+
+    const uint64_t perThread = 50000;
+    runThreads(Threads, [&](unsigned) {
+        for (uint64_t i = 0; i < perThread; i++) {
+            uint64_t value = 0;
+            do {
+                CHECK(map.get(42, value));
+            } while (!map.compareExchange(42, value, value + 1));
+        }
+    });
+
+    uint64_t value = 0;
+    CHECK(map.get(42, value));
+    CHECK_EQ(value, Threads * perThread);
+}
+
+// more distinct keys than slots from every thread at once, exactly capacity() of them get in
+static void testFullTable() {
+    ConcurrentMap map(64);
+    CHECK_EQ(map.capacity(), 64u);
+
+    std::atomic<uint64_t> accepted(0);
+    runThreads(Threads, [&](unsigned t) {
+        for (uint64_t i = 0; i < 64; i++) {
+            if (map.insert(t * 64 + i, 1)) {
+                accepted++;
+            }
+        }
+    });
+    CHECK_EQ(accepted.load(), 64u);
+    CHECK_EQ(map.used(), 64u);
+
+    // full, but keys already in still update
+    uint64_t inKey = ConcurrentMap::ReservedKey;
+    map.forEach([&](uint64_t key, uint64_t) {
+        inKey = key;
+    });
+    CHECK(!map.set(Threads * 64, 1));
+    CHECK(map.set(inKey, 7));
+
+    map.clear();
+    CHECK_EQ(map.used(), 0u);
+    CHECK(map.set(Threads * 64, 1));
+}
+
+static void testReserved() {
+    ConcurrentMap map(16);
+    uint64_t value = 0;
+    CHECK(!map.set(ConcurrentMap::ReservedKey, 1));
+    CHECK(!map.set(1, ConcurrentMap::ReservedValue));
+    CHECK(!map.get(ConcurrentMap::ReservedKey, value));
+
+    // a sum landing on the reserved value is refused and leaves the old one
+    CHECK(map.set(2, ConcurrentMap::ReservedValue - 1));
+    CHECK(!map.add(2, 1));
+    CHECK(map.get(2, value) && value == ConcurrentMap::ReservedValue - 1);
+
+    uint64_t existing = 0;
+    CHECK(map.set(5, 9));
+    CHECK(!map.insert(5, 10, &existing) && existing == 9);
+    CHECK(map.compareExchange(5, 9, 10) && !map.compareExchange(5, 9, 11));
+    CHECK(map.remove(5, &value) && value == 10);
+    CHECK(!map.get(5, value) && !map.remove(5));
+
+    // a removed key comes back in the same slot
+    CHECK(map.insert(5, 3));
+    CHECK_EQ(map.used(), 2u);
+}
+
+int main() {
+    testConcurrentAdd();
+    testInsertRemoveRace();
+    testTombstoneReuse();
+    testChurnAroundCounters();
+    testSetGetConsistency();
+    testCompareExchange();
+    testFullTable();
+    testReserved();
+    return testResult("concurrent_map_test");
+}
@@ -0,0 +1,24 @@
+#pragma once
+// Runs the STraceDecode tool built next to the tests, for the tests that check what it prints. Built with BUILD_DIR
+// defined, see the Makefile.
+#include <stdio.h>
+#include <sys/wait.h>
+#include <string>
+
+#define STRACEDECODE BUILD_DIR "STraceDecode"
+
+// runs the decoder tool, returns its exit code and what it printed
+inline int decodeTool(const std::string& arguments, std::string& printed) {
+    const std::string command = STRACEDECODE " " + arguments + " 2>&1";
+    printed.clear();
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe)
+        return -1;
+
+    char buf[256];
+    while (fgets(buf, sizeof(buf), pipe)) {
+        printed += buf;
+    }
+    const int status = pclose(pipe);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
@@ -0,0 +1,152 @@
+// The driver's ExportIndex over real export directories: every name of an ntoskrnl sized table must resolve to what a
+// linear scan of the same image finds, forwarders must come back as forwarders and nothing else may resolve.
+// included the way the driver does, after ntifs.h
+#include <ntifs.h>
+#include "ExportIndex.h"
+#include "pe_fixture.h"
+#include "test.h"
+#include <algorithm>
+#include <set>
+
+static void testEveryNameMatchesLinearScan() {
+    std::vector<uint8_t> image = mapFixture("kernel_exports.dll");
+    CHECK(!image.empty());
+
+    ExportIndex index;
+    CHECK(index.build((uint64_t)image.data(), (uint32_t)image.size()));
+    CHECK(index.isBuilt());
+
+    const std::vector<FixtureExport> exports = fixtureExports(image);
+    CHECK(exports.size() > 3000);
+
+    uint64_t forwarders = 0;
+    for (const FixtureExport& exp : exports) {
+        ExportIndex::Export found = {};
+        const bool ok = index.lookup(exp.name.c_str(), found);
+        CHECK(ok);
+        if (!ok) {
+            fprintf(stderr, "  %s not found\n", exp.name.c_str());
+            continue;
+        }
+
+        if (exp.forwarder.empty()) {
+            CHECK_EQ(found.address, (uint64_t)image.data() + exp.rva);
+            CHECK(!found.forwarder);
+        } else {
+            forwarders++;
+            CHECK_EQ(found.address, 0u);
+            CHECK(found.forwarder && exp.forwarder == found.forwarder);
+        }
+
+        // prelinked plugins pass the hash they stored
+        ExportIndex::Export byHash = {};
+        CHECK(index.lookup(exp.name.c_str(), StpHashExportName(exp.name.c_str()), byHash) && byHash.address == found.address);
+    }
+    CHECK_EQ(forwarders, 3u);
+    index.Destruct();
+    CHECK(!index.isBuilt());
+}
+
+static void testForwardersAndMisses() {
+    std::vector<uint8_t> image = mapFixture("kernel_exports.dll");
+    ExportIndex index;
+    CHECK(index.build((uint64_t)image.data(), (uint32_t)image.size()));
+
+    ExportIndex::Export found = {};
+    CHECK(index.lookup("FwdKeBugCheckEx", found));
+    CHECK(found.forwarder && strcmp(found.forwarder, "ntoskrnl.KeBugCheckEx") == 0 && !found.address);
+    CHECK(index.lookup("FwdHalMissing", found) && found.forwarder && strcmp(found.forwarder, "hal.HalNotThere") == 0);
+
+    CHECK(index.lookup("ExAllocatePoolWithTag", found) && found.address && !found.forwarder);
+
+    // case sensitive like the loader, no prefixes or extensions of a real name, no forwarder targets
+    std::set<std::string> names;
+    for (const FixtureExport& exp : fixtureExports(image)) {
+        names.insert(exp.name);
+    }
+    for (const char* missing : { "exallocatepoolwithtag", "EXALLOCATEPOOLWITHTAG", "ExAllocatePoolWithTa", "ExAllocatePoolWithTagX",
+                                 "", "KeBugCheckEx2", "ntoskrnl.KeBugCheckEx", "HalNotThere" }) {
+        CHECK(!names.count(missing));
+        CHECK(!index.lookup(missing, found));
+        CHECK(!found.address && !found.forwarder);
+    }
+
+    // built once
+    CHECK(!index.build((uint64_t)image.data(), (uint32_t)image.size()));
+    index.Destruct();
+    CHECK(!index.lookup("ExAllocatePoolWithTag", found));
+}
+
+static void testPluginExports() {
+    std::vector<uint8_t> image = mapFixture("plugin.dll");
+    ExportIndex index;
+    CHECK(index.build((uint64_t)image.data(), (uint32_t)image.size()));
+
+    for (const FixtureExport& exp : fixtureExports(image)) {
+        ExportIndex::Export found = {};
+        CHECK(index.lookup(exp.name.c_str(), found) && found.address == (uint64_t)image.data() + exp.rva);
+    }
+
+    // names differing only in case are different exports, the ordinal only export has no name to find
+    ExportIndex::Export lower = {};
+    ExportIndex::Export upper = {};
+    CHECK(index.lookup("SampleCase", lower) && index.lookup("SAMPLECASE", upper) && lower.address != upper.address);
+    CHECK(!index.lookup("SampleOrdinal", lower));
+    index.Destruct();
+}
+
+static void testMalformedDirectories() {
+    std::vector<uint8_t> image = mapFixture("kernel_exports.dll");
+    ExportIndex index;
+
+    // cut off inside the name table, the names or the directory itself
+    uint32_t dirSize = 0;
+    const uint32_t dir = fixtureDirectory(image, 0, &dirSize);
+    const uint32_t names = fixtureRead32(image, dir + 32);
+    for (uint32_t size : { dir + 20, names + 8, dir + dirSize - 1, 0x3Fu, 0u }) {
+        CHECK(!index.build((uint64_t)image.data(), size));
+        CHECK(!index.isBuilt());
+    }
+
+    // one name pointing past the image, one ordinal past the function table
+    std::vector<uint8_t> badName = image;
+    const uint32_t pastEnd = (uint32_t)badName.size();
+    memcpy(badName.data() + names + 4 * 10, &pastEnd, sizeof(pastEnd));
+    CHECK(!index.build((uint64_t)badName.data(), (uint32_t)badName.size()));
+
+    std::vector<uint8_t> badOrdinal = image;
+    const uint16_t ordinal = 0xFFFF;
+    memcpy(badOrdinal.data() + fixtureRead32(image, dir + 36) + 2 * 10, &ordinal, sizeof(ordinal));
+    CHECK(!index.build((uint64_t)badOrdinal.data(), (uint32_t)badOrdinal.size()));
+
+    // a forwarder string that runs off the end of the image is as good as missing
+    const char forwarder[] = "ntoskrnl.KeQueryPerformanceCounter";
+    auto pForwarder = std::search(image.begin() + dir, image.begin() + dir + dirSize, forwarder, forwarder + sizeof(forwarder));
+    CHECK(pForwarder != image.begin() + dir + dirSize);
+    const uint32_t forwarderEnd = (uint32_t)(pForwarder - image.begin()) + sizeof(forwarder);
+    CHECK_EQ(forwarderEnd, dir + dirSize);
+
+    std::vector<uint8_t> unterminated = image;
+    unterminated[forwarderEnd - 1] = 'X';
+    ExportIndex::Export found = {};
+    CHECK(index.build((uint64_t)unterminated.data(), forwarderEnd));
+    CHECK(!index.lookup("FwdKeQueryPerformanceCounter", found));
+    CHECK(index.lookup("FwdKeBugCheckEx", found) && found.forwarder);
+    index.Destruct();
+
+    std::vector<uint8_t> noExports = image;
+    memset(noExports.data() + fixtureOptionalHeader(image) + 112, 0, 8);
+    CHECK(!index.build((uint64_t)noExports.data(), (uint32_t)noExports.size()));
+
+    std::vector<uint8_t> notPe = image;
+    notPe[0] = 'X';
+    CHECK(!index.build((uint64_t)notPe.data(), (uint32_t)notPe.size()));
+}
+
+int main() {
+    testEveryNameMatchesLinearScan();
+    testForwardersAndMisses();
+    testPluginExports();
+    testMalformedDirectories();
+    return testResult("export_index_test");
+}
@@ -0,0 +1,99 @@
+// Export lookups over PE files mapped from disk: the linear _stricmp scan getExport used to do, the binary search and
+// cache it does now (StpResolveExportName) and ExportIndex's hash probe that import resolution uses.
+//
+//   export_lookup_bench [dll...]    defaults to the fixtures, any PE32+ DLL with exports works
+#include <ntifs.h>
+#include "ExportIndex.h"
+#include "pe_fixture.h"
+#include <strings.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+static const uint32_t Rounds = 200;
+
+// results are written here so the lookups aren't optimized away
+static std::atomic<uint64_t> g_sink;
+
+template<typename Fn>
+static double nsPerLookup(uint64_t lookups, Fn fn) {
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < Rounds; round++) {
+        fn();
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (Rounds * lookups);
+}
+
+static int64_t linearScan(const StpExportDirectory& dir, const char* name) {
+    for (uint32_t i = 0; i < dir.numberOfNames; i++) {
+        if (strcasecmp(StpExportName(dir, i), name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void bench(const std::string& path) {
+    std::vector<uint8_t> image = mapPeFile(path);
+    StpExportDirectory dir;
+    if (image.empty() || !StpReadExportDirectory(image.data(), (uint32_t)image.size(), dir)) {
+        printf("%-32s no export directory\n", path.c_str());
+        return;
+    }
+
+    // every name, and HandleDllLoad's six (or the first six) as the plugin load asks for them
+    std::vector<std::string> names;
+    for (uint32_t i = 0; i < dir.numberOfNames; i++) {
+        names.push_back(StpExportName(dir, i));
+    }
+    std::vector<std::string> loadNames = { "StpCallbackEntry", "StpCallbackReturn", "StpInitialize", "StpDeInitialize", "StpIsTarget", "DtEtwpEventCallback" };
+    if (linearScan(dir, loadNames[0].c_str()) < 0) {
+        loadNames.assign(names.begin(), names.begin() + std::min<size_t>(6, names.size()));
+    }
+
+    ExportIndex index;
+    index.build((uint64_t)image.data(), (uint32_t)image.size());
+
+    const double linear = nsPerLookup(names.size(), [&] {
+        for (const std::string& name : names) {
+            g_sink += linearScan(dir, name.c_str());
+        }
+    });
+    const double binary = nsPerLookup(names.size(), [&] {
+        for (const std::string& name : names) {
+            g_sink += StpFindExportName(dir, name.c_str());
+        }
+    });
+    const double hashed = nsPerLookup(names.size(), [&] {
+        for (const std::string& name : names) {
+            ExportIndex::Export exp;
+            g_sink += index.lookup(name.c_str(), exp);
+        }
+    });
+
+    // a fresh cache per plugin load, the way getExport sees a newly mapped image
+    const double load = nsPerLookup(loadNames.size(), [&] {
+        StpExportCache cache = {};
+        for (int repeat = 0; repeat < 2; repeat++) {
+            for (const std::string& name : loadNames) {
+                g_sink += StpResolveExportName(dir, cache, name.c_str(), [](uint32_t count) { return (uint32_t*)malloc(count * sizeof(uint32_t)); });
+            }
+        }
+        free(cache.ciSortedNameIdxs);
+    }) / 2;
+
+    printf("%-32s %6u names  linear %8.1f  binary %6.1f  hashed %6.1f  plugin load %6.1f ns/lookup\n", path.c_str(),
+        dir.numberOfNames, linear, binary, hashed, load);
+    index.Destruct();
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            bench(argv[i]);
+        }
+    } else {
+        bench(FIXTURE_DIR "plugin.dll");
+        bench(FIXTURE_DIR "kernel_exports.dll");
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+// ManualMapper::getExport's lookups (StpResolveExportName) over real PE files: exact names, the case-insensitive
+// fallback, names that only differ in case, and that the resolved cache serves case-insensitive repeats.
+#include <ntifs.h>
+#include "PeExports.h"
+#include "pe_fixture.h"
+#include "test.h"
+#include <strings.h>
+#include <cctype>
+
+static uint32_t g_allocations = 0;
+
+static uint32_t* allocateIdxs(uint32_t count) {
+    g_allocations++;
+    return (uint32_t*)malloc(count * sizeof(uint32_t));
+}
+
+static uint32_t* failAllocation(uint32_t) {
+    return nullptr;
+}
+
+static std::string upper(std::string name) {
+    for (char& c : name) {
+        c = (char)toupper((unsigned char)c);
+    }
+    return name;
+}
+
+// what the name resolves to as an rva, 0 if it doesn't
+static uint32_t resolveRva(const StpExportDirectory& dir, StpExportCache& cache, const char* name) {
+    const int64_t nameIdx = StpResolveExportName(dir, cache, name, allocateIdxs);
+    return nameIdx < 0 ? 0 : StpExportAt(dir, (uint32_t)nameIdx).rva;
+}
+
+static uint32_t fixtureRva(const std::vector<FixtureExport>& exports, const char* name) {
+    for (const FixtureExport& exp : exports) {
+        if (exp.name == name)
+            return exp.rva;
+    }
+    return 0;
+}
+
+static void testPluginCallbacks() {
+    std::vector<uint8_t> image = mapFixture("plugin.dll");
+    const std::vector<FixtureExport> exports = fixtureExports(image);
+    StpExportDirectory dir;
+    CHECK(StpReadExportDirectory(image.data(), (uint32_t)image.size(), dir));
+
+    StpExportCache cache = {};
+    g_allocations = 0;
+    for (const char* name : { "StpCallbackEntry", "StpCallbackReturn", "StpInitialize", "StpDeInitialize", "StpIsTarget", "DtEtwpEventCallback" }) {
+        CHECK(fixtureRva(exports, name) != 0);
+        CHECK_EQ(resolveRva(dir, cache, name), fixtureRva(exports, name));
+    }
+
+    // exact hits never need the case-insensitive index
+    CHECK_EQ(g_allocations, 0u);
+    CHECK_EQ(cache.resolvedCount, 6u);
+
+    // the same six again come from the cache, even with nothing left to search
+    StpExportDirectory noSearch = dir;
+    noSearch.numberOfNames = 0;
+    for (const char* name : { "StpCallbackEntry", "StpCallbackReturn", "StpInitialize", "StpDeInitialize", "StpIsTarget", "DtEtwpEventCallback" }) {
+        CHECK(StpResolveExportName(noSearch, cache, name, allocateIdxs) >= 0);
+    }
+
+    // callers may differ in case
+    CHECK_EQ(resolveRva(dir, cache, "stpinitialize"), fixtureRva(exports, "StpInitialize"));
+    CHECK_EQ(g_allocations, 1u);
+    CHECK_EQ(resolveRva(dir, cache, "NotExported"), 0u);
+    CHECK_EQ(resolveRva(dir, cache, "SampleOrdinal"), 0u);
+    CHECK_EQ(resolveRva(dir, cache, ""), 0u);
+    CHECK_EQ(g_allocations, 1u);
+    free(cache.ciSortedNameIdxs);
+}
+
+// SampleCase and SAMPLECASE are two exports, a case-insensitive hit on one must never answer an exact query for the other
+static void testNamesDifferingInCase() {
+    std::vector<uint8_t> image = mapFixture("plugin.dll");
+    const std::vector<FixtureExport> exports = fixtureExports(image);
+    StpExportDirectory dir;
+    CHECK(StpReadExportDirectory(image.data(), (uint32_t)image.size(), dir));
+
+    const uint32_t lower = fixtureRva(exports, "SampleCase");
+    const uint32_t upperCase = fixtureRva(exports, "SAMPLECASE");
+    CHECK(lower && upperCase && lower != upperCase);
+
+    StpExportCache cache = {};
+    const uint32_t either = resolveRva(dir, cache, "samplecase");
+    CHECK(either == lower || either == upperCase);
+    CHECK(cache.ciSortedNameIdxs && !cache.ciUnique);
+
+    for (int round = 0; round < 2; round++) {
+        CHECK_EQ(resolveRva(dir, cache, "SampleCase"), lower);
+        CHECK_EQ(resolveRva(dir, cache, "SAMPLECASE"), upperCase);
+        CHECK_EQ(resolveRva(dir, cache, "samplecase"), either);
+    }
+    free(cache.ciSortedNameIdxs);
+}
+
+// an ntoskrnl sized table: every name exactly and upper cased, the latter checked against a linear _stricmp scan
+static void testKernelNames() {
+    std::vector<uint8_t> image = mapFixture("kernel_exports.dll");
+    const std::vector<FixtureExport> exports = fixtureExports(image);
+    StpExportDirectory dir;
+    CHECK(StpReadExportDirectory(image.data(), (uint32_t)image.size(), dir));
+
+    StpExportCache cache = {};
+    for (uint32_t i = 0; i < exports.size(); i++) {
+        CHECK_EQ(StpFindExportName(dir, exports[i].name.c_str()), (int64_t)i);
+        CHECK_EQ(StpResolveExportName(dir, cache, exports[i].name.c_str(), allocateIdxs), (int64_t)i);
+
+        const std::string shouted = upper(exports[i].name);
+        int64_t linear = -1;
+        for (uint32_t j = 0; j < exports.size() && linear < 0; j++) {
+            if (strcasecmp(exports[j].name.c_str(), shouted.c_str()) == 0) {
+                linear = j;
+            }
+        }
+        CHECK_EQ(StpResolveExportName(dir, cache, shouted.c_str(), allocateIdxs), linear);
+    }
+    CHECK(cache.ciSortedNameIdxs && cache.ciUnique);
+    free(cache.ciSortedNameIdxs);
+}
+
+// With no two names equal ignoring case, a case-insensitive repeat is a cache hit
+static void testCaseInsensitiveCacheHits() {
+    std::vector<uint8_t> image = mapFixture("kernel_exports.dll");
+    StpExportDirectory dir;
+    CHECK(StpReadExportDirectory(image.data(), (uint32_t)image.size(), dir));
+
+    StpExportCache cache = {};
+    const int64_t nameIdx = StpResolveExportName(dir, cache, "exallocatepoolwithtag", allocateIdxs);
+    CHECK(nameIdx >= 0 && strcmp(StpExportName(dir, (uint32_t)nameIdx), "ExAllocatePoolWithTag") == 0);
+    CHECK_EQ(cache.resolvedCount, 1u);
+
+    StpExportDirectory noSearch = dir;
+    noSearch.numberOfNames = 0;
+    CHECK_EQ(StpResolveExportName(noSearch, cache, "exallocatepoolwithtag", allocateIdxs), nameIdx);
+    CHECK_EQ(StpResolveExportName(noSearch, cache, "EXALLOCATEPOOLWITHTAG", allocateIdxs), nameIdx);
+    CHECK_EQ(StpResolveExportName(noSearch, cache, "ExAllocatePoolWithTag", allocateIdxs), nameIdx);
+
+    // the exact query found the already cached entry, it didn't take a second slot
+    CHECK_EQ(StpResolveExportName(dir, cache, "ExAllocatePoolWithTag", allocateIdxs), nameIdx);
+    CHECK_EQ(cache.resolvedCount, 1u);
+
+    // a full cache still answers, it just stops remembering
+    for (const char* name : { "KeBugCheckEx", "IoCallDriver", "ObfDereferenceObject", "ZwClose", "RtlInitUnicodeString",
+                              "KeWaitForSingleObject", "PsGetCurrentProcessId", "MmGetSystemRoutineAddress", "ExFreePoolWithTag" }) {
+        CHECK(StpResolveExportName(dir, cache, name, allocateIdxs) >= 0);
+    }
+    CHECK_EQ(cache.resolvedCount, 8u);
+    free(cache.ciSortedNameIdxs);
+}
+
+static void testAllocationFailure() {
+    std::vector<uint8_t> image = mapFixture("plugin.dll");
+    StpExportDirectory dir;
+    CHECK(StpReadExportDirectory(image.data(), (uint32_t)image.size(), dir));
+
+    // only the case-insensitive fallback needs memory
+    StpExportCache cache = {};
+    CHECK(StpResolveExportName(dir, cache, "StpIsTarget", failAllocation) >= 0);
+    CHECK(StpResolveExportName(dir, cache, "stpistarget", failAllocation) < 0);
+    CHECK(!cache.ciSortedNameIdxs);
+}
+
+int main() {
+    testPluginCallbacks();
+    testNamesDifferingInCase();
+    testKernelNames();
+    testCaseInsensitiveCacheHits();
+    testAllocationFailure();
+    return testResult("export_lookup_test");
+}
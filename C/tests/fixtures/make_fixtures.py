@@ -0,0 +1,207 @@
+# Regenerates the PE fixtures the host side tests load. The objects are written directly as COFF and linked by a real
+# PE linker, so the export, import and relocation directories in the DLLs are exactly what a linker emits for a plugin.
+#
+#   python3 make_fixtures.py [linker]
+#
+# linker is any MSVC compatible link.exe: link.exe, lld-link, or "rust-lld -flavor link" (the default, it ships with
+# rustup). Output goes next to this script:
+#
+#   plugin.dll          a plugin shaped DLL: the six exports HandleDllLoad looks up, imports from ntoskrnl.exe and
+#                       hal.dll, a pointer table that needs DIR64 relocations, two names that only differ in case and
+#                       an export by ordinal only
+#   kernel_exports.dll  every name ntoskrnl.lib exports, each with its own RVA, plus a few forwarders, for indexing an
+#                       export directory the size of ntoskrnl's
+import os
+import shlex
+import struct
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+NTOSKRNL_LIB = os.path.join(HERE, "..", "..", "ntoskrnl.lib")
+
+IMAGE_FILE_MACHINE_AMD64 = 0x8664
+IMAGE_REL_AMD64_ADDR64 = 0x1
+IMAGE_REL_AMD64_REL32 = 0x4
+IMAGE_SYM_CLASS_EXTERNAL = 2
+SECTION_FLAGS = {
+    ".text": 0x60500020,  # code, execute, read, align 16
+    ".rdata": 0x40400040, # initialized data, read, align 8
+    ".data": 0xC0400040,  # initialized data, read, write, align 8
+}
+
+# kernel_exports.dll forwarders, name = target
+FORWARDERS = [
+    ("FwdKeBugCheckEx", "ntoskrnl.KeBugCheckEx"),
+    ("FwdKeQueryPerformanceCounter", "ntoskrnl.KeQueryPerformanceCounter"),
+    ("FwdHalMissing", "hal.HalNotThere"),
+]
+
+
+class CoffObject:
+    def __init__(self):
+        self.sections = {name: bytearray() for name in SECTION_FLAGS}
+        self.relocs = {name: [] for name in SECTION_FLAGS}
+        self.symbols = []
+        self.symbol_index = {}
+
+    def symbol(self, name, section=None, value=0, function=False):
+        if name in self.symbol_index:
+            index = self.symbol_index[name]
+            if section is not None:
+                self.symbols[index] = (name, section, value, function)
+            return index
+
+        self.symbol_index[name] = len(self.symbols)
+        self.symbols.append((name, section, value, function))
+        return self.symbol_index[name]
+
+    def define(self, section, name, data, align, relocs=(), function=False):
+        buf = self.sections[section]
+        pad = 0xCC if section == ".text" else 0
+        while len(buf) % align:
+            buf.append(pad)
+
+        offset = len(buf)
+        buf += data
+        self.symbol(name, section, offset, function)
+        for at, target, kind in relocs:
+            self.relocs[section].append((offset + at, self.symbol(target), kind))
+
+    def function_returning(self, name, value):
+        # mov eax, value; ret
+        self.define(".text", name, b"\xB8" + struct.pack("<I", value) + b"\xC3", 8, function=True)
+
+    def function_jumping_to_import(self, name, imported):
+        # jmp qword ptr [rip + __imp_imported]
+        self.define(".text", name, b"\xFF\x25\x00\x00\x00\x00", 8, [(2, "__imp_" + imported, IMAGE_REL_AMD64_REL32)],
+                    function=True)
+
+    def write(self, path):
+        names = [name for name in SECTION_FLAGS if self.sections[name]]
+        section_number = {name: i + 1 for i, name in enumerate(names)}
+        offset = 20 + 40 * len(names)
+        headers = b""
+        body = b""
+        for name in names:
+            data = bytes(self.sections[name])
+            relocs = b"".join(struct.pack("<IIH", at, symbol, kind) for at, symbol, kind in self.relocs[name])
+            headers += struct.pack("<8sIIIIIIHHI", name.encode(), 0, 0, len(data), offset, offset + len(data) if relocs else 0,
+                                   0, len(self.relocs[name]), 0, SECTION_FLAGS[name])
+            body += data + relocs
+            offset += len(data) + len(relocs)
+
+        strings = b""
+        symbols = b""
+        for name, section, value, function in self.symbols:
+            encoded = name.encode()
+            if len(encoded) <= 8:
+                short = encoded.ljust(8, b"\0")
+            else:
+                short = struct.pack("<II", 0, 4 + len(strings))
+                strings += encoded + b"\0"
+            symbols += struct.pack("<8sIhHBB", short, value, section_number.get(section, 0), 0x20 if function else 0,
+                                   IMAGE_SYM_CLASS_EXTERNAL, 0)
+
+        header = struct.pack("<HHIIIHH", IMAGE_FILE_MACHINE_AMD64, len(names), 0, offset, len(self.symbols), 0, 0)
+        with open(path, "wb") as f:
+            f.write(header + headers + body + symbols + struct.pack("<I", 4 + len(strings)) + strings)
+
+
+def ntoskrnl_exports():
+    # short import objects of the import library, (name, is_code)
+    with open(NTOSKRNL_LIB, "rb") as f:
+        data = f.read()
+
+    exports = []
+    pos = 8
+    while pos < len(data):
+        size = int(data[pos + 48:pos + 58])
+        member = data[pos + 60:pos + 60 + size]
+        if len(member) > 20 and member[:4] == b"\x00\x00\xff\xff":
+            kind = struct.unpack_from("<H", member, 18)[0] & 3
+            name = member[20:].split(b"\0")[0].decode()
+            exports.append((name, kind == 0))
+        pos += 60 + size + (size & 1)
+    return sorted(set(exports))
+
+
+def link(linker, tmp, name, obj, exports, libs):
+    def_path = os.path.join(tmp, name + ".def")
+    with open(def_path, "w") as f:
+        f.write("LIBRARY %s.dll\nEXPORTS\n" % name)
+        f.writelines("    %s\n" % line for line in exports)
+
+    out = os.path.join(HERE, name + ".dll")
+    subprocess.check_call(linker + ["/dll", "/noentry", "/nodefaultlib", "/machine:x64", "/subsystem:native",
+                                    "/Brepro", "/opt:noicf", "/def:" + def_path, "/implib:" + os.path.join(tmp, name + ".lib"),
+                                    "/out:" + out, obj] + libs)
+    print("wrote", out)
+
+
+def make_plugin(linker, tmp):
+    hal_def = os.path.join(tmp, "hal.def")
+    hal_lib = os.path.join(tmp, "hal.lib")
+    with open(hal_def, "w") as f:
+        f.write("LIBRARY hal.dll\nEXPORTS\n    KeQueryPerformanceCounter\n")
+    subprocess.check_call(linker + ["/lib", "/machine:x64", "/def:" + hal_def, "/out:" + hal_lib])
+
+    obj = CoffObject()
+    obj.function_jumping_to_import("StpInitialize", "KeQueryTimeIncrement")
+    obj.function_jumping_to_import("StpDeInitialize", "ExFreePoolWithTag")
+    obj.function_jumping_to_import("StpIsTarget", "KeQueryPerformanceCounter")
+    obj.function_jumping_to_import("DtEtwpEventCallback", "ExAllocatePoolWithTag")
+    obj.function_returning("StpCallbackEntry", 1)
+    obj.function_returning("StpCallbackReturn", 2)
+    obj.function_returning("SampleCase", 3)
+    obj.function_returning("SAMPLECASE", 4)
+    obj.function_returning("SampleOrdinal", 5)
+    obj.define(".data", "SampleValue", struct.pack("<Q", 42), 8)
+    obj.define(".data", "SampleTable", bytes(24), 8, [
+        (0, "SampleValue", IMAGE_REL_AMD64_ADDR64),
+        (8, "StpInitialize", IMAGE_REL_AMD64_ADDR64),
+        (16, "StpCallbackEntry", IMAGE_REL_AMD64_ADDR64),
+    ])
+
+    obj_path = os.path.join(tmp, "plugin.obj")
+    obj.write(obj_path)
+    exports = ["StpInitialize", "StpDeInitialize", "StpIsTarget", "StpCallbackEntry", "StpCallbackReturn",
+               "DtEtwpEventCallback", "SampleCase", "SAMPLECASE", "SampleOrdinal @50 NONAME", "SampleValue DATA",
+               "SampleTable DATA"]
+    link(linker, tmp, "plugin", obj_path, exports, [NTOSKRNL_LIB, hal_lib])
+
+
+def make_kernel_exports(linker, tmp):
+    obj = CoffObject()
+    exports = []
+    for i, (name, is_code) in enumerate(ntoskrnl_exports()):
+        if is_code:
+            obj.function_returning(name, i)
+            exports.append(name)
+        else:
+            obj.define(".data", name, struct.pack("<Q", i), 8)
+            exports.append(name + " DATA")
+    exports += ["%s = %s" % forwarder for forwarder in FORWARDERS]
+
+    obj_path = os.path.join(tmp, "kernel_exports.obj")
+    obj.write(obj_path)
+    link(linker, tmp, "kernel_exports", obj_path, exports, [])
+
+
+def default_linker():
+    sysroot = subprocess.check_output(["rustc", "--print", "sysroot"], text=True).strip()
+    host = [line.split()[1] for line in subprocess.check_output(["rustc", "-vV"], text=True).splitlines()
+            if line.startswith("host:")][0]
+    return [os.path.join(sysroot, "lib", "rustlib", host, "bin", "rust-lld"), "-flavor", "link"]
+
+
+def main():
+    linker = shlex.split(sys.argv[1]) if len(sys.argv) > 1 else default_linker()
+    with tempfile.TemporaryDirectory() as tmp:
+        make_plugin(linker, tmp)
+        make_kernel_exports(linker, tmp)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,66 @@
+# Regenerates counters.strc, a "STraceCLI top -o FILE" recording: IOCTL_GET_COUNTERS snapshots back to back, exactly
+# as the driver returns them (see StpCounterSnapshotHeader in STrace/RecordFormat.h).
+#
+#   python3 make_snapshots.py
+#
+# The rows are cumulative and per CPU like the driver's. Between them the snapshots cover a busy process, an idle
+# probe, a process that starts and one that exits, counters that went backwards because they were re-enabled, calls
+# still in flight, tables that overflowed, a truncated snapshot and an interval of zero length. rate_view_test holds
+# the rates they must produce, worked out by hand.
+import os
+import struct
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+STP_COUNTERS_MAGIC = 0x43525453
+QPC_FREQUENCY = 10000000
+
+# (timestamp, overflow, truncated, [(pid, probeId, calls, completed, totalTicks), ...]), one row per CPU it ran on
+SNAPSHOTS = [
+    (1000000000, 0, False, [
+        (100, 1, 1000, 1000, 5000000),
+        (100, 1, 500, 500, 2500000),
+        (100, 2, 10, 10, 100000),
+        (200, 1, 50, 49, 490000),
+    ]),
+    # one second later
+    (1010000000, 5, False, [
+        (100, 1, 1600, 1600, 8000000),
+        (100, 1, 900, 900, 4500000),
+        (100, 2, 10, 10, 100000),
+        (200, 1, 250, 249, 494000),
+        (300, 3, 20, 19, 1900),
+        (300, 3, 10, 10, 1000),
+        (50, 4, 30, 0, 0),
+    ]),
+    # two and a half seconds later, 300 and 50 exited and 200's counters were re-enabled
+    (1035000000, 5, True, [
+        (100, 1, 2100, 2100, 8150000),
+        (100, 1, 900, 900, 4500000),
+        (100, 2, 20, 10, 100000),
+        (200, 1, 40, 40, 400),
+    ]),
+    # read again at the same tick, 200 was re-enabled once more and made more calls than before but completed fewer
+    (1035000000, 9, False, [
+        (100, 1, 2101, 2101, 8150100),
+        (100, 1, 900, 900, 4500000),
+        (200, 1, 45, 5, 50),
+    ]),
+]
+
+
+def snapshot(timestamp, overflow, truncated, rows):
+    body = b"".join(struct.pack("<IIQQQ", *row) for row in rows)
+    header = struct.pack("<IIIIQQQ", STP_COUNTERS_MAGIC, 40 + len(body), len(rows), len(rows) + (3 if truncated else 0),
+                         timestamp, QPC_FREQUENCY, overflow)
+    return header + body
+
+
+def main():
+    with open(os.path.join(HERE, "counters.strc"), "wb") as f:
+        for s in SNAPSHOTS:
+            f.write(snapshot(*s))
+
+
+if __name__ == "__main__":
+    main()
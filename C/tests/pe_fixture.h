@@ -0,0 +1,99 @@
+#pragma once
+// Loads the PE fixtures made by fixtures/make_fixtures.py. Deliberately parses the files on its own, with nothing from
+// the STrace headers, so the tests compare the driver's code against an independent reading of the same bytes.
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#define FIXTURE_DIR "fixtures/"
+
+inline uint32_t fixtureRead32(const std::vector<uint8_t>& buf, uint64_t offset) {
+    uint32_t value = 0;
+    if (offset + sizeof(value) <= buf.size()) {
+        memcpy(&value, buf.data() + offset, sizeof(value));
+    }
+    return value;
+}
+
+inline uint16_t fixtureRead16(const std::vector<uint8_t>& buf, uint64_t offset) {
+    uint16_t value = 0;
+    if (offset + sizeof(value) <= buf.size()) {
+        memcpy(&value, buf.data() + offset, sizeof(value));
+    }
+    return value;
+}
+
+inline std::vector<uint8_t> readPeFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// offset of the PE32+ optional header
+inline uint64_t fixtureOptionalHeader(const std::vector<uint8_t>& file) {
+    return fixtureRead32(file, 0x3C) + 4 + 20;
+}
+
+// The file laid out at its RVAs the way the driver's mapper does it, empty if the file is missing
+inline std::vector<uint8_t> mapPeFile(const std::string& path) {
+    const std::vector<uint8_t> file = readPeFile(path);
+    if (file.size() < 0x40)
+        return {};
+
+    const uint64_t optionalHeader = fixtureOptionalHeader(file);
+    std::vector<uint8_t> image(fixtureRead32(file, optionalHeader + 56), 0);
+    const uint32_t sizeOfHeaders = fixtureRead32(file, optionalHeader + 60);
+    memcpy(image.data(), file.data(), sizeOfHeaders);
+
+    const uint16_t sections = fixtureRead16(file, optionalHeader - 20 + 2);
+    const uint64_t sectionTable = optionalHeader + fixtureRead16(file, optionalHeader - 20 + 16);
+    for (uint16_t i = 0; i < sections; i++) {
+        const uint64_t section = sectionTable + i * 40;
+        const uint32_t virtualAddress = fixtureRead32(file, section + 12);
+        const uint32_t rawSize = fixtureRead32(file, section + 16);
+        const uint32_t rawOffset = fixtureRead32(file, section + 20);
+        memcpy(image.data() + virtualAddress, file.data() + rawOffset, rawSize);
+    }
+    return image;
+}
+
+inline std::vector<uint8_t> mapFixture(const char* name) {
+    return mapPeFile(std::string(FIXTURE_DIR) + name);
+}
+
+inline uint32_t fixtureDirectory(const std::vector<uint8_t>& image, uint32_t index, uint32_t* size = nullptr) {
+    const uint64_t entry = fixtureOptionalHeader(image) + 112 + index * 8;
+    if (size) {
+        *size = fixtureRead32(image, entry + 4);
+    }
+    return fixtureRead32(image, entry);
+}
+
+struct FixtureExport {
+    std::string name;
+    uint32_t rva;           // zero for forwarders
+    std::string forwarder;
+};
+
+// every named export of a mapped image, in AddressOfNames order
+inline std::vector<FixtureExport> fixtureExports(const std::vector<uint8_t>& image) {
+    uint32_t dirSize = 0;
+    const uint32_t dir = fixtureDirectory(image, 0, &dirSize);
+    const uint32_t functions = fixtureRead32(image, dir + 28);
+    const uint32_t names = fixtureRead32(image, dir + 32);
+    const uint32_t ordinals = fixtureRead32(image, dir + 36);
+
+    std::vector<FixtureExport> exports;
+    for (uint32_t i = 0; i < fixtureRead32(image, dir + 24); i++) {
+        const uint32_t rva = fixtureRead32(image, functions + 4 * fixtureRead16(image, ordinals + 2 * i));
+        FixtureExport exp = { (const char*)image.data() + fixtureRead32(image, names + 4 * i), rva, "" };
+        if (rva >= dir && rva < dir + dirSize) {
+            exp.rva = 0;
+            exp.forwarder = (const char*)image.data() + rva;
+        }
+        exports.push_back(exp);
+    }
+    return exports;
+}
@@ -0,0 +1,207 @@
+// Runs the STracePrelink tool over the plugin fixture and checks its output against an independent reading of the DLL:
+// the image must be the DLL mapped at its RVAs, the relocation stream must decode (with the driver's decoder) to the
+// DLL's DIR64 sites and every import must name the right module, hash and IAT slot. Then the image is relocated the
+// way mapPrelinkedImage does it and the pointers checked.
+#include <stdint.h>
+#include <string.h>
+#include "PrelinkFormat.h"
+#include "pe_fixture.h"
+#include "test.h"
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+#define PRELINK BUILD_DIR "STracePrelink"
+
+struct ExpectedImport {
+    uint32_t module;
+    std::string name;
+    uint32_t iatRva;
+};
+
+// runs the tool, returns its exit code and what it printed
+static int prelink(const std::string& input, const std::string& output, std::string& printed) {
+    const std::string command = PRELINK " " + input + " " + output + " 2>&1";
+    printed.clear();
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe)
+        return -1;
+
+    char buf[256];
+    while (fgets(buf, sizeof(buf), pipe)) {
+        printed += buf;
+    }
+    const int status = pclose(pipe);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// IMAGE_REL_BASED_DIR64 sites of a mapped image, ascending
+static std::vector<uint32_t> dir64Sites(const std::vector<uint8_t>& image) {
+    uint32_t size = 0;
+    const uint32_t start = fixtureDirectory(image, 5, &size);
+    std::vector<uint32_t> sites;
+    for (uint32_t block = start; block < start + size; block += fixtureRead32(image, block + 4)) {
+        const uint32_t page = fixtureRead32(image, block);
+        for (uint32_t entry = block + 8; entry < block + fixtureRead32(image, block + 4); entry += 2) {
+            const uint16_t value = fixtureRead16(image, entry);
+            if (value >> 12 == 10) {
+                sites.push_back(page + (value & 0xFFF));
+            }
+        }
+    }
+    std::sort(sites.begin(), sites.end());
+    return sites;
+}
+
+static std::vector<ExpectedImport> imports(const std::vector<uint8_t>& image) {
+    std::vector<ExpectedImport> result;
+    for (uint32_t desc = fixtureDirectory(image, 1); fixtureRead32(image, desc + 12); desc += 20) {
+        std::string module = (const char*)image.data() + fixtureRead32(image, desc + 12);
+        const uint32_t lookup = fixtureRead32(image, desc);
+        const uint32_t iat = fixtureRead32(image, desc + 16);
+        for (uint32_t i = 0; fixtureRead32(image, lookup + 8 * i); i++) {
+            const uint32_t hintName = fixtureRead32(image, lookup + 8 * i);
+            result.push_back({ module == "hal.dll" ? (uint32_t)PrelinkModuleHal : (uint32_t)PrelinkModuleNtoskrnl,
+                               (const char*)image.data() + hintName + 2, iat + 8 * i });
+        }
+    }
+    return result;
+}
+
+static void testPluginOutput() {
+    std::string printed;
+    CHECK_EQ(prelink(FIXTURE_DIR "plugin.dll", BUILD_DIR "plugin.stp", printed), 0);
+
+    const std::vector<uint8_t> image = mapFixture("plugin.dll");
+    const std::vector<uint8_t> out = readPeFile(BUILD_DIR "plugin.stp");
+    CHECK(out.size() > sizeof(PrelinkHeader));
+    if (out.size() <= sizeof(PrelinkHeader))
+        return;
+
+    PrelinkHeader header;
+    memcpy(&header, out.data(), sizeof(header));
+    CHECK_EQ(header.magic, (uint32_t)STP_PRELINK_MAGIC);
+    CHECK_EQ(header.version, (uint32_t)STP_PRELINK_VERSION);
+    CHECK_EQ(header.preferredBase, 0x180000000ull);
+    CHECK_EQ(header.sizeOfImage, image.size());
+
+    const std::vector<uint32_t> sites = dir64Sites(image);
+    CHECK_EQ(sites.size(), 3u);
+    CHECK_EQ(header.relocCount, sites.size());
+
+    const std::vector<ExpectedImport> expected = imports(image);
+    CHECK_EQ(expected.size(), 4u);
+    CHECK_EQ(header.importCount, expected.size());
+
+    const uint64_t relocOffset = sizeof(PrelinkHeader) + header.sizeOfImage;
+    const uint64_t importOffset = relocOffset + header.relocBytes;
+    CHECK_EQ(out.size(), importOffset + header.importCount * sizeof(PrelinkImport));
+    if (out.size() != importOffset + header.importCount * sizeof(PrelinkImport))
+        return;
+
+    // sections at their RVAs, headers included
+    CHECK(memcmp(out.data() + sizeof(PrelinkHeader), image.data(), image.size()) == 0);
+
+    const uint8_t* pReloc = out.data() + relocOffset;
+    const uint8_t* pRelocEnd = pReloc + header.relocBytes;
+    uint64_t rva = 0;
+    for (uint32_t i = 0; i < header.relocCount; i++) {
+        uint64_t delta = 0;
+        CHECK(StpReadRelocDelta(pReloc, pRelocEnd, delta));
+        rva += delta;
+        CHECK_EQ(rva, sites[i]);
+    }
+    CHECK(pReloc == pRelocEnd);
+
+    // every import once, grouped by module then hash
+    std::vector<PrelinkImport> written(header.importCount);
+    memcpy(written.data(), out.data() + importOffset, written.size() * sizeof(PrelinkImport));
+    for (uint32_t i = 1; i < written.size(); i++) {
+        CHECK(written[i - 1].module < written[i].module || (written[i - 1].module == written[i].module && written[i - 1].hash <= written[i].hash));
+    }
+
+    for (const ExpectedImport& exp : expected) {
+        auto it = std::find_if(written.begin(), written.end(), [&](const PrelinkImport& import) { return import.iatRva == exp.iatRva; });
+        CHECK(it != written.end());
+        if (it == written.end())
+            continue;
+
+        CHECK_EQ(it->module, exp.module);
+        CHECK_EQ(it->hash, StpHashExportName(exp.name.c_str()));
+        CHECK(exp.name == (const char*)image.data() + it->nameRva);
+    }
+    CHECK(printed.find("[+] 20480 byte image, 3 relocations (4 bytes), 4 imports") != std::string::npos);
+}
+
+// what mapPrelinkedImage does with the output at some other base, SampleTable must then point into the new image
+static void testRelocatedImage() {
+    const std::vector<uint8_t> out = readPeFile(BUILD_DIR "plugin.stp");
+    if (out.size() <= sizeof(PrelinkHeader))
+        return;
+
+    PrelinkHeader header;
+    memcpy(&header, out.data(), sizeof(header));
+    std::vector<uint8_t> mapped(out.begin() + sizeof(PrelinkHeader), out.begin() + sizeof(PrelinkHeader) + header.sizeOfImage);
+
+    const int64_t delta = (int64_t)((uint64_t)mapped.data() - header.preferredBase);
+    const uint8_t* pReloc = out.data() + sizeof(PrelinkHeader) + header.sizeOfImage;
+    const uint8_t* pRelocEnd = pReloc + header.relocBytes;
+    uint64_t rva = 0;
+    for (uint32_t i = 0; i < header.relocCount; i++) {
+        uint64_t rvaDelta = 0;
+        CHECK(StpReadRelocDelta(pReloc, pRelocEnd, rvaDelta));
+        rva += rvaDelta;
+        int64_t value;
+        memcpy(&value, mapped.data() + rva, sizeof(value));
+        value += delta;
+        memcpy(mapped.data() + rva, &value, sizeof(value));
+    }
+
+    uint32_t sampleValue = 0, sampleTable = 0, stpInitialize = 0, stpCallbackEntry = 0;
+    for (const FixtureExport& exp : fixtureExports(mapFixture("plugin.dll"))) {
+        if (exp.name == "SampleValue") sampleValue = exp.rva;
+        if (exp.name == "SampleTable") sampleTable = exp.rva;
+        if (exp.name == "StpInitialize") stpInitialize = exp.rva;
+        if (exp.name == "StpCallbackEntry") stpCallbackEntry = exp.rva;
+    }
+
+    uint64_t table[3];
+    memcpy(table, mapped.data() + sampleTable, sizeof(table));
+    CHECK_EQ(table[0], (uint64_t)mapped.data() + sampleValue);
+    CHECK_EQ(table[1], (uint64_t)mapped.data() + stpInitialize);
+    CHECK_EQ(table[2], (uint64_t)mapped.data() + stpCallbackEntry);
+}
+
+static void testRejectedInputs() {
+    std::string printed;
+    CHECK_EQ(prelink(FIXTURE_DIR "missing.dll", BUILD_DIR "missing.stp", printed), 1);
+    CHECK(printed.find("failed to open") != std::string::npos);
+
+    // not a PE, cut off in the section data
+    const std::vector<uint8_t> file = readPeFile(FIXTURE_DIR "plugin.dll");
+    struct Case {
+        const char* name;
+        std::vector<uint8_t> bytes;
+        const char* message;
+    };
+    std::vector<uint8_t> notPe = file;
+    notPe[0] = 'X';
+    std::vector<uint8_t> truncated(file.begin(), file.begin() + file.size() / 2);
+    for (const Case& c : { Case{ "notpe.dll", notPe, "DOS magic" }, Case{ "truncated.dll", truncated, "out of bounds" } }) {
+        const std::string path = std::string(BUILD_DIR) + c.name;
+        FILE* f = fopen(path.c_str(), "wb");
+        CHECK(f && fwrite(c.bytes.data(), 1, c.bytes.size(), f) == c.bytes.size());
+        if (f) {
+            fclose(f);
+        }
+        CHECK_EQ(prelink(path, path + ".stp", printed), 1);
+        CHECK(printed.find(c.message) != std::string::npos);
+    }
+}
+
+int main() {
+    testPluginOutput();
+    testRelocatedImage();
+    testRejectedInputs();
+    return testResult("prelink_test");
+}
@@ -0,0 +1,189 @@
+// "STraceCLI top" rates from the recorded snapshots in fixtures/counters.strc: per CPU rows must be merged, every
+// interval must yield the rates worked out by hand in make_snapshots.py's scenario, and STraceDecode replaying the
+// recording must print fixtures/counters.txt.
+#include <stdint.h>
+#include <string.h>
+#include "RateView.h"
+#include "test.h"
+#include "decode_tool.h"
+#include <math.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#define FIXTURE_DIR "fixtures/"
+
+static std::vector<uint8_t> readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+static std::vector<CounterSnapshot> readSnapshots(const std::vector<uint8_t>& data) {
+    std::vector<CounterSnapshot> snapshots;
+    for (size_t offset = 0; offset < data.size();) {
+        CounterSnapshot snapshot;
+        const size_t size = snapshot.parse(data.data() + offset, data.size() - offset);
+        CHECK(size);
+        if (!size)
+            break;
+
+        snapshots.push_back(std::move(snapshot));
+        offset += size;
+    }
+    return snapshots;
+}
+
+static bool near(double a, double b) {
+    return fabs(a - b) < 1e-6 * (fabs(b) + 1);
+}
+
+static void checkRows(const std::vector<RateRow>& rows, const std::vector<RateRow>& expected) {
+    CHECK_EQ(rows.size(), expected.size());
+    for (size_t i = 0; i < rows.size() && i < expected.size(); i++) {
+        CHECK_EQ(rows[i].pid, expected[i].pid);
+        CHECK_EQ(rows[i].probeId, expected[i].probeId);
+        CHECK_EQ(rows[i].calls, expected[i].calls);
+        CHECK(near(rows[i].callsPerSecond, expected[i].callsPerSecond));
+        CHECK(near(rows[i].avgLatencyUs, expected[i].avgLatencyUs));
+        if (rows[i].pid != expected[i].pid || rows[i].calls != expected[i].calls || !near(rows[i].avgLatencyUs, expected[i].avgLatencyUs)) {
+            fprintf(stderr, "  row %zu: pid %u probe %u calls %llu %.3f/s %.3fus\n", i, rows[i].pid, rows[i].probeId,
+                (unsigned long long)rows[i].calls, rows[i].callsPerSecond, rows[i].avgLatencyUs);
+        }
+    }
+}
+
+static void testParse() {
+    const std::vector<CounterSnapshot> snapshots = readSnapshots(readFile(FIXTURE_DIR "counters.strc"));
+    CHECK_EQ(snapshots.size(), 4u);
+    if (snapshots.size() != 4)
+        return;
+
+    // two CPUs' rows of (100, 1) summed up
+    const CounterSnapshot& first = snapshots[0];
+    CHECK_EQ(first.rows.size(), 3u);
+    CHECK_EQ(first.timestamp, 1000000000u);
+    CHECK_EQ(first.qpcFrequency, 10000000u);
+    auto it = first.rows.find((100ull << 32) | 1);
+    CHECK(it != first.rows.end());
+    if (it != first.rows.end()) {
+        CHECK_EQ(it->second.calls, 1500u);
+        CHECK_EQ(it->second.completed, 1500u);
+        CHECK_EQ(it->second.totalTicks, 7500000u);
+    }
+
+    CHECK(!first.truncated && !snapshots[1].truncated && snapshots[2].truncated);
+    CHECK_EQ(snapshots[1].overflow, 5u);
+    CHECK_EQ(snapshots[1].rows.size(), 5u);
+}
+
+static void testRates() {
+    const std::vector<CounterSnapshot> snapshots = readSnapshots(readFile(FIXTURE_DIR "counters.strc"));
+    if (snapshots.size() != 4)
+        return;
+
+    // one second: 100's idle probe 2 is left out, 300 and 50 started, 50 tie-breaks ahead of 300 on pid and has no
+    // completed call to average
+    checkRows(RateView::compute(snapshots[0], snapshots[1]), {
+        { 100, 1, 1000, 1000.0, 500.0 },
+        { 200, 1, 200, 200.0, 2.0 },
+        { 50, 4, 30, 30.0, 0.0 },
+        { 300, 3, 30, 30.0, 10.0 },
+    });
+
+    // two and a half seconds: 200 went backwards and counts from zero, 100's probe 2 calls are all still in flight
+    checkRows(RateView::compute(snapshots[1], snapshots[2]), {
+        { 100, 1, 500, 200.0, 30.0 },
+        { 200, 1, 40, 16.0, 1.0 },
+        { 100, 2, 10, 4.0, 0.0 },
+    });
+
+    // no time passed, there's no rate but the latency still holds. Fewer completed calls also means re-enabled
+    checkRows(RateView::compute(snapshots[2], snapshots[3]), {
+        { 200, 1, 45, 0.0, 1.0 },
+        { 100, 1, 1, 0.0, 10.0 },
+    });
+
+    // against itself nothing happened, from nothing every call counts
+    checkRows(RateView::compute(snapshots[1], snapshots[1]), {});
+    checkRows(RateView::compute(CounterSnapshot(), snapshots[0]), {
+        { 100, 1, 1500, 1500.0 / 100, 500.0 },
+        { 200, 1, 50, 50.0 / 100, 1000.0 },
+        { 100, 2, 10, 10.0 / 100, 1000.0 },
+    });
+}
+
+static void testRender() {
+    const std::vector<CounterSnapshot> snapshots = readSnapshots(readFile(FIXTURE_DIR "counters.strc"));
+    if (snapshots.size() != 4)
+        return;
+
+    RecordDecoder names;
+    std::ostringstream out;
+    RateView::render(RateView::compute(snapshots[0], snapshots[1]), snapshots[0], snapshots[1], names, out, 2);
+    const std::string text = out.str();
+
+    // totals count every row, the table only the top ones
+    CHECK(text.find("1260 calls in 1.00s, 4 (pid, probe) pairs\n") == 0);
+    char row[160];
+    snprintf(row, sizeof(row), "%-8u %-40s %12.1f %12.2f\n", 200, "probe#1", 200.0, 2.0);
+    CHECK(text.find(row) != std::string::npos);
+    snprintf(row, sizeof(row), "%-8u %-40s %12.1f %12.2f\n", 50, "probe#4", 30.0, 0.0);
+    CHECK(text.find(row) == std::string::npos);
+    CHECK(text.find("5 calls were not counted") != std::string::npos);
+    CHECK(text.find("truncated") == std::string::npos);
+}
+
+static void testMalformed() {
+    const std::vector<uint8_t> data = readFile(FIXTURE_DIR "counters.strc");
+    StpCounterSnapshotHeader header;
+    CHECK(data.size() > sizeof(header));
+    if (data.size() <= sizeof(header))
+        return;
+    memcpy(&header, data.data(), sizeof(header));
+
+    CounterSnapshot snapshot;
+    CHECK_EQ(snapshot.parse(data.data(), header.size), header.size);
+    CHECK_EQ(snapshot.parse(data.data(), header.size - 1), 0u);
+    CHECK_EQ(snapshot.parse(data.data(), sizeof(header) - 1), 0u);
+
+    // a size that disagrees with the row count, a wrong magic
+    std::vector<uint8_t> bad = data;
+    const uint32_t rowCount = header.rowCount + 1;
+    memcpy(bad.data() + offsetof(StpCounterSnapshotHeader, rowCount), &rowCount, sizeof(rowCount));
+    CHECK_EQ(snapshot.parse(bad.data(), bad.size()), 0u);
+
+    bad = data;
+    bad[0] ^= 1;
+    CHECK_EQ(snapshot.parse(bad.data(), bad.size()), 0u);
+}
+
+static void testReplay() {
+    const std::vector<uint8_t> expected = readFile(FIXTURE_DIR "counters.txt");
+    std::string printed;
+    CHECK_EQ(decodeTool(FIXTURE_DIR "counters.strc", printed), 0);
+    CHECK(!expected.empty() && printed == std::string(expected.begin(), expected.end()));
+
+    CHECK_EQ(decodeTool(FIXTURE_DIR "counters.strc 1", printed), 0);
+    CHECK(printed.find("probe#4") == std::string::npos && printed.find("probe#2") == std::string::npos);
+
+    // a recording cut off in its last snapshot
+    std::vector<uint8_t> data = readFile(FIXTURE_DIR "counters.strc");
+    const std::string path = BUILD_DIR "truncated.strc";
+    FILE* f = fopen(path.c_str(), "wb");
+    CHECK(f && fwrite(data.data(), 1, data.size() - 8, f) == data.size() - 8);
+    if (f) {
+        fclose(f);
+    }
+    CHECK_EQ(decodeTool(path, printed), 1);
+    CHECK(printed.find("corrupt counter snapshot at offset") != std::string::npos);
+}
+
+int main() {
+    testParse();
+    testRates();
+    testRender();
+    testMalformed();
+    testReplay();
+    return testResult("rate_view_test");
+}
@@ -0,0 +1,528 @@
+// Records encoded the way RecordStream lays them out in its ring, decoded with STraceCLI's RecordDecoder: every field
+// must come back as written, however the stream is cut into reads, and corrupt or lying records must not be read past.
+// Then the same records as a raw dump through the STraceDecode tool, the way "STraceCLI stream --raw" output is read.
+#include <stdint.h>
+#include <string.h>
+#include "RecordDecoder.h"
+#include "test.h"
+#include "decode_tool.h"
+#include <stdlib.h>
+#include <sstream>
+
+// RecordStream::write and append: header, body, tail, zeroed up to the alignment
+class RecordWriter {
+public:
+    std::vector<uint8_t> bytes;
+
+    void write(uint16_t type, const void* body, uint32_t bodySize, const void* tail = nullptr, uint32_t tailSize = 0) {
+        StpRecordHeader header;
+        header.size = StpRecordAlign(sizeof(StpRecordHeader) + bodySize + tailSize);
+        header.type = type;
+        header.cpu = m_cpu;
+        header.pid = 4242;
+        header.tid = 4343;
+        header.timestamp = m_timestamp;
+        m_cpu = (m_cpu + 1) % 3;
+        m_timestamp += 1000;
+
+        const size_t offset = bytes.size();
+        bytes.resize(offset + header.size);
+        memcpy(bytes.data() + offset, &header, sizeof(header));
+        if (bodySize) {
+            memcpy(bytes.data() + offset + sizeof(header), body, bodySize);
+        }
+        if (tailSize) {
+            memcpy(bytes.data() + offset + sizeof(header) + bodySize, tail, tailSize);
+        }
+    }
+
+    // writes the fixed part of a record struct, everything after its header
+    template<typename Record>
+    void writeRecord(uint16_t type, const Record& record, const void* tail = nullptr, uint32_t tailSize = 0) {
+        write(type, (const uint8_t*)&record + sizeof(StpRecordHeader), sizeof(Record) - sizeof(StpRecordHeader), tail, tailSize);
+    }
+
+    void writeLog(const char* text) {
+        write(StpRecordLog, nullptr, 0, text, (uint32_t)strlen(text) + 1);
+    }
+
+    void writeProbeName(uint32_t probeId, const char* name) {
+        StpProbeNameRecord record = {};
+        record.probeId = probeId;
+        record.nameLength = (uint32_t)strlen(name);
+        writeRecord(StpRecordProbeName, record, name, record.nameLength + 1);
+    }
+
+    void writeSyscall(uint16_t type, uint32_t probeId, uint32_t paramCount, uint64_t firstArg) {
+        StpSyscallRecord record = {};
+        record.probeId = probeId;
+        record.paramCount = paramCount;
+        record.service = 0x1000 + probeId;
+        for (uint32_t i = 0; i < STP_RECORD_MAX_ARGS; i++) {
+            record.args[i] = firstArg + i;
+        }
+        writeRecord(type, record);
+    }
+private:
+    uint16_t m_cpu = 0;
+    uint64_t m_timestamp = 5000000;
+};
+
+// Everything the visitor was handed, in order
+class RecordingVisitor : public RecordVisitor {
+public:
+    std::vector<std::string> logs;
+    std::vector<StpSyscallRecord> syscalls;
+    std::vector<uint64_t> dropped;
+    std::vector<StpMemoryRecord> memory;
+    std::vector<std::vector<StpNgram>> ngrams;
+    std::vector<StpNgramRecord> ngramRecords;
+    std::vector<std::string> modulePaths;
+    std::vector<StpModuleRecord> modules;
+    std::vector<std::vector<uint64_t>> stacks;
+    std::vector<StpStackRecord> stackRecords;
+    std::vector<StpRecordHeader> headers;
+
+    void onLog(const StpRecordHeader& header, const char* text) override {
+        headers.push_back(header);
+        logs.push_back(text);
+    }
+    void onSyscall(const StpSyscallRecord& record) override {
+        headers.push_back(record.header);
+        syscalls.push_back(record);
+    }
+    void onDropped(const StpRecordHeader& header, uint64_t count) override {
+        headers.push_back(header);
+        dropped.push_back(count);
+    }
+    void onMemory(const StpMemoryRecord& record) override {
+        headers.push_back(record.header);
+        memory.push_back(record);
+    }
+    void onNgrams(const StpNgramRecord& record, const std::vector<StpNgram>& grams) override {
+        headers.push_back(record.header);
+        ngramRecords.push_back(record);
+        ngrams.push_back(grams);
+    }
+    void onModule(const StpModuleRecord& record, const char* path) override {
+        headers.push_back(record.header);
+        modules.push_back(record);
+        modulePaths.push_back(path);
+    }
+    void onStack(const StpStackRecord& record, const std::vector<uint64_t>& frames) override {
+        headers.push_back(record.header);
+        stackRecords.push_back(record);
+        stacks.push_back(frames);
+    }
+};
+
+static const uint8_t SampleGuid[16] = { 0x4D, 0x22, 0x72, 0x1B, 0xB8, 0x37, 0x92, 0x17, 0x28, 0x20, 0x0E, 0xD8, 0x99, 0x44, 0x98, 0xB2 };
+
+// One of every record type, in the order a traced NtCreateFile with raw stacks produces them
+static RecordWriter sampleStream() {
+    RecordWriter writer;
+    writer.writeProbeName(1, "NtCreateFile");
+    writer.writeProbeName(2, "NtClose");
+    writer.writeLog("[+] plugin loaded\r\n");
+
+    StpModuleRecord kernel = {};
+    kernel.flags = StpModuleFlagKernel | StpModuleFlagSnapshot;
+    kernel.base = 0xfffff80000000000ull;
+    kernel.size = 0x1000000;
+    kernel.timeDateStamp = 0x5f3e2c11;
+    kernel.pdbAge = 1;
+    memcpy(kernel.pdbGuid, SampleGuid, sizeof(SampleGuid));
+    const char* kernelPath = "\\SystemRoot\\system32\\ntoskrnl.exe";
+    kernel.pathLength = (uint32_t)strlen(kernelPath);
+    writer.writeRecord(StpRecordModule, kernel, kernelPath, kernel.pathLength + 1);
+
+    StpModuleRecord user = {};
+    user.pid = 4242;
+    user.flags = StpModuleFlag32Bit | StpModuleFlagNoIdentity;
+    user.base = 0x400000;
+    user.size = 0x20000;
+    const char* userPath = "C:\\tools\\app.exe";
+    user.pathLength = (uint32_t)strlen(userPath);
+    writer.writeRecord(StpRecordModule, user, userPath, user.pathLength + 1);
+
+    writer.writeSyscall(StpRecordSyscallEntry, 1, 11, 0x100);
+
+    StpStackRecord stack = {};
+    stack.probeId = 1;
+    stack.frameCount = 3;
+    const uint64_t frames[3] = { 0x401234, 0xfffff80000123456ull, 0x7ff000000000ull };
+    writer.writeRecord(StpRecordStack, stack, frames, sizeof(frames));
+
+    writer.writeSyscall(StpRecordSyscallReturn, 1, 11, 0);
+
+    StpDroppedRecord dropped = {};
+    dropped.count = 17;
+    writer.writeRecord(StpRecordDropped, dropped);
+
+    StpMemoryRecord memory = {};
+    memory.event = StpMemoryWriteToExecute;
+    memory.flags = StpMemoryFlagRemoteWrite;
+    memory.targetPid = 777;
+    memory.oldProtect = 0x04;
+    memory.newProtect = 0x20;
+    memory.address = 0x10000;
+    memory.size = 0x2000;
+    writer.writeRecord(StpRecordMemory, memory);
+
+    // a record type from a newer driver, readers skip it by size
+    const uint64_t future[3] = { 1, 2, 3 };
+    writer.write(99, future, sizeof(future));
+
+    StpNgramRecord ngram = {};
+    ngram.pid = 4242;
+    ngram.gramCount = 2;
+    ngram.last = 1;
+    StpNgram grams[2] = {};
+    grams[0].n = 2;
+    grams[0].probes[0] = 1;
+    grams[0].probes[1] = 2;
+    grams[0].count = 40;
+    grams[1].n = 3;
+    grams[1].probes[0] = 2;
+    grams[1].probes[1] = STP_NGRAM_OTHER_PROBE;
+    grams[1].probes[2] = 9;
+    grams[1].count = 3;
+    writer.writeRecord(StpRecordNgrams, ngram, grams, sizeof(grams));
+
+    writer.writeSyscall(StpRecordSyscallEntry, 2, 1, 0x44);
+    return writer;
+}
+
+static const uint64_t SampleRecords = 13;
+
+static void checkSample(const RecordDecoder& decoder, const RecordingVisitor& visitor) {
+    CHECK_EQ(decoder.recordCount(), SampleRecords);
+
+    CHECK_EQ(decoder.probeName(1) == "NtCreateFile", true);
+    CHECK_EQ(decoder.displayName(2) == "NtClose", true);
+    CHECK_EQ(decoder.displayName(12) == "probe#12", true);
+
+    CHECK_EQ(visitor.logs.size(), 1u);
+    CHECK(!visitor.logs.empty() && visitor.logs[0] == "[+] plugin loaded\r\n");
+
+    CHECK_EQ(visitor.syscalls.size(), 3u);
+    if (visitor.syscalls.size() == 3) {
+        const StpSyscallRecord& entry = visitor.syscalls[0];
+        CHECK_EQ(entry.header.type, (uint16_t)StpRecordSyscallEntry);
+        CHECK_EQ(entry.probeId, 1u);
+        CHECK_EQ(entry.paramCount, 11u);
+        CHECK_EQ(entry.service, 0x1001u);
+        for (uint32_t i = 0; i < STP_RECORD_MAX_ARGS; i++) {
+            CHECK_EQ(entry.args[i], 0x100u + i);
+        }
+        CHECK_EQ(visitor.syscalls[1].header.type, (uint16_t)StpRecordSyscallReturn);
+        CHECK_EQ(visitor.syscalls[1].args[0], 0u);
+        CHECK_EQ(visitor.syscalls[2].probeId, 2u);
+        CHECK_EQ(visitor.syscalls[2].args[0], 0x44u);
+    }
+
+    CHECK_EQ(visitor.dropped.size(), 1u);
+    CHECK(!visitor.dropped.empty() && visitor.dropped[0] == 17);
+
+    CHECK_EQ(visitor.memory.size(), 1u);
+    if (!visitor.memory.empty()) {
+        const StpMemoryRecord& memory = visitor.memory[0];
+        CHECK_EQ(memory.event, (uint32_t)StpMemoryWriteToExecute);
+        CHECK_EQ(memory.flags, (uint32_t)StpMemoryFlagRemoteWrite);
+        CHECK_EQ(memory.targetPid, 777u);
+        CHECK_EQ(memory.oldProtect, 0x04u);
+        CHECK_EQ(memory.newProtect, 0x20u);
+        CHECK_EQ(memory.address, 0x10000u);
+        CHECK_EQ(memory.size, 0x2000u);
+    }
+
+    CHECK_EQ(visitor.ngrams.size(), 1u);
+    if (!visitor.ngrams.empty()) {
+        CHECK_EQ(visitor.ngramRecords[0].pid, 4242u);
+        CHECK_EQ(visitor.ngramRecords[0].last, 1u);
+        CHECK_EQ(visitor.ngrams[0].size(), 2u);
+        if (visitor.ngrams[0].size() == 2) {
+            CHECK_EQ(visitor.ngrams[0][0].count, 40u);
+            CHECK(decoder.gramName(visitor.ngrams[0][0]) == "NtCreateFile > NtClose");
+            CHECK_EQ(visitor.ngrams[0][1].count, 3u);
+            CHECK(decoder.gramName(visitor.ngrams[0][1]) == "NtClose > other > probe#9");
+        }
+    }
+
+    CHECK_EQ(visitor.modules.size(), 2u);
+    if (visitor.modules.size() == 2) {
+        CHECK(visitor.modulePaths[0] == "\\SystemRoot\\system32\\ntoskrnl.exe");
+        CHECK(visitor.modulePaths[1] == "C:\\tools\\app.exe");
+        CHECK_EQ(visitor.modules[0].timeDateStamp, 0x5f3e2c11u);
+        CHECK(RecordDecoder::pdbKey(visitor.modules[0]) == "1B72224D37B8179228200ED8994498B21");
+        CHECK(RecordDecoder::pdbKey(visitor.modules[1]).empty());
+    }
+
+    CHECK_EQ(visitor.stacks.size(), 1u);
+    if (!visitor.stacks.empty()) {
+        CHECK_EQ(visitor.stackRecords[0].probeId, 1u);
+        CHECK_EQ(visitor.stacks[0].size(), 3u);
+        CHECK(visitor.stacks[0] == std::vector<uint64_t>({ 0x401234, 0xfffff80000123456ull, 0x7ff000000000ull }));
+    }
+
+    // user addresses in the process's modules, kernel addresses in pid 0's, from any process
+    const RecordDecoder::Module* pModule = decoder.moduleAt(4242, 0x401234);
+    CHECK(pModule && pModule->path == "C:\\tools\\app.exe" && pModule->base == 0x400000);
+    pModule = decoder.moduleAt(1, 0xfffff80000123456ull);
+    CHECK(pModule && pModule->pdb == "1B72224D37B8179228200ED8994498B21");
+    CHECK(!decoder.moduleAt(1, 0x401234));
+    CHECK(!decoder.moduleAt(4242, 0x420000));
+    CHECK(!decoder.moduleAt(4242, 0x7ff000000000ull));
+
+    // headers in stream order, the unknown record and probe names aren't visited
+    CHECK_EQ(visitor.headers.size(), 10u);
+    for (size_t i = 1; i < visitor.headers.size(); i++) {
+        CHECK(visitor.headers[i - 1].timestamp < visitor.headers[i].timestamp);
+        CHECK_EQ(visitor.headers[i].pid, 4242u);
+        CHECK_EQ(visitor.headers[i].tid, 4343u);
+    }
+}
+
+static void testRoundTrip() {
+    const RecordWriter writer = sampleStream();
+    for (size_t offset = 0; offset < writer.bytes.size();) {
+        StpRecordHeader header;
+        memcpy(&header, writer.bytes.data() + offset, sizeof(header));
+        CHECK_EQ(header.size % STP_RECORD_ALIGNMENT, 0u);
+        offset += header.size;
+    }
+
+    RecordDecoder decoder;
+    RecordingVisitor visitor;
+    CHECK_EQ(decoder.decode(writer.bytes.data(), writer.bytes.size(), visitor), writer.bytes.size());
+    checkSample(decoder, visitor);
+}
+
+// Reads end anywhere, STraceDecode and the CLI carry the partial tail over to the next one
+static void testEverySplit() {
+    const RecordWriter writer = sampleStream();
+    const std::vector<uint8_t>& bytes = writer.bytes;
+    for (size_t chunk = 1; chunk <= bytes.size(); chunk++) {
+        RecordDecoder decoder;
+        RecordingVisitor visitor;
+        std::vector<uint8_t> buffer;
+        size_t fed = 0;
+        bool corrupt = false;
+        while (fed < bytes.size() && !corrupt) {
+            const size_t take = std::min(chunk, bytes.size() - fed);
+            buffer.insert(buffer.end(), bytes.begin() + fed, bytes.begin() + fed + take);
+            fed += take;
+
+            const size_t consumed = decoder.decode(buffer.data(), buffer.size(), visitor);
+            corrupt = consumed == SIZE_MAX;
+            if (!corrupt) {
+                buffer.erase(buffer.begin(), buffer.begin() + consumed);
+            }
+        }
+        CHECK(!corrupt);
+        CHECK(buffer.empty());
+        checkSample(decoder, visitor);
+        if (failures()) {
+            fprintf(stderr, "  with %zu byte reads\n", chunk);
+            return;
+        }
+    }
+}
+
+static void testCorruptAndTruncated() {
+    RecordWriter writer;
+    writer.writeSyscall(StpRecordSyscallEntry, 1, 2, 0x10);
+    writer.writeSyscall(StpRecordSyscallEntry, 2, 2, 0x20);
+    const size_t second = sizeof(StpSyscallRecord);
+
+    // a record cut off is left for the next read, so is a cut off header
+    for (size_t size : { second + 1, second + sizeof(StpRecordHeader) - 1, second + sizeof(StpRecordHeader), writer.bytes.size() - 8 }) {
+        RecordDecoder decoder;
+        RecordingVisitor visitor;
+        CHECK_EQ(decoder.decode(writer.bytes.data(), size, visitor), second);
+        CHECK_EQ(visitor.syscalls.size(), 1u);
+    }
+
+    // sizes a driver never writes, and nothing after them is read
+    for (uint32_t badSize : { 0u, 8u, (uint32_t)sizeof(StpRecordHeader) - 8, (uint32_t)second + 4 }) {
+        std::vector<uint8_t> bytes = writer.bytes;
+        memcpy(bytes.data() + second, &badSize, sizeof(badSize));
+        RecordDecoder decoder;
+        RecordingVisitor visitor;
+        CHECK_EQ(decoder.decode(bytes.data(), bytes.size(), visitor), SIZE_MAX);
+        CHECK_EQ(visitor.syscalls.size(), 1u);
+        CHECK_EQ(decoder.recordCount(), 1u);
+    }
+}
+
+// Counts and strings in a record that claim more than its size holds are cut at the record's end
+static void testLyingRecords() {
+    RecordWriter writer;
+
+    // no terminator before the next record starts
+    const char unterminated[16] = { 'N', 't', 'O', 'p', 'e', 'n', 'K', 'e', 'y', 'E', 'x', 'T', 'a', 'i', 'l', '!' };
+    writer.write(StpRecordLog, nullptr, 0, unterminated, sizeof(unterminated));
+    StpProbeNameRecord probe = {};
+    probe.probeId = 5;
+    probe.nameLength = 100;
+    writer.writeRecord(StpRecordProbeName, probe, unterminated, sizeof(unterminated));
+
+    StpNgramRecord ngram = {};
+    ngram.gramCount = 1000;
+    StpNgram gram = {};
+    gram.n = 2;
+    gram.count = 9;
+    writer.writeRecord(StpRecordNgrams, ngram, &gram, sizeof(gram));
+
+    StpStackRecord stack = {};
+    stack.frameCount = STP_STACK_MAX_FRAMES;
+    const uint64_t frames[2] = { 0x1000, 0x2000 };
+    writer.writeRecord(StpRecordStack, stack, frames, sizeof(frames));
+
+    // shorter than its type, skipped by size
+    writer.write(StpRecordSyscallEntry, frames, sizeof(frames));
+
+    // an empty module never matches
+    StpModuleRecord module = {};
+    module.pid = 4242;
+    module.base = 0x400000;
+    module.pathLength = 1;
+    writer.writeRecord(StpRecordModule, module, "x", 2);
+
+    writer.writeSyscall(StpRecordSyscallReturn, 3, 1, 0);
+
+    RecordDecoder decoder;
+    RecordingVisitor visitor;
+    CHECK_EQ(decoder.decode(writer.bytes.data(), writer.bytes.size(), visitor), writer.bytes.size());
+    CHECK_EQ(decoder.recordCount(), 7u);
+    CHECK(visitor.logs.size() == 1 && visitor.logs[0] == std::string(unterminated, sizeof(unterminated)));
+    CHECK(decoder.probeName(5) == std::string(unterminated, sizeof(unterminated)));
+    CHECK(visitor.ngrams.size() == 1 && visitor.ngrams[0].size() == 1 && visitor.ngrams[0][0].count == 9);
+    CHECK(visitor.stacks.size() == 1 && visitor.stacks[0] == std::vector<uint64_t>({ 0x1000, 0x2000 }));
+    CHECK_EQ(visitor.modules.size(), 1u);
+    CHECK(!decoder.moduleAt(4242, 0x400000));
+    CHECK(visitor.syscalls.size() == 1 && visitor.syscalls[0].probeId == 3);
+}
+
+// A later module over the same range replaces the earlier one, untouched neighbours stay
+static void testModuleReplacement() {
+    RecordWriter writer;
+    const auto writeModule = [&](uint64_t base, uint64_t size, const char* path) {
+        StpModuleRecord module = {};
+        module.pid = 10;
+        module.base = base;
+        module.size = size;
+        module.pathLength = (uint32_t)strlen(path);
+        writer.writeRecord(StpRecordModule, module, path, module.pathLength + 1);
+    };
+    writeModule(0x10000, 0x10000, "a.dll");
+    writeModule(0x20000, 0x10000, "b.dll");
+    writeModule(0x40000, 0x10000, "d.dll");
+    writeModule(0x18000, 0x10000, "c.dll");
+
+    RecordDecoder decoder;
+    RecordingVisitor visitor;
+    CHECK_EQ(decoder.decode(writer.bytes.data(), writer.bytes.size(), visitor), writer.bytes.size());
+    CHECK(!decoder.moduleAt(10, 0x10000));
+    CHECK(!decoder.moduleAt(10, 0x28000));
+    const RecordDecoder::Module* pModule = decoder.moduleAt(10, 0x27fff);
+    CHECK(pModule && pModule->path == "c.dll");
+    pModule = decoder.moduleAt(10, 0x40000);
+    CHECK(pModule && pModule->path == "d.dll");
+}
+
+static void testTextPrinter() {
+    const RecordWriter writer = sampleStream();
+    RecordDecoder decoder;
+    std::ostringstream out;
+    TextPrinter printer(decoder, out, 1000000);
+    decoder.decode(writer.bytes.data(), writer.bytes.size(), printer);
+
+    const std::string text = out.str();
+    for (const char* line : {
+             "[    0.000000] cpu=2   pid=4242   tid=4343   [+] plugin loaded\n",
+             "[    0.003000] cpu=2   pid=4242   tid=4343   NtCreateFile(0x100, 0x101, 0x102, 0x103, ...)\n",
+             "stack NtCreateFile 3 frames\n  [C:\\tools\\app.exe] +0x00001234\n  [\\SystemRoot\\system32\\ntoskrnl.exe] +0x00123456\n"
+             "  [UNKNOWN MODULE]   0x00007ff000000000\n",
+             "NtCreateFile -> 0x0\n",
+             "*** 17 records dropped, the driver's buffer was full ***\n",
+             "W->X target=777 0x10000+0x2000 protect 0x4 -> 0x20 remote-written\n",
+             "ngram exited=4242 NtCreateFile > NtClose x40\n",
+             "ngram exited=4242 NtClose > other > probe#9 x3\n",
+             "NtClose(0x44)\n",
+             "module kernel 0xfffff80000000000+0x1000000 timestamp=5f3e2c11 pdb=1B72224D37B8179228200ED8994498B21 loaded \\SystemRoot\\system32\\ntoskrnl.exe\n",
+             "module process=4242 0x400000+0x20000 timestamp=00000000 pdb=- 32bit unreadable C:\\tools\\app.exe\n" }) {
+        CHECK(text.find(line) != std::string::npos);
+        if (text.find(line) == std::string::npos) {
+            fprintf(stderr, "  missing: %s", line);
+        }
+    }
+}
+
+static void writeFile(const std::string& path, const std::vector<uint8_t>& bytes) {
+    FILE* f = fopen(path.c_str(), "wb");
+    CHECK(f && fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+    if (f) {
+        fclose(f);
+    }
+}
+
+static void testDecodeTool() {
+    StpDumpHeader header = {};
+    header.magic = STP_DUMP_MAGIC;
+    header.version = STP_DUMP_VERSION;
+    header.qpcFrequency = 1000000;
+    std::vector<uint8_t> dump((const uint8_t*)&header, (const uint8_t*)(&header + 1));
+    const RecordWriter writer = sampleStream();
+    dump.insert(dump.end(), writer.bytes.begin(), writer.bytes.end());
+
+    const std::string path = BUILD_DIR "sample.strd";
+    writeFile(path, dump);
+
+    RecordDecoder decoder;
+    std::ostringstream expected;
+    TextPrinter printer(decoder, expected, header.qpcFrequency);
+    decoder.decode(writer.bytes.data(), writer.bytes.size(), printer);
+
+    std::string printed;
+    CHECK_EQ(decodeTool(path, printed), 0);
+    CHECK(printed == expected.str());
+
+    // one entry paired with its return 2000 ticks later, the other still open
+    CHECK_EQ(decodeTool(path + " --aggregate", printed), 0);
+    char row[160];
+    snprintf(row, sizeof(row), "%-8u %-40s %12u %12.2f\n", 4242, "NtCreateFile", 1, 2000.0);
+    CHECK(printed.find(row) != std::string::npos);
+    snprintf(row, sizeof(row), "%-8u %-40s %12u %12.2f\n", 4242, "NtClose", 1, 0.0);
+    CHECK(printed.find(row) != std::string::npos);
+    CHECK(printed.find("17 records were dropped, counts are a lower bound") != std::string::npos);
+
+    std::vector<uint8_t> truncated(dump.begin(), dump.end() - 8);
+    writeFile(path, truncated);
+    CHECK_EQ(decodeTool(path, printed), 0);
+    CHECK(printed.find("dump ends with a truncated record") != std::string::npos);
+    CHECK(printed.find("NtClose(0x44)") == std::string::npos);
+
+    std::vector<uint8_t> corrupt = dump;
+    corrupt[sizeof(header)] = 12;
+    writeFile(path, corrupt);
+    CHECK_EQ(decodeTool(path, printed), 1);
+    CHECK(printed.find("corrupt record after 0 records") != std::string::npos);
+
+    std::vector<uint8_t> newer = dump;
+    newer[4] = STP_DUMP_VERSION + 1;
+    writeFile(path, newer);
+    CHECK_EQ(decodeTool(path, printed), 1);
+    CHECK(printed.find("unsupported dump version") != std::string::npos);
+}
+
+int main() {
+    testRoundTrip();
+    testEverySplit();
+    testCorruptAndTruncated();
+    testLyingRecords();
+    testModuleReplacement();
+    testTextPrinter();
+    testDecodeTool();
+    return testResult("record_decoder_test");
+}
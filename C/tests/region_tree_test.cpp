@@ -0,0 +1,281 @@
+// Tests of the VM tracker's RegionTree: splitting on assign and erase, eraseAllocation, firstOverlap at the edges of a
+// range, and a randomized run against a page by page model that checks order and balance after every step.
+#include "RegionTree.h"
+#include "test.h"
+#include <math.h>
+#include <random>
+#include <vector>
+
+typedef RegionTree::Region Region;
+
+static Region makeRegion(uint64_t start, uint64_t end, uint64_t allocationBase, uint32_t protect) {
+    Region region = {};
+    region.start = start;
+    region.end = end;
+    region.allocationBase = allocationBase;
+    region.protect = protect;
+    return region;
+}
+
+static std::vector<Region> regionsOf(RegionTree& tree) {
+    std::vector<Region> regions;
+    tree.forEachOverlap(0, ~0ull, [&](Region& region) {
+        regions.push_back(region);
+    });
+    return regions;
+}
+
+// sorted, non-empty, non-overlapping, counted, and no higher than an AVL tree of that size can be
+static void checkInvariants(RegionTree& tree) {
+    const std::vector<Region> regions = regionsOf(tree);
+    CHECK_EQ(regions.size(), tree.count());
+    for (size_t i = 0; i < regions.size(); i++) {
+        CHECK(regions[i].start < regions[i].end);
+        if (i) {
+            CHECK(regions[i - 1].end <= regions[i].start);
+        }
+    }
+    CHECK(tree.height() <= 1.4405 * log2((double)tree.count() + 2));
+}
+
+static void checkRegion(const Region& region, uint64_t start, uint64_t end, uint64_t allocationBase, uint32_t protect) {
+    CHECK_EQ(region.start, start);
+    CHECK_EQ(region.end, end);
+    CHECK_EQ(region.allocationBase, allocationBase);
+    CHECK_EQ(region.protect, protect);
+}
+
+static void keepNew(const Region&, Region&) {
+}
+
+// a range inside one region splits it in three, the parts outside keep the old region's fields
+static void testAssignSplit() {
+    volatile LONG budget = 100;
+    RegionTree tree;
+    tree.initialize(&budget);
+
+    CHECK(tree.assign(makeRegion(0x1000, 0x5000, 0x1000, 1), keepNew));
+    int overlaps = 0;
+    CHECK(tree.assign(makeRegion(0x2000, 0x3000, 0x1000, 2), [&](const Region& old, Region& region) {
+        checkRegion(old, 0x1000, 0x5000, 0x1000, 1);
+        region.flags = 7;
+        overlaps++;
+    }));
+    CHECK_EQ(overlaps, 1);
+
+    std::vector<Region> regions = regionsOf(tree);
+    CHECK_EQ(regions.size(), 3u);
+    if (regions.size() == 3) {
+        checkRegion(regions[0], 0x1000, 0x2000, 0x1000, 1);
+        checkRegion(regions[1], 0x2000, 0x3000, 0x1000, 2);
+        CHECK_EQ(regions[1].flags, 7u);
+        checkRegion(regions[2], 0x3000, 0x5000, 0x1000, 1);
+    }
+    CHECK_EQ(budget, 97);
+    checkInvariants(tree);
+
+    tree.clear();
+    CHECK_EQ(tree.count(), 0u);
+    CHECK_EQ(budget, 100);
+}
+
+// a range over several regions replaces them, only the outer ends of the first and last survive
+static void testAssignOverlapping() {
+    volatile LONG budget = 100;
+    RegionTree tree;
+    tree.initialize(&budget);
+
+    CHECK(tree.assign(makeRegion(0x1000, 0x2000, 0x1000, 1), keepNew));
+    CHECK(tree.assign(makeRegion(0x2000, 0x3000, 0x2000, 2), keepNew));
+    CHECK(tree.assign(makeRegion(0x3000, 0x5000, 0x3000, 3), keepNew));
+
+    std::vector<uint64_t> seen;
+    CHECK(tree.assign(makeRegion(0x1800, 0x3800, 0x1800, 4), [&](const Region& old, Region&) {
+        seen.push_back(old.start);
+    }));
+    CHECK_EQ(seen.size(), 3u);
+    if (seen.size() == 3) {
+        // in address order
+        CHECK_EQ(seen[0], 0x1000u);
+        CHECK_EQ(seen[1], 0x2000u);
+        CHECK_EQ(seen[2], 0x3000u);
+    }
+
+    std::vector<Region> regions = regionsOf(tree);
+    CHECK_EQ(regions.size(), 3u);
+    if (regions.size() == 3) {
+        checkRegion(regions[0], 0x1000, 0x1800, 0x1000, 1);
+        checkRegion(regions[1], 0x1800, 0x3800, 0x1800, 4);
+        checkRegion(regions[2], 0x3800, 0x5000, 0x3000, 3);
+    }
+
+    // exactly over an existing region replaces it without any split
+    CHECK(tree.assign(makeRegion(0x1800, 0x3800, 0x1800, 5), keepNew));
+    CHECK_EQ(tree.count(), 3u);
+    checkInvariants(tree);
+    tree.clear();
+}
+
+static void testEraseMiddle() {
+    volatile LONG budget = 100;
+    RegionTree tree;
+    tree.initialize(&budget);
+
+    CHECK(tree.assign(makeRegion(0x1000, 0x4000, 0x1000, 1), keepNew));
+    CHECK(tree.erase(0x2000, 0x3000));
+
+    std::vector<Region> regions = regionsOf(tree);
+    CHECK_EQ(regions.size(), 2u);
+    if (regions.size() == 2) {
+        checkRegion(regions[0], 0x1000, 0x2000, 0x1000, 1);
+        checkRegion(regions[1], 0x3000, 0x4000, 0x1000, 1);
+    }
+
+    // erasing a hole that's already there changes nothing
+    CHECK(tree.erase(0x2000, 0x3000));
+    CHECK_EQ(tree.count(), 2u);
+
+    // across the hole takes the inner ends of both sides
+    CHECK(tree.erase(0x1800, 0x3800));
+    regions = regionsOf(tree);
+    CHECK_EQ(regions.size(), 2u);
+    if (regions.size() == 2) {
+        checkRegion(regions[0], 0x1000, 0x1800, 0x1000, 1);
+        checkRegion(regions[1], 0x3800, 0x4000, 0x1000, 1);
+    }
+    checkInvariants(tree);
+    tree.clear();
+}
+
+// the regions cut from one allocation go together, its neighbours stay
+static void testEraseAllocation() {
+    volatile LONG budget = 100;
+    RegionTree tree;
+    tree.initialize(&budget);
+
+    CHECK(tree.assign(makeRegion(0xF000, 0x10000, 0xF000, 1), keepNew));
+    CHECK(tree.assign(makeRegion(0x10000, 0x14000, 0x10000, 1), keepNew));
+    CHECK(tree.assign(makeRegion(0x11000, 0x12000, 0x10000, 2), keepNew));
+    CHECK(tree.assign(makeRegion(0x14000, 0x15000, 0x14000, 1), keepNew));
+    CHECK_EQ(tree.count(), 5u);
+
+    tree.eraseAllocation(0x10000);
+    std::vector<Region> regions = regionsOf(tree);
+    CHECK_EQ(regions.size(), 2u);
+    if (regions.size() == 2) {
+        checkRegion(regions[0], 0xF000, 0x10000, 0xF000, 1);
+        checkRegion(regions[1], 0x14000, 0x15000, 0x14000, 1);
+    }
+
+    // an allocation with no region left is a no-op
+    tree.eraseAllocation(0x10000);
+    CHECK_EQ(tree.count(), 2u);
+    checkInvariants(tree);
+    tree.clear();
+}
+
+// ends are exclusive, touching ranges don't overlap
+static void testFirstOverlapEdges() {
+    volatile LONG budget = 100;
+    RegionTree tree;
+    tree.initialize(&budget);
+    CHECK(tree.firstOverlap(0, ~0ull) == nullptr);
+
+    CHECK(tree.assign(makeRegion(0x1000, 0x2000, 0x1000, 1), keepNew));
+    CHECK(tree.assign(makeRegion(0x3000, 0x4000, 0x3000, 1), keepNew));
+
+    CHECK(tree.firstOverlap(0, 0x1000) == nullptr);
+    CHECK(tree.firstOverlap(0x2000, 0x3000) == nullptr);
+    CHECK(tree.firstOverlap(0x4000, 0x5000) == nullptr);
+
+    Region* pRegion = tree.firstOverlap(0xFFF, 0x1001);
+    CHECK(pRegion && pRegion->start == 0x1000);
+    pRegion = tree.firstOverlap(0x1FFF, 0x2000);
+    CHECK(pRegion && pRegion->start == 0x1000);
+    pRegion = tree.firstOverlap(0x2000, 0x3001);
+    CHECK(pRegion && pRegion->start == 0x3000);
+    pRegion = tree.firstOverlap(0x3FFF, ~0ull);
+    CHECK(pRegion && pRegion->start == 0x3000);
+
+    // the first of several, not whichever holds start
+    pRegion = tree.firstOverlap(0x1800, 0x3800);
+    CHECK(pRegion && pRegion->start == 0x1000);
+    pRegion = tree.firstOverlap(0, ~0ull);
+    CHECK(pRegion && pRegion->start == 0x1000);
+    tree.clear();
+}
+
+// a node that can't be had fails the assign, what fit is kept and the budget is never overdrawn
+static void testBudget() {
+    volatile LONG budget = 2;
+    RegionTree tree;
+    tree.initialize(&budget);
+
+    CHECK(tree.assign(makeRegion(0x1000, 0x4000, 0x1000, 1), keepNew));
+    CHECK(tree.assign(makeRegion(0x5000, 0x6000, 0x5000, 1), keepNew));
+    CHECK(!tree.assign(makeRegion(0x7000, 0x8000, 0x7000, 1), keepNew));
+    CHECK(!tree.erase(0x2000, 0x3000));
+    CHECK_EQ(budget, 0);
+    checkInvariants(tree);
+
+    tree.clear();
+    CHECK_EQ(budget, 2);
+}
+
+// random assigns and erases against one protect value per page, 0 for none
+static void testRandomized() {
+    const uint32_t Pages = 2048;
+    const uint64_t PageSize = 0x1000;
+    volatile LONG budget = 100000;
+    RegionTree tree;
+    tree.initialize(&budget);
+
+    std::vector<uint32_t> model(Pages, 0);
+    std::mt19937 rng(69);
+    for (uint32_t step = 0; step < 20000; step++) {
+        const uint32_t first = rng() % Pages;
+        const uint32_t last = first + rng() % (step % 7 == 0 ? Pages / 4 : 16);
+        const uint32_t end = last < Pages ? last + 1 : Pages;
+        if (rng() % 3) {
+            const uint32_t protect = 1 + rng() % 8;
+            CHECK(tree.assign(makeRegion(first * PageSize, end * PageSize, first * PageSize, protect), keepNew));
+            for (uint32_t page = first; page < end; page++) {
+                model[page] = protect;
+            }
+        } else {
+            CHECK(tree.erase(first * PageSize, end * PageSize));
+            for (uint32_t page = first; page < end; page++) {
+                model[page] = 0;
+            }
+        }
+
+        if (step % 50 && step != 19999)
+            continue;
+
+        checkInvariants(tree);
+        std::vector<uint32_t> pages(Pages, 0);
+        for (const Region& region : regionsOf(tree)) {
+            for (uint64_t page = region.start / PageSize; page < region.end / PageSize; page++) {
+                pages[page] = region.protect;
+            }
+        }
+        CHECK(pages == model);
+        if (failures())
+            break;
+    }
+
+    CHECK_EQ(budget, 100000 - (LONG)tree.count());
+    tree.clear();
+    CHECK_EQ(budget, 100000);
+}
+
+int main() {
+    testAssignSplit();
+    testAssignOverlapping();
+    testEraseMiddle();
+    testEraseAllocation();
+    testFirstOverlapEdges();
+    testBudget();
+    testRandomized();
+    return testResult("region_tree_test");
+}
@@ -0,0 +1,33 @@
+#pragma once
+// User mode stand-ins for the kernel APIs the plugin headers use, enough to run them under g++ on Linux
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+typedef int LONG;
+typedef long long LONG64;
+
+enum POOL_TYPE { NonPagedPoolNx = 512 };
+
+inline void* ExAllocatePoolWithTag(POOL_TYPE, size_t size, unsigned) {
+    return malloc(size);
+}
+
+inline void ExFreePoolWithTag(void* p, unsigned) {
+    free(p);
+}
+
+typedef uintptr_t KSPIN_LOCK, * PKSPIN_LOCK;
+typedef unsigned char KIRQL;
+
+// there's no IRQL to raise in user mode, a plain test and set spin does the rest
+inline KIRQL KeAcquireSpinLockRaiseToDpc(PKSPIN_LOCK spinLock) {
+    while (__sync_lock_test_and_set(spinLock, 1)) {
+        __builtin_ia32_pause();
+    }
+    return 0;
+}
+
+inline void KeReleaseSpinLock(PKSPIN_LOCK spinLock, KIRQL) {
+    __sync_lock_release(spinLock);
+}
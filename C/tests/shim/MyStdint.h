@@ -0,0 +1,3 @@
+#pragma once
+// The driver's MyStdint.h typedefs clash with glibc's, the tests use the real ones
+#include <stdint.h>
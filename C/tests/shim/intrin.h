@@ -0,0 +1,26 @@
+#pragma once
+// MSVC interlocked intrinsics on top of the GCC builtins, all full barriers like on x64
+#include "KernelApis.h"
+
+inline LONG64 _InterlockedCompareExchange64(volatile LONG64* destination, LONG64 exchange, LONG64 comparand) {
+    return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+inline LONG64 _InterlockedExchange64(volatile LONG64* destination, LONG64 value) {
+    return __atomic_exchange_n(destination, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 _InterlockedIncrement64(volatile LONG64* addend) {
+    return __sync_add_and_fetch(addend, 1);
+}
+
+// cmpxchg16b, the Makefile builds with -mcx16 so this stays inline. Element 0 is the low half, like on x64.
+inline unsigned char _InterlockedCompareExchange128(volatile LONG64* destination, LONG64 exchangeHigh, LONG64 exchangeLow, LONG64* comparandResult) {
+    typedef unsigned __int128 uint128;
+    const uint128 comparand = ((uint128)(uint64_t)comparandResult[1] << 64) | (uint64_t)comparandResult[0];
+    const uint128 exchange = ((uint128)(uint64_t)exchangeHigh << 64) | (uint64_t)exchangeLow;
+    const uint128 prev = __sync_val_compare_and_swap((volatile uint128*)destination, comparand, exchange);
+    comparandResult[0] = (LONG64)(uint64_t)prev;
+    comparandResult[1] = (LONG64)(uint64_t)(prev >> 64);
+    return prev == comparand;
+}
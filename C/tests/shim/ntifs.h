@@ -0,0 +1,12 @@
+#pragma once
+// What the driver's translation units built by the tests take from ntifs.h
+#include "KernelApis.h"
+#include <string.h>
+
+inline LONG InterlockedIncrement(volatile LONG* addend) {
+    return __sync_add_and_fetch(addend, 1);
+}
+
+inline LONG InterlockedDecrement(volatile LONG* addend) {
+    return __sync_sub_and_fetch(addend, 1);
+}
@@ -0,0 +1,36 @@
+#pragma once
+// Minimal checks for the host side tests, a failed CHECK reports and the test's main returns failures() != 0
+#include <stdio.h>
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);  \
+            failures()++;                                                           \
+        }                                                                           \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                                  \
+    do {                                                                                                \
+        const auto checkA = (a);                                                                        \
+        const auto checkB = (b);                                                                        \
+        if (!(checkA == checkB)) {                                                                      \
+            fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %s (%llu vs %llu)\n", __FILE__, __LINE__, #a,  \
+                #b, (unsigned long long)checkA, (unsigned long long)checkB);                            \
+            failures()++;                                                                               \
+        }                                                                                               \
+    } while (0)
+
+inline int testResult(const char* name) {
+    if (failures()) {
+        printf("%s: %d check(s) failed\n", name, failures());
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
@@ -0,0 +1,197 @@
+// Flame graph input from the folded stacks LogSyscallsPlugin writes to the strace log, see StackFolder.h there:
+//
+//   [FOLDMOD] <module id> <module path>
+//   [FOLDSTACK] <stack id> <process> <module id>+<offset>;...    frames root first, ids and offsets in hex
+//   [FOLDSTACK+] <stack id> <module id>+<offset>;...             more frames of the stack above
+//   [FOLD] <stack id> <calls>                                     calls since the plugin's previous flush
+//
+// The log is read a line at a time and only the distinct modules and stacks are kept, so a trace of any size folds in
+// the memory its distinct stacks take. Module ids only hold within one plugin load, frames are resolved to the module
+// path as soon as their stack is read.
+use std::collections::{BTreeMap, HashMap};
+use std::io::{self, Write};
+
+// Index into the module paths, NO_MODULE if the frame was outside any module and its offset is the address
+pub const NO_MODULE: u32 = u32::MAX;
+
+pub type FrameKey = (u32, u64);
+
+struct Stack {
+    process: String,
+    frames: Vec<FrameKey>,
+    calls: u64,
+}
+
+#[derive(Default)]
+pub struct FoldedStacks {
+    module_ids: HashMap<u32, u32>, // module id of the current plugin load -> path index
+    paths: Vec<String>,
+    path_indexes: HashMap<String, u32>,
+    stacks: HashMap<u64, Stack>,
+    retired: Vec<Stack>, // replaced by a stack of a later plugin load with the same id
+    unknown_calls: u64,  // counted for stacks the log never defined, it started mid trace
+}
+
+impl FoldedStacks {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    // Feeds one log line, anything that isn't a folded stack line is ignored
+    pub fn feed(&mut self, line: &str) {
+        let line = match line.find("[FOLD") {
+            Some(start) => line[start..].trim_end(),
+            None => return,
+        };
+
+        let (tag, rest) = line.split_once(' ').unwrap_or((line, ""));
+        match tag {
+            "[FOLDMOD]" => {
+                if let Some((id, path)) = rest.split_once(' ') {
+                    if let Ok(id) = u32::from_str_radix(id, 16) {
+                        let index = self.intern_path(path);
+                        self.module_ids.insert(id, index);
+                    }
+                }
+            }
+            "[FOLDSTACK]" => {
+                // process names may hold spaces, frames never do
+                let parsed = rest.split_once(' ').and_then(|(id, rest)| {
+                    let (process, frames) = rest.rsplit_once(' ')?;
+                    Some((u64::from_str_radix(id, 16).ok()?, process, frames))
+                });
+
+                if let Some((id, process, frames)) = parsed {
+                    let stack = Stack {
+                        process: process.to_string(),
+                        frames: self.parse_frames(frames),
+                        calls: 0,
+                    };
+
+                    if let Some(old) = self.stacks.insert(id, stack) {
+                        self.retired.push(old);
+                    }
+                }
+            }
+            "[FOLDSTACK+]" => {
+                if let Some((id, frames)) = rest.split_once(' ') {
+                    if let Ok(id) = u64::from_str_radix(id, 16) {
+                        let frames = self.parse_frames(frames);
+                        if let Some(stack) = self.stacks.get_mut(&id) {
+                            stack.frames.extend(frames);
+                        }
+                    }
+                }
+            }
+            "[FOLD]" => {
+                if let Some((id, calls)) = rest.split_once(' ') {
+                    if let (Ok(id), Ok(calls)) = (u64::from_str_radix(id, 16), calls.parse::<u64>())
+                    {
+                        match self.stacks.get_mut(&id) {
+                            Some(stack) => stack.calls += calls,
+                            None => self.unknown_calls += calls,
+                        }
+                    }
+                }
+            }
+            _ => {}
+        }
+    }
+
+    pub fn stack_count(&self) -> usize {
+        self.stacks.len() + self.retired.len()
+    }
+
+    pub fn path(&self, module: u32) -> Option<&str> {
+        self.paths.get(module as usize).map(|p| p.as_str())
+    }
+
+    // Every distinct frame inside a module, what a symbolizer has to resolve
+    pub fn frames(&self) -> Vec<FrameKey> {
+        let mut frames: Vec<FrameKey> = self
+            .all_stacks()
+            .flat_map(|s| s.frames.iter().copied())
+            .filter(|f| f.0 != NO_MODULE)
+            .collect();
+        frames.sort_unstable();
+        frames.dedup();
+        frames
+    }
+
+    // Writes "process;root;...;leaf calls" lines, stacks that render the same are merged. Frames missing from names are
+    // written as module+offset. Returns the number of lines written.
+    pub fn write<W: Write>(
+        &self,
+        out: &mut W,
+        names: &HashMap<FrameKey, String>,
+    ) -> io::Result<usize> {
+        let mut folded: BTreeMap<String, u64> = BTreeMap::new();
+        for stack in self.all_stacks().filter(|s| s.calls != 0) {
+            let mut line = sanitize(&stack.process);
+            for frame in &stack.frames {
+                line.push(';');
+                match names.get(frame) {
+                    Some(name) => line.push_str(&sanitize(name)),
+                    None => line.push_str(&self.raw_name(*frame)),
+                }
+            }
+            *folded.entry(line).or_insert(0) += stack.calls;
+        }
+
+        if self.unknown_calls != 0 {
+            folded.insert("[unknown stack]".to_string(), self.unknown_calls);
+        }
+
+        for (line, calls) in &folded {
+            writeln!(out, "{} {}", line, calls)?;
+        }
+        Ok(folded.len())
+    }
+
+    fn all_stacks(&self) -> impl Iterator<Item = &Stack> {
+        self.stacks.values().chain(self.retired.iter())
+    }
+
+    fn intern_path(&mut self, path: &str) -> u32 {
+        if let Some(index) = self.path_indexes.get(path) {
+            return *index;
+        }
+
+        let index = self.paths.len() as u32;
+        self.paths.push(path.to_string());
+        self.path_indexes.insert(path.to_string(), index);
+        index
+    }
+
+    // "3+1a2b;0+7ff6a0001000", a module the log never named counts as no module
+    fn parse_frames(&self, frames: &str) -> Vec<FrameKey> {
+        frames
+            .split(';')
+            .filter_map(|frame| {
+                let (module, offset) = frame.split_once('+')?;
+                let module = u32::from_str_radix(module, 16).ok()?;
+                let offset = u64::from_str_radix(offset, 16).ok()?;
+                Some((*self.module_ids.get(&module).unwrap_or(&NO_MODULE), offset))
+            })
+            .collect()
+    }
+
+    // ntdll.dll+0x9f4c4, or the address alone outside any module
+    fn raw_name(&self, frame: FrameKey) -> String {
+        match self.path(frame.0) {
+            Some(path) => {
+                let file = path
+                    .rsplit(|c| c == '\\' || c == '/')
+                    .next()
+                    .unwrap_or(path);
+                format!("{}+0x{:x}", sanitize(file), frame.1)
+            }
+            None => format!("0x{:x}", frame.1),
+        }
+    }
+}
+
+// Flame graph tools split frames on ';' and the count off the last space
+fn sanitize(name: &str) -> String {
+    name.replace(';', ":")
+}
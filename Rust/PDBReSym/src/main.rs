@@ -23,19 +23,13 @@ use symbolic_common::{Language, Name, NameMangling};
 use symbolic_demangle::{Demangle, DemangleOptions};
 use tokio::fs::DirEntry;
 use tokio::io::AsyncWriteExt;
-use tokio::sync::RwLock;
+mod fold;
 mod guid;
+mod symindex;
+use symindex::{Symbol, SymbolIndex};
 
-fn load_txt_file(txt_file: &Path) -> Option<Vec<String>> {
-    let file = File::open(txt_file).ok()?;
-    let reader = BufReader::new(file);
-    Some(
-        reader
-            .lines()
-            .map(|l| l.expect("Could not parse line"))
-            .collect(),
-    )
-}
+// log lines symbolicated per batch, bounds the memory a log of any size takes
+const SYMBOLICATE_BATCH_LINES: usize = 1 << 18;
 
 #[derive(Clone, PartialEq, Eq)]
 struct PDBPaths {
@@ -280,128 +274,239 @@ struct LineSymbol {
     end_rva: u32,
 }
 
-async fn resolve_symbol_main(
+// maps every RVA covered by a function of the pdb to that function
+fn build_line_table(
+    pdb_bytes: Bytes,
+    pdb_paths: &PDBPaths,
+    mpb: &MultiProgress,
+) -> Result<RangeMap<u32, LineSymbol>> {
+    let mut pdb = pdb::PDB::open(std::io::Cursor::new(pdb_bytes)).context("Failed to open PDB")?;
+    let context_data = pdb_addr2line::ContextPdbData::try_from_pdb_ref(&mut pdb)
+        .context("Failed to locate PDB info")?;
+    let context = context_data
+        .make_context()
+        .context("Failed to parse PDB info")?;
+
+    let cache_progressbar = mpb.add(ProgressBar::new(context.function_count() as u64));
+    cache_progressbar.set_style(get_pb_style());
+    cache_progressbar.set_message(format!(
+        "Building {} symbol index...",
+        pdb_paths.pdb_filename
+    ));
+
+    let mut line_table = RangeMap::new();
+
+    // if a line has no end rva, the start of the next block defines it's end. Lots of symbols are like this.
+    // we have to handle it by record the partially resolved line from last loop iteration, then fill in end rva.
+    let mut prev_partial_line: Option<LineSymbol> = None;
+    for f in context.functions() {
+        cache_progressbar.inc(1);
+
+        if let Some(name) = f.name {
+            let mangled_name = Name::new(name, NameMangling::Unknown, Language::Unknown);
+            let demanged_named = mangled_name
+                .try_demangle(DemangleOptions::name_only())
+                .to_string();
+
+            if let Some(mut partial_line) = prev_partial_line.as_mut() {
+                partial_line.end_rva = f.start_rva;
+                line_table.insert(
+                    partial_line.start_rva..partial_line.end_rva,
+                    partial_line.clone(),
+                );
+                prev_partial_line = None;
+            }
+
+            if let Some(end_rva) = f.end_rva {
+                let range = f.start_rva..end_rva;
+                let line = LineSymbol {
+                    demangled_name: demanged_named,
+                    start_rva: f.start_rva,
+                    end_rva: end_rva,
+                };
+                line_table.insert(range, line);
+            } else {
+                prev_partial_line = Some(LineSymbol {
+                    demangled_name: demanged_named,
+                    start_rva: f.start_rva,
+                    end_rva: 0,
+                });
+            }
+        } else {
+            prev_partial_line = None
+        }
+    }
+    cache_progressbar.finish_and_clear();
+    Ok(line_table)
+}
+
+struct ModuleSymbols {
+    module_name: String,
+    index: SymbolIndex,
+}
+
+// Maps the binary's symbol index from the cache, building it from the binary's pdb (downloaded if necessary) the
+// first time. Later runs never open the pdb again.
+async fn load_module_symbols(
     binary_path: &Path,
-    rva: u32,
     symbol_cache_dir: &Path,
-    open_pdb_cache: Arc<RwLock<HashMap<PathBuf, RangeMap<u32, LineSymbol>>>>,
     mpb: Arc<MultiProgress>,
-) -> Result<String> {
-    let binary_cache_key = binary_path.to_owned();
-
-    // racy, check if we should try the long task of loading the pdb. Done this way so async task isn't holding the lock
-    let should_try_insert;
-    {
-        let pdb_cache = open_pdb_cache.read().await;
-        should_try_insert = !pdb_cache.contains_key(&binary_cache_key);
+) -> Result<ModuleSymbols> {
+    let module_name = binary_path
+        .file_stem()
+        .context("Failed to get filename for modulename")?
+        .to_str()
+        .context("modulename is not valid utf-8")?
+        .to_string();
+
+    let pdb_paths = get_pdb_cache_path_from_binary(binary_path, symbol_cache_dir).await?;
+    let index_path = pdb_paths
+        .pdb_cache_dir
+        .join(format!("{}.symidx", pdb_paths.pdb_filename));
+
+    // a missing or damaged index is rebuilt
+    if let Ok(index) = SymbolIndex::open(&index_path) {
+        return Ok(ModuleSymbols { module_name, index });
+    }
+
+    let (pdb_bytes, pdb_paths) = fetch_pdb(binary_path, symbol_cache_dir, mpb.clone()).await?;
+
+    // MS symbol server gives us a 0 bytes pdb sometimes. Ignore that...
+    if pdb_bytes.len() == 0 {
+        return Err(anyhow!("Zero byte PDB"));
     }
 
-    // await pdb loading, do this while _NOT_ locking
-    if should_try_insert {
-        // download the pdb OR load it from the local file cache
-        let (pdb_bytes, pdb_paths) = fetch_pdb(binary_path, symbol_cache_dir, mpb.clone()).await?;
+    let index_path_clone = index_path.clone();
+    tokio::task::spawn_blocking(move || -> Result<()> {
+        let line_table = build_line_table(pdb_bytes, &pdb_paths, &mpb)?;
+        SymbolIndex::write(
+            &index_path_clone,
+            line_table.iter().map(|(range, line)| {
+                (
+                    range.start,
+                    range.end,
+                    line.start_rva,
+                    line.demangled_name.as_str(),
+                )
+            }),
+        )
+        .context("Failed to write symbol index")
+    })
+    .await??;
 
-        // MS symbol server gives us a 0 bytes pdb sometimes. Ignore that...
-        if pdb_bytes.len() == 0 {
-            return Err(anyhow!("Zero byte PDB"));
+    let index = SymbolIndex::open(&index_path).context("Failed to map symbol index")?;
+    Ok(ModuleSymbols { module_name, index })
+}
+
+// The symbol indexes of every binary seen so far, keyed by the path as the log spells it. A binary that failed to load
+// is remembered as None and not tried again. Lookups only read the mapped indexes, any number of threads can share one.
+struct Symbolizer {
+    modules: HashMap<String, Option<ModuleSymbols>>,
+}
+
+impl Symbolizer {
+    fn new() -> Self {
+        Symbolizer {
+            modules: HashMap::new(),
         }
+    }
 
-        // build an in memory cache mapping lines to symbols
-        let binary_cache_key_clone = binary_cache_key.clone();
-        let line_table_cache: Result<_, anyhow::Error> = tokio::task::spawn_blocking(move || {
-            let mut pdb =
-                pdb::PDB::open(std::io::Cursor::new(pdb_bytes)).context("Failed to open PDB")?;
-            let context_data = pdb_addr2line::ContextPdbData::try_from_pdb_ref(&mut pdb)
-                .context("Failed to locate PDB info")?;
-            let context = context_data
-                .make_context()
-                .context("Failed to parse PDB info")?;
-
-            let cache_progressbar = mpb.add(ProgressBar::new(context.function_count() as u64));
-            cache_progressbar.set_style(get_pb_style());
-            cache_progressbar.set_message(format!(
-                "Building {} symbol cache...",
-                pdb_paths.pdb_filename
-            ));
-
-            let mut line_table = RangeMap::new();
-            //println!("Building line cache for {}", pdb_path_str);
-
-            // if a line has no end rva, the start of the next block defines it's end. Lots of symbols are like this.
-            // we have to handle it by record the partially resolved line from last loop iteration, then fill in end rva.
-            let mut prev_partial_line: Option<LineSymbol> = None;
-            for f in context.functions() {
-                cache_progressbar.inc(1);
-
-                if let Some(name) = f.name {
-                    let mangled_name = Name::new(name, NameMangling::Unknown, Language::Unknown);
-                    let demanged_named = mangled_name
-                        .try_demangle(DemangleOptions::name_only())
-                        .to_string();
-
-                    if let Some(mut partial_line) = prev_partial_line.as_mut() {
-                        partial_line.end_rva = f.start_rva;
-                        line_table.insert(
-                            partial_line.start_rva..partial_line.end_rva,
-                            partial_line.clone(),
-                        );
-                        //println!("{} {:08X} {:08X} {}", pdb_paths.pdb_filename, partial_line.start_rva, partial_line.end_rva, partial_line.demangled_name);
-                        prev_partial_line = None;
-                    }
-
-                    if let Some(end_rva) = f.end_rva {
-                        let range = f.start_rva..end_rva;
-                        let line = LineSymbol {
-                            demangled_name: demanged_named,
-                            start_rva: f.start_rva,
-                            end_rva: end_rva,
-                        };
-
-                        //println!("{} {:08X} {:08X} {}", pdb_paths.pdb_filename,f.start_rva, end_rva, line.demangled_name);
-                        line_table.insert(range, line);
-                    } else {
-                        prev_partial_line = Some(LineSymbol {
-                            demangled_name: demanged_named,
-                            start_rva: f.start_rva,
-                            end_rva: 0,
-                        });
-                    }
-                } else {
-                    prev_partial_line = None
-                }
-            }
-            cache_progressbar.finish_and_clear();
-            Ok(line_table)
-        })
-        .await?;
+    fn is_loaded(&self, log_path: &str) -> bool {
+        self.modules.contains_key(log_path)
+    }
+
+    async fn load(&mut self, log_path: &str, symbol_cache_dir: &Path, mpb: Arc<MultiProgress>) {
+        if self.is_loaded(log_path) {
+            return;
+        }
 
-        // lock again, may insert, may throw that cache away if another thing raced us.
-        let mut pdb_cache = open_pdb_cache.write().await;
-        let _ = pdb_cache.insert(binary_cache_key_clone, line_table_cache?);
+        let binary_path = log_path.replace("\\SystemRoot\\", "C:\\Windows\\");
+        let module = load_module_symbols(Path::new(&binary_path), symbol_cache_dir, mpb)
+            .await
+            .ok();
+        self.modules.insert(log_path.to_string(), module);
     }
 
-    // whew, ok lookup the RVA in the range map to find the function name we're nearest [start, end)
-    let pdb_cache = open_pdb_cache.read().await;
-    let lines = pdb_cache
-        .get(&binary_cache_key)
-        .context("Failed to load cached PDB")?;
-    let line = lines.get(&rva).context("No symbol found for line")?;
+    // The module's name and the function holding rva, None if the binary isn't loaded or rva is outside its functions
+    fn resolve(&self, log_path: &str, rva: u32) -> Option<(&str, Symbol<'_>)> {
+        let module = self.modules.get(log_path)?.as_ref()?;
+        Some((module.module_name.as_str(), module.index.lookup(rva)?))
+    }
+}
 
-    let module_name = binary_path
-        .file_stem()
-        .expect("Failed to get filename for modulename")
-        .to_str()
-        .unwrap();
-
-    // resolve rva to offset from fn start
-    let new_line = format!(
-        "{}!{} +0x{:04X}",
-        module_name,
-        line.demangled_name,
-        rva - line.start_rva
-    );
+// A "prefix [path] +0xoffset suffix" stack frame line of the strace log
+struct FrameLine<'a> {
+    prefix: &'a str,
+    path: &'a str,
+    rva: u32,
+    suffix: &'a str,
+}
+
+fn parse_frame_line<'a>(regx: &Regex, line: &'a str) -> Option<FrameLine<'a>> {
+    // most lines aren't frames, skip them before running the regex
+    if !line.contains("+0x") {
+        return None;
+    }
 
-    return Ok(new_line);
+    let captures = regx.captures(line)?;
+    let offset_str = captures.get(3).map_or("", |m| m.as_str());
+    Some(FrameLine {
+        prefix: captures.get(1).map_or("", |m| m.as_str()),
+        path: captures.get(2).map_or("", |m| m.as_str()),
+        rva: u64::from_str_radix(offset_str.trim_start_matches("0x"), 16).ok()? as u32,
+        suffix: captures.get(4).map_or("", |m| m.as_str()),
+    })
+}
+
+// f over items on up to threads threads, results in the order of items
+fn parallel_map<T: Sync, R: Send>(
+    items: &[T],
+    threads: usize,
+    f: impl Fn(&T) -> R + Sync,
+) -> Vec<R> {
+    if items.is_empty() {
+        return Vec::new();
+    }
+
+    let chunk_size = (items.len() + threads - 1) / threads.max(1);
+    std::thread::scope(|scope| {
+        let f = &f;
+        let workers: Vec<_> = items
+            .chunks(chunk_size.max(1))
+            .map(|chunk| scope.spawn(move || chunk.iter().map(f).collect::<Vec<R>>()))
+            .collect();
+
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().expect("Symbolication thread panicked"))
+            .collect()
+    })
+}
+
+// Reads up to max_lines lines into lines without their line endings, returns the bytes read
+fn read_lines<R: BufRead>(
+    reader: &mut R,
+    lines: &mut Vec<String>,
+    max_lines: usize,
+) -> io::Result<u64> {
+    lines.clear();
+
+    let mut total = 0;
+    let mut buffer = Vec::new();
+    while lines.len() < max_lines {
+        buffer.clear();
+        let read = reader.read_until(b'\n', &mut buffer)?;
+        if read == 0 {
+            break;
+        }
+        total += read as u64;
+
+        while matches!(buffer.last(), Some(b'\n') | Some(b'\r')) {
+            buffer.pop();
+        }
+        lines.push(String::from_utf8_lossy(&buffer).into_owned());
+    }
+    Ok(total)
 }
 
 fn get_pb_style() -> ProgressStyle {
@@ -434,6 +539,18 @@ async fn main() {
             clap::Arg::new("outfile").help("Path to write symbolicated output file").required(true)
         )
     )
+    .subcommand(clap::Command::new("fold")
+        .about("Fold the stacks of the given logfile into flame graph input (process;frame;...;frame count). May download PDBs as necessary")
+        .arg(
+            clap::Arg::new("logfile").help("Path to strace log file with [FOLD] lines").required(true)
+        )
+        .arg(
+            clap::Arg::new("outfile").help("Path to write the folded stacks to").required(true)
+        )
+        .arg(
+            clap::Arg::new("nosymbols").help("Keep frames as module+offset instead of symbolicating them").long("nosymbols").action(clap::ArgAction::SetTrue)
+        )
+    )
     .subcommand(
         clap::Command::new("cachesyms")
         .about("Iterates the specified sysdir and downloads all PDBs concurrently")
@@ -518,12 +635,58 @@ async fn main() {
         );
     }
 
-    if let Some(("symbolicate", args)) = subcommand {
-        // binary file path -> range: RVA_start..RVA_end = PDB Function Line Info
-        let open_pdbs: HashMap<PathBuf, RangeMap<u32, LineSymbol>> = HashMap::new();
+    if let Some(("fold", args)) = subcommand {
+        let logfile = Path::new(
+            args.get_one::<String>("logfile")
+                .expect("logfile argument not provided"),
+        );
 
-        let open_pdb_arc = Arc::new(RwLock::new(open_pdbs));
+        let outfile = Path::new(
+            args.get_one::<String>("outfile")
+                .expect("outfile argument not provided"),
+        );
+
+        // one line at a time, only the distinct stacks are kept
+        let mut folded = fold::FoldedStacks::new();
+        let reader = BufReader::new(File::open(logfile).expect("Failed to open logfile"));
+        for line in reader.lines() {
+            folded.feed(&line.expect("Could not parse line"));
+        }
 
+        // each distinct frame is symbolicated once, the offset into the function is dropped so calls through
+        // different return addresses of one function share its box in the graph
+        let mut names: HashMap<fold::FrameKey, String> = HashMap::new();
+        if !args.get_flag("nosymbols") {
+            let mut symbols = Symbolizer::new();
+            let frames = folded.frames();
+
+            let sym_progressbar = mpb.add(ProgressBar::new(frames.len() as u64));
+            sym_progressbar.set_style(get_pb_style());
+            sym_progressbar.set_message("Symbolicating frames");
+            for frame in frames {
+                sym_progressbar.inc(1);
+                let path = folded.path(frame.0).unwrap_or("");
+                symbols.load(path, symbol_cache_dir, mpb.clone()).await;
+                if let Some((module_name, symbol)) = symbols.resolve(path, frame.1 as u32) {
+                    names.insert(frame, format!("{}!{}", module_name, symbol.name));
+                }
+            }
+            sym_progressbar.finish();
+        }
+
+        let mut h_outfile =
+            io::BufWriter::new(File::create(outfile).expect("Failed to create output file"));
+        let lines = folded
+            .write(&mut h_outfile, &names)
+            .expect("Failed to write to output file");
+        println!(
+            "Folded {} stacks into {} lines",
+            folded.stack_count(),
+            lines
+        );
+    }
+
+    if let Some(("symbolicate", args)) = subcommand {
         let logfile = Path::new(
             args.get_one::<String>("logfile")
                 .expect("logfile argument not provided"),
@@ -534,73 +697,69 @@ async fn main() {
                 .expect("outfile argument not provided"),
         );
 
-        if let Some(loglines) = load_txt_file(Path::new(logfile)) {
-            let log_progressbar = mpb.add(ProgressBar::new(loglines.len() as u64));
-            log_progressbar.set_style(get_pb_style());
-            log_progressbar.set_message("Symbolicating");
-
-            // 10:49:00.035  INF #1   1136    [C:\Windows\Microsoft.NET\Framework64\v4.0.30319\clr.dll] +0x006df961
-            // (?<prefix>.*?)\[(?<path>.*?)\]\s+\+(?<offset>0x[0-9a-fA-F]+)
-            let regx = Regex::new("(.*?)\\[(.*?)\\]\\s+\\+(0x[0-9a-fA-F]+)(.*)").unwrap();
-
-            let transformed_lines = stream::iter(loglines)
-                .then(|line| {
-                    let open_pdb_clone = open_pdb_arc.clone();
-                    let regx_clone = regx.clone();
-                    let log_progressbar_clone = log_progressbar.clone();
-                    let mpb_clone = mpb.clone();
-
-                    // this async block is run 1 by 1 per each element
-                    async move {
-                        log_progressbar_clone.inc(1);
-                        if let Some(captures) = regx_clone.captures(&line) {
-                            let line_prefix = captures.get(1).map_or("", |m| m.as_str());
-                            let path = captures
-                                .get(2)
-                                .map_or("", |m| m.as_str())
-                                .replace("\\SystemRoot\\", "C:\\Windows\\");
-                            let offset_str = captures.get(3).map_or("", |m| m.as_str());
-                            let line_suffix = captures.get(4).map_or("", |m| m.as_str());
-
-                            let offset =
-                                u64::from_str_radix(offset_str.trim_start_matches("0x"), 16)
-                                    .unwrap() as u32;
-
-                            if let Ok(symbol) = resolve_symbol_main(
-                                Path::new(&path),
-                                offset,
-                                symbol_cache_dir,
-                                open_pdb_clone.clone(),
-                                mpb_clone,
-                            )
-                            .await
-                            {
-                                return format!("{}{}{}", line_prefix, symbol, line_suffix);
-                            }
-                        }
-                        line.to_string()
-                    }
-                })
-                .collect::<Vec<_>>()
-                .await;
-
-            let out_progressbar = mpb.add(ProgressBar::new(transformed_lines.len() as u64));
-            out_progressbar.set_style(get_pb_style());
-            out_progressbar.set_message("Writing Output");
-
-            let mut h_outfile = tokio::fs::File::create(outfile)
-                .await
-                .expect("Failed to create output file");
-            for line in transformed_lines {
-                out_progressbar.inc(1);
-                let _ = h_outfile
-                    .write((line + "\n").as_bytes())
-                    .await
-                    .expect("Failed to write to output file");
+        let log = File::open(logfile).expect("Failed to open logfile");
+        let log_size = log.metadata().map_or(0, |m| m.len());
+        let mut reader = BufReader::with_capacity(1 << 20, log);
+        let mut h_outfile = io::BufWriter::with_capacity(
+            1 << 20,
+            File::create(outfile).expect("Failed to create output file"),
+        );
+
+        let log_progressbar = mpb.add(ProgressBar::new(log_size));
+        log_progressbar.set_style(get_pb_dl_style());
+        log_progressbar.set_message("Symbolicating");
+
+        // 10:49:00.035  INF #1   1136    [C:\Windows\Microsoft.NET\Framework64\v4.0.30319\clr.dll] +0x006df961
+        // (?<prefix>.*?)\[(?<path>.*?)\]\s+\+(?<offset>0x[0-9a-fA-F]+)
+        let regx = Regex::new("(.*?)\\[(.*?)\\]\\s+\\+(0x[0-9a-fA-F]+)(.*)").unwrap();
+        let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+
+        // the log is streamed in batches: parse a batch on every core, load the binaries it names that weren't seen
+        // before (this may download pdbs and build their indexes), then resolve it on every core and write it in order
+        let mut symbols = Symbolizer::new();
+        let mut batch = Vec::new();
+        loop {
+            let read = read_lines(&mut reader, &mut batch, SYMBOLICATE_BATCH_LINES)
+                .expect("Failed to read logfile");
+            if batch.is_empty() {
+                break;
             }
 
-            log_progressbar.finish();
-            out_progressbar.finish();
+            let frames = parallel_map(&batch, threads, |line| parse_frame_line(&regx, line));
+
+            let mut new_paths: Vec<&str> = frames
+                .iter()
+                .flatten()
+                .map(|frame| frame.path)
+                .filter(|path| !symbols.is_loaded(path))
+                .collect();
+            new_paths.sort_unstable();
+            new_paths.dedup();
+            for path in new_paths {
+                symbols.load(path, symbol_cache_dir, mpb.clone()).await;
+            }
+
+            let lines = parallel_map(&frames, threads, |frame| {
+                let frame = frame.as_ref()?;
+                let (module_name, symbol) = symbols.resolve(frame.path, frame.rva)?;
+                Some(format!(
+                    "{}{}!{} +0x{:04X}{}",
+                    frame.prefix,
+                    module_name,
+                    symbol.name,
+                    frame.rva.wrapping_sub(symbol.function_rva),
+                    frame.suffix
+                ))
+            });
+
+            for (line, symbolicated) in batch.iter().zip(lines) {
+                writeln!(h_outfile, "{}", symbolicated.as_deref().unwrap_or(line))
+                    .expect("Failed to write to output file");
+            }
+            log_progressbar.inc(read);
         }
+
+        h_outfile.flush().expect("Failed to write to output file");
+        log_progressbar.finish();
     }
 }
@@ -0,0 +1,126 @@
+// On disk symbol index of one PDB, written next to the cached PDB the first time one of its binaries is symbolicated
+// and memory mapped on every later run, so a PDB is parsed once per symbol cache instead of once per run:
+//
+//   magic      b"PDBRSIX1"
+//   count      u32, number of ranges
+//   names      u32, size of the name table in bytes
+//   ranges     count * { start u32, end u32, function u32, name u32, name_len u32 }
+//   name table UTF-8 function names, a range's name is name_len bytes at offset name
+//
+// Integers are little endian. Ranges are [start, end) RVAs sorted by start and never overlap, function is the RVA the
+// range's function starts at. A function whose lines are split by another one's has several ranges sharing a name.
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::path::Path;
+use symbolic_common::ByteView;
+
+const MAGIC: &[u8; 8] = b"PDBRSIX1";
+const HEADER_SIZE: usize = 16;
+const RANGE_SIZE: usize = 20;
+
+pub struct SymbolIndex {
+    data: ByteView<'static>,
+    count: usize,
+}
+
+pub struct Symbol<'a> {
+    pub name: &'a str,
+    pub function_rva: u32,
+}
+
+impl SymbolIndex {
+    // Writes ranges given as (start, end, function, name) to path, replacing any index there. They must be sorted by
+    // start and must not overlap.
+    pub fn write<'a, I>(path: &Path, ranges: I) -> io::Result<()>
+    where
+        I: IntoIterator<Item = (u32, u32, u32, &'a str)>,
+    {
+        let mut table = Vec::new();
+        let mut names = Vec::new();
+        let mut name_offsets: HashMap<&str, u32> = HashMap::new();
+        let mut count: u32 = 0;
+        for (start, end, function, name) in ranges {
+            let offset = *name_offsets.entry(name).or_insert_with(|| {
+                names.extend_from_slice(name.as_bytes());
+                (names.len() - name.len()) as u32
+            });
+
+            for value in [start, end, function, offset, name.len() as u32] {
+                table.extend_from_slice(&value.to_le_bytes());
+            }
+            count += 1;
+        }
+
+        // a run killed halfway leaves a .tmp behind, never a truncated index
+        let tmp_path = path.with_extension("tmp");
+        {
+            let mut file = io::BufWriter::new(File::create(&tmp_path)?);
+            file.write_all(MAGIC)?;
+            file.write_all(&count.to_le_bytes())?;
+            file.write_all(&(names.len() as u32).to_le_bytes())?;
+            file.write_all(&table)?;
+            file.write_all(&names)?;
+            file.flush()?;
+        }
+        fs::rename(&tmp_path, path)
+    }
+
+    // Maps an index written by write, fails if it's missing or doesn't look like one
+    pub fn open(path: &Path) -> io::Result<SymbolIndex> {
+        let data = ByteView::open(path)?;
+        if data.len() < HEADER_SIZE || &data[..MAGIC.len()] != MAGIC {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "not a symbol index",
+            ));
+        }
+
+        let count = read_u32(&data, 8) as usize;
+        let names = read_u32(&data, 12) as usize;
+        if HEADER_SIZE + count * RANGE_SIZE + names != data.len() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "truncated symbol index",
+            ));
+        }
+        Ok(SymbolIndex { data, count })
+    }
+
+    // The function whose range holds rva
+    pub fn lookup(&self, rva: u32) -> Option<Symbol<'_>> {
+        // the first range starting after rva, the one before it is the only candidate
+        let (mut low, mut high) = (0, self.count);
+        while low < high {
+            let mid = low + (high - low) / 2;
+            if self.field(mid, 0) <= rva {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        let range = low.checked_sub(1)?;
+        if rva >= self.field(range, 1) {
+            return None;
+        }
+
+        let names_start = HEADER_SIZE + self.count * RANGE_SIZE;
+        let offset = names_start + self.field(range, 3) as usize;
+        let name = self
+            .data
+            .get(offset..offset + self.field(range, 4) as usize)?;
+        Some(Symbol {
+            name: std::str::from_utf8(name).ok()?,
+            function_rva: self.field(range, 2),
+        })
+    }
+
+    fn field(&self, range: usize, field: usize) -> u32 {
+        read_u32(&self.data, HEADER_SIZE + range * RANGE_SIZE + field * 4)
+    }
+}
+
+fn read_u32(data: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(data[offset..offset + 4].try_into().unwrap())
+}